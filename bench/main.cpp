@@ -0,0 +1,430 @@
+/**
+ * Microbenchmarks for the library's hot paths.
+ *
+ * Every benchmark runs a fixed number of operations on each of its threads
+ * and reports the aggregate throughput and the per-operation latency
+ * percentiles.  The keys, tokens and key cache are generated afresh in a
+ * temporary cache home, and the cold-cache benchmarks fetch from a mock
+ * issuer served over TLS from this process, so runs depend on nothing but
+ * the machine.
+ */
+
+#include "common.h"
+
+#include <ftw.h>
+#include <getopt.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <functional>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+using namespace scitokens_bench;
+
+namespace {
+
+const char usage[] =
+    "\n"
+    "Syntax: %s [--iterations N] [--threads N[,N...]] [--filter substring]\n"
+    "\n"
+    " Options\n"
+    "    -h | --help                  Display usage\n"
+    "    -n | --iterations       <N>  Operations per thread (default 1000).\n"
+    "    -t | --threads   <N[,N...]>  Thread counts to run each benchmark "
+    "with\n"
+    "                                 (default 1 and the number of CPUs).\n"
+    "    -f | --filter   <substring>  Only run benchmarks whose name "
+    "contains\n"
+    "                                 the substring.\n"
+    "\n"
+    " Benchmarks\n"
+    "    serialize/<alg>              scitoken_serialize.\n"
+    "    verify/<alg>/memory          scitoken_deserialize_v2, keys in the\n"
+    "                                 in-memory tier of the key cache.\n"
+    "    verify/<alg>/sqlite          As above, with the in-memory tier "
+    "dropped\n"
+    "                                 before each operation, so the keys are\n"
+    "                                 read from SQLite (on a reopened\n"
+    "                                 connection); single-threaded only.\n"
+    "    enforcer_test/scopes=<N>     enforcer_test against a token with N\n"
+    "                                 scopes; /cached with its ACL cache.\n"
+    "    enforcer_generate_acls/scopes=<N>\n"
+    "                                 enforcer_generate_acls, likewise.\n"
+    "    refresh/cold                 keycache_refresh_jwks from the mock\n"
+    "                                 issuer, a new TLS connection each time.\n"
+    "\n";
+
+const struct option long_options[] = {
+    {"help", no_argument, NULL, 'h'},
+    {"iterations", required_argument, NULL, 'n'},
+    {"threads", required_argument, NULL, 't'},
+    {"filter", required_argument, NULL, 'f'},
+    {0, 0, 0, 0}};
+
+const char short_options[] = "hn:t:f:";
+
+int g_iterations = 1000;
+std::vector<unsigned> g_threads;
+std::string g_filter;
+
+int init_arguments(int argc, char *argv[]) {
+    int arg;
+    while ((arg = getopt_long(argc, argv, short_options, long_options,
+                              nullptr)) != -1) {
+        switch (arg) {
+        case 'h':
+            printf(usage, argv[0]);
+            exit(0);
+            break;
+        case 'n':
+            g_iterations = atoi(optarg);
+            break;
+        case 't': {
+            std::string list = optarg;
+            size_t pos = 0;
+            while (pos <= list.size()) {
+                auto end = list.find(',', pos);
+                if (end == std::string::npos) {
+                    end = list.size();
+                }
+                int threads = atoi(list.substr(pos, end - pos).c_str());
+                if (threads <= 0) {
+                    fprintf(stderr, "%s: invalid thread count in %s\n",
+                            argv[0], optarg);
+                    exit(1);
+                }
+                g_threads.push_back(threads);
+                pos = end + 1;
+            }
+            break;
+        }
+        case 'f':
+            g_filter = optarg;
+            break;
+        default:
+            fprintf(stderr, usage, argv[0]);
+            exit(1);
+            break;
+        }
+    }
+
+    if (optind != argc) {
+        fprintf(stderr, "%s: invalid option -- %s\n", argv[0], argv[optind]);
+        fprintf(stderr, usage, argv[0]);
+        exit(1);
+    }
+    if (g_iterations <= 0) {
+        fprintf(stderr, "%s: --iterations must be positive\n", argv[0]);
+        exit(1);
+    }
+    if (g_threads.empty()) {
+        g_threads.push_back(1);
+        unsigned cpus = std::thread::hardware_concurrency();
+        if (cpus > 1) {
+            g_threads.push_back(cpus);
+        }
+    }
+    return 0;
+}
+
+struct Benchmark {
+    std::string m_name;
+    // Run by each thread before timing starts, e.g. to warm caches.
+    std::function<void(unsigned)> m_setup;
+    // One operation, run by the given thread.
+    std::function<void(unsigned)> m_op;
+    // Run with one thread only, whatever the thread counts asked for.
+    bool m_single_threaded;
+};
+
+void run(const Benchmark &bench, unsigned threads) {
+    std::vector<std::vector<double>> latencies(threads);
+    std::vector<std::string> errors(threads);
+    std::atomic<unsigned> ready(0);
+    std::atomic<bool> go(false);
+
+    auto worker = [&](unsigned thread) {
+        auto &thread_latencies = latencies[thread];
+        thread_latencies.reserve(g_iterations);
+        try {
+            if (bench.m_setup) {
+                bench.m_setup(thread);
+            }
+            ready++;
+            while (!go) {
+                std::this_thread::yield();
+            }
+            for (int iter = 0; iter < g_iterations; iter++) {
+                auto start = std::chrono::steady_clock::now();
+                bench.m_op(thread);
+                std::chrono::duration<double, std::micro> elapsed =
+                    std::chrono::steady_clock::now() - start;
+                thread_latencies.push_back(elapsed.count());
+            }
+        } catch (std::exception &exc) {
+            errors[thread] = exc.what();
+            ready++;
+        }
+    };
+
+    std::vector<std::thread> workers;
+    for (unsigned thread = 0; thread < threads; thread++) {
+        workers.emplace_back(worker, thread);
+    }
+    while (ready < threads) {
+        std::this_thread::yield();
+    }
+    auto start = std::chrono::steady_clock::now();
+    go = true;
+    for (auto &thread : workers) {
+        thread.join();
+    }
+    std::chrono::duration<double> elapsed =
+        std::chrono::steady_clock::now() - start;
+
+    for (const auto &error : errors) {
+        if (!error.empty()) {
+            printf("%-40s %7u  failed: %s\n", bench.m_name.c_str(), threads,
+                   error.c_str());
+            return;
+        }
+    }
+    std::vector<double> all;
+    for (const auto &thread_latencies : latencies) {
+        all.insert(all.end(), thread_latencies.begin(),
+                   thread_latencies.end());
+    }
+    std::sort(all.begin(), all.end());
+    auto percentile = [&](double pct) {
+        return all[std::min(all.size() - 1,
+                            static_cast<size_t>(pct * all.size()))];
+    };
+    printf("%-40s %7u %12.1f %10.1f %10.1f\n", bench.m_name.c_str(), threads,
+           all.size() / elapsed.count(), percentile(0.5), percentile(0.99));
+}
+
+struct Signer {
+    std::string m_alg;
+    std::string m_issuer;
+    const char *m_kid;
+    const char *m_public;
+    const char *m_private;
+    const char *m_jwks;
+};
+
+TokenPtr create_token(const Signer &signer, SciTokenKey key,
+                      const std::string &scope) {
+    char *err_msg = nullptr;
+    TokenPtr token(scitoken_create(key), scitoken_destroy);
+    check(scitoken_set_claim_string(token.get(), "iss",
+                                    signer.m_issuer.c_str(), &err_msg),
+          err_msg, "Failed to set the issuer");
+    check(scitoken_set_claim_string(token.get(), "aud", audience, &err_msg),
+          err_msg, "Failed to set the audience");
+    check(scitoken_set_claim_string(token.get(), "scope", scope.c_str(),
+                                    &err_msg),
+          err_msg, "Failed to set the scope");
+    scitoken_set_lifetime(token.get(), 3600);
+    return token;
+}
+
+std::string serialize(SciToken token) {
+    char *err_msg = nullptr, *value = nullptr;
+    check(scitoken_serialize(token, &value, &err_msg), err_msg,
+          "Failed to serialize a token");
+    std::string result(value);
+    free(value);
+    return result;
+}
+
+TokenPtr deserialize(const std::string &value) {
+    char *err_msg = nullptr;
+    TokenPtr token(scitoken_create(nullptr), scitoken_destroy);
+    check(scitoken_deserialize_v2(value.c_str(), token.get(), nullptr,
+                                  &err_msg),
+          err_msg, "Failed to deserialize a token");
+    return token;
+}
+
+void reset_memory_cache(const std::string &cache_home) {
+    char *err_msg = nullptr;
+    check(scitoken_config_set_str("keycache.cache_home", cache_home.c_str(),
+                                  &err_msg),
+          err_msg, "Failed to set the cache home");
+}
+
+std::vector<Benchmark> create_benchmarks(const std::string &cache_home,
+                                         const MockIssuer &mock,
+                                         std::vector<KeyPtr> &keys,
+                                         std::vector<EnforcerPtr> &enforcers) {
+    char *err_msg = nullptr;
+    std::vector<Benchmark> benchmarks;
+    std::vector<Signer> signers = {
+        {"ES256", "https://bench.example/es256", "ec", ec_public,
+         ec_private, ec_jwks},
+        {"RS256", "https://bench.example/rs256", "rsa", rsa_public,
+         rsa_private, rsa_jwks}};
+
+    for (const auto &signer : signers) {
+        keys.emplace_back(scitoken_key_create(signer.m_kid,
+                                              signer.m_alg.c_str(),
+                                              signer.m_public,
+                                              signer.m_private, &err_msg),
+                          scitoken_key_destroy);
+        if (!keys.back()) {
+            check(-1, err_msg, "Failed to create the " + signer.m_alg + " key");
+        }
+        auto key = keys.back().get();
+        check(keycache_set_jwks(signer.m_issuer.c_str(), signer.m_jwks,
+                                &err_msg),
+              err_msg, "Failed to store the " + signer.m_alg + " keys");
+
+        // scitoken_serialize updates the token, so each thread has its own.
+        auto tokens = std::make_shared<std::vector<TokenPtr>>();
+        auto max_threads =
+            *std::max_element(g_threads.begin(), g_threads.end());
+        for (unsigned thread = 0; thread < max_threads; thread++) {
+            tokens->push_back(create_token(signer, key, "read:/"));
+        }
+        benchmarks.push_back({"serialize/" + signer.m_alg, nullptr,
+                              [tokens](unsigned thread) {
+                                  serialize((*tokens)[thread].get());
+                              },
+                              false});
+
+        auto value = std::make_shared<std::string>(
+            serialize(tokens->front().get()));
+        auto warm = [value](unsigned) { deserialize(*value); };
+        benchmarks.push_back({"verify/" + signer.m_alg + "/memory", warm,
+                              [value](unsigned) { deserialize(*value); },
+                              false});
+        benchmarks.push_back({"verify/" + signer.m_alg + "/sqlite", warm,
+                              [value, cache_home](unsigned) {
+                                  reset_memory_cache(cache_home);
+                                  deserialize(*value);
+                              },
+                              true});
+    }
+
+    const char *audiences[] = {audience, nullptr};
+    const auto &signer = signers.front();
+    for (int scopes : {1, 16, 256}) {
+        std::string scope;
+        for (int idx = 0; idx < scopes; idx++) {
+            scope += (idx ? " read:/dir" : "read:/dir") + std::to_string(idx);
+        }
+        auto token = std::shared_ptr<void>(
+            deserialize(serialize(
+                            create_token(signer, keys.front().get(), scope)
+                                .get()))
+                .release(),
+            scitoken_destroy);
+        auto resource = std::make_shared<std::string>(
+            "/dir" + std::to_string(scopes - 1) + "/file");
+
+        for (bool cached : {false, true}) {
+            enforcers.emplace_back(
+                enforcer_create(signer.m_issuer.c_str(), audiences, &err_msg),
+                enforcer_destroy);
+            if (!enforcers.back()) {
+                check(-1, err_msg, "Failed to create an enforcer");
+            }
+            auto enf = enforcers.back().get();
+            if (cached) {
+                check(enforcer_set_cache_size(enf, 16, &err_msg), err_msg,
+                      "Failed to set the enforcer cache size");
+            }
+            auto suffix =
+                "/scopes=" + std::to_string(scopes) + (cached ? "/cached" : "");
+            auto test = [enf, token, resource](unsigned) {
+                char *err_msg = nullptr;
+                Acl acl = {"read", resource->c_str()};
+                check(enforcer_test(enf, token.get(), &acl, &err_msg),
+                      err_msg, "Access denied");
+            };
+            benchmarks.push_back(
+                {"enforcer_test" + suffix, test, test, false});
+            auto generate = [enf, token](unsigned) {
+                char *err_msg = nullptr;
+                Acl *acls = nullptr;
+                check(enforcer_generate_acls(enf, token.get(), &acls,
+                                             &err_msg),
+                      err_msg, "Failed to generate ACLs");
+                enforcer_acl_free(acls);
+            };
+            benchmarks.push_back(
+                {"enforcer_generate_acls" + suffix, generate, generate, false});
+        }
+    }
+
+    auto issuer = std::make_shared<std::string>(mock.url());
+    benchmarks.push_back({"refresh/cold", nullptr, [issuer](unsigned) {
+                              char *err_msg = nullptr;
+                              check(keycache_refresh_jwks(issuer->c_str(),
+                                                          &err_msg),
+                                    err_msg, "Failed to refresh the keys");
+                          },
+                          false});
+    return benchmarks;
+}
+
+} // namespace
+
+int main(int argc, char *argv[]) {
+    int rv = init_arguments(argc, argv);
+    if (rv) {
+        return rv;
+    }
+
+    char cache_home[] = "/tmp/scitokens-bench.XXXXXX";
+    if (!mkdtemp(cache_home)) {
+        fprintf(stderr, "Failed to create a temporary cache home: %s\n",
+                strerror(errno));
+        return 1;
+    }
+
+    int result = 0;
+    try {
+        reset_memory_cache(cache_home);
+        MockIssuer mock(cache_home, ec_jwks);
+        char *err_msg = nullptr;
+        check(scitoken_config_set_str("tls.ca_file", mock.ca_file().c_str(),
+                                      &err_msg),
+              err_msg, "Failed to set the CA file");
+
+        std::vector<KeyPtr> keys;
+        std::vector<EnforcerPtr> enforcers;
+        auto benchmarks = create_benchmarks(cache_home, mock, keys, enforcers);
+
+        printf("%-40s %7s %12s %10s %10s\n", "benchmark", "threads", "ops/s",
+               "p50 us", "p99 us");
+        for (const auto &bench : benchmarks) {
+            if (bench.m_name.find(g_filter) == std::string::npos) {
+                continue;
+            }
+            for (auto threads : g_threads) {
+                if (bench.m_single_threaded && threads > 1) {
+                    continue;
+                }
+                run(bench, threads);
+            }
+        }
+    } catch (std::exception &exc) {
+        fprintf(stderr, "%s: %s\n", argv[0], exc.what());
+        result = 1;
+    }
+
+    if (nftw(cache_home, remove_entry, 16, FTW_DEPTH | FTW_PHYS) != 0) {
+        fprintf(stderr, "Failed to remove %s\n", cache_home);
+    }
+    return result;
+}
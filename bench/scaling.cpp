@@ -0,0 +1,503 @@
+/**
+ * Scaling benchmark for verification against the shared key cache.
+ *
+ * For each combination of process and thread counts, that many processes
+ * are forked, all using one cache home, and each verifies a token on that
+ * many threads for a fixed time while another of its threads forces a
+ * refresh of the issuer's keys from a mock issuer every so often, as
+ * keycache_refresh_jwks does in production.  The report gives the aggregate
+ * throughput, the throughput per thread (flat when verification scales),
+ * the latency percentiles and the time spent waiting for locks, so
+ * contention in the key cache shows up as the counts grow.
+ */
+
+#include "common.h"
+
+#include <getopt.h>
+#include <sys/wait.h>
+
+#include <picojson/picojson.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cstdint>
+#include <vector>
+
+using namespace scitokens_bench;
+
+namespace {
+
+const char usage[] =
+    "\n"
+    "Syntax: %s [--processes N[,N...]] [--threads N[,N...]] [--duration S]\n"
+    "           [--refresh-interval MS]\n"
+    "\n"
+    " Options\n"
+    "    -h | --help                    Display usage\n"
+    "    -p | --processes  <N[,N...]>   Process counts to run with (default "
+    "1, 2, 4,\n"
+    "                                   ... up to the number of CPUs).\n"
+    "    -t | --threads    <N[,N...]>   Verifying threads per process "
+    "(default 1).\n"
+    "    -d | --duration          <S>   Seconds to run each combination "
+    "for\n"
+    "                                   (default 2).\n"
+    "    -r | --refresh-interval <MS>   Milliseconds between forced key "
+    "refreshes\n"
+    "                                   in each process (default 100; 0 for "
+    "none).\n"
+    "\n";
+
+const struct option long_options[] = {
+    {"help", no_argument, NULL, 'h'},
+    {"processes", required_argument, NULL, 'p'},
+    {"threads", required_argument, NULL, 't'},
+    {"duration", required_argument, NULL, 'd'},
+    {"refresh-interval", required_argument, NULL, 'r'},
+    {0, 0, 0, 0}};
+
+const char short_options[] = "hp:t:d:r:";
+
+std::vector<unsigned> g_processes, g_threads;
+double g_duration = 2;
+int g_refresh_interval_ms = 100;
+
+std::vector<unsigned> parse_counts(const char *argv0, const char *arg) {
+    std::vector<unsigned> counts;
+    std::string list = arg;
+    size_t pos = 0;
+    while (pos <= list.size()) {
+        auto end = list.find(',', pos);
+        if (end == std::string::npos) {
+            end = list.size();
+        }
+        int count = atoi(list.substr(pos, end - pos).c_str());
+        if (count <= 0) {
+            fprintf(stderr, "%s: invalid count in %s\n", argv0, arg);
+            exit(1);
+        }
+        counts.push_back(count);
+        pos = end + 1;
+    }
+    return counts;
+}
+
+int init_arguments(int argc, char *argv[]) {
+    int arg;
+    while ((arg = getopt_long(argc, argv, short_options, long_options,
+                              nullptr)) != -1) {
+        switch (arg) {
+        case 'h':
+            printf(usage, argv[0]);
+            exit(0);
+            break;
+        case 'p':
+            g_processes = parse_counts(argv[0], optarg);
+            break;
+        case 't':
+            g_threads = parse_counts(argv[0], optarg);
+            break;
+        case 'd':
+            g_duration = atof(optarg);
+            break;
+        case 'r':
+            g_refresh_interval_ms = atoi(optarg);
+            break;
+        default:
+            fprintf(stderr, usage, argv[0]);
+            exit(1);
+            break;
+        }
+    }
+
+    if (optind != argc) {
+        fprintf(stderr, "%s: invalid option -- %s\n", argv[0], argv[optind]);
+        fprintf(stderr, usage, argv[0]);
+        exit(1);
+    }
+    if (g_duration <= 0) {
+        fprintf(stderr, "%s: --duration must be positive\n", argv[0]);
+        exit(1);
+    }
+    if (g_refresh_interval_ms < 0) {
+        fprintf(stderr, "%s: --refresh-interval must not be negative\n",
+                argv[0]);
+        exit(1);
+    }
+    if (g_processes.empty()) {
+        unsigned cpus = std::max(1u, std::thread::hardware_concurrency());
+        for (unsigned count = 1; count < cpus; count *= 2) {
+            g_processes.push_back(count);
+        }
+        g_processes.push_back(cpus);
+    }
+    if (g_threads.empty()) {
+        g_threads.push_back(1);
+    }
+    return 0;
+}
+
+// What one worker process measured, as sent back to the parent.
+struct ProcessResult {
+    std::vector<double> m_latencies;
+    double m_elapsed{0};
+    uint64_t m_failures{0};
+    uint64_t m_refreshes{0};
+    uint64_t m_refresh_failures{0};
+    std::string m_stats;
+};
+
+bool write_all(int fd, const void *data, size_t size) {
+    auto bytes = static_cast<const char *>(data);
+    while (size) {
+        auto rc = write(fd, bytes, size);
+        if (rc < 0 && errno == EINTR) {
+            continue;
+        } else if (rc <= 0) {
+            return false;
+        }
+        bytes += rc;
+        size -= rc;
+    }
+    return true;
+}
+
+bool read_all(int fd, void *data, size_t size) {
+    auto bytes = static_cast<char *>(data);
+    while (size) {
+        auto rc = read(fd, bytes, size);
+        if (rc < 0 && errno == EINTR) {
+            continue;
+        } else if (rc <= 0) {
+            return false;
+        }
+        bytes += rc;
+        size -= rc;
+    }
+    return true;
+}
+
+bool send_result(int fd, const ProcessResult &result) {
+    uint64_t count = result.m_latencies.size(), size = result.m_stats.size();
+    return write_all(fd, &count, sizeof(count)) &&
+           write_all(fd, result.m_latencies.data(), count * sizeof(double)) &&
+           write_all(fd, &result.m_elapsed, sizeof(result.m_elapsed)) &&
+           write_all(fd, &result.m_failures, sizeof(result.m_failures)) &&
+           write_all(fd, &result.m_refreshes, sizeof(result.m_refreshes)) &&
+           write_all(fd, &result.m_refresh_failures,
+                     sizeof(result.m_refresh_failures)) &&
+           write_all(fd, &size, sizeof(size)) &&
+           write_all(fd, result.m_stats.data(), size);
+}
+
+bool receive_result(int fd, ProcessResult &result) {
+    uint64_t count, size;
+    if (!read_all(fd, &count, sizeof(count))) {
+        return false;
+    }
+    result.m_latencies.resize(count);
+    if (!read_all(fd, result.m_latencies.data(), count * sizeof(double)) ||
+        !read_all(fd, &result.m_elapsed, sizeof(result.m_elapsed)) ||
+        !read_all(fd, &result.m_failures, sizeof(result.m_failures)) ||
+        !read_all(fd, &result.m_refreshes, sizeof(result.m_refreshes)) ||
+        !read_all(fd, &result.m_refresh_failures,
+                  sizeof(result.m_refresh_failures)) ||
+        !read_all(fd, &size, sizeof(size))) {
+        return false;
+    }
+    result.m_stats.resize(size);
+    return read_all(fd, &result.m_stats[0], size);
+}
+
+/**
+ * The body of a worker process: set up, report ready on `ready_fd`, wait
+ * for `go_fd` to be closed, verify for g_duration seconds and send the
+ * results to `result_fd`.
+ */
+int run_worker(unsigned threads, const std::string &issuer,
+               const std::string &token, int ready_fd, int go_fd,
+               int result_fd) {
+    char *err_msg = nullptr;
+    try {
+        // The other processes may be seeding it too; the keys are the same.
+        check(keycache_set_jwks(issuer.c_str(), ec_jwks, &err_msg), err_msg,
+              "Failed to store the keys");
+        auto verify = [&token]() {
+            char *err_msg = nullptr;
+            SciToken scitoken = nullptr;
+            int rv = scitoken_deserialize(token.c_str(), &scitoken, nullptr,
+                                          &err_msg);
+            free(err_msg);
+            scitoken_destroy(scitoken);
+            return rv == 0;
+        };
+        if (!verify()) {
+            throw std::runtime_error("The token does not verify");
+        }
+    } catch (std::exception &exc) {
+        fprintf(stderr, "Worker %d: %s\n", static_cast<int>(getpid()),
+                exc.what());
+        return 1;
+    }
+
+    char byte = 0;
+    if (!write_all(ready_fd, &byte, 1)) {
+        return 1;
+    }
+    // Blocks until the parent closes its end, starting every worker at once.
+    read(go_fd, &byte, 1);
+    scitoken_reset_stats();
+
+    ProcessResult result;
+    std::vector<std::vector<double>> latencies(threads);
+    std::atomic<uint64_t> failures(0);
+    std::atomic<bool> done(false);
+    auto start = std::chrono::steady_clock::now();
+    auto deadline =
+        start + std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+                    std::chrono::duration<double>(g_duration));
+
+    auto verifier = [&](unsigned thread) {
+        auto &thread_latencies = latencies[thread];
+        for (auto now = std::chrono::steady_clock::now(); now < deadline;) {
+            char *err_msg = nullptr;
+            SciToken scitoken = nullptr;
+            if (scitoken_deserialize(token.c_str(), &scitoken, nullptr,
+                                     &err_msg)) {
+                failures++;
+            }
+            free(err_msg);
+            scitoken_destroy(scitoken);
+            auto end = std::chrono::steady_clock::now();
+            std::chrono::duration<double, std::micro> elapsed = end - now;
+            thread_latencies.push_back(elapsed.count());
+            now = end;
+        }
+    };
+    auto refresher = [&]() {
+        auto interval = std::chrono::milliseconds(g_refresh_interval_ms);
+        for (auto next = start + interval; next < deadline && !done;
+             next += interval) {
+            std::this_thread::sleep_until(next);
+            char *err_msg = nullptr;
+            if (keycache_refresh_jwks(issuer.c_str(), &err_msg)) {
+                result.m_refresh_failures++;
+            } else {
+                result.m_refreshes++;
+            }
+            free(err_msg);
+        }
+    };
+
+    std::vector<std::thread> workers;
+    for (unsigned thread = 0; thread < threads; thread++) {
+        workers.emplace_back(verifier, thread);
+    }
+    std::thread refresh_thread;
+    if (g_refresh_interval_ms > 0) {
+        refresh_thread = std::thread(refresher);
+    }
+    for (auto &worker : workers) {
+        worker.join();
+    }
+    std::chrono::duration<double> elapsed =
+        std::chrono::steady_clock::now() - start;
+    done = true;
+    if (refresh_thread.joinable()) {
+        refresh_thread.join();
+    }
+
+    for (const auto &thread_latencies : latencies) {
+        result.m_latencies.insert(result.m_latencies.end(),
+                                  thread_latencies.begin(),
+                                  thread_latencies.end());
+    }
+    result.m_elapsed = elapsed.count();
+    result.m_failures = failures;
+    char *stats = nullptr;
+    if (scitoken_get_stats(&stats, &err_msg) == 0) {
+        result.m_stats = stats;
+        free(stats);
+    } else {
+        free(err_msg);
+    }
+    return send_result(result_fd, result) ? 0 : 1;
+}
+
+// The count and total microseconds of a latency histogram in the stats.
+void histogram_totals(const std::string &stats, const char *name,
+                      uint64_t &count, double &sum_us) {
+    picojson::value json;
+    if (!picojson::parse(json, stats).empty() || !json.is<picojson::object>()) {
+        return;
+    }
+    const auto &keycache = json.get("keycache");
+    if (!keycache.is<picojson::object>()) {
+        return;
+    }
+    const auto &histogram = keycache.get(name);
+    if (!histogram.is<picojson::object>()) {
+        return;
+    }
+    if (histogram.get("count").is<double>()) {
+        count += histogram.get("count").get<double>();
+    }
+    if (histogram.get("sum_us").is<double>()) {
+        sum_us += histogram.get("sum_us").get<double>();
+    }
+}
+
+void run(unsigned processes, unsigned threads, const std::string &issuer,
+         const std::string &token) {
+    int ready_pipe[2], go_pipe[2];
+    if (pipe(ready_pipe) || pipe(go_pipe)) {
+        throw std::runtime_error("Failed to create a pipe");
+    }
+    std::vector<std::pair<pid_t, int>> workers;
+    for (unsigned idx = 0; idx < processes; idx++) {
+        int result_pipe[2];
+        if (pipe(result_pipe)) {
+            throw std::runtime_error("Failed to create a pipe");
+        }
+        // Only this thread is carried into the child; the mock issuer's
+        // thread is idle in poll() as no child has started yet.
+        fflush(stdout);
+        pid_t pid = fork();
+        if (pid < 0) {
+            throw std::runtime_error("Failed to fork a worker");
+        } else if (pid == 0) {
+            close(ready_pipe[0]);
+            close(go_pipe[1]);
+            close(result_pipe[0]);
+            _exit(run_worker(threads, issuer, token, ready_pipe[1],
+                             go_pipe[0], result_pipe[1]));
+        }
+        close(result_pipe[1]);
+        workers.emplace_back(pid, result_pipe[0]);
+    }
+    close(ready_pipe[1]);
+    close(go_pipe[0]);
+
+    unsigned ready = 0;
+    char byte;
+    while (ready < processes && read_all(ready_pipe[0], &byte, 1)) {
+        ready++;
+    }
+    close(ready_pipe[0]);
+    close(go_pipe[1]);
+
+    std::vector<double> latencies;
+    double throughput = 0;
+    uint64_t failures = 0, refreshes = 0, refresh_failures = 0;
+    uint64_t lock_waits = 0, sqlite_locks = 0;
+    double lock_wait_us = 0, sqlite_lock_us = 0;
+    bool complete = ready == processes;
+    for (const auto &worker : workers) {
+        ProcessResult result;
+        if (complete && receive_result(worker.second, result)) {
+            latencies.insert(latencies.end(), result.m_latencies.begin(),
+                             result.m_latencies.end());
+            throughput += result.m_latencies.size() / result.m_elapsed;
+            failures += result.m_failures;
+            refreshes += result.m_refreshes;
+            refresh_failures += result.m_refresh_failures;
+            histogram_totals(result.m_stats, "lock_wait_us", lock_waits,
+                             lock_wait_us);
+            histogram_totals(result.m_stats, "sqlite_lock_wait_us",
+                             sqlite_locks, sqlite_lock_us);
+        } else {
+            complete = false;
+        }
+        close(worker.second);
+        int status;
+        waitpid(worker.first, &status, 0);
+        if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+            complete = false;
+        }
+    }
+    if (!complete || latencies.empty()) {
+        printf("%9u %7u  failed: a worker process did not finish\n",
+               processes, threads);
+        return;
+    }
+
+    std::sort(latencies.begin(), latencies.end());
+    auto percentile = [&](double pct) {
+        return latencies[std::min(latencies.size() - 1,
+                                  static_cast<size_t>(pct * latencies.size()))];
+    };
+    printf("%9u %7u %12.1f %12.1f %9.1f %9.1f %8llu/%-5llu %7llu %9.1f "
+           "%9.1f %8llu\n",
+           processes, threads, throughput,
+           throughput / (processes * threads), percentile(0.5),
+           percentile(0.99), static_cast<unsigned long long>(refreshes),
+           static_cast<unsigned long long>(refresh_failures),
+           static_cast<unsigned long long>(lock_waits), lock_wait_us / 1000,
+           sqlite_lock_us / 1000, static_cast<unsigned long long>(failures));
+}
+
+} // namespace
+
+int main(int argc, char *argv[]) {
+    int rv = init_arguments(argc, argv);
+    if (rv) {
+        return rv;
+    }
+
+    char cache_home[] = "/tmp/scitokens-bench.XXXXXX";
+    if (!mkdtemp(cache_home)) {
+        fprintf(stderr, "Failed to create a temporary cache home: %s\n",
+                strerror(errno));
+        return 1;
+    }
+
+    int result = 0;
+    try {
+        char *err_msg = nullptr;
+        check(scitoken_config_set_str("keycache.cache_home", cache_home,
+                                      &err_msg),
+              err_msg, "Failed to set the cache home");
+        MockIssuer mock(cache_home, ec_jwks);
+        check(scitoken_config_set_str("tls.ca_file", mock.ca_file().c_str(),
+                                      &err_msg),
+              err_msg, "Failed to set the CA file");
+
+        // The token is signed here; only the workers touch the key cache,
+        // as SQLite connections must not be carried across fork().
+        KeyPtr key(scitoken_key_create("ec", "ES256", ec_public, ec_private,
+                                       &err_msg),
+                   scitoken_key_destroy);
+        if (!key) {
+            check(-1, err_msg, "Failed to create the key");
+        }
+        TokenPtr token(scitoken_create(key.get()), scitoken_destroy);
+        check(scitoken_set_claim_string(token.get(), "iss",
+                                        mock.url().c_str(), &err_msg),
+              err_msg, "Failed to set the issuer");
+        scitoken_set_lifetime(token.get(), 3600);
+        char *value = nullptr;
+        check(scitoken_serialize(token.get(), &value, &err_msg), err_msg,
+              "Failed to serialize the token");
+        std::string serialized(value);
+        free(value);
+
+        printf("%9s %7s %12s %12s %9s %9s %14s %7s %9s %9s %8s\n",
+               "processes", "threads", "ops/s", "ops/s/thread", "p50 us",
+               "p99 us", "refreshes/fail", "waits", "wait ms", "sqlite ms",
+               "failures");
+        for (auto processes : g_processes) {
+            for (auto threads : g_threads) {
+                run(processes, threads, mock.url(), serialized);
+            }
+        }
+    } catch (std::exception &exc) {
+        fprintf(stderr, "%s: %s\n", argv[0], exc.what());
+        result = 1;
+    }
+
+    if (nftw(cache_home, remove_entry, 16, FTW_DEPTH | FTW_PHYS) != 0) {
+        fprintf(stderr, "Failed to remove %s\n", cache_home);
+    }
+    return result;
+}
@@ -4,8 +4,11 @@
 #include <getopt.h>
 #include <stdlib.h>
 
+#include <algorithm>
+#include <chrono>
 #include <cstdio>
 #include <fstream>
+#include <map>
 #include <memory>
 #include <string>
 #include <vector>
@@ -15,7 +18,8 @@ namespace {
 const char usage[] =
     "\n"
     "Syntax: %s [--cred cred_file] [--key key_file] [--keyid kid]\n"
-    "           [--claim key=val] ...\n"
+    "           [--alg alg] [--claim key=val] ...\n"
+    "           [--count N] [--subjects file] [--threads N] [--benchmark]\n"
     "\n"
     " Options\n"
     "    -h | --help                        Display usage\n"
@@ -24,24 +28,63 @@ const char usage[] =
     "    -k | --key             <key_file>  File containing the signing "
     "private key.\n"
     "    -K | --keyid                <kid>  Name of the token key.\n"
+    "    -a | --alg                  <alg>  Signing algorithm (ES256, "
+    "ES384, RS256,\n"
+    "                                       EdDSA); defaults to ES256.\n"
     "    -i | --issuer            <issuer>  Issuer for the token.\n"
     "    -p | --profile          <profile>  Token profile (wlcg, scitokens1, "
     "scitokens2, atjwt).\n"
+    "    -n | --count                  <N>  Number of tokens to mint, one "
+    "per line;\n"
+    "                                       defaults to 1, or one per "
+    "subject.\n"
+    "    -s | --subjects            <file>  File of token subjects, one per "
+    "line,\n"
+    "                                       each optionally followed by a "
+    "tab and\n"
+    "                                       the token's scope; used in turn.\n"
+    "    -t | --threads                <N>  Threads signing the tokens "
+    "(default 1).\n"
+    "    -B | --benchmark                   Report the minting rate in "
+    "place of\n"
+    "                                       the tokens.\n"
     "\n";
 
-const struct option long_options[] = {{"help", no_argument, NULL, 'h'},
-                                      {"cred", required_argument, NULL, 'c'},
-                                      {"key", required_argument, NULL, 'k'},
-                                      {"keyid", required_argument, NULL, 'K'},
-                                      {"issuer", required_argument, NULL, 'i'},
-                                      {"claim", required_argument, NULL, 'C'},
-                                      {"profile", required_argument, NULL, 'p'},
-                                      {0, 0, 0, 0}};
+const struct option long_options[] = {
+    {"help", no_argument, NULL, 'h'},
+    {"cred", required_argument, NULL, 'c'},
+    {"key", required_argument, NULL, 'k'},
+    {"keyid", required_argument, NULL, 'K'},
+    {"alg", required_argument, NULL, 'a'},
+    {"issuer", required_argument, NULL, 'i'},
+    {"claim", required_argument, NULL, 'C'},
+    {"profile", required_argument, NULL, 'p'},
+    {"count", required_argument, NULL, 'n'},
+    {"subjects", required_argument, NULL, 's'},
+    {"threads", required_argument, NULL, 't'},
+    {"benchmark", no_argument, NULL, 'B'},
+    {0, 0, 0, 0}};
 
-const char short_options[] = "hc:k:K:i:C:p:";
+const char short_options[] = "hc:k:K:a:i:C:p:n:s:t:B";
 
-std::string g_cred, g_key, g_kid, g_issuer, g_profile;
+std::string g_cred, g_key, g_kid, g_alg = "ES256", g_issuer, g_profile,
+    g_subjects;
 std::vector<std::string> g_claims;
+int g_count = 0, g_threads = 1;
+bool g_benchmark = false;
+
+// Tokens minted per pass, bounding the memory a large run holds.
+const size_t block_size = 4096;
+
+int positive_argument(const char *argv0, const char *name, const char *arg) {
+    char *end;
+    long value = strtol(arg, &end, 10);
+    if (*arg == '\0' || *end != '\0' || value <= 0 || value > 1000000000) {
+        fprintf(stderr, "%s: invalid %s -- %s\n", argv0, name, arg);
+        exit(1);
+    }
+    return value;
+}
 
 int init_arguments(int argc, char *argv[]) {
 
@@ -62,6 +105,9 @@ int init_arguments(int argc, char *argv[]) {
         case 'K':
             g_kid = optarg;
             break;
+        case 'a':
+            g_alg = optarg;
+            break;
         case 'i':
             g_issuer = optarg;
             break;
@@ -71,6 +117,18 @@ int init_arguments(int argc, char *argv[]) {
         case 'p':
             g_profile = optarg;
             break;
+        case 'n':
+            g_count = positive_argument(argv[0], "count", optarg);
+            break;
+        case 's':
+            g_subjects = optarg;
+            break;
+        case 't':
+            g_threads = positive_argument(argv[0], "thread count", optarg);
+            break;
+        case 'B':
+            g_benchmark = true;
+            break;
         default:
             fprintf(stderr, usage, argv[0]);
             exit(1);
@@ -111,6 +169,100 @@ int init_arguments(int argc, char *argv[]) {
     return 0;
 }
 
+struct Subject {
+    std::string m_sub;   // Empty for the token's own.
+    std::string m_scope; // Empty for the token's own.
+};
+
+/**
+ * Mint g_count tokens like `token`, taking their subjects and scopes from
+ * `subjects` in turn.  Each distinct scope gets a template, so every token
+ * is minted by encoding and signing only its own jti, times and subject.
+ */
+int mint_many(SciToken token, const std::vector<Subject> &subjects) {
+    // "" sorts first, so its template is made before the token's scope is
+    // overridden for the others.
+    std::map<std::string, std::unique_ptr<void, void (*)(void *)>> templates;
+    for (const auto &subject : subjects) {
+        templates.emplace(subject.m_scope,
+                          std::unique_ptr<void, void (*)(void *)>(
+                              nullptr, scitoken_template_destroy));
+    }
+    char *err_msg;
+    for (auto &entry : templates) {
+        if (!entry.first.empty() &&
+            scitoken_set_claim_string(token, "scope", entry.first.c_str(),
+                                      &err_msg)) {
+            fprintf(stderr, "Failed to set scope (%s): %s\n",
+                    entry.first.c_str(), err_msg);
+            free(err_msg);
+            return 1;
+        }
+        entry.second.reset(scitoken_template_create(token, &err_msg));
+        if (!entry.second) {
+            fprintf(stderr, "Failed to create a token template: %s\n",
+                    err_msg);
+            free(err_msg);
+            return 1;
+        }
+    }
+
+    auto start = std::chrono::steady_clock::now();
+    std::vector<char *> values;
+    for (size_t first = 0; first < static_cast<size_t>(g_count);
+         first += block_size) {
+        size_t count = std::min(block_size, g_count - first);
+        values.assign(count, nullptr);
+        // Mint the block's tokens for each scope together, then print them
+        // in order.
+        for (const auto &entry : templates) {
+            std::vector<size_t> indices;
+            std::vector<const char *> subs;
+            for (size_t idx = 0; idx < count; idx++) {
+                const auto &subject =
+                    subjects[(first + idx) % subjects.size()];
+                if (subject.m_scope == entry.first) {
+                    indices.push_back(idx);
+                    subs.push_back(subject.m_sub.c_str());
+                }
+            }
+            if (indices.empty()) {
+                continue;
+            }
+            std::vector<char *> minted(indices.size());
+            if (scitoken_template_serialize_many(
+                    entry.second.get(), subs.data(), subs.size(), g_threads,
+                    minted.data(), &err_msg)) {
+                fprintf(stderr, "Failed to serialize the tokens: %s\n",
+                        err_msg);
+                free(err_msg);
+                for (auto value : values) {
+                    free(value);
+                }
+                return 1;
+            }
+            for (size_t idx = 0; idx < indices.size(); idx++) {
+                values[indices[idx]] = minted[idx];
+            }
+        }
+        for (auto value : values) {
+            if (!g_benchmark) {
+                printf("%s\n", value);
+            }
+            free(value);
+        }
+    }
+    std::chrono::duration<double> elapsed =
+        std::chrono::steady_clock::now() - start;
+
+    if (g_benchmark) {
+        printf("Minted %d tokens in %.3f s with %d threads: %.1f tokens/s\n",
+               g_count, elapsed.count(), g_threads,
+               g_count / elapsed.count());
+    }
+    return 0;
+}
+
 } // namespace
 
 int main(int argc, char *argv[]) {
@@ -129,8 +281,9 @@ int main(int argc, char *argv[]) {
 
     char *err_msg;
     auto key_raw =
-        scitoken_key_create(g_kid.c_str(), "ES256", public_contents.c_str(),
-                            private_contents.c_str(), &err_msg);
+        scitoken_key_create(g_kid.c_str(), g_alg.c_str(),
+                            public_contents.c_str(), private_contents.c_str(),
+                            &err_msg);
     std::unique_ptr<void, decltype(&scitoken_key_destroy)> key(
         key_raw, scitoken_key_destroy);
     if (key_raw == nullptr) {
@@ -191,6 +344,43 @@ int main(int argc, char *argv[]) {
         scitoken_set_serialize_mode(token.get(), profile);
     }
 
+    if (g_count || !g_subjects.empty() || g_benchmark) {
+        std::vector<Subject> subjects;
+        if (!g_subjects.empty()) {
+            std::ifstream subjects_ifs(g_subjects);
+            if (!subjects_ifs) {
+                fprintf(stderr, "Failed to open %s\n", g_subjects.c_str());
+                return 1;
+            }
+            std::string line;
+            while (std::getline(subjects_ifs, line)) {
+                if (!line.empty() && line.back() == '\r') {
+                    line.pop_back();
+                }
+                if (line.empty()) {
+                    continue;
+                }
+                auto tab = line.find('\t');
+                Subject subject;
+                subject.m_sub = line.substr(0, tab);
+                if (tab != std::string::npos) {
+                    subject.m_scope = line.substr(tab + 1);
+                }
+                subjects.push_back(subject);
+            }
+            if (subjects.empty()) {
+                fprintf(stderr, "No subjects in %s\n", g_subjects.c_str());
+                return 1;
+            }
+        } else {
+            subjects.emplace_back();
+        }
+        if (!g_count) {
+            g_count = g_subjects.empty() ? 1 : subjects.size();
+        }
+        return mint_many(token.get(), subjects);
+    }
+
     char *value;
     rv = scitoken_serialize(token.get(), &value, &err_msg);
     if (rv) {
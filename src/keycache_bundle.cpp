@@ -0,0 +1,37 @@
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+
+#include "scitokens.h"
+
+int main(int argc, const char **argv) {
+    if (argc < 4 ||
+        (strcmp(argv[1], "export") && strcmp(argv[1], "import"))) {
+        std::cerr << "Usage: " << argv[0]
+                  << " (export|import) (BUNDLE) (SECRET_FILE)" << std::endl;
+        return 1;
+    }
+    bool do_export = !strcmp(argv[1], "export");
+
+    char *err_msg = nullptr;
+    // The bundle is MAC'd with, and only imported if it matches, the secret.
+    if (scitoken_config_set_str("keycache.bundle_secret_file", argv[3],
+                                &err_msg)) {
+        std::cerr << "Failed to load the bundle secret: " << err_msg
+                  << std::endl;
+        free(err_msg);
+        return 1;
+    }
+    size_t count = 0;
+    auto rv = do_export ? keycache_export_bundle(argv[2], &count, &err_msg)
+                        : keycache_import_bundle(argv[2], &count, &err_msg);
+    if (rv) {
+        std::cerr << "Failed to " << argv[1] << " the key cache bundle: "
+                  << err_msg << std::endl;
+        free(err_msg);
+        return 1;
+    }
+    std::cout << (do_export ? "Exported " : "Imported ") << count
+              << " issuer(s)." << std::endl;
+    return 0;
+}
@@ -13,10 +13,97 @@
 // Cache timeout config
 std::atomic_int configurer::Configuration::m_next_update_delta{600};
 std::atomic_int configurer::Configuration::m_expiry_delta{4 * 24 * 3600};
+std::atomic_int configurer::Configuration::m_min_update_delta{60};
+std::atomic_int configurer::Configuration::m_max_update_delta{24 * 3600};
+std::atomic_int configurer::Configuration::m_metadata_delta{24 * 3600};
+std::atomic_int configurer::Configuration::m_refresh_interval{0};
+std::atomic_int configurer::Configuration::m_verify_threads{0};
+std::atomic_int configurer::Configuration::m_sqlite_busy_timeout{5000};
+std::atomic_bool configurer::Configuration::m_keycache_snapshot{false};
+std::atomic_int configurer::Configuration::m_failure_backoff{10};
+std::atomic_int configurer::Configuration::m_unknown_kid_ttl{60};
+std::atomic_int configurer::Configuration::m_pool_objects{0};
+std::atomic_bool configurer::Configuration::m_issuer_prefilter{false};
+std::atomic_int configurer::Configuration::m_max_metadata_bytes{1024 * 1024};
+std::atomic_int configurer::Configuration::m_max_jwks_bytes{1024 * 1024};
+std::atomic_int configurer::Configuration::m_revocation_refresh_interval{300};
+std::atomic_int configurer::Configuration::m_keycache_max_entries{0};
+std::atomic_int configurer::Configuration::m_keycache_max_bytes{0};
+std::atomic_int configurer::Configuration::m_keycache_compact_interval{3600};
+std::atomic_int configurer::Configuration::m_fetch_connect_timeout{0};
+std::atomic_int configurer::Configuration::m_fetch_total_timeout{0};
+std::atomic_int configurer::Configuration::m_fetch_dns_cache_timeout{60};
+std::atomic_int configurer::Configuration::m_fetch_hedge_delay{0};
 
 // SciTokens cache home config
 std::shared_ptr<std::string> configurer::Configuration::m_cache_home =
     std::make_shared<std::string>("");
+std::atomic_int configurer::Configuration::m_cache_home_generation{0};
+std::shared_ptr<const std::string> configurer::Configuration::m_tls_ca_file =
+    std::make_shared<const std::string>("");
+std::shared_ptr<const std::string>
+    configurer::Configuration::m_keycache_backend =
+        std::make_shared<const std::string>("sqlite");
+std::shared_ptr<const std::string>
+    configurer::Configuration::m_capability_secret_file =
+        std::make_shared<const std::string>("");
+std::shared_ptr<const std::string>
+    configurer::Configuration::m_capability_secret =
+        std::make_shared<const std::string>("");
+std::shared_ptr<const std::string>
+    configurer::Configuration::m_memcached_server =
+        std::make_shared<const std::string>("localhost:11211");
+std::shared_ptr<const std::string>
+    configurer::Configuration::m_memcached_secret_file =
+        std::make_shared<const std::string>("");
+std::shared_ptr<const std::string>
+    configurer::Configuration::m_memcached_secret =
+        std::make_shared<const std::string>("");
+std::shared_ptr<const std::string>
+    configurer::Configuration::m_bundle_secret_file =
+        std::make_shared<const std::string>("");
+std::shared_ptr<const std::string>
+    configurer::Configuration::m_bundle_secret =
+        std::make_shared<const std::string>("");
+
+namespace {
+
+// Every status handed out by the C API wraps its AsyncStatus in a
+// SciTokenAsyncStatus; callers pass the handle by address.
+scitokens::AsyncStatus *get_async_status(const SciTokenStatus *status) {
+    auto real_status =
+        reinterpret_cast<scitokens::SciTokenAsyncStatus *>(*status);
+    return real_status ? real_status->m_status.get() : nullptr;
+}
+
+// Fetch context handles hold a reference to the context, which is shared
+// with the statuses using it.
+std::shared_ptr<scitokens::internal::FetchContext>
+get_fetch_context(SciTokenFetchContext ctx) {
+    if (!ctx) {
+        return nullptr;
+    }
+    return *reinterpret_cast<
+        std::shared_ptr<scitokens::internal::FetchContext> *>(ctx);
+}
+
+// What an AclList handle points to.
+struct AclListHandle {
+    std::shared_ptr<const scitokens::internal::ScopeIndex> m_index;
+};
+
+// The message handed to a C callback for a failed request.
+char *exception_message(std::exception_ptr error) {
+    try {
+        std::rethrow_exception(error);
+    } catch (std::exception &exc) {
+        return strdup(exc.what());
+    } catch (...) {
+        return strdup("Unknown error");
+    }
+}
+
+} // namespace
 
 SciTokenKey scitoken_key_create(const char *key_id, const char *alg,
                                 const char *public_contents,
@@ -205,6 +292,66 @@ int scitoken_get_claim_string_list(const SciToken token, const char *key,
     return 0;
 }
 
+int scitoken_get_claim_string_view(const SciToken token, const char *key,
+                                   const char **value, size_t *len,
+                                   char **err_msg) {
+    auto real_token = reinterpret_cast<scitokens::SciToken *>(token);
+    if (real_token == nullptr) {
+        if (err_msg)
+            *err_msg = strdup(
+                "NULL scitoken passed to scitoken_get_claim_string_view");
+        return -1;
+    }
+    auto claim = real_token->find_claim(key);
+    if (!claim || !claim->is<std::string>()) {
+        if (err_msg) {
+            *err_msg = strdup(claim ? "Claim's value is not a string"
+                                    : "Claim is not set");
+        }
+        return -1;
+    }
+    const auto &str = claim->get<std::string>();
+    *value = str.data();
+    *len = str.size();
+    return 0;
+}
+
+int scitoken_get_claim_string_list_view(const SciToken token, const char *key,
+                                        const char **values, size_t *lens,
+                                        size_t *count, char **err_msg) {
+    auto real_token = reinterpret_cast<scitokens::SciToken *>(token);
+    if (real_token == nullptr) {
+        if (err_msg)
+            *err_msg = strdup(
+                "NULL scitoken passed to scitoken_get_claim_string_list_view");
+        return -1;
+    }
+    auto claim = real_token->find_claim(key);
+    if (!claim || !claim->is<picojson::array>()) {
+        if (err_msg) {
+            *err_msg = strdup(claim ? "Claim's value is not a JSON list"
+                                    : "Claim is not set");
+        }
+        return -1;
+    }
+    const auto &array = claim->get<picojson::array>();
+    for (const auto &entry : array) {
+        if (!entry.is<std::string>()) {
+            if (err_msg) {
+                *err_msg = strdup("Claim's list has a non-string entry");
+            }
+            return -1;
+        }
+    }
+    for (size_t idx = 0; idx < array.size() && idx < *count; idx++) {
+        const auto &str = array[idx].get<std::string>();
+        values[idx] = str.data();
+        lens[idx] = str.size();
+    }
+    *count = array.size();
+    return 0;
+}
+
 void scitoken_free_string_list(char **value) {
     int idx = 0;
     do {
@@ -265,6 +412,84 @@ int scitoken_serialize(const SciToken token, char **value, char **err_msg) {
     return 0;
 }
 
+SciTokenTemplate scitoken_template_create(const SciToken token,
+                                          char **err_msg) {
+    if (token == nullptr) {
+        if (err_msg) {
+            *err_msg = strdup("Token may not be NULL");
+        }
+        return nullptr;
+    }
+    try {
+        return new scitokens::TokenTemplate(
+            *reinterpret_cast<scitokens::SciToken *>(token));
+    } catch (std::exception &exc) {
+        if (err_msg) {
+            *err_msg = strdup(exc.what());
+        }
+        return nullptr;
+    }
+}
+
+void scitoken_template_destroy(SciTokenTemplate tmpl) {
+    delete reinterpret_cast<scitokens::TokenTemplate *>(tmpl);
+}
+
+int scitoken_template_serialize(const SciTokenTemplate tmpl, const char *sub,
+                                char **value, char **err_msg) {
+    if (tmpl == nullptr || value == nullptr) {
+        if (err_msg) {
+            *err_msg = strdup("Template and output variable may not be NULL");
+        }
+        return -1;
+    }
+    auto real_tmpl = reinterpret_cast<scitokens::TokenTemplate *>(tmpl);
+    try {
+        std::string serialized = real_tmpl->serialize(sub ? sub : "");
+        *value = strdup(serialized.c_str());
+    } catch (std::exception &exc) {
+        if (err_msg) {
+            *err_msg = strdup(exc.what());
+        }
+        return -1;
+    }
+    return 0;
+}
+
+int scitoken_template_serialize_many(const SciTokenTemplate tmpl,
+                                     const char *const *subs, int count,
+                                     int threads, char **values,
+                                     char **err_msg) {
+    if (tmpl == nullptr || count < 0 || (count && !values)) {
+        if (err_msg) {
+            *err_msg = strdup("Template and output array may not be NULL");
+        }
+        return -1;
+    }
+    auto real_tmpl = reinterpret_cast<scitokens::TokenTemplate *>(tmpl);
+    std::vector<std::string> subs_vec(count);
+    if (subs) {
+        for (int idx = 0; idx < count; idx++) {
+            if (subs[idx]) {
+                subs_vec[idx] = subs[idx];
+            }
+        }
+    }
+    try {
+        auto tokens =
+            real_tmpl->serialize_many(subs_vec, threads > 0 ? threads : 1);
+        for (int idx = 0; idx < count; idx++) {
+            values[idx] = strdup(tokens[idx].c_str());
+        }
+    } catch (std::exception &exc) {
+        if (err_msg) {
+            *err_msg = strdup(exc.what());
+        }
+        return -1;
+    }
+    return 0;
+}
+
 int scitoken_deserialize(const char *value, SciToken *token,
                          char const *const *allowed_issuers, char **err_msg) {
     if (value == nullptr) {
@@ -307,8 +532,65 @@ int scitoken_deserialize_v2(const char *value, SciToken token,
         }
     }
 
+    // Rejections come back without an exception; their message is only
+    // formatted if it is wanted.
+    scitokens::internal::Rejection why;
+    try {
+        if (!real_token->try_deserialize(value, allowed_issuers_vec, why)) {
+            if (err_msg) {
+                *err_msg = strdup(why.message().c_str());
+            }
+            return -1;
+        }
+    } catch (std::exception &exc) {
+        if (err_msg) {
+            *err_msg = strdup(exc.what());
+        }
+        return -1;
+    }
+    return 0;
+}
+
+int scitoken_deserialize_many(const char *const *values, SciToken *tokens,
+                              int count, char const *const *allowed_issuers,
+                              int threads, char **errors, char **err_msg) {
+    if (count < 0 || (count && (!values || !tokens || !errors))) {
+        if (err_msg) {
+            *err_msg = strdup("Token, value and error arrays may not be NULL");
+        }
+        return -1;
+    }
+
+    std::vector<std::string> values_vec;
+    std::vector<scitokens::SciToken *> tokens_vec;
+    values_vec.reserve(count);
+    tokens_vec.reserve(count);
+    for (int idx = 0; idx < count; idx++) {
+        if (!values[idx] || !tokens[idx]) {
+            if (err_msg) {
+                *err_msg = strdup("Token and value may not be NULL");
+            }
+            return -1;
+        }
+        values_vec.emplace_back(values[idx]);
+        tokens_vec.push_back(
+            reinterpret_cast<scitokens::SciToken *>(tokens[idx]));
+    }
+    std::vector<std::string> allowed_issuers_vec;
+    if (allowed_issuers != nullptr) {
+        for (int idx = 0; allowed_issuers[idx]; idx++) {
+            allowed_issuers_vec.push_back(allowed_issuers[idx]);
+        }
+    }
+
     try {
-        real_token->deserialize(value, allowed_issuers_vec);
+        auto results = scitokens::SciToken::deserialize_many(
+            values_vec, tokens_vec, allowed_issuers_vec,
+            threads > 0 ? threads : 1);
+        for (int idx = 0; idx < count; idx++) {
+            errors[idx] =
+                results[idx].empty() ? nullptr : strdup(results[idx].c_str());
+        }
     } catch (std::exception &exc) {
         if (err_msg) {
             *err_msg = strdup(exc.what());
@@ -321,6 +603,15 @@ int scitoken_deserialize_v2(const char *value, SciToken token,
 int scitoken_deserialize_start(const char *value, SciToken *token,
                                char const *const *allowed_issuers,
                                SciTokenStatus *status_out, char **err_msg) {
+    return scitoken_deserialize_start_with_context(
+        value, token, allowed_issuers, nullptr, status_out, err_msg);
+}
+
+int scitoken_deserialize_start_with_context(const char *value, SciToken *token,
+                                            char const *const *allowed_issuers,
+                                            SciTokenFetchContext ctx,
+                                            SciTokenStatus *status_out,
+                                            char **err_msg) {
     if (value == nullptr) {
         if (err_msg) {
             *err_msg = strdup("Token may not be NULL");
@@ -346,7 +637,8 @@ int scitoken_deserialize_start(const char *value, SciToken *token,
 
     std::unique_ptr<scitokens::SciTokenAsyncStatus> status;
     try {
-        status = real_token->deserialize_start(value, allowed_issuers_vec);
+        status = real_token->deserialize_start(value, allowed_issuers_vec,
+                                               get_fetch_context(ctx));
     } catch (std::exception &exc) {
         if (err_msg) {
             *err_msg = strdup(exc.what());
@@ -368,6 +660,45 @@ int scitoken_deserialize_start(const char *value, SciToken *token,
     return 0;
 }
 
+int scitoken_deserialize_with_callback(const char *value,
+                                       char const *const *allowed_issuers,
+                                       SciTokenDeserializeCallback callback,
+                                       void *data, char **err_msg) {
+    if (value == nullptr) {
+        if (err_msg) {
+            *err_msg = strdup("Token may not be NULL");
+        }
+        return -1;
+    }
+    if (callback == nullptr) {
+        if (err_msg) {
+            *err_msg = strdup("Callback may not be a null pointer");
+        }
+        return -1;
+    }
+
+    std::vector<std::string> allowed_issuers_vec;
+    if (allowed_issuers != nullptr) {
+        for (int idx = 0; allowed_issuers[idx]; idx++) {
+            allowed_issuers_vec.push_back(allowed_issuers[idx]);
+        }
+    }
+
+    scitokens::SciTokenKey key;
+    scitokens::SciToken *real_token = new scitokens::SciToken(key);
+    real_token->deserialize_with_callback(
+        value, std::move(allowed_issuers_vec),
+        [real_token, callback, data](std::exception_ptr error) {
+            if (error) {
+                delete real_token;
+                callback(data, nullptr, exception_message(error));
+            } else {
+                callback(data, real_token, nullptr);
+            }
+        });
+    return 0;
+}
+
 int scitoken_deserialize_continue(SciToken *token, SciTokenStatus *status,
                                   char **err_msg) {
     if (token == nullptr) {
@@ -378,7 +709,7 @@ int scitoken_deserialize_continue(SciToken *token, SciTokenStatus *status,
     }
 
     scitokens::SciToken *real_token =
-        reinterpret_cast<scitokens::SciToken *>(token);
+        reinterpret_cast<scitokens::SciToken *>(*token);
     std::unique_ptr<scitokens::SciTokenAsyncStatus> real_status(
         reinterpret_cast<scitokens::SciTokenAsyncStatus *>(*status));
 
@@ -405,6 +736,121 @@ int scitoken_deserialize_continue(SciToken *token, SciTokenStatus *status,
     return 0;
 }
 
+int scitoken_peek(const char *value, SciToken token, char **err_msg) {
+    if (!value) {
+        if (err_msg) {
+            *err_msg = strdup("Token may not be NULL");
+        }
+        return -1;
+    }
+    if (!token) {
+        if (err_msg) {
+            *err_msg = strdup("Output token not provided");
+        }
+        return -1;
+    }
+    auto real_token = reinterpret_cast<scitokens::SciToken *>(token);
+    try {
+        real_token->peek(value);
+    } catch (std::exception &exc) {
+        if (err_msg) {
+            *err_msg = strdup(exc.what());
+        }
+        return -1;
+    }
+    return 0;
+}
+
+int scitoken_peek_header(const char *value, char **header, char **err_msg) {
+    if (!value) {
+        if (err_msg) {
+            *err_msg = strdup("Token may not be NULL");
+        }
+        return -1;
+    }
+    if (!header) {
+        if (err_msg) {
+            *err_msg = strdup("Output header not provided");
+        }
+        return -1;
+    }
+    try {
+        *header = strdup(scitokens::SciToken::peek_header(value).c_str());
+    } catch (std::exception &exc) {
+        if (err_msg) {
+            *err_msg = strdup(exc.what());
+        }
+        return -1;
+    }
+    return 0;
+}
+
+SciTokenDeserializer
+scitoken_deserializer_create(char const *const *allowed_issuers,
+                             SciTokenProfile profile, char **err_msg) {
+    std::vector<std::string> allowed_issuers_vec;
+    if (allowed_issuers != nullptr) {
+        for (int idx = 0; allowed_issuers[idx]; idx++) {
+            allowed_issuers_vec.push_back(allowed_issuers[idx]);
+        }
+    }
+    try {
+        return new scitokens::Deserializer(
+            std::move(allowed_issuers_vec),
+            static_cast<scitokens::SciToken::Profile>(profile));
+    } catch (std::exception &exc) {
+        if (err_msg) {
+            *err_msg = strdup(exc.what());
+        }
+        return nullptr;
+    }
+}
+
+int scitoken_deserializer_deserialize(const SciTokenDeserializer deserializer,
+                                      const char *value, SciToken token,
+                                      char **err_msg) {
+    if (!deserializer) {
+        if (err_msg) {
+            *err_msg = strdup("Deserializer may not be NULL");
+        }
+        return -1;
+    }
+    if (!value) {
+        if (err_msg) {
+            *err_msg = strdup("Token may not be NULL");
+        }
+        return -1;
+    }
+    if (!token) {
+        if (err_msg) {
+            *err_msg = strdup("Output token not provided");
+        }
+        return -1;
+    }
+    auto real_deserializer =
+        reinterpret_cast<const scitokens::Deserializer *>(deserializer);
+    auto real_token = reinterpret_cast<scitokens::SciToken *>(token);
+    scitokens::internal::Rejection why;
+    try {
+        if (!real_deserializer->try_deserialize(value, *real_token, why)) {
+            if (err_msg) {
+                *err_msg = strdup(why.message().c_str());
+            }
+            return -1;
+        }
+    } catch (std::exception &exc) {
+        if (err_msg) {
+            *err_msg = strdup(exc.what());
+        }
+        return -1;
+    }
+    return 0;
+}
+
+void scitoken_deserializer_destroy(SciTokenDeserializer deserializer) {
+    delete reinterpret_cast<scitokens::Deserializer *>(deserializer);
+}
+
 int scitoken_store_public_ec_key(const char *issuer, const char *keyid,
                                  const char *key, char **err_msg) {
     bool success;
@@ -420,7 +866,7 @@ int scitoken_store_public_ec_key(const char *issuer, const char *keyid,
     return success ? 0 : -1;
 }
 
-Validator validator_create() { return new Validator(); }
+Validator validator_create() { return new scitokens::Validator(); }
 
 void validator_destroy(Validator validator) {
     scitokens::Validator *real_validator =
@@ -561,17 +1007,151 @@ void enforcer_acl_free(Acl *acls) {
     free(acls);
 }
 
-void enforcer_set_validate_profile(Enforcer enf, SciTokenProfile profile) {
+int enforcer_acl_list_generate(const Enforcer enf, const SciToken scitoken,
+                               AclList *acls, char **err_msg) {
     if (enf == nullptr) {
-        return;
+        if (err_msg) {
+            *err_msg = strdup("Enforcer may not be a null pointer");
+        }
+        return -1;
     }
-
     auto real_enf = reinterpret_cast<scitokens::Enforcer *>(enf);
-    real_enf->set_validate_profile(
-        static_cast<scitokens::SciToken::Profile>(profile));
-}
-
-namespace {
+    if (scitoken == nullptr) {
+        if (err_msg) {
+            *err_msg = strdup("SciToken may not be a null pointer");
+        }
+        return -1;
+    }
+    auto real_scitoken = reinterpret_cast<scitokens::SciToken *>(scitoken);
+    if (acls == nullptr) {
+        if (err_msg) {
+            *err_msg = strdup("ACL list may not be a null pointer");
+        }
+        return -1;
+    }
+
+    std::shared_ptr<const scitokens::internal::ScopeIndex> index;
+    try {
+        index = real_enf->generate_acl_index(*real_scitoken);
+    } catch (std::exception &exc) {
+        if (err_msg) {
+            *err_msg = strdup(exc.what());
+        }
+        return -1;
+    }
+    auto handle = reinterpret_cast<AclListHandle *>(*acls);
+    if (!handle) {
+        handle = new AclListHandle();
+        *acls = handle;
+    }
+    handle->m_index = std::move(index);
+    return 0;
+}
+
+size_t enforcer_acl_list_size(const AclList acls) {
+    auto handle = reinterpret_cast<const AclListHandle *>(acls);
+    if (!handle || !handle->m_index) {
+        return 0;
+    }
+    return handle->m_index->get_acls().size();
+}
+
+int enforcer_acl_list_get(const AclList acls, size_t idx, const char **authz,
+                          size_t *authz_len, const char **resource,
+                          size_t *resource_len) {
+    if (idx >= enforcer_acl_list_size(acls)) {
+        return -1;
+    }
+    const auto &acl = reinterpret_cast<const AclListHandle *>(acls)
+                          ->m_index->get_acls()[idx];
+    *authz = acl.first.data();
+    *authz_len = acl.first.size();
+    *resource = acl.second.data();
+    *resource_len = acl.second.size();
+    return 0;
+}
+
+void enforcer_acl_list_destroy(AclList acls) {
+    delete reinterpret_cast<AclListHandle *>(acls);
+}
+
+MultiEnforcer enforcer_multi_create() {
+    return new scitokens::MultiEnforcer();
+}
+
+void enforcer_multi_destroy(MultiEnforcer enf) {
+    delete reinterpret_cast<scitokens::MultiEnforcer *>(enf);
+}
+
+Enforcer enforcer_multi_add_issuer(MultiEnforcer enf, const char *issuer,
+                                   const char **audience_list,
+                                   char **err_msg) {
+    if (enf == nullptr) {
+        if (err_msg) {
+            *err_msg = strdup("Enforcer may not be a null pointer");
+        }
+        return nullptr;
+    }
+    if (issuer == nullptr) {
+        if (err_msg) {
+            *err_msg = strdup("Issuer may not be a null pointer");
+        }
+        return nullptr;
+    }
+    std::vector<std::string> aud_list;
+    if (audience_list != nullptr) {
+        for (int idx = 0; audience_list[idx]; idx++) {
+            aud_list.push_back(audience_list[idx]);
+        }
+    }
+    auto real_enf = reinterpret_cast<scitokens::MultiEnforcer *>(enf);
+    try {
+        return &real_enf->add_issuer(issuer, aud_list);
+    } catch (std::exception &exc) {
+        if (err_msg) {
+            *err_msg = strdup(exc.what());
+        }
+        return nullptr;
+    }
+}
+
+Enforcer enforcer_multi_route(const MultiEnforcer enf, const SciToken scitoken,
+                              char **err_msg) {
+    if (enf == nullptr) {
+        if (err_msg) {
+            *err_msg = strdup("Enforcer may not be a null pointer");
+        }
+        return nullptr;
+    }
+    if (scitoken == nullptr) {
+        if (err_msg) {
+            *err_msg = strdup("SciToken may not be a null pointer");
+        }
+        return nullptr;
+    }
+    auto real_enf = reinterpret_cast<scitokens::MultiEnforcer *>(enf);
+    auto real_scitoken = reinterpret_cast<scitokens::SciToken *>(scitoken);
+    try {
+        return &real_enf->route(*real_scitoken);
+    } catch (std::exception &exc) {
+        if (err_msg) {
+            *err_msg = strdup(exc.what());
+        }
+        return nullptr;
+    }
+}
+
+void enforcer_set_validate_profile(Enforcer enf, SciTokenProfile profile) {
+    if (enf == nullptr) {
+        return;
+    }
+
+    auto real_enf = reinterpret_cast<scitokens::Enforcer *>(enf);
+    real_enf->set_validate_profile(
+        static_cast<scitokens::SciToken::Profile>(profile));
+}
+
+namespace {
 
 Acl *convert_acls(scitokens::Enforcer::AclsList &acls_list, char **err_msg) {
     Acl *acl_result =
@@ -618,6 +1198,26 @@ int enforcer_set_time(Enforcer enf, time_t now, char **err_msg) {
     return 0;
 }
 
+int enforcer_set_cache_size(Enforcer enf, int entries, char **err_msg) {
+    if (enf == nullptr) {
+        if (err_msg) {
+            *err_msg = strdup("Enforcer may not be a null pointer");
+        }
+        return -1;
+    }
+    if (entries < 0) {
+        if (err_msg) {
+            *err_msg = strdup("Cache size must be non-negative");
+        }
+        return -1;
+    }
+    auto real_enf = reinterpret_cast<scitokens::Enforcer *>(enf);
+
+    real_enf->set_cache_size(entries);
+
+    return 0;
+}
+
 int enforcer_generate_acls(const Enforcer enf, const SciToken scitoken,
                            Acl **acls, char **err_msg) {
     if (enf == nullptr) {
@@ -652,9 +1252,186 @@ int enforcer_generate_acls(const Enforcer enf, const SciToken scitoken,
     return 0;
 }
 
+int enforcer_mark_verified(const Enforcer enf, SciToken scitoken,
+                           char **err_msg) {
+    if (enf == nullptr) {
+        if (err_msg) {
+            *err_msg = strdup("Enforcer may not be a null pointer");
+        }
+        return -1;
+    }
+    auto real_enf = reinterpret_cast<scitokens::Enforcer *>(enf);
+    if (scitoken == nullptr) {
+        if (err_msg) {
+            *err_msg = strdup("SciToken may not be a null pointer");
+        }
+        return -1;
+    }
+    auto real_scitoken = reinterpret_cast<scitokens::SciToken *>(scitoken);
+
+    try {
+        real_enf->mark_verified(*real_scitoken);
+    } catch (std::exception &exc) {
+        if (err_msg) {
+            *err_msg = strdup(exc.what());
+        }
+        return -1;
+    }
+    return 0;
+}
+
+int enforcer_generate_acls_with_callback(const Enforcer enf,
+                                         const SciToken scitoken,
+                                         SciTokenAclsCallback callback,
+                                         void *data, char **err_msg) {
+    if (enf == nullptr) {
+        if (err_msg) {
+            *err_msg = strdup("Enforcer may not be a null pointer");
+        }
+        return -1;
+    }
+    auto real_enf = reinterpret_cast<scitokens::Enforcer *>(enf);
+    if (scitoken == nullptr) {
+        if (err_msg) {
+            *err_msg = strdup("SciToken may not be a null pointer");
+        }
+        return -1;
+    }
+    auto real_scitoken = reinterpret_cast<scitokens::SciToken *>(scitoken);
+    if (callback == nullptr) {
+        if (err_msg) {
+            *err_msg = strdup("Callback may not be a null pointer");
+        }
+        return -1;
+    }
+
+    real_enf->generate_acls_with_callback(
+        *real_scitoken, [callback, data](scitokens::Enforcer::AclsList acls,
+                                         std::exception_ptr error) {
+            if (error) {
+                callback(data, nullptr, exception_message(error));
+                return;
+            }
+            char *err = nullptr;
+            auto result_acls = convert_acls(acls, &err);
+            callback(data, result_acls, result_acls ? nullptr : err);
+        });
+    return 0;
+}
+
+int enforcer_export_capability(const Enforcer enf, const SciToken scitoken,
+                               char **capability, size_t *capability_len,
+                               char **err_msg) {
+    if (enf == nullptr) {
+        if (err_msg) {
+            *err_msg = strdup("Enforcer may not be a null pointer");
+        }
+        return -1;
+    }
+    auto real_enf = reinterpret_cast<scitokens::Enforcer *>(enf);
+    if (scitoken == nullptr) {
+        if (err_msg) {
+            *err_msg = strdup("SciToken may not be a null pointer");
+        }
+        return -1;
+    }
+    auto real_scitoken = reinterpret_cast<scitokens::SciToken *>(scitoken);
+    if (capability == nullptr || capability_len == nullptr) {
+        if (err_msg) {
+            *err_msg = strdup("Capability output may not be a null pointer");
+        }
+        return -1;
+    }
+
+    std::string result;
+    try {
+        result = real_enf->export_capability(*real_scitoken);
+    } catch (std::exception &exc) {
+        if (err_msg) {
+            *err_msg = strdup(exc.what());
+        }
+        return -1;
+    }
+    *capability = static_cast<char *>(malloc(result.size()));
+    if (*capability == nullptr) {
+        if (err_msg) {
+            *err_msg = strdup("Failed to allocate memory for the capability");
+        }
+        return -1;
+    }
+    memcpy(*capability, result.data(), result.size());
+    *capability_len = result.size();
+    return 0;
+}
+
+int enforcer_import_capability(const Enforcer enf, const char *capability,
+                               size_t capability_len, Acl **acls,
+                               char **subject, time_t *expiry,
+                               SciTokenProfile *profile, char **err_msg) {
+    if (enf == nullptr) {
+        if (err_msg) {
+            *err_msg = strdup("Enforcer may not be a null pointer");
+        }
+        return -1;
+    }
+    auto real_enf = reinterpret_cast<scitokens::Enforcer *>(enf);
+    if (capability == nullptr || acls == nullptr) {
+        if (err_msg) {
+            *err_msg = strdup("Capability and ACLs may not be null pointers");
+        }
+        return -1;
+    }
+
+    scitokens::Enforcer::Capability result;
+    try {
+        result = real_enf->import_capability(
+            std::string(capability, capability_len));
+    } catch (std::exception &exc) {
+        if (err_msg) {
+            *err_msg = strdup(exc.what());
+        }
+        return -1;
+    }
+    char *result_subject = nullptr;
+    if (subject) {
+        result_subject = strdup(result.m_subject.c_str());
+        if (!result_subject) {
+            if (err_msg) {
+                *err_msg = strdup("Failed to allocate memory for the subject");
+            }
+            return -1;
+        }
+    }
+    auto result_acls = convert_acls(result.m_acls, err_msg);
+    if (!result_acls) {
+        free(result_subject);
+        return -1;
+    }
+    *acls = result_acls;
+    if (subject) {
+        *subject = result_subject;
+    }
+    if (expiry) {
+        *expiry = result.m_expiry;
+    }
+    if (profile) {
+        *profile = static_cast<SciTokenProfile>(result.m_profile);
+    }
+    return 0;
+}
+
 int enforcer_generate_acls_start(const Enforcer enf, const SciToken scitoken,
                                  SciTokenStatus *status_out, Acl **acls,
                                  char **err_msg) {
+    return enforcer_generate_acls_start_with_context(enf, scitoken, nullptr,
+                                                     status_out, acls, err_msg);
+}
+
+int enforcer_generate_acls_start_with_context(const Enforcer enf,
+                                              const SciToken scitoken,
+                                              SciTokenFetchContext ctx,
+                                              SciTokenStatus *status_out,
+                                              Acl **acls, char **err_msg) {
     if (enf == nullptr) {
         if (err_msg) {
             *err_msg = strdup("Enforcer may not be a null pointer");
@@ -673,7 +1450,8 @@ int enforcer_generate_acls_start(const Enforcer enf, const SciToken scitoken,
     scitokens::Enforcer::AclsList acls_list;
     std::unique_ptr<scitokens::AsyncStatus> status;
     try {
-        status = real_enf->generate_acls_start(*real_scitoken, acls_list);
+        status = real_enf->generate_acls_start(*real_scitoken, acls_list,
+                                               get_fetch_context(ctx));
     } catch (std::exception &exc) {
         if (err_msg) {
             *err_msg = strdup(exc.what());
@@ -689,7 +1467,10 @@ int enforcer_generate_acls_start(const Enforcer enf, const SciToken scitoken,
         *status_out = nullptr;
         return 0;
     }
-    *status_out = status.release();
+    std::unique_ptr<scitokens::SciTokenAsyncStatus> real_status(
+        new scitokens::SciTokenAsyncStatus());
+    real_status->m_status = std::move(status);
+    *status_out = real_status.release();
     return 0;
 }
 
@@ -710,11 +1491,11 @@ int enforcer_generate_acls_continue(const Enforcer enf, SciTokenStatus *status,
     }
 
     scitokens::Enforcer::AclsList acls_list;
-    std::unique_ptr<scitokens::AsyncStatus> status_internal(
-        reinterpret_cast<scitokens::AsyncStatus *>(*status));
+    std::unique_ptr<scitokens::SciTokenAsyncStatus> status_internal(
+        reinterpret_cast<scitokens::SciTokenAsyncStatus *>(*status));
     try {
-        status_internal = real_enf->generate_acls_continue(
-            std::move(status_internal), acls_list);
+        status_internal->m_status = real_enf->generate_acls_continue(
+            std::move(status_internal->m_status), acls_list);
     } catch (std::exception &exc) {
         *status = nullptr;
         if (err_msg) {
@@ -722,13 +1503,13 @@ int enforcer_generate_acls_continue(const Enforcer enf, SciTokenStatus *status,
         }
         return -1;
     }
-    if (status_internal->m_done) {
+    if (status_internal->m_status->m_done) {
+        *status = nullptr;
         auto result_acls = convert_acls(acls_list, err_msg);
         if (!result_acls) {
             return -1;
         }
         *acls = result_acls;
-        *status = nullptr;
         return 0;
     }
     *status = status_internal.release();
@@ -759,7 +1540,9 @@ int enforcer_test(const Enforcer enf, const SciToken scitoken, const Acl *acl,
     }
 
     try {
-        return real_enf->test(*real_scitoken, acl->authz, acl->resource) == true
+        // The pointer-and-length overload skips copying the request.
+        return real_enf->test(*real_scitoken, acl->authz, strlen(acl->authz),
+                              acl->resource, strlen(acl->resource)) == true
                    ? 0
                    : -1;
     } catch (std::exception &exc) {
@@ -771,37 +1554,82 @@ int enforcer_test(const Enforcer enf, const SciToken scitoken, const Acl *acl,
     return 0;
 }
 
-void scitoken_status_free(SciTokenStatus status) {
-    std::unique_ptr<scitokens::AsyncStatus> status_real(
-        reinterpret_cast<scitokens::AsyncStatus *>(status));
-}
-
-int scitoken_status_get_timeout_val(const SciTokenStatus *status,
-                                    time_t expiry_time, struct timeval *timeout,
-                                    char **err_msg) {
-    if (status == nullptr) {
+int enforcer_test_many(const Enforcer enf, const SciToken scitoken,
+                       const Acl *acls, int *results, char **err_msg) {
+    if (enf == nullptr) {
         if (err_msg) {
-            *err_msg = strdup("Status object may not be a null pointer");
+            *err_msg = strdup("Enforcer may not be a null pointer");
         }
         return -1;
     }
-    if (timeout == nullptr) {
+    auto real_enf = reinterpret_cast<scitokens::Enforcer *>(enf);
+    if (scitoken == nullptr) {
         if (err_msg) {
-            *err_msg = strdup("Timeout object may not be a null pointer");
+            *err_msg = strdup("SciToken may not be a null pointer");
+        }
+        return -1;
+    }
+    auto real_scitoken = reinterpret_cast<scitokens::SciToken *>(scitoken);
+    if (acls == nullptr || results == nullptr) {
+        if (err_msg) {
+            *err_msg = strdup("ACL list and results may not be null pointers");
+        }
+        return -1;
+    }
+
+    try {
+        scitokens::Enforcer::AclsList requests;
+        for (int idx = 0; acls[idx].authz && acls[idx].resource; idx++) {
+            requests.emplace_back(acls[idx].authz, acls[idx].resource);
+        }
+        auto permitted = real_enf->test_many(*real_scitoken, requests);
+        for (size_t idx = 0; idx < permitted.size(); idx++) {
+            results[idx] = permitted[idx] ? 1 : 0;
+        }
+    } catch (std::exception &exc) {
+        if (err_msg) {
+            *err_msg = strdup(exc.what());
         }
         return -1;
     }
-
-    auto real_status = reinterpret_cast<const scitokens::AsyncStatus *>(status);
-    struct timeval timeout_internal = real_status->get_timeout_val(expiry_time);
-    timeout->tv_sec = timeout_internal.tv_sec;
-    timeout->tv_usec = timeout_internal.tv_usec;
+    return 0;
+}
+
+void scitoken_status_free(SciTokenStatus *status) {
+    if (status == nullptr) {
+        return;
+    }
+    std::unique_ptr<scitokens::SciTokenAsyncStatus> status_real(
+        reinterpret_cast<scitokens::SciTokenAsyncStatus *>(*status));
+    *status = nullptr;
+}
+
+int scitoken_status_get_timeout_val(const SciTokenStatus *status,
+                                    time_t expiry_time, struct timeval *timeout,
+                                    char **err_msg) {
+    if (status == nullptr || *status == nullptr) {
+        if (err_msg) {
+            *err_msg = strdup("Status object may not be a null pointer");
+        }
+        return -1;
+    }
+    if (timeout == nullptr) {
+        if (err_msg) {
+            *err_msg = strdup("Timeout object may not be a null pointer");
+        }
+        return -1;
+    }
+
+    auto real_status = get_async_status(status);
+    struct timeval timeout_internal = real_status->get_timeout_val(expiry_time);
+    timeout->tv_sec = timeout_internal.tv_sec;
+    timeout->tv_usec = timeout_internal.tv_usec;
     return 0;
 }
 
 int scitoken_status_get_read_fd_set(SciTokenStatus *status,
                                     fd_set **read_fd_set, char **err_msg) {
-    if (status == nullptr) {
+    if (status == nullptr || *status == nullptr) {
         if (err_msg) {
             *err_msg = strdup("Status object may not be a null pointer");
         }
@@ -814,14 +1642,14 @@ int scitoken_status_get_read_fd_set(SciTokenStatus *status,
         return -1;
     }
 
-    auto real_status = reinterpret_cast<scitokens::AsyncStatus *>(status);
+    auto real_status = get_async_status(status);
     *read_fd_set = real_status->get_read_fd_set();
     return 0;
 }
 
 int scitoken_status_get_write_fd_set(SciTokenStatus *status,
                                      fd_set **write_fd_set, char **err_msg) {
-    if (status == nullptr) {
+    if (status == nullptr || *status == nullptr) {
         if (err_msg) {
             *err_msg = strdup("Status object may not be a null pointer");
         }
@@ -834,14 +1662,14 @@ int scitoken_status_get_write_fd_set(SciTokenStatus *status,
         return -1;
     }
 
-    auto real_status = reinterpret_cast<scitokens::AsyncStatus *>(status);
+    auto real_status = get_async_status(status);
     *write_fd_set = real_status->get_write_fd_set();
     return 0;
 }
 
 int scitoken_status_get_exc_fd_set(SciTokenStatus *status, fd_set **exc_fd_set,
                                    char **err_msg) {
-    if (status == nullptr) {
+    if (status == nullptr || *status == nullptr) {
         if (err_msg) {
             *err_msg = strdup("Status object may not be a null pointer");
         }
@@ -854,14 +1682,14 @@ int scitoken_status_get_exc_fd_set(SciTokenStatus *status, fd_set **exc_fd_set,
         return -1;
     }
 
-    auto real_status = reinterpret_cast<scitokens::AsyncStatus *>(status);
+    auto real_status = get_async_status(status);
     *exc_fd_set = real_status->get_exc_fd_set();
     return 0;
 }
 
 int scitoken_status_get_max_fd(const SciTokenStatus *status, int *max_fd,
                                char **err_msg) {
-    if (status == nullptr) {
+    if (status == nullptr || *status == nullptr) {
         if (err_msg) {
             *err_msg = strdup("Status object may not be a null pointer");
         }
@@ -874,11 +1702,159 @@ int scitoken_status_get_max_fd(const SciTokenStatus *status, int *max_fd,
         return -1;
     }
 
-    auto real_status = reinterpret_cast<const scitokens::AsyncStatus *>(status);
+    auto real_status = get_async_status(status);
     *max_fd = real_status->get_max_fd();
     return 0;
 }
 
+int scitoken_status_get_socket_count(const SciTokenStatus *status, int *count,
+                                     char **err_msg) {
+    if (status == nullptr || *status == nullptr) {
+        if (err_msg) {
+            *err_msg = strdup("Status object may not be a null pointer");
+        }
+        return -1;
+    }
+    if (count == nullptr) {
+        if (err_msg) {
+            *err_msg = strdup("Socket count may not be a null pointer");
+        }
+        return -1;
+    }
+
+    auto real_status = get_async_status(status);
+    *count = real_status->get_sockets().size();
+    return 0;
+}
+
+int scitoken_status_get_socket(const SciTokenStatus *status, int idx, int *fd,
+                               int *events, char **err_msg) {
+    if (status == nullptr || *status == nullptr) {
+        if (err_msg) {
+            *err_msg = strdup("Status object may not be a null pointer");
+        }
+        return -1;
+    }
+    if (fd == nullptr || events == nullptr) {
+        if (err_msg) {
+            *err_msg = strdup("Socket outputs may not be null pointers");
+        }
+        return -1;
+    }
+
+    auto real_status = get_async_status(status);
+    const auto &sockets = real_status->get_sockets();
+    if (idx < 0 || static_cast<size_t>(idx) >= sockets.size()) {
+        if (err_msg) {
+            *err_msg = strdup("Socket index is out of range");
+        }
+        return -1;
+    }
+    *fd = sockets[idx].m_fd;
+    *events = 0;
+    if (sockets[idx].m_events & CURL_POLL_IN) {
+        *events |= SCITOKEN_POLL_IN;
+    }
+    if (sockets[idx].m_events & CURL_POLL_OUT) {
+        *events |= SCITOKEN_POLL_OUT;
+    }
+    return 0;
+}
+
+int scitoken_status_get_timer_ms(const SciTokenStatus *status, long *timer_ms,
+                                 char **err_msg) {
+    if (status == nullptr || *status == nullptr) {
+        if (err_msg) {
+            *err_msg = strdup("Status object may not be a null pointer");
+        }
+        return -1;
+    }
+    if (timer_ms == nullptr) {
+        if (err_msg) {
+            *err_msg = strdup("Timer may not be a null pointer");
+        }
+        return -1;
+    }
+
+    auto real_status = get_async_status(status);
+    *timer_ms = real_status->get_timer_ms();
+    return 0;
+}
+
+int scitoken_status_socket_ready(SciTokenStatus *status, int fd, int events,
+                                 char **err_msg) {
+    if (status == nullptr || *status == nullptr) {
+        if (err_msg) {
+            *err_msg = strdup("Status object may not be a null pointer");
+        }
+        return -1;
+    }
+
+    int curl_events = 0;
+    if (events & SCITOKEN_POLL_IN) {
+        curl_events |= CURL_CSELECT_IN;
+    }
+    if (events & SCITOKEN_POLL_OUT) {
+        curl_events |= CURL_CSELECT_OUT;
+    }
+    if (events & SCITOKEN_POLL_ERR) {
+        curl_events |= CURL_CSELECT_ERR;
+    }
+    auto real_status = get_async_status(status);
+    real_status->socket_ready(fd, curl_events);
+    return 0;
+}
+
+int scitoken_status_timer_fired(SciTokenStatus *status, char **err_msg) {
+    if (status == nullptr || *status == nullptr) {
+        if (err_msg) {
+            *err_msg = strdup("Status object may not be a null pointer");
+        }
+        return -1;
+    }
+
+    auto real_status = get_async_status(status);
+    real_status->timer_fired();
+    return 0;
+}
+
+SciTokenFetchContext scitoken_fetch_context_create(char **err_msg) {
+    try {
+        return new std::shared_ptr<scitokens::internal::FetchContext>(
+            new scitokens::internal::FetchContext());
+    } catch (std::exception &exc) {
+        if (err_msg) {
+            *err_msg = strdup(exc.what());
+        }
+        return nullptr;
+    }
+}
+
+void scitoken_fetch_context_destroy(SciTokenFetchContext ctx) {
+    delete reinterpret_cast<
+        std::shared_ptr<scitokens::internal::FetchContext> *>(ctx);
+}
+
+int scitoken_fetch_context_wait(SciTokenFetchContext ctx, long timeout_ms,
+                                char **err_msg) {
+    if (ctx == nullptr) {
+        if (err_msg) {
+            *err_msg = strdup("Fetch context may not be a null pointer");
+        }
+        return -1;
+    }
+
+    try {
+        get_fetch_context(ctx)->wait(timeout_ms);
+    } catch (std::exception &exc) {
+        if (err_msg) {
+            *err_msg = strdup(exc.what());
+        }
+        return -1;
+    }
+    return 0;
+}
+
 int keycache_refresh_jwks(const char *issuer, char **err_msg) {
     if (!issuer) {
         if (err_msg) {
@@ -902,6 +1878,60 @@ int keycache_refresh_jwks(const char *issuer, char **err_msg) {
     return 0;
 }
 
+int keycache_prefetch(const char **issuers, int timeout_s, char **errors,
+                      char **err_msg) {
+    if (!issuers) {
+        if (err_msg) {
+            *err_msg = strdup("Issuers list may not be a null pointer");
+        }
+        return -1;
+    }
+    if (timeout_s < 0) {
+        if (err_msg) {
+            *err_msg = strdup("Timeout may not be negative");
+        }
+        return -1;
+    }
+    std::vector<std::string> issuer_list;
+    for (const char **issuer = issuers; *issuer; issuer++) {
+        issuer_list.emplace_back(*issuer);
+    }
+    std::vector<std::string> results;
+    try {
+        results = scitokens::Validator::prefetch_keys(issuer_list, timeout_s);
+    } catch (std::exception &exc) {
+        if (err_msg) {
+            *err_msg = strdup(exc.what());
+        }
+        return -1;
+    }
+    size_t failures = 0;
+    const std::string *first_error = nullptr;
+    for (size_t idx = 0; idx < results.size(); idx++) {
+        if (!results[idx].empty()) {
+            failures++;
+            if (!first_error) {
+                first_error = &results[idx];
+            }
+        }
+        if (errors) {
+            errors[idx] =
+                results[idx].empty() ? nullptr : strdup(results[idx].c_str());
+        }
+    }
+    if (failures) {
+        if (err_msg) {
+            *err_msg = strdup(("Failed to refresh " +
+                               std::to_string(failures) + " of " +
+                               std::to_string(results.size()) +
+                               " issuers; first error: " + *first_error)
+                                  .c_str());
+        }
+        return -1;
+    }
+    return 0;
+}
+
 int keycache_get_cached_jwks(const char *issuer, char **jwks, char **err_msg) {
     if (!issuer) {
         if (err_msg) {
@@ -955,6 +1985,130 @@ int keycache_set_jwks(const char *issuer, const char *jwks, char **err_msg) {
     return 0;
 }
 
+int keycache_export_bundle(const char *path, size_t *count, char **err_msg) {
+    if (!path) {
+        if (err_msg) {
+            *err_msg = strdup("Bundle path may not be a null pointer");
+        }
+        return -1;
+    }
+    try {
+        auto written = scitokens::Validator::export_keycache_bundle(path);
+        if (count) {
+            *count = written;
+        }
+    } catch (std::exception &exc) {
+        if (err_msg) {
+            *err_msg = strdup(exc.what());
+        }
+        return -1;
+    }
+    return 0;
+}
+
+int keycache_import_bundle(const char *path, size_t *count, char **err_msg) {
+    if (!path) {
+        if (err_msg) {
+            *err_msg = strdup("Bundle path may not be a null pointer");
+        }
+        return -1;
+    }
+    try {
+        auto stored = scitokens::Validator::import_keycache_bundle(path);
+        if (count) {
+            *count = stored;
+        }
+    } catch (std::exception &exc) {
+        if (err_msg) {
+            *err_msg = strdup(exc.what());
+        }
+        return -1;
+    }
+    return 0;
+}
+
+int keycache_compact(size_t *removed, char **err_msg) {
+    try {
+        auto count = scitokens::Validator::compact_keycache();
+        if (removed) {
+            *removed = count;
+        }
+    } catch (std::exception &exc) {
+        if (err_msg) {
+            *err_msg = strdup(exc.what());
+        }
+        return -1;
+    }
+    return 0;
+}
+
+int scitoken_get_stats(char **json, char **err_msg) {
+    if (!json) {
+        if (err_msg) {
+            *err_msg = strdup("JSON output pointer may not be null.");
+        }
+        return -1;
+    }
+    try {
+        *json = strdup(scitokens::internal::Stats::get().to_json().c_str());
+    } catch (std::exception &exc) {
+        if (err_msg) {
+            *err_msg = strdup(exc.what());
+        }
+        return -1;
+    }
+    return 0;
+}
+
+void scitoken_reset_stats() { scitokens::internal::Stats::get().reset(); }
+
+int scitoken_config_set_trace_callback(SciTokenTraceCallback callback,
+                                       void *data, char **err_msg) {
+    using scitokens::internal::TraceSpan;
+    try {
+        if (!callback) {
+            TraceSpan::set_callback(nullptr);
+            return 0;
+        }
+        TraceSpan::set_callback([callback, data](const TraceSpan &span) {
+            const char *source = "";
+            switch (span.m_key_source) {
+            case TraceSpan::KeySource::MEMORY:
+                source = "memory";
+                break;
+            case TraceSpan::KeySource::SQLITE:
+                source = "sqlite";
+                break;
+            case TraceSpan::KeySource::WEB:
+                source = "web";
+                break;
+            case TraceSpan::KeySource::NONE:
+                break;
+            }
+            SciTokenTraceSpan result;
+            result.issuer = span.m_issuer.c_str();
+            result.kid = span.m_kid.c_str();
+            result.key_source = source;
+            result.error = span.m_failed ? span.m_error.c_str() : nullptr;
+            result.start_us = span.get_start_us();
+            result.decode_us = span.get_stage_us(TraceSpan::DECODE);
+            result.key_lookup_us = span.get_stage_us(TraceSpan::KEY_LOOKUP);
+            result.key_construct_us =
+                span.get_stage_us(TraceSpan::KEY_CONSTRUCT);
+            result.signature_us = span.get_stage_us(TraceSpan::SIGNATURE);
+            result.claims_us = span.get_stage_us(TraceSpan::CLAIMS);
+            result.total_us = span.get_total_us();
+            callback(&result, data);
+        });
+    } catch (std::exception &exc) {
+        if (err_msg) {
+            *err_msg = strdup(exc.what());
+        }
+        return -1;
+    }
+    return 0;
+}
+
 int config_set_int(const char *key, int value, char **err_msg) {
     return scitoken_config_set_int(key, value, err_msg);
 }
@@ -990,6 +2144,218 @@ int scitoken_config_set_int(const char *key, int value, char **err_msg) {
         return 0;
     }
 
+    else if (_key == "keycache.min_update_interval_s") {
+        if (value < 0) {
+            if (err_msg) {
+                *err_msg = strdup("Minimum update interval must be positive.");
+            }
+            return -1;
+        }
+        configurer::Configuration::set_min_update_delta(value);
+        return 0;
+    }
+
+    else if (_key == "keycache.max_update_interval_s") {
+        if (value < 0) {
+            if (err_msg) {
+                *err_msg = strdup("Maximum update interval must be positive.");
+            }
+            return -1;
+        }
+        configurer::Configuration::set_max_update_delta(value);
+        return 0;
+    }
+
+    else if (_key == "keycache.metadata_interval_s") {
+        if (value < 0) {
+            if (err_msg) {
+                *err_msg = strdup("Metadata interval must be positive.");
+            }
+            return -1;
+        }
+        configurer::Configuration::set_metadata_delta(value);
+        return 0;
+    }
+
+    else if (_key == "keycache.refresh_interval_s") {
+        if (value < 0) {
+            if (err_msg) {
+                *err_msg = strdup("Refresh interval must be positive.");
+            }
+            return -1;
+        }
+        try {
+            configurer::Configuration::set_refresh_interval(value);
+            scitokens::internal::BackgroundRefresher::get().reconfigure();
+        } catch (std::exception &exc) {
+            if (err_msg) {
+                *err_msg = strdup(exc.what());
+            }
+            return -1;
+        }
+        return 0;
+    }
+
+    else if (_key == "verify.worker_threads") {
+        if (value < 0) {
+            if (err_msg) {
+                *err_msg = strdup("Worker thread count must be positive.");
+            }
+            return -1;
+        }
+        try {
+            configurer::Configuration::set_verify_threads(value);
+            scitokens::internal::VerifyPool::get().reconfigure();
+        } catch (std::exception &exc) {
+            if (err_msg) {
+                *err_msg = strdup(exc.what());
+            }
+            return -1;
+        }
+        return 0;
+    }
+
+    else if (_key == "keycache.sqlite_busy_timeout_ms") {
+        if (value < 0) {
+            if (err_msg) {
+                *err_msg = strdup("Busy timeout must be positive.");
+            }
+            return -1;
+        }
+        configurer::Configuration::set_sqlite_busy_timeout(value);
+        return 0;
+    }
+
+    else if (_key == "keycache.snapshot") {
+        if (value != 0 && value != 1) {
+            if (err_msg) {
+                *err_msg = strdup("Snapshot setting must be 0 or 1.");
+            }
+            return -1;
+        }
+        configurer::Configuration::set_keycache_snapshot(value);
+        return 0;
+    }
+
+    else if (_key == "keycache.failure_backoff_s") {
+        if (value < 0) {
+            if (err_msg) {
+                *err_msg = strdup("Failure backoff must be positive.");
+            }
+            return -1;
+        }
+        configurer::Configuration::set_failure_backoff(value);
+        return 0;
+    }
+
+    else if (_key == "keycache.unknown_kid_ttl_s") {
+        if (value < 0) {
+            if (err_msg) {
+                *err_msg = strdup("Unknown key ID lifetime must be positive.");
+            }
+            return -1;
+        }
+        configurer::Configuration::set_unknown_kid_ttl(value);
+        return 0;
+    }
+
+    else if (_key == "verify.pool_objects") {
+        if (value < 0) {
+            if (err_msg) {
+                *err_msg = strdup("Pool size must be positive.");
+            }
+            return -1;
+        }
+        configurer::Configuration::set_pool_objects(value);
+        return 0;
+    }
+
+    else if (_key == "verify.issuer_prefilter") {
+        if (value != 0 && value != 1) {
+            if (err_msg) {
+                *err_msg = strdup("Issuer prefilter setting must be 0 or 1.");
+            }
+            return -1;
+        }
+        configurer::Configuration::set_issuer_prefilter(value);
+        return 0;
+    }
+
+    else if (_key == "keycache.max_metadata_bytes") {
+        if (value < 0) {
+            if (err_msg) {
+                *err_msg = strdup("Metadata size limit must be positive.");
+            }
+            return -1;
+        }
+        configurer::Configuration::set_max_metadata_bytes(value);
+        return 0;
+    }
+
+    else if (_key == "keycache.max_jwks_bytes") {
+        if (value < 0) {
+            if (err_msg) {
+                *err_msg = strdup("Key set size limit must be positive.");
+            }
+            return -1;
+        }
+        configurer::Configuration::set_max_jwks_bytes(value);
+        return 0;
+    }
+
+    else if (_key == "revocation.refresh_interval_s") {
+        if (value < 0) {
+            if (err_msg) {
+                *err_msg = strdup("Refresh interval must be positive.");
+            }
+            return -1;
+        }
+        configurer::Configuration::set_revocation_refresh_interval(value);
+        scitokens::internal::RevocationList::get().reconfigure();
+        return 0;
+    }
+
+    else if (_key == "keycache.max_entries" ||
+             _key == "keycache.max_bytes" ||
+             _key == "keycache.compact_interval_s") {
+        if (value < 0) {
+            if (err_msg) {
+                *err_msg = strdup("Key cache limits must be positive.");
+            }
+            return -1;
+        }
+        if (_key == "keycache.max_entries") {
+            configurer::Configuration::set_keycache_max_entries(value);
+        } else if (_key == "keycache.max_bytes") {
+            configurer::Configuration::set_keycache_max_bytes(value);
+        } else {
+            configurer::Configuration::set_keycache_compact_interval(value);
+        }
+        return 0;
+    }
+
+    else if (_key == "fetch.connect_timeout_ms" ||
+             _key == "fetch.total_timeout_ms" ||
+             _key == "fetch.dns_cache_timeout_s" ||
+             _key == "fetch.hedge_delay_ms") {
+        if (value < 0) {
+            if (err_msg) {
+                *err_msg = strdup("Fetch timeouts must be positive.");
+            }
+            return -1;
+        }
+        if (_key == "fetch.connect_timeout_ms") {
+            configurer::Configuration::set_fetch_connect_timeout(value);
+        } else if (_key == "fetch.total_timeout_ms") {
+            configurer::Configuration::set_fetch_total_timeout(value);
+        } else if (_key == "fetch.dns_cache_timeout_s") {
+            configurer::Configuration::set_fetch_dns_cache_timeout(value);
+        } else {
+            configurer::Configuration::set_fetch_hedge_delay(value);
+        }
+        return 0;
+    }
+
     else {
         if (err_msg) {
             *err_msg = strdup("Key not recognized.");
@@ -1019,6 +2385,90 @@ int scitoken_config_get_int(const char *key, char **err_msg) {
         return configurer::Configuration::get_expiry_delta();
     }
 
+    else if (_key == "keycache.min_update_interval_s") {
+        return configurer::Configuration::get_min_update_delta();
+    }
+
+    else if (_key == "keycache.max_update_interval_s") {
+        return configurer::Configuration::get_max_update_delta();
+    }
+
+    else if (_key == "keycache.metadata_interval_s") {
+        return configurer::Configuration::get_metadata_delta();
+    }
+
+    else if (_key == "keycache.refresh_interval_s") {
+        return configurer::Configuration::get_refresh_interval();
+    }
+
+    else if (_key == "verify.worker_threads") {
+        return configurer::Configuration::get_verify_threads();
+    }
+
+    else if (_key == "keycache.sqlite_busy_timeout_ms") {
+        return configurer::Configuration::get_sqlite_busy_timeout();
+    }
+
+    else if (_key == "keycache.snapshot") {
+        return configurer::Configuration::get_keycache_snapshot();
+    }
+
+    else if (_key == "keycache.failure_backoff_s") {
+        return configurer::Configuration::get_failure_backoff();
+    }
+
+    else if (_key == "keycache.unknown_kid_ttl_s") {
+        return configurer::Configuration::get_unknown_kid_ttl();
+    }
+
+    else if (_key == "verify.pool_objects") {
+        return configurer::Configuration::get_pool_objects();
+    }
+
+    else if (_key == "verify.issuer_prefilter") {
+        return configurer::Configuration::get_issuer_prefilter();
+    }
+
+    else if (_key == "keycache.max_metadata_bytes") {
+        return configurer::Configuration::get_max_metadata_bytes();
+    }
+
+    else if (_key == "keycache.max_jwks_bytes") {
+        return configurer::Configuration::get_max_jwks_bytes();
+    }
+
+    else if (_key == "revocation.refresh_interval_s") {
+        return configurer::Configuration::get_revocation_refresh_interval();
+    }
+
+    else if (_key == "keycache.max_entries") {
+        return configurer::Configuration::get_keycache_max_entries();
+    }
+
+    else if (_key == "keycache.max_bytes") {
+        return configurer::Configuration::get_keycache_max_bytes();
+    }
+
+    else if (_key == "keycache.compact_interval_s") {
+        return configurer::Configuration::get_keycache_compact_interval();
+    }
+
+    else if (_key == "fetch.connect_timeout_ms") {
+        return configurer::Configuration::get_fetch_connect_timeout();
+    }
+
+    else if (_key == "fetch.total_timeout_ms") {
+        return configurer::Configuration::get_fetch_total_timeout();
+    }
+
+    else if (_key == "fetch.dns_cache_timeout_s") {
+        return configurer::Configuration::get_fetch_dns_cache_timeout();
+    }
+
+    else if (_key == "fetch.hedge_delay_ms") {
+        return configurer::Configuration::get_fetch_hedge_delay();
+    }
+
     else {
         if (err_msg) {
             *err_msg = strdup("Key not recognized.");
@@ -1047,6 +2497,77 @@ int scitoken_config_set_str(const char *key, const char *value,
         }
     }
 
+    else if (_key == "tls.ca_file") {
+        configurer::Configuration::set_tls_ca_file(value ? value : "");
+    }
+
+    else if (_key == "keycache.backend") {
+        std::string backend = value ? value : "";
+        if (backend != "sqlite" && backend != "memcached" &&
+            backend != "memory") {
+            if (err_msg) {
+                *err_msg = strdup("Unknown key cache backend.");
+            }
+            return -1;
+        }
+        configurer::Configuration::set_keycache_backend(backend);
+    }
+
+    else if (_key == "keycache.memcached_server") {
+        if (!value || !*value) {
+            if (err_msg) {
+                *err_msg = strdup("A memcached server must be provided.");
+            }
+            return -1;
+        }
+        configurer::Configuration::set_memcached_server(value);
+    }
+
+    else if (_key == "keycache.memcached_secret_file") {
+        auto rp = configurer::Configuration::set_memcached_secret_file(
+            value ? value : "");
+        if (!rp.first) {
+            if (err_msg) {
+                *err_msg = strdup(rp.second.c_str());
+            }
+            return -1;
+        }
+    }
+
+    else if (_key == "keycache.bundle_secret_file") {
+        auto rp = configurer::Configuration::set_bundle_secret_file(
+            value ? value : "");
+        if (!rp.first) {
+            if (err_msg) {
+                *err_msg = strdup(rp.second.c_str());
+            }
+            return -1;
+        }
+    }
+
+    else if (_key == "capability.secret_file") {
+        auto rp = configurer::Configuration::set_capability_secret_file(
+            value ? value : "");
+        if (!rp.first) {
+            if (err_msg) {
+                *err_msg = strdup(rp.second.c_str());
+            }
+            return -1;
+        }
+    }
+
+    else if (_key == "revocation.source") {
+        try {
+            scitokens::internal::RevocationList::get().set_source(
+                value ? value : "");
+        } catch (std::exception &exc) {
+            if (err_msg) {
+                *err_msg = strdup(exc.what());
+            }
+            return -1;
+        }
+    }
+
     else {
         if (err_msg) {
             *err_msg = strdup("Key not recognized.");
@@ -1069,6 +2590,41 @@ int scitoken_config_get_str(const char *key, char **output, char **err_msg) {
         *output = strdup(configurer::Configuration::get_cache_home().c_str());
     }
 
+    else if (_key == "tls.ca_file") {
+        *output =
+            strdup(configurer::Configuration::get_tls_ca_file().c_str());
+    }
+
+    else if (_key == "keycache.backend") {
+        *output =
+            strdup(configurer::Configuration::get_keycache_backend().c_str());
+    }
+
+    else if (_key == "keycache.memcached_server") {
+        *output =
+            strdup(configurer::Configuration::get_memcached_server().c_str());
+    }
+
+    else if (_key == "keycache.memcached_secret_file") {
+        *output = strdup(
+            configurer::Configuration::get_memcached_secret_file().c_str());
+    }
+
+    else if (_key == "keycache.bundle_secret_file") {
+        *output = strdup(
+            configurer::Configuration::get_bundle_secret_file().c_str());
+    }
+
+    else if (_key == "capability.secret_file") {
+        *output = strdup(
+            configurer::Configuration::get_capability_secret_file().c_str());
+    }
+
+    else if (_key == "revocation.source") {
+        *output = strdup(
+            scitokens::internal::RevocationList::get().get_source().c_str());
+    }
+
     else {
         if (err_msg) {
             *err_msg = strdup("Key not recognized.");
@@ -16,10 +16,15 @@ extern "C" {
 
 typedef void *SciTokenKey;
 typedef void *SciToken;
+typedef void *SciTokenTemplate;
 typedef void *Validator;
 typedef void *Enforcer;
+typedef void *MultiEnforcer;
 typedef void *SciTokenStatus;
+typedef void *SciTokenFetchContext;
 typedef void *Configuration;
+typedef void *AclList;
+typedef void *SciTokenDeserializer;
 
 typedef int (*StringValidatorFunction)(const char *value, char **err_msg);
 typedef struct Acl_s {
@@ -45,6 +50,11 @@ typedef enum _profile {
     AT_JWT
 } SciTokenProfile;
 
+/**
+ * Create a signing key from PEM contents.  `algorithm` is the JWS algorithm
+ * the key signs with: "RS256", "ES256", "ES384" or "EdDSA" (Ed25519; not
+ * available when built against OpenSSL before 1.1.1).
+ */
 SciTokenKey scitoken_key_create(const char *key_id, const char *algorithm,
                                 const char *public_contents,
                                 const char *private_contents, char **err_msg);
@@ -77,6 +87,25 @@ int scitoken_get_claim_string_list(const SciToken token, const char *key,
  */
 void scitoken_free_string_list(char **value);
 
+/**
+ * Borrowed views of a claim's value, for callers reading claims on a hot
+ * path: nothing is copied, and each string is `len` bytes that need not be
+ * NUL-terminated.  They stay valid until the token is changed, serialized,
+ * deserialized again or destroyed.
+ */
+int scitoken_get_claim_string_view(const SciToken token, const char *key,
+                                   const char **value, size_t *len,
+                                   char **err_msg);
+
+/**
+ * As scitoken_get_claim_string_list, into caller-provided arrays with room
+ * for `*count` entries.  On success `*count` is set to the length of the
+ * list; if that exceeds the room given, only the first entries are filled.
+ */
+int scitoken_get_claim_string_list_view(const SciToken token, const char *key,
+                                        const char **values, size_t *lens,
+                                        size_t *count, char **err_msg);
+
 /**
  * Set the value of a claim to a list of strings.
  */
@@ -90,6 +119,46 @@ void scitoken_set_lifetime(SciToken token, int lifetime);
 
 int scitoken_serialize(const SciToken token, char **value, char **err_msg);
 
+/**
+ * Create a template for minting many tokens like `token` quickly.
+ *
+ * The template captures the token's claims, lifetime and serialize profile;
+ * later changes to the token do not affect it.  Its header and claims are
+ * encoded once, so each token minted from it only encodes and signs what
+ * differs: the jti, iat, nbf, exp and, optionally, sub claims.  The key the
+ * token was created with must outlive the template.
+ *
+ * @return The template, or nullptr on failure (e.g. no issuer set).
+ */
+SciTokenTemplate scitoken_template_create(const SciToken token,
+                                          char **err_msg);
+
+void scitoken_template_destroy(SciTokenTemplate tmpl);
+
+/**
+ * Mint a token from a template.
+ *
+ * @param sub The token's subject; NULL or empty keeps the template's, if
+ * any.
+ * @param value Destination for the serialized token; the caller must free
+ * it.
+ */
+int scitoken_template_serialize(const SciTokenTemplate tmpl, const char *sub,
+                                char **value, char **err_msg);
+
+/**
+ * Mint `count` tokens from a template, signing on up to `threads` threads.
+ *
+ * @param subs The tokens' subjects, as for scitoken_template_serialize, or
+ * NULL to keep the template's for each.
+ * @param values Room for `count` serialized tokens, each of which the
+ * caller must free.  On failure, none are set.
+ */
+int scitoken_template_serialize_many(const SciTokenTemplate tmpl,
+                                     const char *const *subs, int count,
+                                     int threads, char **values,
+                                     char **err_msg);
+
 /**
  * Set the profile used for serialization; if COMPAT mode is used, then
  * the library default is utilized (currently, scitokens 1.0).
@@ -120,6 +189,39 @@ int scitoken_deserialize_start(const char *value, SciToken *token,
                                char const *const *allowed_issuers,
                                SciTokenStatus *status, char **err_msg);
 
+/**
+ * @brief As scitoken_deserialize_start, but any downloads needed go through
+ * the given fetch context (see scitoken_fetch_context_create).
+ */
+int scitoken_deserialize_start_with_context(const char *value, SciToken *token,
+                                            char const *const *allowed_issuers,
+                                            SciTokenFetchContext ctx,
+                                            SciTokenStatus *status,
+                                            char **err_msg);
+
+/**
+ * Called once a request started with scitoken_deserialize_with_callback is
+ * over: with the token (owned by the callback, to be freed with
+ * scitoken_destroy) and a NULL `err_msg` on success, else with a NULL token
+ * and the error (which the callback must free).
+ */
+typedef void (*SciTokenDeserializeCallback)(void *data, SciToken token,
+                                            char *err_msg);
+
+/**
+ * @brief As scitoken_deserialize_start, but rather than being polled the
+ * request is driven by a library thread and `callback` called, with `data`,
+ * once it is over.  If the issuer's keys are at hand the callback is called
+ * before this returns; otherwise it is called on the library's thread.
+ *
+ * @return int 0 if the request was started (the callback will be called
+ * exactly once), -1 with `err_msg` set if the arguments are invalid.
+ */
+int scitoken_deserialize_with_callback(const char *value,
+                                       char const *const *allowed_issuers,
+                                       SciTokenDeserializeCallback callback,
+                                       void *data, char **err_msg);
+
 /**
  * @brief Continue the deserialization process for a token, updating the status
  * object.
@@ -139,6 +241,89 @@ int scitoken_deserialize_continue(SciToken *token, SciTokenStatus *status,
 int scitoken_deserialize_v2(const char *value, SciToken token,
                             char const *const *allowed_issuers, char **err_msg);
 
+/**
+ * @brief Deserialize and verify a batch of tokens.
+ *
+ * Equivalent to calling scitoken_deserialize_v2 on each token, but faster:
+ * the tokens are grouped by issuer and key id so each key is loaded once,
+ * any downloads needed proceed in parallel, and the signature checks are
+ * spread over up to `threads` threads.
+ *
+ * @param values The `count` serialized tokens.
+ * @param tokens `count` tokens to deserialize into, as from
+ * scitoken_create(NULL).
+ * @param count Number of tokens.
+ * @param allowed_issuers A null-terminated list of allowed issuers, or nullptr
+ * for no issuer check.
+ * @param threads Number of threads to verify signatures with; 0 or 1 uses
+ * only the calling thread.
+ * @param errors Room for `count` error messages; each is set to nullptr if
+ * the token verified, otherwise to a message the caller must free.
+ * @param err_msg Destination for error message.
+ * @return int 0 if each token was processed (check `errors` for the
+ * individual results), -1 on invalid arguments.
+ */
+int scitoken_deserialize_many(const char *const *values, SciToken *tokens,
+                              int count, char const *const *allowed_issuers,
+                              int threads, char **errors, char **err_msg);
+
+/**
+ * @brief Create a reusable deserializer: the allowed issuers and profile are
+ * set up once, so each scitoken_deserializer_deserialize call skips that
+ * work.  A deserializer may be shared by several threads.
+ *
+ * @param allowed_issuers A null-terminated list of allowed issuers, or
+ * nullptr for no issuer check.
+ * @param profile The profile tokens must match; COMPAT accepts any.
+ * @param err_msg Destination for error message.
+ * @return The deserializer, or nullptr on error.
+ */
+SciTokenDeserializer
+scitoken_deserializer_create(char const *const *allowed_issuers,
+                             SciTokenProfile profile, char **err_msg);
+
+/**
+ * @brief As scitoken_deserialize_v2, with the deserializer's settings.
+ *
+ * @param deserializer The deserializer.
+ * @param value The serialized token.
+ * @param token The token to deserialize into, as from scitoken_create(NULL).
+ * @param err_msg Destination for error message.
+ * @return int 0 on success, -1 on error.
+ */
+int scitoken_deserializer_deserialize(const SciTokenDeserializer deserializer,
+                                      const char *value, SciToken token,
+                                      char **err_msg);
+
+void scitoken_deserializer_destroy(SciTokenDeserializer deserializer);
+
+/**
+ * @brief Decode a token's claims WITHOUT verifying it.
+ *
+ * No signature check, key lookup or claim validation is done, so the claims
+ * read from `token` afterwards may be forged.  Meant for routing a request
+ * (e.g., by `iss` or `sub`) to where the token is deserialized and verified;
+ * never grant access based on a peeked token.  Enforcers verify any token
+ * they are given, peeked or not.
+ *
+ * @param value The serialized token.
+ * @param token The token to decode into, as from scitoken_create(NULL).
+ * @param err_msg Destination for error message.
+ * @return int 0 on success, -1 if the token is malformed.
+ */
+int scitoken_peek(const char *value, SciToken token, char **err_msg);
+
+/**
+ * @brief Decode only the JSON header of a token (e.g., to read `kid` or
+ * `alg`), WITHOUT verifying it; see scitoken_peek.
+ *
+ * @param value The serialized token.
+ * @param header Destination for the header's JSON; the caller must free it.
+ * @param err_msg Destination for error message.
+ * @return int 0 on success, -1 if the header is malformed.
+ */
+int scitoken_peek_header(const char *value, char **header, char **err_msg);
+
 int scitoken_store_public_ec_key(const char *issuer, const char *keyid,
                                  const char *value, char **err_msg);
 
@@ -187,9 +372,43 @@ void enforcer_set_validate_profile(Enforcer, SciTokenProfile profile);
  */
 int enforcer_set_time(Enforcer enf, time_t now, char **err_msg);
 
+/**
+ * Cache the ACLs generated for up to `entries` tokens, so that presenting the
+ * same token again (to enforcer_generate_acls, enforcer_test or the
+ * asynchronous variants) skips signature verification, claim validation and
+ * scope parsing.  A cached token is only accepted while its "nbf"/"iat" and
+ * "exp" claims hold at the enforcer's time (see enforcer_set_time) and its
+ * "jti" is not on the revocation list, and is dropped once it expires or is
+ * revoked; changing the enforcer's profile empties the cache, as may
+ * resizing it.  A token keeps working from the cache even if its issuer
+ * rotates its keys before the token expires.  Large caches are split into
+ * shards with their own locks, so threads testing different tokens rarely
+ * contend.
+ *
+ * Disabled (0) by default.
+ */
+int enforcer_set_cache_size(Enforcer enf, int entries, char **err_msg);
+
 int enforcer_generate_acls(const Enforcer enf, const SciToken scitokens,
                            Acl **acls, char **err_msg);
 
+/**
+ * Verify the token and mark it as verified by this enforcer, for sessions
+ * that keep a token for a long time and check it on every request.  Later
+ * calls to enforcer_test, enforcer_generate_acls (and their variants) with
+ * this enforcer and token skip the signature check, claim validation and
+ * scope parsing: they only check that the token is within its "nbf"/"iat"
+ * and "exp" claims at the enforcer's time (see enforcer_set_time) and not
+ * revoked, then use the ACLs compiled here.  A token failing those checks
+ * is verified in full, and fails with the usual error.
+ *
+ * The mark is dropped by deserializing the token again, and ignored by
+ * other enforcers and after enforcer_set_validate_profile.  The token must
+ * not be used by other threads during this call.
+ */
+int enforcer_mark_verified(const Enforcer enf, SciToken scitoken,
+                           char **err_msg);
+
 /**
  * The asynchronous versions of enforcer_generate_acls.
  */
@@ -199,11 +418,143 @@ int enforcer_generate_acls_start(const Enforcer enf, const SciToken scitokens,
 int enforcer_generate_acls_continue(const Enforcer enf, SciTokenStatus *status,
                                     Acl **acls, char **err_msg);
 
+/**
+ * As enforcer_generate_acls_start, but any downloads needed go through the
+ * given fetch context (see scitoken_fetch_context_create).
+ */
+int enforcer_generate_acls_start_with_context(const Enforcer enf,
+                                              const SciToken scitokens,
+                                              SciTokenFetchContext ctx,
+                                              SciTokenStatus *status,
+                                              Acl **acls, char **err_msg);
+
+/**
+ * Called once a request started with enforcer_generate_acls_with_callback
+ * is over: with the ACLs (freed with enforcer_acl_free) and a NULL
+ * `err_msg` on success, else with NULL ACLs and the error (which the
+ * callback must free).
+ */
+typedef void (*SciTokenAclsCallback)(void *data, Acl *acls, char *err_msg);
+
+/**
+ * As enforcer_generate_acls_start, but rather than being polled the request
+ * is driven by a library thread and `callback` called, with `data`, once it
+ * is over.  If the keys are at hand the callback is called before this
+ * returns; otherwise it is called on the library's thread.  The enforcer
+ * must not be destroyed until then; the token may be.
+ * - Returns 0 if the request was started (the callback will be called
+ *   exactly once), or -1 with `err_msg` set if the arguments are invalid.
+ */
+int enforcer_generate_acls_with_callback(const Enforcer enf,
+                                         const SciToken scitoken,
+                                         SciTokenAclsCallback callback,
+                                         void *data, char **err_msg);
+
 void enforcer_acl_free(Acl *acls);
 
+/**
+ * Verify the token and export what it grants -- its ACLs, subject, expiry
+ * and profile -- as a compact binary capability, MAC'd with the node's
+ * secret (see "capability.secret_file" in scitoken_config_set_str).  Another
+ * process on the node can hand it to enforcer_import_capability instead of
+ * the token, skipping the key lookup and signature check.
+ *
+ * @param capability Destination for the capability, `*capability_len`
+ * bytes (not NUL-terminated) the caller must free.
+ */
+int enforcer_export_capability(const Enforcer enf, const SciToken scitoken,
+                               char **capability, size_t *capability_len,
+                               char **err_msg);
+
+/**
+ * Accept a capability from enforcer_export_capability after checking only
+ * its MAC, its expiry (against the enforcer's time) and the revocation
+ * list.  Capabilities are only accepted by an enforcer with the same
+ * issuer, audiences and validate profile as the one that exported them.
+ *
+ * @param acls Destination for the ACLs, freed with enforcer_acl_free.
+ * @param subject If not NULL, destination for the token's subject (empty if
+ * it had none), which the caller must free.
+ * @param expiry If not NULL, destination for the token's expiry.
+ * @param profile If not NULL, destination for the token's profile.
+ */
+int enforcer_import_capability(const Enforcer enf, const char *capability,
+                               size_t capability_len, Acl **acls,
+                               char **subject, time_t *expiry,
+                               SciTokenProfile *profile, char **err_msg);
+
+/**
+ * Generate the token's ACLs without copying them: the list shares the
+ * enforcer's compiled ACLs (from its cache, when enforcer_set_cache_size is
+ * on) and is read entry by entry with enforcer_acl_list_get.  If `*acls`
+ * already holds a list, it is reused rather than a new one created.
+ */
+int enforcer_acl_list_generate(const Enforcer enf, const SciToken scitoken,
+                               AclList *acls, char **err_msg);
+
+size_t enforcer_acl_list_size(const AclList acls);
+
+/**
+ * Borrow entry `idx` of the list; the strings are `*_len` bytes that need
+ * not be NUL-terminated, valid until the list is regenerated or destroyed.
+ * Returns -1 if `idx` is out of range.
+ */
+int enforcer_acl_list_get(const AclList acls, size_t idx, const char **authz,
+                          size_t *authz_len, const char **resource,
+                          size_t *resource_len);
+
+void enforcer_acl_list_destroy(AclList acls);
+
+/**
+ * A multi-issuer enforcer holds one enforcer per trusted issuer and routes
+ * each token to the one for its `iss` claim, so a service trusting many
+ * issuers verifies a token once rather than trying an enforcer per issuer.
+ * The per-issuer enforcers share the key cache.
+ */
+MultiEnforcer enforcer_multi_create();
+
+void enforcer_multi_destroy(MultiEnforcer);
+
+/**
+ * Trust `issuer`, accepting the given audiences (as for enforcer_create).
+ * Returns the issuer's enforcer, owned by the multi-issuer enforcer, which may
+ * be configured with enforcer_set_validate_profile, enforcer_set_time and
+ * enforcer_set_cache_size; adding an issuer twice returns the same enforcer
+ * and ignores the new audiences.  Issuers must not be added while tokens are
+ * being routed.
+ */
+Enforcer enforcer_multi_add_issuer(MultiEnforcer enf, const char *issuer,
+                                   const char **audience, char **err_msg);
+
+/**
+ * Return the enforcer for the token's issuer, to be passed to any of the
+ * enforcer_* functions above (e.g. enforcer_test or
+ * enforcer_generate_acls_start), or null with `err_msg` set if the issuer was
+ * not added.  The token must have been deserialized.
+ */
+Enforcer enforcer_multi_route(const MultiEnforcer enf, const SciToken scitoken,
+                              char **err_msg);
+
+/**
+ * Test one requested access against the token.  Once the ACL cache is on
+ * (enforcer_set_cache_size), testing a token it already holds does not
+ * allocate, so per-request checks stay off the heap.
+ */
 int enforcer_test(const Enforcer enf, const SciToken sci, const Acl *acl,
                   char **err_msg);
 
+/**
+ * Test many requested accesses against one token, verifying it only once.
+ * `acls` is terminated by an entry with a null authz and resource, like the
+ * lists returned by enforcer_generate_acls; `results` must have room for one
+ * int per entry and is set to 1 where the access is permitted, 0 elsewhere.
+ *
+ * Returns 0 if the token verified (whatever the individual results) and -1
+ * with `err_msg` set if it did not.
+ */
+int enforcer_test_many(const Enforcer enf, const SciToken sci, const Acl *acls,
+                       int *results, char **err_msg);
+
 void scitoken_status_free(SciTokenStatus *status);
 
 /**
@@ -220,9 +571,9 @@ int scitoken_status_get_timeout_val(const SciTokenStatus *status,
 
 /**
  * Get the set of read file descriptors.  This will return a borrowed pointer
- * (whose lifetime matches the status object) pointing at a fd_set array of size
- * FD_SETSIZE.  Any file descriptors owned by the status operation will be set
- * and the returned fd_set can be used for select() operations.
+ * (whose lifetime matches the status object) pointing at a single fd_set.  Any
+ * file descriptors owned by the status operation will be set and the returned
+ * fd_set can be used for select() operations.
  *
  * IMPLEMENTATION NOTE: If the file descriptor monitored by libcurl are too high
  * to be stored in this set, libcurl should give a corresponding low timeout val
@@ -257,6 +608,79 @@ int scitoken_status_get_exc_fd_set(SciTokenStatus *status, fd_set **exc_fd_set,
 int scitoken_status_get_max_fd(const SciTokenStatus *status, int *max_fd,
                                char **err_msg);
 
+/**
+ * Event-loop integration.  As an alternative to the select()-style fd_sets
+ * above, a status can report each socket it is waiting on along with a timer,
+ * so it can be driven from epoll, kqueue, libevent, libuv and similar loops
+ * regardless of FD_SETSIZE.
+ *
+ * After each *_start or *_continue call that leaves the operation pending,
+ * (re)register the sockets reported by scitoken_status_get_socket and arm the
+ * timer from scitoken_status_get_timer_ms; the set may change between calls.
+ * When a socket becomes ready, report it with scitoken_status_socket_ready;
+ * when the timer expires, report it with scitoken_status_timer_fired.  Then
+ * call the corresponding *_continue function.
+ */
+typedef enum _poll_events {
+    SCITOKEN_POLL_IN = 1,
+    SCITOKEN_POLL_OUT = 2,
+    SCITOKEN_POLL_ERR = 4
+} SciTokenPollEvents;
+
+/**
+ * Get the number of sockets the status operation is waiting on.
+ */
+int scitoken_status_get_socket_count(const SciTokenStatus *status, int *count,
+                                     char **err_msg);
+
+/**
+ * Get the socket at index `idx` (starting from 0) and the events to watch it
+ * for, a mask of SCITOKEN_POLL_IN and SCITOKEN_POLL_OUT.
+ */
+int scitoken_status_get_socket(const SciTokenStatus *status, int idx, int *fd,
+                               int *events, char **err_msg);
+
+/**
+ * Get the number of milliseconds until the status operation's timer expires.
+ * A value of 0 means it has already expired; -1 means there is no timer.
+ */
+int scitoken_status_get_timer_ms(const SciTokenStatus *status, long *timer_ms,
+                                 char **err_msg);
+
+/**
+ * Report that the socket `fd` is ready for the given events, a mask of
+ * SCITOKEN_POLL_IN, SCITOKEN_POLL_OUT and SCITOKEN_POLL_ERR.
+ */
+int scitoken_status_socket_ready(SciTokenStatus *status, int fd, int events,
+                                 char **err_msg);
+
+/**
+ * Report that the status operation's timer has expired.
+ */
+int scitoken_status_timer_fired(SciTokenStatus *status, char **err_msg);
+
+/**
+ * A fetch context lets many asynchronous operations share one set of
+ * downloads: every status started with the context has its metadata and key
+ * downloads on the same curl multi handle.  A single
+ * scitoken_fetch_context_wait call then advances all of them, after which
+ * the host calls the *_continue function of each pending status.  Operations
+ * on the same issuer share a single download regardless of context.
+ *
+ * The context may be destroyed while statuses using it are pending; it is
+ * freed once the last of them is.  It may be used from multiple threads.
+ */
+SciTokenFetchContext scitoken_fetch_context_create(char **err_msg);
+
+void scitoken_fetch_context_destroy(SciTokenFetchContext ctx);
+
+/**
+ * Wait up to `timeout_ms` milliseconds for any download in the context to
+ * make progress, and advance them all.
+ */
+int scitoken_fetch_context_wait(SciTokenFetchContext ctx, long timeout_ms,
+                                char **err_msg);
+
 /**
  * API for explicity managing the key cache.
  *
@@ -270,6 +694,17 @@ int scitoken_status_get_max_fd(const SciTokenStatus *status, int *max_fd,
  */
 int keycache_refresh_jwks(const char *issuer, char **err_msg);
 
+/**
+ * Refresh the JWKS of every issuer in the NULL-terminated `issuers` list
+ * concurrently, as keycache_refresh_jwks would; useful to warm the keycache
+ * at startup.  Fetches still outstanding after `timeout_s` seconds fail.
+ * - If `errors` is non-NULL, it must have room for one entry per issuer;
+ *   each is set to NULL on success or to a message the caller must free.
+ * - Returns 0 if every issuer was refreshed, nonzero otherwise.
+ */
+int keycache_prefetch(const char **issuers, int timeout_s, char **errors,
+                      char **err_msg);
+
 /**
  * Retrieve the JWKS from the keycache for a given issuer.
  * - Returns 0 if successful, nonzero on failure.
@@ -290,6 +725,91 @@ int keycache_get_cached_jwks(const char *issuer, char **jwks, char **err_msg);
  */
 int keycache_set_jwks(const char *issuer, const char *jwks, char **err_msg);
 
+/**
+ * Write every unexpired keycache entry, with its next update and expiry
+ * times, to a single bundle file at `path` (replaced atomically).  The bundle
+ * is a binary file, the same on every architecture, meant to be distributed
+ * to hosts that cannot reach the issuers and loaded with
+ * keycache_import_bundle.  It is MAC'd with the secret in
+ * "keycache.bundle_secret_file" (see scitoken_config_set_str), which must be
+ * set; the hosts importing it need the same secret.
+ * - If `count` is non-NULL, it is set to the number of issuers written.
+ * - Returns 0 on success, nonzero on failure.
+ */
+int keycache_export_bundle(const char *path, size_t *count, char **err_msg);
+
+/**
+ * Load a bundle written by keycache_export_bundle into the keycache, in a
+ * single transaction.  Nothing is loaded unless the bundle's MAC matches the
+ * secret in "keycache.bundle_secret_file".  Each entry replaces any existing
+ * one for its issuer and keeps the lifetimes recorded in the bundle; expired
+ * entries are skipped.
+ * - If `count` is non-NULL, it is set to the number of issuers loaded.
+ * - Returns 0 on success, nonzero on failure.
+ */
+int keycache_import_bundle(const char *path, size_t *count, char **err_msg);
+
+/**
+ * Compact the keycache database now rather than waiting for the next
+ * periodic compaction: drop expired entries, then evict the least recently
+ * used ones past "keycache.max_entries" and "keycache.max_bytes" (see
+ * scitoken_config_set_int).
+ * - If `removed` is non-NULL, it is set to the number of issuers dropped.
+ * - Returns 0 on success, nonzero on failure.
+ */
+int keycache_compact(size_t *removed, char **err_msg);
+
+/**
+ * Get a JSON snapshot of the library's counters and latency histograms: key
+ * cache lookups (in-memory and SQLite hits, SQLite read and write times),
+ * key refreshes (outcomes, durations, failures per issuer), signature checks
+ * and enforcer claim checks and ACL cache use.  Histograms have cumulative
+ * power-of-two microsecond buckets, ready to export to Prometheus.
+ *
+ * The counters are process-wide and count from library load or the last
+ * scitoken_reset_stats.  `json` must be freed by the caller.
+ */
+int scitoken_get_stats(char **json, char **err_msg);
+
+/**
+ * Zero all the counters reported by scitoken_get_stats.
+ */
+void scitoken_reset_stats();
+
+/**
+ * Timing of one token verification, passed to the trace callback.  Stage
+ * times are in microseconds and -1 for stages the verification did not
+ * reach; `key_construct_us` is the part of the key lookup spent building
+ * the public key from the JWKS.  `key_source` is "memory", "sqlite", "web"
+ * or "" if no key was found; `error` is NULL if the token verified.  The
+ * strings are only valid for the duration of the callback.
+ */
+typedef struct SciTokenTraceSpan_s {
+    const char *issuer;
+    const char *kid;
+    const char *key_source;
+    const char *error;
+    long long start_us; // Microseconds since the Unix epoch.
+    long long decode_us;
+    long long key_lookup_us;
+    long long key_construct_us;
+    long long signature_us;
+    long long claims_us;
+    long long total_us;
+} SciTokenTraceSpan;
+
+typedef void (*SciTokenTraceCallback)(const SciTokenTraceSpan *span,
+                                      void *data);
+
+/**
+ * Call `callback` with `data` once for every token deserialized, after it
+ * is verified or rejected.  The callback runs on the verifying thread
+ * (possibly a worker pool thread) and must be thread-safe.  A NULL
+ * callback turns tracing off, leaving the verification path untimed.
+ */
+int scitoken_config_set_trace_callback(SciTokenTraceCallback callback,
+                                       void *data, char **err_msg);
+
 /**
  * APIs for managing scitokens configuration parameters.
  */
@@ -302,6 +822,55 @@ int config_set_int(const char *key, int value, char **err_msg);
  * Takes in key/value pairs and assigns the input value to whatever
  * configuration variable is indicated by the key.
  * Returns 0 on success, and non-zero for invalid keys or values.
+ *
+ * "keycache.sqlite_busy_timeout_ms" (default 5000) is how long a key cache
+ * access waits for another process's write before it is retried.
+ *
+ * "keycache.snapshot" set to 1 makes every key cache update also publish a
+ * read-only snapshot of the cache next to the database, which processes with
+ * the setting on read in place of SQLite.  The database stays the source of
+ * truth.
+ *
+ * "keycache.failure_backoff_s" (default 10) is how long an issuer whose keys
+ * could not be downloaded is left alone before the next attempt, doubling
+ * with each consecutive failure; verifications in the meantime use the keys
+ * cached, or fail at once.  "keycache.unknown_kid_ttl_s" (default 60) is how
+ * long a key ID the issuer does not publish is remembered as such.  Zero
+ * turns either off.
+ *
+ * "verify.pool_objects" (default 0, off) is how many freed objects of each
+ * kind a verification allocates (validators, status objects, downloads) a
+ * thread keeps for reuse, taking them off malloc's hot path when many
+ * threads verify at once.
+ *
+ * "verify.issuer_prefilter" set to 1 makes deserializing with a list of
+ * allowed issuers first look for one of them in the token's payload, turning
+ * tokens from other issuers away before their JSON is parsed.  Tokens whose
+ * payload escapes any character are left to the full check.
+ *
+ * "keycache.max_metadata_bytes" and "keycache.max_jwks_bytes" (default 1 MiB
+ * each; 0 for no limit) cap the size of an issuer's metadata and key set
+ * responses; a larger response fails the download.
+ *
+ * "revocation.refresh_interval_s" (default 300) is how often the revocation
+ * list set as "revocation.source" is reloaded; 0 loads it only when set.
+ *
+ * "keycache.compact_interval_s" (default 3600; 0 for never) is how often a
+ * process storing keys also drops expired rows from the keycache database.
+ * "keycache.max_entries" and "keycache.max_bytes" (default 0, no limit)
+ * bound the database at each compaction by evicting the least recently used
+ * issuers; "keycache.max_entries" also bounds the in-memory tier.
+ *
+ * "fetch.connect_timeout_ms" bounds connecting to an issuer (0, the
+ * default, leaves it to curl) and "fetch.total_timeout_ms" a whole
+ * metadata or key set download (0, the default, for the built-in 4 s for
+ * refreshes and 30 s for issuers not yet cached).
+ * "fetch.dns_cache_timeout_s" (default 60) is how long resolved issuer
+ * addresses are reused.
+ *
+ * "fetch.hedge_delay_ms" (default 0, off) starts a second request for a
+ * download still running after that long, on a new connection to another
+ * of the issuer's addresses where there is one; the first response wins.
  */
 int scitoken_config_set_int(const char *key, int value, char **err_msg);
 
@@ -319,6 +888,49 @@ int scitoken_config_get_int(const char *key, char **err_msg);
 /**
  * Set current scitokens str parameters.
  * Returns 0 on success, nonzero on failure
+ *
+ * "tls.ca_file" names a PEM bundle of CAs to trust when fetching issuer
+ * metadata and keys in place of the system's; empty restores the default.
+ *
+ * "keycache.backend" selects where issuers' keys are cached: "sqlite" (the
+ * default, a database in the cache home) or "memcached", a server named by
+ * "keycache.memcached_server" ("host:port", default "localhost:11211") that
+ * many hosts can share so each issuer's keys are downloaded once per refresh
+ * rather than once per host.  If the server can't be reached, keys are
+ * downloaded as if they were not cached.
+ *
+ * SECURITY: memcached has no authentication, so anyone who can write to the
+ * server could plant keys for any issuer and mint tokens that verify.  The
+ * memcached backend therefore stores and accepts only rows MAC'd with the
+ * secret in "keycache.memcached_secret_file" (at least 32 bytes, in a file
+ * not accessible to other users nor writable by the group), which every
+ * host sharing the server must hold; rows failing the check are ignored and
+ * the keys downloaded again.  Without a secret (the default) the backend is
+ * not used.  Anyone holding the secret can still plant keys, so keep it to
+ * the hosts that would be trusted with issuers' keys anyway.
+ *
+ * The "memory" backend keeps keys in the process only and never touches the
+ * filesystem, for containers without a usable home directory; seed it with
+ * keycache_set_jwks to avoid the first downloads.  Key cache snapshots and
+ * bundles need the sqlite backend.
+ *
+ * "keycache.bundle_secret_file" names a file holding the secret (at least 32
+ * bytes, with the same permissions as above) key cache bundles are MAC'd
+ * with; see keycache_export_bundle.  Anyone holding it can make a bundle
+ * that plants keys for any issuer.
+ *
+ * "capability.secret_file" names a file holding the node-local secret (at
+ * least 32 bytes) capabilities are MAC'd with; see
+ * enforcer_export_capability.  The file must not be accessible to other
+ * users, nor writable by the group.  Empty (the default) forgets the
+ * secret.
+ *
+ * "revocation.source" names a file, or an http(s) URL, listing the IDs
+ * ("jti") of tokens revoked before they expire, one per line; blank lines
+ * and lines starting with '#' are ignored.  Tokens with a listed ID fail
+ * verification.  The list is loaded when set, failing the call if it can't
+ * be, and reloaded in the background; empty (the default) turns the check
+ * off.
  */
 int scitoken_config_set_str(const char *key, const char *value, char **err_msg);
 
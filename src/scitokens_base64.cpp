@@ -0,0 +1,324 @@
+
+#include <cstdint>
+#include <stdexcept>
+#include <string>
+
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+#define SCITOKENS_BASE64_X86
+#include <immintrin.h>
+#endif
+
+#include "scitokens_internal.h"
+
+namespace {
+
+const char encode_table[] =
+    "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789-_";
+
+// The value of each base64url character, or -1.
+struct DecodeTable {
+    DecodeTable() {
+        for (auto &value : m_values) {
+            value = -1;
+        }
+        for (int idx = 0; idx < 64; idx++) {
+            m_values[static_cast<unsigned char>(encode_table[idx])] = idx;
+        }
+    }
+    int8_t m_values[256];
+};
+
+const DecodeTable decode_table;
+
+[[noreturn]] void invalid_input() {
+    throw std::runtime_error("Invalid base64url input");
+}
+
+#ifdef SCITOKENS_BASE64_X86
+
+// Which of `chars` lie in [low, high].  Characters at or above 0x80
+// compare as negative and so fall in no range of the alphabet.
+inline __m128i in_range(__m128i chars, char low, char high) {
+    return _mm_and_si128(_mm_cmpgt_epi8(chars, _mm_set1_epi8(low - 1)),
+                         _mm_cmpgt_epi8(_mm_set1_epi8(high + 1), chars));
+}
+
+__attribute__((target("avx2"))) inline __m256i
+in_range(__m256i chars, char low, char high) {
+    return _mm256_and_si256(
+        _mm256_cmpgt_epi8(chars, _mm256_set1_epi8(low - 1)),
+        _mm256_cmpgt_epi8(_mm256_set1_epi8(high + 1), chars));
+}
+
+// Map 16 characters to their 6-bit values; sets `valid` to false if any
+// is outside the alphabet.
+__attribute__((target("ssse3"))) inline __m128i
+translate_sse(__m128i chars, bool &valid) {
+    __m128i upper = in_range(chars, 'A', 'Z');
+    __m128i lower = in_range(chars, 'a', 'z');
+    __m128i digit = in_range(chars, '0', '9');
+    __m128i dash = _mm_cmpeq_epi8(chars, _mm_set1_epi8('-'));
+    __m128i underscore = _mm_cmpeq_epi8(chars, _mm_set1_epi8('_'));
+    __m128i any = _mm_or_si128(_mm_or_si128(upper, lower),
+                               _mm_or_si128(_mm_or_si128(digit, dash),
+                                            underscore));
+    valid = _mm_movemask_epi8(any) == 0xffff;
+    __m128i offset = _mm_or_si128(
+        _mm_or_si128(_mm_and_si128(upper, _mm_set1_epi8(-'A')),
+                     _mm_and_si128(lower, _mm_set1_epi8(26 - 'a'))),
+        _mm_or_si128(
+            _mm_or_si128(_mm_and_si128(digit, _mm_set1_epi8(52 - '0')),
+                         _mm_and_si128(dash, _mm_set1_epi8(62 - '-'))),
+            _mm_and_si128(underscore, _mm_set1_epi8(63 - '_'))));
+    return _mm_add_epi8(chars, offset);
+}
+
+// Pack each group of four 6-bit values into 24 bits, leaving 12 bytes at
+// the front of the vector.
+__attribute__((target("ssse3"))) inline __m128i pack_sse(__m128i values) {
+    __m128i pairs =
+        _mm_maddubs_epi16(values, _mm_set1_epi32(0x01400140));
+    __m128i words = _mm_madd_epi16(pairs, _mm_set1_epi32(0x00011000));
+    return _mm_shuffle_epi8(words, _mm_setr_epi8(2, 1, 0, 6, 5, 4, 10, 9, 8,
+                                                 14, 13, 12, -1, -1, -1,
+                                                 -1));
+}
+
+/**
+ * Decode 16 (or, with AVX2, 32) characters at a time into 12 (24) bytes
+ * while that many are left, stopping early at an invalid character for the
+ * scalar loop to report.  Each returns the number of characters consumed;
+ * the output needs 32 bytes of slack past the decoded length.
+ */
+__attribute__((target("ssse3"))) size_t
+decode_ssse3(const char *in, size_t len, char *out) {
+    size_t consumed = 0;
+    while (len - consumed >= 16) {
+        __m128i chars = _mm_loadu_si128(
+            reinterpret_cast<const __m128i *>(in + consumed));
+        bool valid;
+        __m128i values = translate_sse(chars, valid);
+        if (!valid) {
+            break;
+        }
+        _mm_storeu_si128(reinterpret_cast<__m128i *>(out),
+                         pack_sse(values));
+        consumed += 16;
+        out += 12;
+    }
+    return consumed;
+}
+
+__attribute__((target("avx2"))) size_t decode_avx2(const char *in,
+                                                   size_t len, char *out) {
+    size_t consumed = 0;
+    const __m256i shuffle = _mm256_setr_epi8(
+        2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1, 2, 1, 0, 6,
+        5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1);
+    while (len - consumed >= 32) {
+        __m256i chars = _mm256_loadu_si256(
+            reinterpret_cast<const __m256i *>(in + consumed));
+        __m256i upper = in_range(chars, 'A', 'Z');
+        __m256i lower = in_range(chars, 'a', 'z');
+        __m256i digit = in_range(chars, '0', '9');
+        __m256i dash = _mm256_cmpeq_epi8(chars, _mm256_set1_epi8('-'));
+        __m256i underscore = _mm256_cmpeq_epi8(chars, _mm256_set1_epi8('_'));
+        __m256i any = _mm256_or_si256(
+            _mm256_or_si256(upper, lower),
+            _mm256_or_si256(_mm256_or_si256(digit, dash), underscore));
+        if (_mm256_movemask_epi8(any) != -1) {
+            break;
+        }
+        __m256i offset = _mm256_or_si256(
+            _mm256_or_si256(
+                _mm256_and_si256(upper, _mm256_set1_epi8(-'A')),
+                _mm256_and_si256(lower, _mm256_set1_epi8(26 - 'a'))),
+            _mm256_or_si256(
+                _mm256_or_si256(
+                    _mm256_and_si256(digit, _mm256_set1_epi8(52 - '0')),
+                    _mm256_and_si256(dash, _mm256_set1_epi8(62 - '-'))),
+                _mm256_and_si256(underscore, _mm256_set1_epi8(63 - '_'))));
+        __m256i values = _mm256_add_epi8(chars, offset);
+        __m256i pairs =
+            _mm256_maddubs_epi16(values, _mm256_set1_epi32(0x01400140));
+        __m256i words =
+            _mm256_madd_epi16(pairs, _mm256_set1_epi32(0x00011000));
+        __m256i bytes = _mm256_shuffle_epi8(words, shuffle);
+        // Each lane holds 12 bytes; bring them together.
+        bytes = _mm256_permutevar8x32_epi32(
+            bytes, _mm256_setr_epi32(0, 1, 2, 4, 5, 6, 7, 7));
+        _mm256_storeu_si256(reinterpret_cast<__m256i *>(out), bytes);
+        consumed += 32;
+        out += 24;
+    }
+    return consumed;
+}
+
+// Encode whole groups of 3 bytes into 4 characters each while at least 16
+// bytes remain to be read; returns the number of bytes consumed.
+__attribute__((target("ssse3"))) size_t
+encode_ssse3(const unsigned char *in, size_t len, char *out) {
+    size_t consumed = 0;
+    // For the 6-bit value v of each character, the reduced index
+    // saturate(v - 51), or 13 for v < 26, selects the offset to ASCII.
+    const __m128i offsets = _mm_setr_epi8('a' - 26, '0' - 52, '0' - 52,
+                                          '0' - 52, '0' - 52, '0' - 52,
+                                          '0' - 52, '0' - 52, '0' - 52,
+                                          '0' - 52, '0' - 52, '-' - 62,
+                                          '_' - 63, 'A', 0, 0);
+    while (len - consumed >= 16) {
+        __m128i bytes = _mm_loadu_si128(
+            reinterpret_cast<const __m128i *>(in + consumed));
+        // Each group of 3 bytes [a, b, c] becomes the 32-bit lane
+        // [b, a, c, b], from which the four values are shifted out.
+        bytes = _mm_shuffle_epi8(bytes, _mm_setr_epi8(1, 0, 2, 1, 4, 3, 5, 4,
+                                                      7, 6, 8, 7, 10, 9, 11,
+                                                      10));
+        __m128i high = _mm_mulhi_epu16(
+            _mm_and_si128(bytes, _mm_set1_epi32(0x0fc0fc00)),
+            _mm_set1_epi32(0x04000040));
+        __m128i low = _mm_mullo_epi16(
+            _mm_and_si128(bytes, _mm_set1_epi32(0x003f03f0)),
+            _mm_set1_epi32(0x01000010));
+        __m128i values = _mm_or_si128(high, low);
+        __m128i reduced = _mm_subs_epu8(values, _mm_set1_epi8(51));
+        __m128i below_26 = _mm_cmpgt_epi8(_mm_set1_epi8(26), values);
+        reduced =
+            _mm_or_si128(reduced, _mm_and_si128(below_26, _mm_set1_epi8(13)));
+        __m128i chars =
+            _mm_add_epi8(values, _mm_shuffle_epi8(offsets, reduced));
+        _mm_storeu_si128(reinterpret_cast<__m128i *>(out), chars);
+        consumed += 12;
+        out += 16;
+    }
+    return consumed;
+}
+
+typedef size_t (*DecodeBlocks)(const char *, size_t, char *);
+typedef size_t (*EncodeBlocks)(const unsigned char *, size_t, char *);
+
+DecodeBlocks select_decoder() {
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        return &decode_avx2;
+    }
+    if (__builtin_cpu_supports("ssse3")) {
+        return &decode_ssse3;
+    }
+    return nullptr;
+}
+
+EncodeBlocks select_encoder() {
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("ssse3") ? &encode_ssse3 : nullptr;
+}
+
+DecodeBlocks decode_blocks = select_decoder();
+EncodeBlocks encode_blocks = select_encoder();
+
+#endif // SCITOKENS_BASE64_X86
+
+} // namespace
+
+void scitokens::internal::b64url_set_simd(bool enabled) {
+#ifdef SCITOKENS_BASE64_X86
+    decode_blocks = enabled ? select_decoder() : nullptr;
+    encode_blocks = enabled ? select_encoder() : nullptr;
+#else
+    (void)enabled;
+#endif
+}
+
+std::string scitokens::internal::b64url_decode(const char *data,
+                                               size_t len) {
+    // Padding is not expected, but accepted.
+    if (len % 4 == 0) {
+        for (int idx = 0; idx < 2 && len && data[len - 1] == '='; idx++) {
+            len--;
+        }
+    }
+    if (len % 4 == 1) {
+        invalid_input();
+    }
+    size_t out_len = len / 4 * 3 + (len % 4 ? len % 4 - 1 : 0);
+    std::string result;
+    result.resize(out_len + 32);
+    char *out = &result[0];
+
+    size_t consumed = 0;
+#ifdef SCITOKENS_BASE64_X86
+    if (decode_blocks) {
+        consumed = decode_blocks(data, len, out);
+        out += consumed / 4 * 3;
+    }
+#endif
+    const int8_t *values = decode_table.m_values;
+    auto value = [&](size_t pos) {
+        int result = values[static_cast<unsigned char>(data[pos])];
+        if (result < 0) {
+            invalid_input();
+        }
+        return static_cast<uint32_t>(result);
+    };
+    for (; len - consumed >= 4; consumed += 4) {
+        uint32_t group = value(consumed) << 18 | value(consumed + 1) << 12 |
+                         value(consumed + 2) << 6 | value(consumed + 3);
+        *out++ = static_cast<char>(group >> 16);
+        *out++ = static_cast<char>(group >> 8);
+        *out++ = static_cast<char>(group);
+    }
+    if (len - consumed >= 2) {
+        uint32_t group = value(consumed) << 18 | value(consumed + 1) << 12;
+        if (len - consumed == 3) {
+            group |= value(consumed + 2) << 6;
+        }
+        // Only the canonical encoding, with the bits past the last byte
+        // clear, is accepted.
+        if (group & (len - consumed == 3 ? 0xff : 0xffff)) {
+            invalid_input();
+        }
+        *out++ = static_cast<char>(group >> 16);
+        if (len - consumed == 3) {
+            *out++ = static_cast<char>(group >> 8);
+        }
+    }
+    result.resize(out_len);
+    return result;
+}
+
+std::string scitokens::internal::b64url_encode(const char *data,
+                                               size_t len) {
+    auto in = reinterpret_cast<const unsigned char *>(data);
+    size_t out_len = len / 3 * 4 + (len % 3 ? len % 3 + 1 : 0);
+    std::string result;
+    result.resize(out_len);
+    char *out = &result[0];
+
+    size_t consumed = 0;
+#ifdef SCITOKENS_BASE64_X86
+    if (encode_blocks) {
+        consumed = encode_blocks(in, len, out);
+        out += consumed / 3 * 4;
+    }
+#endif
+    for (; len - consumed >= 3; consumed += 3) {
+        uint32_t group = in[consumed] << 16 | in[consumed + 1] << 8 |
+                         in[consumed + 2];
+        *out++ = encode_table[group >> 18];
+        *out++ = encode_table[(group >> 12) & 0x3f];
+        *out++ = encode_table[(group >> 6) & 0x3f];
+        *out++ = encode_table[group & 0x3f];
+    }
+    if (len - consumed) {
+        uint32_t group = in[consumed] << 16;
+        if (len - consumed == 2) {
+            group |= in[consumed + 1] << 8;
+        }
+        *out++ = encode_table[group >> 18];
+        *out++ = encode_table[(group >> 12) & 0x3f];
+        if (len - consumed == 2) {
+            *out++ = encode_table[(group >> 6) & 0x3f];
+        }
+    }
+    return result;
+}
@@ -1,13 +1,33 @@
 
+#include <algorithm>
+#include <atomic>
+#include <chrono>
 #include <cstdint>
+#include <fstream>
+#include <list>
 #include <memory>
+#include <mutex>
+#include <sstream>
 #include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
 
+#include <errno.h>
+#include <fcntl.h>
 #include <pwd.h>
+#include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <sys/file.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
 #include <unistd.h>
 
+#include <openssl/crypto.h>
+#include <openssl/evp.h>
+#include <openssl/hmac.h>
+
 #ifndef PICOJSON_USE_INT64
 #define PICOJSON_USE_INT64
 #endif
@@ -18,26 +38,73 @@
 
 namespace {
 
-void initialize_cachedb(const std::string &keycache_file) {
+// Statements still busy once the busy timeout has run out are retried this
+// many times, with a growing pause, before the cache gives up on them.
+const int busy_retries = 3;
+
+bool is_busy(int rc) {
+    rc &= 0xff; // Strip the extended result code.
+    return rc == SQLITE_BUSY || rc == SQLITE_LOCKED;
+}
+
+void pause_for_retry(int attempt) {
+    scitokens::internal::Stats::add(
+        scitokens::internal::Stats::get().m_sqlite_busy_retries);
+    std::this_thread::sleep_for(std::chrono::milliseconds(10 << attempt));
+}
+
+int exec_with_retry(sqlite3 *db, const char *sql) {
+    int rc = sqlite3_exec(db, sql, NULL, 0, NULL);
+    for (int attempt = 0; attempt < busy_retries && is_busy(rc); attempt++) {
+        pause_for_retry(attempt);
+        rc = sqlite3_exec(db, sql, NULL, 0, NULL);
+    }
+    return rc;
+}
+
+// Start a write transaction, timing the wait for the write lock.
+int begin_immediate(sqlite3 *db) {
+    scitokens::internal::ScopedLatency timer(
+        scitokens::internal::Stats::get().m_sqlite_lock_wait_us);
+    return exec_with_retry(db, "BEGIN IMMEDIATE");
+}
 
-    sqlite3 *db;
-    int rc = sqlite3_open(keycache_file.c_str(), &db);
-    if (rc != SQLITE_OK) {
-        std::cerr << "SQLite key cache creation failed." << std::endl;
-        sqlite3_close(db);
-        return;
+// Step a statement run outside an explicit transaction (or one that starts
+// it), which SQLite allows to be retried after SQLITE_BUSY.
+int step_with_retry(sqlite3_stmt *stmt) {
+    int rc = sqlite3_step(stmt);
+    for (int attempt = 0; attempt < busy_retries && is_busy(rc); attempt++) {
+        pause_for_retry(attempt);
+        sqlite3_reset(stmt); // Keeps the bindings.
+        rc = sqlite3_step(stmt);
     }
+    return rc;
+}
+
+bool initialize_cachedb(sqlite3 *db) {
     char *err_msg = nullptr;
-    rc = sqlite3_exec(db,
-                      "CREATE TABLE IF NOT EXISTS keycache ("
-                      "issuer text UNIQUE PRIMARY KEY NOT NULL,"
-                      "keys text NOT NULL)",
-                      NULL, 0, &err_msg);
+    // keycache_usage sits beside keycache, rather than adding columns to it,
+    // so releases that only know keycache can keep sharing the file; their
+    // rows are given usage rows at the next compaction.
+    int rc = sqlite3_exec(db,
+                          "CREATE TABLE IF NOT EXISTS keycache ("
+                          "issuer text UNIQUE PRIMARY KEY NOT NULL,"
+                          "keys text NOT NULL);"
+                          "CREATE TABLE IF NOT EXISTS keycache_usage ("
+                          "issuer text UNIQUE PRIMARY KEY NOT NULL,"
+                          "expires integer NOT NULL,"
+                          "last_used integer NOT NULL);"
+                          "CREATE INDEX IF NOT EXISTS keycache_usage_expires "
+                          "ON keycache_usage (expires);"
+                          "CREATE INDEX IF NOT EXISTS keycache_usage_last_used "
+                          "ON keycache_usage (last_used)",
+                          NULL, 0, &err_msg);
     if (rc) {
         std::cerr << "Sqlite table creation failed: " << err_msg << std::endl;
         sqlite3_free(err_msg);
+        return false;
     }
-    sqlite3_close(db);
+    return true;
 }
 
 /**
@@ -47,7 +114,7 @@ void initialize_cachedb(const std::string &keycache_file) {
  *  3. .cache subdirectory of home directory as returned by the password
  * database
  */
-std::string get_cache_file() {
+std::string resolve_cache_file() {
 
     const char *xdg_cache_home = getenv("XDG_CACHE_HOME");
 
@@ -89,191 +156,1517 @@ std::string get_cache_file() {
         return "";
     }
 
-    std::string keycache_file = keycache_dir + "/scitokens_cpp.sqllite";
-    initialize_cachedb(keycache_file);
-
-    return keycache_file;
+    return keycache_dir + "/scitokens_cpp.sqllite";
 }
 
-void remove_issuer_entry(sqlite3 *db, const std::string &issuer,
-                         bool new_transaction) {
+#if SQLITE_VERSION_NUMBER >= 3024000
+const char *const upsert_sql =
+    "INSERT INTO keycache VALUES (?, ?) "
+    "ON CONFLICT(issuer) DO UPDATE SET keys = excluded.keys";
+#else
+// Releases before 3.24 have no UPSERT.
+const char *const upsert_sql = "INSERT OR REPLACE INTO keycache VALUES (?, ?)";
+#endif
 
-    if (new_transaction)
-        sqlite3_exec(db, "BEGIN", 0, 0, 0);
+/**
+ * An open handle to the key cache database with its statements prepared.
+ *
+ * Each thread keeps one of these for the life of the thread (SQLite
+ * connections must not be used concurrently); it is reopened only when the
+ * cache home is reconfigured.
+ *
+ * The cache is typically shared by many processes on a host, so it uses a
+ * write-ahead log: readers then never block the writer nor it them, and
+ * writers wait for each other for up to the configured busy timeout.
+ */
+class CacheConnection {
+  public:
+    CacheConnection() = default;
+    CacheConnection(const CacheConnection &) = delete;
+    CacheConnection &operator=(const CacheConnection &) = delete;
 
-    sqlite3_stmt *stmt;
-    int rc = sqlite3_prepare_v2(db, "DELETE FROM keycache WHERE issuer = ?", -1,
-                                &stmt, NULL);
-    if (rc != SQLITE_OK) {
-        sqlite3_close(db);
-        return;
+    ~CacheConnection() {
+        sqlite3_finalize(m_select);
+        sqlite3_finalize(m_insert);
+        sqlite3_finalize(m_delete);
+        sqlite3_finalize(m_usage);
+        sqlite3_close(m_db);
     }
 
-    if (sqlite3_bind_text(stmt, 1, issuer.c_str(), issuer.size(),
-                          SQLITE_STATIC) != SQLITE_OK) {
-        sqlite3_finalize(stmt);
-        sqlite3_close(db);
-        return;
+    bool open(const std::string &keycache_file) {
+        if (sqlite3_open(keycache_file.c_str(), &m_db) != SQLITE_OK) {
+            std::cerr << "SQLite key cache creation failed." << std::endl;
+            return false;
+        }
+        m_file = keycache_file;
+        // Wait out other connections' writes rather than failing outright.
+        set_busy_timeout(configurer::Configuration::get_sqlite_busy_timeout());
+        // The journal mode is stored in the database, so this only changes
+        // anything for the first connection.  Filesystems without shared
+        // memory support keep the rollback journal.
+        exec_with_retry(m_db, "PRAGMA journal_mode=WAL");
+        // With a write-ahead log this only risks losing the last writes on
+        // power loss, which a cache can afford; it saves an fsync per write.
+        sqlite3_exec(m_db, "PRAGMA synchronous=NORMAL", NULL, 0, NULL);
+        if (!initialize_cachedb(m_db)) {
+            return false;
+        }
+        return (sqlite3_prepare_v2(m_db,
+                                   "SELECT keys from keycache where issuer = ?",
+                                   -1, &m_select, NULL) == SQLITE_OK) &&
+               (sqlite3_prepare_v2(m_db, upsert_sql, -1, &m_insert, NULL) ==
+                SQLITE_OK) &&
+               (sqlite3_prepare_v2(m_db,
+                                   "DELETE FROM keycache WHERE issuer = ?", -1,
+                                   &m_delete, NULL) == SQLITE_OK) &&
+               (sqlite3_prepare_v2(m_db,
+                                   "INSERT OR REPLACE INTO keycache_usage "
+                                   "VALUES (?, ?, ?)",
+                                   -1, &m_usage, NULL) == SQLITE_OK);
     }
 
-    rc = sqlite3_step(stmt);
-    if (rc != SQLITE_DONE) {
-        sqlite3_finalize(stmt);
-        sqlite3_close(db);
-        return;
+    void set_busy_timeout(int busy_timeout_ms) {
+        sqlite3_busy_timeout(m_db, busy_timeout_ms);
+        m_busy_timeout_ms = busy_timeout_ms;
     }
 
-    sqlite3_finalize(stmt);
+    std::string m_file;
+    sqlite3 *m_db{nullptr};
+    sqlite3_stmt *m_select{nullptr};
+    sqlite3_stmt *m_insert{nullptr};
+    sqlite3_stmt *m_delete{nullptr};
+    sqlite3_stmt *m_usage{nullptr};
+    int m_generation{-1};
+    int m_busy_timeout_ms{-1};
+};
+
+/**
+ * Resolve (and create, if necessary) the cache file location.  This is done
+ * once per process and again only when the cache home is reconfigured.
+ */
+// These live at namespace scope (rather than as function-local statics) so
+// they are constructed at load time and outlive the background refresher.
+std::mutex cache_file_mutex;
+std::string cache_file;
+int cache_file_generation = -1;
 
-    if (new_transaction)
-        sqlite3_exec(db, "COMMIT", 0, 0, 0);
+std::string get_cache_file(int generation) {
+    std::lock_guard<std::mutex> guard(cache_file_mutex);
+    if (cache_file_generation != generation || cache_file.empty()) {
+        cache_file = resolve_cache_file();
+        cache_file_generation = generation;
+    }
+    return cache_file;
 }
 
-} // namespace
+/**
+ * Get this thread's connection to the key cache; returns nullptr if the
+ * cache is unavailable.
+ */
+CacheConnection *get_connection() {
+    static thread_local std::unique_ptr<CacheConnection> connection;
+
+    int generation = configurer::Configuration::get_cache_home_generation();
+    if (connection && connection->m_generation == generation) {
+        int busy_timeout_ms =
+            configurer::Configuration::get_sqlite_busy_timeout();
+        if (connection->m_busy_timeout_ms != busy_timeout_ms) {
+            connection->set_busy_timeout(busy_timeout_ms);
+        }
+        return connection.get();
+    }
+    connection.reset();
 
-bool scitokens::Validator::get_public_keys_from_db(const std::string issuer,
-                                                   int64_t now,
-                                                   picojson::value &keys,
-                                                   int64_t &next_update) {
-    auto cache_fname = get_cache_file();
+    auto cache_fname = get_cache_file(generation);
     if (cache_fname.size() == 0) {
-        return false;
+        return nullptr;
+    }
+    std::unique_ptr<CacheConnection> new_connection(new CacheConnection());
+    if (!new_connection->open(cache_fname)) {
+        return nullptr;
     }
+    new_connection->m_generation = generation;
+    connection = std::move(new_connection);
+    return connection.get();
+}
 
-    sqlite3 *db;
-    int rc = sqlite3_open(cache_fname.c_str(), &db);
-    if (rc) {
-        sqlite3_close(db);
+/**
+ * The in-memory tier of the key cache: parsed key sets, by issuer.
+ *
+ * Lookups are served from here while the key set is fresh, without touching
+ * SQLite or re-parsing JSON.  Once an entry is due for an update the database
+ * is consulted again, as another process may already have refreshed it.  The
+ * tier is dropped when the cache home is reconfigured, and holds at most
+ * "keycache.max_entries" issuers, evicting the least recently used.
+ *
+ * Each CPU has a replica of the tier, so a lookup only takes the lock of its
+ * own CPU's replica, which other CPUs rarely touch.  Entries are immutable:
+ * storing a key set publishes one new entry to every replica in turn, and
+ * lookups share the entry they found rather than copying it.
+ */
+class MemoryCache {
+  public:
+    struct Entry {
+        std::shared_ptr<const picojson::value> m_keys;
+        std::shared_ptr<const scitokens::internal::KeyIndex> m_index;
+        int64_t m_next_update{-1};
+        int64_t m_expires{-1};
+        scitokens::internal::KeyCacheMetadata m_metadata;
+    };
+
+    MemoryCache() {
+        auto count = scitokens::internal::cpu_shard_count();
+        m_replicas.reserve(count);
+        for (size_t idx = 0; idx < count; idx++) {
+            m_replicas.emplace_back(new Replica());
+        }
+    }
+
+    static MemoryCache &get();
+
+    // Null if there is no entry or it has expired.
+    std::shared_ptr<const Entry> lookup(const std::string &issuer,
+                                        int64_t now) {
+        auto &replica =
+            *m_replicas[scitokens::internal::cpu_shard(m_replicas.size())];
+        scitokens::internal::TimedLockGuard guard(replica.m_mutex);
+        check_generation(replica);
+        auto iter = replica.m_entries.find(issuer);
+        if (iter == replica.m_entries.end()) {
+            return nullptr;
+        }
+        if (now > iter->second.m_entry->m_expires) {
+            // Expired in every replica; each drops it once it notices.
+            replica.m_entries.erase(iter);
+            return nullptr;
+        }
+        iter->second.m_last_used = std::time(NULL);
+        return iter->second.m_entry;
+    }
+
+    void insert(const std::string &issuer, Entry entry) {
+        auto published = std::make_shared<const Entry>(std::move(entry));
+        auto now = std::time(NULL);
+        size_t max_entries =
+            configurer::Configuration::get_keycache_max_entries();
+        bool full = false;
+        std::lock_guard<std::mutex> writer(m_write_mutex);
+        for (auto &replica : m_replicas) {
+            scitokens::internal::TimedLockGuard guard(replica->m_mutex);
+            check_generation(*replica);
+            auto &slot = replica->m_entries[issuer];
+            slot.m_entry = published;
+            slot.m_last_used = now;
+            full = full ||
+                   (max_entries && replica->m_entries.size() > max_entries);
+        }
+        if (full) {
+            evict(max_entries);
+        }
+    }
+
+    void erase(const std::string &issuer) {
+        std::lock_guard<std::mutex> writer(m_write_mutex);
+        for (auto &replica : m_replicas) {
+            std::lock_guard<std::mutex> guard(replica->m_mutex);
+            replica->m_entries.erase(issuer);
+        }
+    }
+
+    // The issuers held, with when each was last looked up (on any CPU) or
+    // stored.
+    std::vector<std::pair<std::string, int64_t>> get_usage() {
+        std::unordered_map<std::string, int64_t> last_used;
+        for (auto &replica : m_replicas) {
+            std::lock_guard<std::mutex> guard(replica->m_mutex);
+            for (const auto &entry : replica->m_entries) {
+                auto &used = last_used[entry.first];
+                used = std::max(used, entry.second.m_last_used);
+            }
+        }
+        return std::vector<std::pair<std::string, int64_t>>(last_used.begin(),
+                                                            last_used.end());
+    }
+
+  private:
+    struct Slot {
+        std::shared_ptr<const Entry> m_entry;
+        int64_t m_last_used{0};
+    };
+
+    struct Replica {
+        std::mutex m_mutex;
+        std::unordered_map<std::string, Slot> m_entries;
+        int m_generation{-1};
+        // Keeps the next replica off this one's cache lines.
+        char m_padding[64];
+    };
+
+    // Must be called with the replica's lock held.
+    static void check_generation(Replica &replica) {
+        int generation =
+            configurer::Configuration::get_cache_home_generation();
+        if (generation != replica.m_generation) {
+            replica.m_entries.clear();
+            replica.m_generation = generation;
+        }
+    }
+
+    // Drop the issuers least recently used on any CPU until none of the
+    // replicas, which each hold a subset of all issuers, holds more than
+    // `max_entries`.  Must be called with m_write_mutex held.
+    void evict(size_t max_entries) {
+        auto usage = get_usage();
+        if (usage.size() <= max_entries) {
+            return;
+        }
+        std::sort(usage.begin(), usage.end(),
+                  [](const std::pair<std::string, int64_t> &left,
+                     const std::pair<std::string, int64_t> &right) {
+                      return left.second < right.second;
+                  });
+        usage.resize(usage.size() - max_entries);
+        for (auto &replica : m_replicas) {
+            std::lock_guard<std::mutex> guard(replica->m_mutex);
+            for (const auto &victim : usage) {
+                replica->m_entries.erase(victim.first);
+            }
+        }
+        scitokens::internal::Stats::add(
+            scitokens::internal::Stats::get().m_memory_evictions,
+            usage.size());
+    }
+
+    // Serializes stores, so that every replica sees them in the same order.
+    std::mutex m_write_mutex;
+    std::vector<std::unique_ptr<Replica>> m_replicas;
+};
+
+// At namespace scope for the same reason as cache_file.
+MemoryCache memory_cache;
+
+MemoryCache &MemoryCache::get() { return memory_cache; }
+
+/**
+ * Parse a key cache row (as stored in SQLite) into `entry`.  Returns false if
+ * the row is malformed or its keys expired.
+ */
+bool parse_cache_row(const std::string &db_str, int64_t now,
+                     MemoryCache::Entry &entry) {
+    picojson::value json_obj;
+    auto err = picojson::parse(json_obj, db_str);
+    if (!err.empty() || !json_obj.is<picojson::object>()) {
+        return false;
+    }
+    auto &top_obj = json_obj.get<picojson::object>();
+    auto iter = top_obj.find("jwks");
+    if (iter == top_obj.end() || !iter->second.is<picojson::object>()) {
+        return false;
+    }
+    auto &keys_local = iter->second;
+    iter = top_obj.find("expires");
+    if (iter == top_obj.end() || !iter->second.is<int64_t>()) {
+        return false;
+    }
+    auto expiry = iter->second.get<int64_t>();
+    if (now > expiry) {
         return false;
     }
 
-    sqlite3_stmt *stmt;
-    rc = sqlite3_prepare_v2(db, "SELECT keys from keycache where issuer = ?",
-                            -1, &stmt, NULL);
-    if (rc != SQLITE_OK) {
-        sqlite3_close(db);
+    iter = top_obj.find("next_update");
+    if (iter == top_obj.end() || !iter->second.is<int64_t>()) {
+        entry.m_next_update = expiry - 4 * 3600;
+    } else {
+        entry.m_next_update = iter->second.get<int64_t>();
+    }
+    iter = top_obj.find("etag");
+    if (iter != top_obj.end() && iter->second.is<std::string>()) {
+        entry.m_metadata.m_etag = iter->second.get<std::string>();
+    }
+    iter = top_obj.find("last_modified");
+    if (iter != top_obj.end() && iter->second.is<std::string>()) {
+        entry.m_metadata.m_last_modified = iter->second.get<std::string>();
+    }
+    iter = top_obj.find("jwks_uri");
+    if (iter != top_obj.end() && iter->second.is<std::string>()) {
+        entry.m_metadata.m_jwks_uri = iter->second.get<std::string>();
+    }
+    iter = top_obj.find("metadata_url");
+    if (iter != top_obj.end() && iter->second.is<std::string>()) {
+        entry.m_metadata.m_metadata_url = iter->second.get<std::string>();
+    }
+    iter = top_obj.find("jwks_uri_expires");
+    if (iter != top_obj.end() && iter->second.is<int64_t>()) {
+        entry.m_metadata.m_jwks_uri_expires = iter->second.get<int64_t>();
+    }
+    entry.m_keys =
+        std::make_shared<const picojson::value>(std::move(keys_local));
+    entry.m_index =
+        std::make_shared<const scitokens::internal::KeyIndex>(entry.m_keys);
+    entry.m_expires = expiry;
+    return true;
+}
+
+/**
+ * A read-only snapshot of the whole key cache in a flat file next to the
+ * database, for processes on one host to share without touching SQLite.
+ *
+ * The writer of the database writes a new file on every store, splicing the
+ * changed row into the previous file, and publishes it by renaming it into
+ * place once the store commits (see PendingSnapshot).  Readers map the file
+ * and notice a new one by its inode changing; a published file is never
+ * modified, so reads take no locks.  Each row is the same JSON as in SQLite,
+ * but the index is sorted by issuer and carries the update and expiry times,
+ * so only the matching row is ever parsed.  Stores by processes with
+ * "keycache.snapshot" off reach the snapshot at the next compaction.
+ *
+ * Layout, in host byte order as it never leaves the host: a SnapshotHeader,
+ * `count` SnapshotIndex records and the issuer and row strings they point to.
+ * Bundles, which do, have their own format (see bundle_magic).
+ */
+struct SnapshotHeader {
+    char m_magic[8];
+    uint64_t m_count;
+};
+
+struct SnapshotIndex {
+    uint64_t m_issuer_offset;
+    uint64_t m_row_offset;
+    uint32_t m_issuer_size;
+    uint32_t m_row_size;
+    int64_t m_next_update;
+    int64_t m_expires;
+};
+
+const char snapshot_magic[8] = {'S', 'T', 'K', 'S', 'N', 'A', 'P', '1'};
+
+std::string get_snapshot_file(const std::string &cache_file) {
+    return cache_file + "-snapshot";
+}
+
+class KeySnapshot {
+  public:
+    struct Mapping {
+        Mapping() = default;
+        Mapping(const Mapping &) = delete;
+        Mapping &operator=(const Mapping &) = delete;
+        ~Mapping() {
+            if (m_data) {
+                munmap(m_data, m_size);
+            }
+        }
+
+        const SnapshotHeader &header() const {
+            return *static_cast<const SnapshotHeader *>(m_data);
+        }
+        const SnapshotIndex *begin() const {
+            return reinterpret_cast<const SnapshotIndex *>(&header() + 1);
+        }
+        const SnapshotIndex *end() const { return begin() + header().m_count; }
+        const char *base() const { return static_cast<const char *>(m_data); }
+
+        std::string m_file;
+        dev_t m_dev{0};
+        ino_t m_ino{0};
+        void *m_data{nullptr};
+        size_t m_size{0};
+    };
+
+    static KeySnapshot &get();
+
+    // Map and validate the snapshot at `file`; null if it is malformed.
+    static std::shared_ptr<const Mapping> map(const std::string &file);
+
+    // Look up the issuer in the current snapshot at `file`; on success,
+    // `row` holds its database row.
+    bool lookup(const std::string &file, const std::string &issuer,
+                std::string &row, int64_t &next_update) {
+        auto mapping = current(file);
+        if (!mapping) {
+            return false;
+        }
+        auto begin = mapping->begin();
+        auto end = mapping->end();
+        auto base = mapping->base();
+        auto iter = std::lower_bound(
+            begin, end, issuer,
+            [base](const SnapshotIndex &index, const std::string &value) {
+                return value.compare(0, value.size(),
+                                     base + index.m_issuer_offset,
+                                     index.m_issuer_size) > 0;
+            });
+        if (iter == end ||
+            issuer.compare(0, issuer.size(), base + iter->m_issuer_offset,
+                           iter->m_issuer_size) != 0) {
+            return false;
+        }
+        row.assign(base + iter->m_row_offset, iter->m_row_size);
+        next_update = iter->m_next_update;
+        return true;
+    }
+
+  private:
+    // The mapping of the file currently published at `file`, remapped if it
+    // was replaced; null if there is none or it is malformed.
+    std::shared_ptr<const Mapping> current(const std::string &file) {
+        auto mapping = std::atomic_load(&m_mapping);
+        struct stat st;
+        if (stat(file.c_str(), &st) != 0) {
+            return nullptr;
+        }
+        if (mapping && mapping->m_file == file && mapping->m_dev == st.st_dev &&
+            mapping->m_ino == st.st_ino) {
+            return mapping;
+        }
+        mapping = map(file);
+        std::atomic_store(&m_mapping, mapping);
+        return mapping;
+    }
+
+    // Check the snapshot's offsets once at mapping time so lookups need not.
+    static bool valid(const Mapping &mapping);
+
+    std::shared_ptr<const Mapping> m_mapping;
+};
+
+std::shared_ptr<const KeySnapshot::Mapping>
+KeySnapshot::map(const std::string &file) {
+    int fd = open(file.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return nullptr;
+    }
+    std::shared_ptr<Mapping> mapping(new Mapping());
+    struct stat st;
+    if (fstat(fd, &st) != 0 ||
+        static_cast<size_t>(st.st_size) < sizeof(SnapshotHeader)) {
+        close(fd);
+        return nullptr;
+    }
+    mapping->m_size = st.st_size;
+    void *data = mmap(nullptr, mapping->m_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED) {
+        return nullptr;
+    }
+    mapping->m_data = data;
+    mapping->m_file = file;
+    mapping->m_dev = st.st_dev;
+    mapping->m_ino = st.st_ino;
+    if (!valid(*mapping)) {
+        return nullptr;
+    }
+    return mapping;
+}
+
+bool KeySnapshot::valid(const Mapping &mapping) {
+    auto header = static_cast<const SnapshotHeader *>(mapping.m_data);
+    if (memcmp(header->m_magic, snapshot_magic, sizeof(snapshot_magic))) {
+        return false;
+    }
+    auto size = mapping.m_size - sizeof(SnapshotHeader);
+    if (header->m_count > size / sizeof(SnapshotIndex)) {
         return false;
     }
+    auto begin = reinterpret_cast<const SnapshotIndex *>(header + 1);
+    for (uint64_t idx = 0; idx < header->m_count; idx++) {
+        const auto &index = begin[idx];
+        if (index.m_issuer_offset > mapping.m_size ||
+            index.m_issuer_size > mapping.m_size - index.m_issuer_offset ||
+            index.m_row_offset > mapping.m_size ||
+            index.m_row_size > mapping.m_size - index.m_row_offset) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// At namespace scope for the same reason as cache_file.
+KeySnapshot key_snapshot;
+
+KeySnapshot &KeySnapshot::get() { return key_snapshot; }
+
+struct SnapshotRow {
+    std::string m_issuer;
+    std::string m_row;
+    MemoryCache::Entry m_entry;
+};
+
+// A row as written to a snapshot; it points into a SnapshotRow or a mapped
+// snapshot, which must outlive it.
+struct SnapshotRef {
+    const char *m_issuer;
+    size_t m_issuer_size;
+    const char *m_row;
+    size_t m_row_size;
+    int64_t m_next_update;
+    int64_t m_expires;
+};
+
+SnapshotRef make_ref(const std::string &issuer, const std::string &row,
+                     const MemoryCache::Entry &entry) {
+    return SnapshotRef{issuer.data(), issuer.size(),      row.data(),
+                       row.size(),    entry.m_next_update, entry.m_expires};
+}
 
-    if (sqlite3_bind_text(stmt, 1, issuer.c_str(), issuer.size(),
-                          SQLITE_STATIC) != SQLITE_OK) {
+std::vector<SnapshotRef> make_refs(const std::vector<SnapshotRow> &rows) {
+    std::vector<SnapshotRef> refs;
+    refs.reserve(rows.size());
+    for (const auto &row : rows) {
+        refs.push_back(make_ref(row.m_issuer, row.m_row, row.m_entry));
+    }
+    return refs;
+}
+
+/**
+ * Read every unexpired row of the database behind `conn`, ordered by issuer.
+ */
+std::vector<SnapshotRow> read_rows(CacheConnection &conn, int64_t now) {
+    std::vector<SnapshotRow> rows;
+    // SQLite's default collation orders issuers by memcmp, as the readers'
+    // binary search expects.
+    sqlite3_stmt *stmt = nullptr;
+    if (sqlite3_prepare_v2(conn.m_db,
+                           "SELECT issuer, keys FROM keycache ORDER BY issuer",
+                           -1, &stmt, NULL) != SQLITE_OK) {
         sqlite3_finalize(stmt);
-        sqlite3_close(db);
-        return false;
+        return rows;
     }
+    while (sqlite3_step(stmt) == SQLITE_ROW) {
+        SnapshotRow row;
+        row.m_issuer =
+            reinterpret_cast<const char *>(sqlite3_column_text(stmt, 0));
+        row.m_row =
+            reinterpret_cast<const char *>(sqlite3_column_text(stmt, 1));
+        if (parse_cache_row(row.m_row, now, row.m_entry)) {
+            rows.push_back(std::move(row));
+        }
+    }
+    sqlite3_finalize(stmt);
+    return rows;
+}
+
+/**
+ * Write `rows` (sorted by issuer) as a snapshot to a new temporary file next
+ * to `file`.  Returns the temporary file's name, or empty if it could not be
+ * written.
+ */
+std::string write_snapshot_tmp(const std::string &file,
+                               const std::vector<SnapshotRef> &rows) {
+    SnapshotHeader header;
+    memcpy(header.m_magic, snapshot_magic, sizeof(snapshot_magic));
+    header.m_count = rows.size();
+    std::vector<SnapshotIndex> index(rows.size());
+    uint64_t offset =
+        sizeof(SnapshotHeader) + rows.size() * sizeof(SnapshotIndex);
+    for (size_t idx = 0; idx < rows.size(); idx++) {
+        index[idx].m_issuer_offset = offset;
+        index[idx].m_issuer_size = rows[idx].m_issuer_size;
+        offset += rows[idx].m_issuer_size;
+        index[idx].m_row_offset = offset;
+        index[idx].m_row_size = rows[idx].m_row_size;
+        offset += rows[idx].m_row_size;
+        index[idx].m_next_update = rows[idx].m_next_update;
+        index[idx].m_expires = rows[idx].m_expires;
+    }
+
+    std::string tmp_file = file + ".XXXXXX";
+    int fd = mkstemp(&tmp_file[0]);
+    if (fd < 0) {
+        return "";
+    }
+    FILE *fp = fdopen(fd, "w");
+    if (!fp) {
+        close(fd);
+        unlink(tmp_file.c_str());
+        return "";
+    }
+    bool ok = fwrite(&header, sizeof(header), 1, fp) == 1 &&
+              (index.empty() || fwrite(index.data(), sizeof(SnapshotIndex),
+                                       index.size(), fp) == index.size());
+    for (const auto &row : rows) {
+        ok = ok &&
+             fwrite(row.m_issuer, 1, row.m_issuer_size, fp) ==
+                 row.m_issuer_size &&
+             fwrite(row.m_row, 1, row.m_row_size, fp) == row.m_row_size;
+    }
+    ok = (fclose(fp) == 0) && ok;
+    if (!ok) {
+        unlink(tmp_file.c_str());
+        return "";
+    }
+    return tmp_file;
+}
 
-    rc = sqlite3_step(stmt);
-    if (rc == SQLITE_ROW) {
-        const unsigned char *data = sqlite3_column_text(stmt, 0);
-        std::string metadata(reinterpret_cast<const char *>(data));
+/**
+ * The snapshot for a write transaction on the database, written while the
+ * transaction holds the write lock and published (or discarded) once it
+ * ends, so no reader ever sees rows that were rolled back.
+ *
+ * A writer holds the lock file next to the snapshot from preparing its
+ * snapshot until publishing it.  It can only prepare once the previous
+ * writer has committed, so the lock orders publication by commit, and the
+ * snapshot it starts from is always the one the previous writer published.
+ */
+class PendingSnapshot {
+  public:
+    explicit PendingSnapshot(const CacheConnection &conn)
+        : m_file(get_snapshot_file(conn.m_file)) {}
+    PendingSnapshot(const PendingSnapshot &) = delete;
+    PendingSnapshot &operator=(const PendingSnapshot &) = delete;
+    ~PendingSnapshot() { discard(); }
+
+    // Snapshot every row of the database.
+    void prepare(CacheConnection &conn, int64_t now) {
+        if (!lock()) {
+            return;
+        }
+        m_tmp_file =
+            write_snapshot_tmp(m_file, make_refs(read_rows(conn, now)));
+    }
+
+    // Snapshot the previous snapshot with the issuer's row replaced by `row`,
+    // or removed if `row` is null, without reading or parsing the others.
+    // Falls back to the whole database if there is no previous snapshot.
+    void prepare(CacheConnection &conn, const std::string &issuer,
+                 const std::string *row, int64_t now) {
+        if (!lock()) {
+            return;
+        }
+        auto previous = KeySnapshot::map(m_file);
+        if (!previous) {
+            m_tmp_file =
+                write_snapshot_tmp(m_file, make_refs(read_rows(conn, now)));
+            return;
+        }
+        MemoryCache::Entry entry;
+        bool have_row = row && parse_cache_row(*row, now, entry);
+        std::vector<SnapshotRef> refs;
+        refs.reserve(previous->header().m_count + 1);
+        auto base = previous->base();
+        bool placed = false;
+        for (auto iter = previous->begin(); iter != previous->end(); ++iter) {
+            // As parse_cache_row, drop the rows that expired.
+            if (now > iter->m_expires) {
+                continue;
+            }
+            int order = issuer.compare(0, issuer.size(),
+                                       base + iter->m_issuer_offset,
+                                       iter->m_issuer_size);
+            if (!placed && order <= 0) {
+                if (have_row) {
+                    refs.push_back(make_ref(issuer, *row, entry));
+                }
+                placed = true;
+                if (order == 0) {
+                    continue;
+                }
+            }
+            refs.push_back(SnapshotRef{
+                base + iter->m_issuer_offset, iter->m_issuer_size,
+                base + iter->m_row_offset, iter->m_row_size,
+                iter->m_next_update, iter->m_expires});
+        }
+        if (!placed && have_row) {
+            refs.push_back(make_ref(issuer, *row, entry));
+        }
+        m_tmp_file = write_snapshot_tmp(m_file, refs);
+    }
+
+    // Rename the snapshot into place; call once the transaction committed.
+    void publish() {
+        if (!m_tmp_file.empty() &&
+            rename(m_tmp_file.c_str(), m_file.c_str()) == 0) {
+            m_tmp_file.clear();
+        }
+        discard();
+    }
+
+    // Drop the snapshot, as when the transaction rolled back.
+    void discard() {
+        if (!m_tmp_file.empty()) {
+            unlink(m_tmp_file.c_str());
+            m_tmp_file.clear();
+        }
+        if (m_lock_fd >= 0) {
+            close(m_lock_fd); // Releases the lock.
+            m_lock_fd = -1;
+        }
+    }
+
+  private:
+    bool lock() {
+        std::string lock_file = m_file + ".lock";
+        m_lock_fd =
+            open(lock_file.c_str(), O_RDONLY | O_CREAT | O_CLOEXEC, 0600);
+        if (m_lock_fd < 0) {
+            return false;
+        }
+        while (flock(m_lock_fd, LOCK_EX) != 0) {
+            if (errno != EINTR) {
+                close(m_lock_fd);
+                m_lock_fd = -1;
+                return false;
+            }
+        }
+        return true;
+    }
+
+    std::string m_file;
+    std::string m_tmp_file;
+    int m_lock_fd{-1};
+};
+
+// Resets a borrowed prepared statement on scope exit so it can be reused.
+struct StatementReset {
+    explicit StatementReset(sqlite3_stmt *stmt) : m_stmt(stmt) {}
+    ~StatementReset() {
+        sqlite3_reset(m_stmt);
+        sqlite3_clear_bindings(m_stmt);
+    }
+    sqlite3_stmt *m_stmt;
+};
+
+// Record the issuer's expiry, and that it was used at `now`, alongside the
+// row just stored for it.
+bool store_usage(CacheConnection &conn, const std::string &issuer,
+                 int64_t expires, int64_t now) {
+    StatementReset reset(conn.m_usage);
+    return sqlite3_bind_text(conn.m_usage, 1, issuer.c_str(), issuer.size(),
+                             SQLITE_STATIC) == SQLITE_OK &&
+           sqlite3_bind_int64(conn.m_usage, 2, expires) == SQLITE_OK &&
+           sqlite3_bind_int64(conn.m_usage, 3, now) == SQLITE_OK &&
+           sqlite3_step(conn.m_usage) == SQLITE_DONE;
+}
+
+// Run `sql`, with `value` bound to any ?1 in it, to completion; returns the
+// number of rows it changed.
+int exec_bound(sqlite3 *db, const char *sql, int64_t value) {
+    sqlite3_stmt *stmt = nullptr;
+    if (sqlite3_prepare_v2(db, sql, -1, &stmt, NULL) != SQLITE_OK) {
+        sqlite3_finalize(stmt);
+        return 0;
+    }
+    if (sqlite3_bind_parameter_count(stmt) > 0) {
+        sqlite3_bind_int64(stmt, 1, value);
+    }
+    int rc = step_with_retry(stmt);
+    sqlite3_finalize(stmt);
+    return rc == SQLITE_DONE ? sqlite3_changes(db) : 0;
+}
+
+/**
+ * Bring the database behind `conn` back within bounds; called inside the
+ * write transaction.  The process first records when it last used the
+ * issuers in its memory tier (lookups served from memory never write to the
+ * database), then drops expired rows and finally, past "keycache.max_entries"
+ * or "keycache.max_bytes", the least recently used ones.  Returns the number
+ * of rows removed.
+ */
+size_t compact_database(CacheConnection &conn, int64_t now) {
+    auto &stats = scitokens::internal::Stats::get();
+    scitokens::internal::Stats::add(stats.m_compactions);
+
+    sqlite3_stmt *stmt = nullptr;
+    if (sqlite3_prepare_v2(conn.m_db,
+                           "UPDATE keycache_usage SET last_used = ?1 "
+                           "WHERE issuer = ?2 AND last_used < ?1",
+                           -1, &stmt, NULL) == SQLITE_OK) {
+        for (const auto &usage : MemoryCache::get().get_usage()) {
+            sqlite3_bind_int64(stmt, 1, usage.second);
+            sqlite3_bind_text(stmt, 2, usage.first.c_str(),
+                              usage.first.size(), SQLITE_STATIC);
+            step_with_retry(stmt);
+            sqlite3_reset(stmt);
+        }
+    }
+    sqlite3_finalize(stmt);
+
+    // Rows stored by releases without keycache_usage: parse them once for
+    // their expiry, counting them as used now.
+    std::vector<std::string> dead;
+    std::vector<std::pair<std::string, int64_t>> untracked;
+    stmt = nullptr;
+    if (sqlite3_prepare_v2(conn.m_db,
+                           "SELECT issuer, keys FROM keycache WHERE issuer "
+                           "NOT IN (SELECT issuer FROM keycache_usage)",
+                           -1, &stmt, NULL) == SQLITE_OK) {
+        while (sqlite3_step(stmt) == SQLITE_ROW) {
+            std::string issuer =
+                reinterpret_cast<const char *>(sqlite3_column_text(stmt, 0));
+            MemoryCache::Entry entry;
+            if (parse_cache_row(reinterpret_cast<const char *>(
+                                    sqlite3_column_text(stmt, 1)),
+                                now, entry)) {
+                untracked.emplace_back(std::move(issuer), entry.m_expires);
+            } else {
+                dead.push_back(std::move(issuer));
+            }
+        }
+    }
+    sqlite3_finalize(stmt);
+    for (const auto &row : untracked) {
+        store_usage(conn, row.first, row.second, now);
+    }
+
+    size_t expired =
+        exec_bound(conn.m_db,
+                   "DELETE FROM keycache WHERE issuer IN (SELECT issuer "
+                   "FROM keycache_usage WHERE expires < ?1)",
+                   now);
+
+    // Walk the rest from the most recently used, keeping what fits.
+    size_t max_entries = configurer::Configuration::get_keycache_max_entries();
+    size_t max_bytes = configurer::Configuration::get_keycache_max_bytes();
+    size_t dead_expired = dead.size();
+    if (max_entries || max_bytes) {
+        stmt = nullptr;
+        if (sqlite3_prepare_v2(
+                conn.m_db,
+                "SELECT k.issuer, length(k.issuer) + length(k.keys) "
+                "FROM keycache k JOIN keycache_usage u ON u.issuer = k.issuer "
+                "ORDER BY u.last_used DESC",
+                -1, &stmt, NULL) == SQLITE_OK) {
+            size_t entries = 0, bytes = 0;
+            while (sqlite3_step(stmt) == SQLITE_ROW) {
+                entries++;
+                bytes += sqlite3_column_int64(stmt, 1);
+                if ((max_entries && entries > max_entries) ||
+                    (max_bytes && bytes > max_bytes)) {
+                    dead.emplace_back(reinterpret_cast<const char *>(
+                        sqlite3_column_text(stmt, 0)));
+                }
+            }
+        }
         sqlite3_finalize(stmt);
-        picojson::value json_obj;
-        auto err = picojson::parse(json_obj, metadata);
-        if (!err.empty() || !json_obj.is<picojson::object>()) {
-            remove_issuer_entry(db, issuer, true);
-            sqlite3_close(db);
+    }
+    for (const auto &issuer : dead) {
+        StatementReset reset(conn.m_delete);
+        if (sqlite3_bind_text(conn.m_delete, 1, issuer.c_str(), issuer.size(),
+                              SQLITE_STATIC) == SQLITE_OK) {
+            step_with_retry(conn.m_delete);
+        }
+    }
+    exec_bound(conn.m_db,
+               "DELETE FROM keycache_usage WHERE issuer NOT IN "
+               "(SELECT issuer FROM keycache)",
+               0);
+
+    scitokens::internal::Stats::add(stats.m_compaction_expired,
+                                    expired + dead_expired);
+    scitokens::internal::Stats::add(stats.m_compaction_evicted,
+                                    dead.size() - dead_expired);
+    return expired + dead.size();
+}
+
+// When this process is next due to compact the database while storing.
+std::atomic<int64_t> next_compaction{0};
+
+/**
+ * The default backend: the SQLite database in the cache home, plus the
+ * snapshot file next to it when "keycache.snapshot" is on.
+ */
+class SqliteBackend : public scitokens::internal::KeyCacheBackend {
+  public:
+    Lookup lookup(const std::string &issuer, int64_t now,
+                  std::string &row) override {
+        auto &stats = scitokens::internal::Stats::get();
+        if (configurer::Configuration::get_keycache_snapshot()) {
+            auto file = get_cache_file(
+                configurer::Configuration::get_cache_home_generation());
+            int64_t snapshot_next_update;
+            if (!file.empty() &&
+                KeySnapshot::get().lookup(get_snapshot_file(file), issuer, row,
+                                          snapshot_next_update) &&
+                now <= snapshot_next_update) {
+                scitokens::internal::Stats::add(stats.m_snapshot_hits);
+                return Lookup::FOUND;
+            }
+        }
+
+        scitokens::internal::Stats::add(stats.m_sqlite_reads);
+        scitokens::internal::ScopedLatency timer(stats.m_sqlite_read_us);
+
+        auto conn = get_connection();
+        if (!conn) {
+            return Lookup::UNAVAILABLE;
+        }
+
+        StatementReset reset(conn->m_select);
+        if (sqlite3_bind_text(conn->m_select, 1, issuer.c_str(), issuer.size(),
+                              SQLITE_STATIC) != SQLITE_OK) {
+            return Lookup::UNAVAILABLE;
+        }
+
+        int rc = step_with_retry(conn->m_select);
+        if (rc == SQLITE_DONE) {
+            return Lookup::MISSING;
+        } else if (rc != SQLITE_ROW) {
+            // Still busy after the retries, or broken.
+            return Lookup::UNAVAILABLE;
+        }
+        const unsigned char *data = sqlite3_column_text(conn->m_select, 0);
+        row = reinterpret_cast<const char *>(data);
+        scitokens::internal::Stats::add(stats.m_sqlite_hits);
+        return Lookup::FOUND;
+    }
+
+    bool store(const std::string &issuer, const std::string &row,
+               int64_t expires) override {
+        auto conn = get_connection();
+        if (!conn) {
             return false;
         }
-        auto top_obj = json_obj.get<picojson::object>();
-        auto iter = top_obj.find("jwks");
-        if (iter == top_obj.end() || !iter->second.is<picojson::object>()) {
-            remove_issuer_entry(db, issuer, true);
-            sqlite3_close(db);
+
+        auto &stats = scitokens::internal::Stats::get();
+        scitokens::internal::Stats::add(stats.m_sqlite_writes);
+        scitokens::internal::ScopedLatency timer(stats.m_sqlite_write_us);
+        // Take the write lock up front: a deferred transaction that has to
+        // upgrade to one can fail with SQLITE_BUSY without waiting.
+        if (begin_immediate(conn->m_db) != SQLITE_OK) {
             return false;
         }
-        auto keys_local = iter->second;
-        iter = top_obj.find("expires");
-        if (iter == top_obj.end() || !iter->second.is<int64_t>()) {
-            remove_issuer_entry(db, issuer, true);
-            sqlite3_close(db);
+
+        {
+            StatementReset reset(conn->m_insert);
+            if ((sqlite3_bind_text(conn->m_insert, 1, issuer.c_str(),
+                                   issuer.size(), SQLITE_STATIC) !=
+                 SQLITE_OK) ||
+                (sqlite3_bind_text(conn->m_insert, 2, row.c_str(), row.size(),
+                                   SQLITE_STATIC) != SQLITE_OK) ||
+                (sqlite3_step(conn->m_insert) != SQLITE_DONE)) {
+                sqlite3_exec(conn->m_db, "ROLLBACK", 0, 0, 0);
+                return false;
+            }
+        }
+        int64_t now = std::time(NULL);
+        if (!store_usage(*conn, issuer, expires, now)) {
+            sqlite3_exec(conn->m_db, "ROLLBACK", 0, 0, 0);
             return false;
         }
-        auto expiry = iter->second.get<int64_t>();
-        if (now > expiry) {
-            remove_issuer_entry(db, issuer, true);
-            sqlite3_close(db);
+        int interval =
+            configurer::Configuration::get_keycache_compact_interval();
+        bool compacted = false;
+        if (interval > 0 && now >= next_compaction) {
+            next_compaction = now + interval;
+            compacted = compact_database(*conn, now) > 0;
+        }
+        PendingSnapshot snapshot(*conn);
+        if (configurer::Configuration::get_keycache_snapshot()) {
+            if (compacted) {
+                snapshot.prepare(*conn, now);
+            } else {
+                snapshot.prepare(*conn, issuer, &row, now);
+            }
+        }
+
+        if (exec_with_retry(conn->m_db, "COMMIT") != SQLITE_OK) {
+            sqlite3_exec(conn->m_db, "ROLLBACK", 0, 0, 0);
             return false;
         }
-        sqlite3_close(db);
-        iter = top_obj.find("next_update");
-        if (iter == top_obj.end() || !iter->second.is<int64_t>()) {
-            next_update = expiry - 4 * 3600;
-        } else {
-            next_update = iter->second.get<int64_t>();
+        snapshot.publish();
+        return true;
+    }
+
+    void invalidate(const std::string &issuer) override {
+        auto conn = get_connection();
+        if (!conn) {
+            return;
+        }
+        if (!configurer::Configuration::get_keycache_snapshot()) {
+            // A single statement, so it is its own transaction.
+            remove(*conn, issuer);
+            return;
+        }
+        // The snapshot must drop the row too.
+        if (begin_immediate(conn->m_db) != SQLITE_OK) {
+            return;
+        }
+        remove(*conn, issuer);
+        PendingSnapshot snapshot(*conn);
+        snapshot.prepare(*conn, issuer, nullptr, std::time(NULL));
+        if (exec_with_retry(conn->m_db, "COMMIT") != SQLITE_OK) {
+            sqlite3_exec(conn->m_db, "ROLLBACK", 0, 0, 0);
+            return;
+        }
+        snapshot.publish();
+    }
+
+    size_t compact(int64_t now) override {
+        auto conn = get_connection();
+        if (!conn) {
+            throw std::runtime_error("The key cache is not available.");
+        }
+        if (begin_immediate(conn->m_db) != SQLITE_OK) {
+            throw std::runtime_error(
+                "Failed to lock the key cache for writing.");
+        }
+        auto removed = compact_database(*conn, now);
+        PendingSnapshot snapshot(*conn);
+        if (configurer::Configuration::get_keycache_snapshot()) {
+            snapshot.prepare(*conn, now);
+        }
+        if (exec_with_retry(conn->m_db, "COMMIT") != SQLITE_OK) {
+            sqlite3_exec(conn->m_db, "ROLLBACK", 0, 0, 0);
+            throw std::runtime_error("Failed to commit the key cache "
+                                     "compaction.");
+        }
+        snapshot.publish();
+        return removed;
+    }
+
+  private:
+    static void remove(CacheConnection &conn, const std::string &issuer) {
+        StatementReset reset(conn.m_delete);
+        if (sqlite3_bind_text(conn.m_delete, 1, issuer.c_str(), issuer.size(),
+                              SQLITE_STATIC) != SQLITE_OK) {
+            return;
         }
-        keys = keys_local;
+        step_with_retry(conn.m_delete);
+    }
+};
+
+/**
+ * Keeps rows in process memory only, for hosts where the filesystem is
+ * missing, read-only or slow: the cache home is never resolved, created or
+ * opened.  Keys are lost when the process exits, so each process downloads
+ * them once (or is seeded with keycache_set_jwks).
+ */
+class MemoryBackend : public scitokens::internal::KeyCacheBackend {
+  public:
+    Lookup lookup(const std::string &issuer, int64_t now,
+                  std::string &row) override {
+        std::lock_guard<std::mutex> guard(m_mutex);
+        auto iter = m_rows.find(issuer);
+        if (iter == m_rows.end()) {
+            return Lookup::MISSING;
+        }
+        if (now > iter->second.m_expires) {
+            m_rows.erase(iter);
+            return Lookup::MISSING;
+        }
+        row = iter->second.m_row;
+        return Lookup::FOUND;
+    }
+
+    bool store(const std::string &issuer, const std::string &row,
+               int64_t expires) override {
+        std::lock_guard<std::mutex> guard(m_mutex);
+        auto &stored = m_rows[issuer];
+        stored.m_row = row;
+        stored.m_expires = expires;
         return true;
-    } else if (rc == SQLITE_DONE) {
-        sqlite3_finalize(stmt);
-        sqlite3_close(db);
+    }
+
+    void invalidate(const std::string &issuer) override {
+        std::lock_guard<std::mutex> guard(m_mutex);
+        m_rows.erase(issuer);
+    }
+
+    // The memory tier in front of this backend already bounds the issuers
+    // in use; here only expired rows need dropping.
+    size_t compact(int64_t now) override {
+        std::lock_guard<std::mutex> guard(m_mutex);
+        size_t removed = 0;
+        for (auto iter = m_rows.begin(); iter != m_rows.end();) {
+            if (now > iter->second.m_expires) {
+                iter = m_rows.erase(iter);
+                removed++;
+            } else {
+                ++iter;
+            }
+        }
+        auto &stats = scitokens::internal::Stats::get();
+        scitokens::internal::Stats::add(stats.m_compactions);
+        scitokens::internal::Stats::add(stats.m_compaction_expired, removed);
+        return removed;
+    }
+
+  private:
+    struct StoredRow {
+        std::string m_row;
+        int64_t m_expires{-1};
+    };
+
+    std::mutex m_mutex;
+    std::unordered_map<std::string, StoredRow> m_rows;
+};
+
+// The backend in use and the configuration generation it was made for; at
+// namespace scope for the same reason as cache_file.
+std::mutex backend_mutex;
+std::shared_ptr<scitokens::internal::KeyCacheBackend> current_backend;
+int backend_generation = -1;
+
+// Bundles are made from and loaded into the SQLite database.
+void require_sqlite_backend() {
+    if (configurer::Configuration::get_keycache_backend() != "sqlite") {
+        throw std::runtime_error(
+            "Key cache bundles need the sqlite key cache backend.");
+    }
+}
+
+/**
+ * A bundle moves a whole key cache between hosts, so unlike the snapshot it
+ * has a fixed layout, with every integer little-endian: the magic, a u64
+ * count, then per issuer a u32 issuer size, a u32 row size and the issuer
+ * and row bytes (the row carries the lifetimes).  It ends in an
+ * HMAC-SHA256, keyed with the secret from "keycache.bundle_secret_file", of
+ * everything before it, which is checked before anything is read.
+ */
+const char bundle_magic[8] = {'S', 'T', 'K', 'B', 'N', 'D', 'L', '1'};
+const size_t bundle_mac_size = 32;
+
+std::shared_ptr<const std::string> require_bundle_secret() {
+    auto secret = configurer::Configuration::get_bundle_secret();
+    if (!secret || secret->empty()) {
+        throw std::runtime_error("Key cache bundles need a secret in "
+                                 "keycache.bundle_secret_file.");
+    }
+    return secret;
+}
+
+std::string bundle_mac(const std::string &secret, const char *data,
+                       size_t size) {
+    std::string message = "scitokens-keycache-bundle";
+    message += '\0';
+    message.append(data, size);
+    unsigned char result[EVP_MAX_MD_SIZE];
+    unsigned result_size = 0;
+    if (!HMAC(EVP_sha256(), secret.data(), secret.size(),
+              reinterpret_cast<const unsigned char *>(message.data()),
+              message.size(), result, &result_size) ||
+        result_size != bundle_mac_size) {
+        throw std::runtime_error("Failed to compute the key cache bundle MAC.");
+    }
+    return std::string(reinterpret_cast<char *>(result), result_size);
+}
+
+void put_le(std::string &out, uint64_t value, size_t size) {
+    for (size_t idx = 0; idx < size; idx++) {
+        out += static_cast<char>((value >> (8 * idx)) & 0xff);
+    }
+}
+
+// Reads a bundle front to back; each get fails, rather than reading past
+// the end, once the data runs out.
+class BundleReader {
+  public:
+    BundleReader(const char *data, size_t size) : m_data(data), m_size(size) {}
+
+    bool get_le(uint64_t &value, size_t size) {
+        if (m_size - m_offset < size) {
+            return false;
+        }
+        value = 0;
+        for (size_t idx = 0; idx < size; idx++) {
+            value |= static_cast<uint64_t>(
+                         static_cast<unsigned char>(m_data[m_offset + idx]))
+                     << (8 * idx);
+        }
+        m_offset += size;
+        return true;
+    }
+
+    bool get_bytes(std::string &value, size_t size) {
+        if (m_size - m_offset < size) {
+            return false;
+        }
+        value.assign(m_data + m_offset, size);
+        m_offset += size;
+        return true;
+    }
+
+    bool at_end() const { return m_offset == m_size; }
+
+  private:
+    const char *m_data;
+    size_t m_size;
+    size_t m_offset{0};
+};
+
+} // namespace
+
+bool scitokens::Validator::get_public_keys_from_db(
+    const std::string issuer, int64_t now,
+    std::shared_ptr<const picojson::value> &keys, int64_t &next_update,
+    internal::KeyCacheMetadata *metadata, bool *from_memory,
+    std::shared_ptr<const internal::KeyIndex> *index) {
+    auto use_entry = [&](const MemoryCache::Entry &entry) {
+        keys = entry.m_keys;
+        if (index) {
+            *index = entry.m_index;
+        }
+        next_update = entry.m_next_update;
+        if (metadata) {
+            *metadata = entry.m_metadata;
+        }
+        return true;
+    };
+
+    auto &stats = internal::Stats::get();
+    auto &memory = MemoryCache::get();
+    auto cached = memory.lookup(issuer, now);
+    if (cached && now <= cached->m_next_update) {
+        internal::Stats::add(stats.m_memory_hits);
+        if (from_memory) {
+            *from_memory = true;
+        }
+        return use_entry(*cached);
+    }
+    if (from_memory) {
+        *from_memory = false;
+    }
+
+    auto backend = internal::KeyCacheBackend::get();
+    std::string db_str;
+    switch (backend->lookup(issuer, now, db_str)) {
+    case internal::KeyCacheBackend::Lookup::FOUND:
+        break;
+    case internal::KeyCacheBackend::Lookup::MISSING:
+        memory.erase(issuer);
         return false;
-    } else {
-        // TODO: log error?
-        sqlite3_finalize(stmt);
-        sqlite3_close(db);
+    case internal::KeyCacheBackend::Lookup::UNAVAILABLE:
+        // Make do with what is in memory, if anything.
+        return cached && use_entry(*cached);
+    }
+
+    MemoryCache::Entry entry;
+    if (!parse_cache_row(db_str, now, entry)) {
+        memory.erase(issuer);
+        backend->invalidate(issuer);
         return false;
     }
+    memory.insert(issuer, entry);
+    return use_entry(entry);
 }
 
-bool scitokens::Validator::store_public_keys(const std::string &issuer,
-                                             const picojson::value &keys,
-                                             int64_t next_update,
-                                             int64_t expires) {
+bool scitokens::Validator::store_public_keys(
+    const std::string &issuer, std::shared_ptr<const picojson::value> keys,
+    int64_t next_update, int64_t expires,
+    const internal::KeyCacheMetadata &metadata) {
+    if (!keys) {
+        return false;
+    }
     picojson::object top_obj;
-    top_obj["jwks"] = keys;
+    top_obj["jwks"] = *keys;
     top_obj["next_update"] = picojson::value(next_update);
     top_obj["expires"] = picojson::value(expires);
+    if (!metadata.m_etag.empty()) {
+        top_obj["etag"] = picojson::value(metadata.m_etag);
+    }
+    if (!metadata.m_last_modified.empty()) {
+        top_obj["last_modified"] = picojson::value(metadata.m_last_modified);
+    }
+    if (!metadata.m_jwks_uri.empty()) {
+        top_obj["jwks_uri"] = picojson::value(metadata.m_jwks_uri);
+        top_obj["jwks_uri_expires"] =
+            picojson::value(metadata.m_jwks_uri_expires);
+    }
+    if (!metadata.m_metadata_url.empty()) {
+        top_obj["metadata_url"] = picojson::value(metadata.m_metadata_url);
+    }
     picojson::value db_value(top_obj);
     std::string db_str = db_value.serialize();
 
-    auto cache_fname = get_cache_file();
-    if (cache_fname.size() == 0) {
+    // Revalidated keys (e.g., after a 304) are the very same object as the
+    // cached ones; their parsed form stays valid.
+    auto &memory = MemoryCache::get();
+    auto cached = memory.lookup(issuer, std::time(NULL));
+    bool unchanged = cached && cached->m_keys == keys;
+
+    if (!internal::KeyCacheBackend::get()->store(issuer, db_str, expires)) {
         return false;
     }
 
-    sqlite3 *db;
-    int rc = sqlite3_open(cache_fname.c_str(), &db);
-    if (rc) {
-        sqlite3_close(db);
-        return false;
+    MemoryCache::Entry entry;
+    if (unchanged && cached->m_index) {
+        entry.m_index = cached->m_index;
+    } else {
+        entry.m_index = std::make_shared<const internal::KeyIndex>(keys);
     }
+    entry.m_keys = std::move(keys);
+    entry.m_next_update = next_update;
+    entry.m_expires = expires;
+    entry.m_metadata = metadata;
+    memory.insert(issuer, std::move(entry));
 
-    sqlite3_exec(db, "BEGIN", 0, 0, 0);
+    if (!unchanged) {
+        // Any parsed keys for this issuer may no longer be published, and
+        // key IDs it did not publish may be now.
+        scitokens::internal::VerifierCache::get().invalidate(issuer);
+        scitokens::internal::NegativeCache::get().forget_kids(issuer);
+    }
+    return true;
+}
 
-    remove_issuer_entry(db, issuer, false);
+std::shared_ptr<scitokens::internal::KeyCacheBackend>
+scitokens::internal::KeyCacheBackend::get() {
+    int generation = configurer::Configuration::get_cache_home_generation();
+    std::lock_guard<std::mutex> guard(backend_mutex);
+    if (!current_backend || backend_generation != generation) {
+        auto name = configurer::Configuration::get_keycache_backend();
+        if (name == "memcached") {
+            current_backend = make_memcached_backend(
+                configurer::Configuration::get_memcached_server());
+        } else if (name == "memory") {
+            current_backend = std::make_shared<MemoryBackend>();
+        } else {
+            current_backend = std::make_shared<SqliteBackend>();
+        }
+        backend_generation = generation;
+    }
+    return current_backend;
+}
 
-    sqlite3_stmt *stmt;
-    rc = sqlite3_prepare_v2(db, "INSERT INTO keycache VALUES (?, ?)", -1, &stmt,
-                            NULL);
-    if (rc != SQLITE_OK) {
-        sqlite3_close(db);
-        return false;
+size_t scitokens::Validator::export_keycache_bundle(const std::string &file) {
+    require_sqlite_backend();
+    auto secret = require_bundle_secret();
+    auto conn = get_connection();
+    if (!conn) {
+        throw std::runtime_error("The key cache is not available.");
+    }
+    auto rows = read_rows(*conn, std::time(NULL));
+    std::string bundle(bundle_magic, sizeof(bundle_magic));
+    put_le(bundle, rows.size(), 8);
+    for (const auto &row : rows) {
+        if (row.m_issuer.size() > UINT32_MAX || row.m_row.size() > UINT32_MAX) {
+            throw std::runtime_error("The key cache entry for " +
+                                     row.m_issuer + " is too large to bundle.");
+        }
+        put_le(bundle, row.m_issuer.size(), 4);
+        put_le(bundle, row.m_row.size(), 4);
+        bundle += row.m_issuer;
+        bundle += row.m_row;
     }
+    bundle += bundle_mac(*secret, bundle.data(), bundle.size());
 
-    if (sqlite3_bind_text(stmt, 1, issuer.c_str(), issuer.size(),
-                          SQLITE_STATIC) != SQLITE_OK) {
-        sqlite3_finalize(stmt);
-        sqlite3_close(db);
-        return false;
+    // Replace the file atomically, as for a snapshot.
+    std::string tmp_file = file + ".XXXXXX";
+    int fd = mkstemp(&tmp_file[0]);
+    if (fd < 0) {
+        throw std::runtime_error("Failed to write the key cache bundle to " +
+                                 file);
     }
+    size_t written = 0;
+    while (written < bundle.size()) {
+        auto rc = write(fd, bundle.data() + written, bundle.size() - written);
+        if (rc < 0 && errno == EINTR) {
+            continue;
+        } else if (rc <= 0) {
+            break;
+        }
+        written += rc;
+    }
+    bool ok = (close(fd) == 0) && written == bundle.size();
+    if (!ok || rename(tmp_file.c_str(), file.c_str()) != 0) {
+        unlink(tmp_file.c_str());
+        throw std::runtime_error("Failed to write the key cache bundle to " +
+                                 file);
+    }
+    return rows.size();
+}
 
-    if (sqlite3_bind_text(stmt, 2, db_str.c_str(), db_str.size(),
-                          SQLITE_STATIC) != SQLITE_OK) {
-        sqlite3_finalize(stmt);
-        sqlite3_close(db);
-        return false;
+size_t scitokens::Validator::import_keycache_bundle(const std::string &file) {
+    require_sqlite_backend();
+    auto secret = require_bundle_secret();
+    std::string bundle;
+    {
+        std::ifstream input(file, std::ios::binary);
+        if (!input) {
+            throw std::runtime_error("Failed to read the key cache bundle " +
+                                     file);
+        }
+        std::ostringstream contents;
+        contents << input.rdbuf();
+        bundle = contents.str();
+    }
+    auto invalid = [&]() {
+        return std::runtime_error("Not a valid key cache bundle: " + file);
+    };
+    if (bundle.size() < sizeof(bundle_magic) + 8 + bundle_mac_size ||
+        memcmp(bundle.data(), bundle_magic, sizeof(bundle_magic))) {
+        throw invalid();
+    }
+    auto signed_size = bundle.size() - bundle_mac_size;
+    if (CRYPTO_memcmp(bundle.data() + signed_size,
+                      bundle_mac(*secret, bundle.data(), signed_size).data(),
+                      bundle_mac_size) != 0) {
+        throw std::runtime_error("The key cache bundle " + file +
+                                 " was not made with this bundle secret.");
     }
 
-    rc = sqlite3_step(stmt);
-    if (rc != SQLITE_DONE) {
-        sqlite3_finalize(stmt);
-        sqlite3_close(db);
-        return false;
+    BundleReader reader(bundle.data() + sizeof(bundle_magic),
+                        signed_size - sizeof(bundle_magic));
+    auto now = std::time(NULL);
+    uint64_t count;
+    if (!reader.get_le(count, 8)) {
+        throw invalid();
+    }
+    std::vector<SnapshotRow> rows;
+    for (uint64_t idx = 0; idx < count; idx++) {
+        SnapshotRow row;
+        uint64_t issuer_size, row_size;
+        if (!reader.get_le(issuer_size, 4) || !reader.get_le(row_size, 4) ||
+            !reader.get_bytes(row.m_issuer, issuer_size) ||
+            !reader.get_bytes(row.m_row, row_size)) {
+            throw invalid();
+        }
+        // Entries that expired since the bundle was made are left out.
+        if (parse_cache_row(row.m_row, now, row.m_entry)) {
+            rows.push_back(std::move(row));
+        }
+    }
+    if (!reader.at_end()) {
+        throw invalid();
+    }
+
+    auto conn = get_connection();
+    if (!conn) {
+        throw std::runtime_error("The key cache is not available.");
+    }
+    auto &stats = internal::Stats::get();
+    internal::Stats::add(stats.m_sqlite_writes);
+    internal::ScopedLatency timer(stats.m_sqlite_write_us);
+    if (begin_immediate(conn->m_db) != SQLITE_OK) {
+        throw std::runtime_error("Failed to lock the key cache for writing.");
+    }
+    for (const auto &row : rows) {
+        StatementReset reset(conn->m_insert);
+        if ((sqlite3_bind_text(conn->m_insert, 1, row.m_issuer.c_str(),
+                               row.m_issuer.size(),
+                               SQLITE_STATIC) != SQLITE_OK) ||
+            (sqlite3_bind_text(conn->m_insert, 2, row.m_row.c_str(),
+                               row.m_row.size(), SQLITE_STATIC) != SQLITE_OK) ||
+            (sqlite3_step(conn->m_insert) != SQLITE_DONE)) {
+            sqlite3_exec(conn->m_db, "ROLLBACK", 0, 0, 0);
+            throw std::runtime_error("Failed to store the JWKS for " +
+                                     row.m_issuer);
+        }
+        if (!store_usage(*conn, row.m_issuer, row.m_entry.m_expires, now)) {
+            sqlite3_exec(conn->m_db, "ROLLBACK", 0, 0, 0);
+            throw std::runtime_error("Failed to store the JWKS for " +
+                                     row.m_issuer);
+        }
+    }
+    PendingSnapshot snapshot(*conn);
+    if (configurer::Configuration::get_keycache_snapshot()) {
+        snapshot.prepare(*conn, now);
     }
+    if (exec_with_retry(conn->m_db, "COMMIT") != SQLITE_OK) {
+        sqlite3_exec(conn->m_db, "ROLLBACK", 0, 0, 0);
+        throw std::runtime_error("Failed to commit the key cache bundle.");
+    }
+    snapshot.publish();
 
-    sqlite3_exec(db, "COMMIT", 0, 0, 0);
+    auto &memory = MemoryCache::get();
+    for (auto &row : rows) {
+        memory.insert(row.m_issuer, std::move(row.m_entry));
+        internal::VerifierCache::get().invalidate(row.m_issuer);
+        internal::NegativeCache::get().forget_kids(row.m_issuer);
+    }
+    return rows.size();
+}
 
-    sqlite3_finalize(stmt);
-    sqlite3_close(db);
-    return true;
+size_t scitokens::Validator::compact_keycache() {
+    return internal::KeyCacheBackend::get()->compact(std::time(NULL));
 }
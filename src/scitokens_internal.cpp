@@ -1,17 +1,27 @@
 
+#include <algorithm>
+#include <fcntl.h>
+#include <fstream>
 #include <functional>
+#include <map>
 #include <memory>
+#include <netdb.h>
+#include <poll.h>
+#include <sched.h>
 #include <sstream>
 #include <sys/stat.h>
+#include <unistd.h>
 
 #include <jwt-cpp/base.h>
 #include <jwt-cpp/jwt.h>
 #include <openssl/bn.h>
+#include <openssl/crypto.h>
 #include <openssl/ec.h>
+#include <openssl/evp.h>
+#include <openssl/hmac.h>
 #include <picojson/picojson.h>
 
 #if OPENSSL_VERSION_NUMBER >= 0x30000000L
-#include <openssl/evp.h>
 #include <openssl/param_build.h>
 #endif
 #define EC_NAME NID_X9_62_prime256v1
@@ -31,19 +41,441 @@ struct CurlRaii {
 
 CurlRaii myCurl;
 
+/**
+ * Process-wide curl share handle, so fetches to the same host reuse DNS
+ * lookups, open connections and TLS sessions instead of starting over with
+ * every AsyncStatus.  Must be declared after myCurl so it is torn down
+ * before curl_global_cleanup.
+ */
+class CurlShare {
+  public:
+    CurlShare() : m_share(curl_share_init()) {
+        if (!m_share) {
+            return;
+        }
+        curl_share_setopt(m_share, CURLSHOPT_LOCKFUNC, &lock);
+        curl_share_setopt(m_share, CURLSHOPT_UNLOCKFUNC, &unlock);
+        curl_share_setopt(m_share, CURLSHOPT_USERDATA, this);
+        curl_share_setopt(m_share, CURLSHOPT_SHARE, CURL_LOCK_DATA_DNS);
+        curl_share_setopt(m_share, CURLSHOPT_SHARE, CURL_LOCK_DATA_SSL_SESSION);
+#if LIBCURL_VERSION_NUM >= 0x073900
+        curl_share_setopt(m_share, CURLSHOPT_SHARE, CURL_LOCK_DATA_CONNECT);
+#endif
+    }
+
+    ~CurlShare() {
+        if (m_share) {
+            curl_share_cleanup(m_share);
+        }
+    }
+
+    CURLSH *get() const { return m_share; }
+
+  private:
+    static void lock(CURL *, curl_lock_data data, curl_lock_access,
+                     void *userptr) {
+        reinterpret_cast<CurlShare *>(userptr)->m_mutexes[data].lock();
+    }
+
+    static void unlock(CURL *, curl_lock_data data, void *userptr) {
+        reinterpret_cast<CurlShare *>(userptr)->m_mutexes[data].unlock();
+    }
+
+    CURLSH *m_share;
+    std::mutex m_mutexes[CURL_LOCK_DATA_LAST];
+};
+
+CurlShare myCurlShare;
+
+/**
+ * The addresses issuer hosts resolve to, kept as long as curl keeps its own
+ * entries ("fetch.dns_cache_timeout_s"), so a hedged request can be sent to
+ * a front-end other than the one the first request went to.  The transfers
+ * themselves resolve through the DNS cache in myCurlShare.  Lookups never
+ * block: hosts that aren't cached are resolved by a background thread, so
+ * getaddrinfo never runs inside a perform_continue.
+ */
+class DnsCache {
+  public:
+    ~DnsCache() {
+        {
+            std::lock_guard<std::mutex> guard(m_mutex);
+            m_shutdown = true;
+        }
+        m_cond.notify_all();
+        if (m_thread.joinable()) {
+            m_thread.join();
+        }
+    }
+
+    // Numeric addresses of `host` if they are cached; otherwise empty, and
+    // `host` is queued to be resolved.
+    std::vector<std::string> lookup(const std::string &host) {
+        std::lock_guard<std::mutex> guard(m_mutex);
+        auto iter = m_entries.find(host);
+        if (iter != m_entries.end() && iter->second.m_expires > time(NULL)) {
+            return iter->second.m_addresses;
+        }
+        if (m_shutdown || m_pending.size() >= max_entries ||
+            std::find(m_pending.begin(), m_pending.end(), host) !=
+                m_pending.end()) {
+            return std::vector<std::string>();
+        }
+        m_pending.push_back(host);
+        if (!m_thread.joinable()) {
+            m_thread = std::thread(&DnsCache::run, this);
+        }
+        m_cond.notify_one();
+        return std::vector<std::string>();
+    }
+
+  private:
+    static constexpr size_t max_entries = 1024;
+
+    struct Entry {
+        std::vector<std::string> m_addresses;
+        time_t m_expires{0};
+    };
+
+    static std::vector<std::string> resolve(const std::string &host) {
+        std::vector<std::string> addresses;
+        struct addrinfo hints = {};
+        hints.ai_family = AF_UNSPEC;
+        hints.ai_socktype = SOCK_STREAM;
+        struct addrinfo *result = nullptr;
+        if (getaddrinfo(host.c_str(), nullptr, &hints, &result) != 0) {
+            return addresses;
+        }
+        for (auto addr = result; addr; addr = addr->ai_next) {
+            char name[NI_MAXHOST];
+            if (getnameinfo(addr->ai_addr, addr->ai_addrlen, name,
+                            sizeof(name), nullptr, 0, NI_NUMERICHOST) == 0 &&
+                std::find(addresses.begin(), addresses.end(), name) ==
+                    addresses.end()) {
+                addresses.emplace_back(name);
+            }
+        }
+        freeaddrinfo(result);
+        return addresses;
+    }
+
+    void run() {
+        std::unique_lock<std::mutex> lock(m_mutex);
+        while (true) {
+            m_cond.wait(lock,
+                        [&] { return m_shutdown || !m_pending.empty(); });
+            if (m_shutdown) {
+                return;
+            }
+            auto host = m_pending.front();
+            lock.unlock();
+            auto addresses = resolve(host);
+            lock.lock();
+            m_pending.pop_front();
+            // Hosts come from token issuers, so don't let them pile up.
+            if (m_entries.size() >= max_entries) {
+                m_entries.clear();
+            }
+            auto &entry = m_entries[host];
+            entry.m_addresses = std::move(addresses);
+            entry.m_expires =
+                time(NULL) +
+                configurer::Configuration::get_fetch_dns_cache_timeout();
+        }
+    }
+
+    std::mutex m_mutex;
+    std::condition_variable m_cond;
+    std::thread m_thread;
+    bool m_shutdown{false};
+    std::deque<std::string> m_pending;
+    std::unordered_map<std::string, Entry> m_entries;
+};
+
+DnsCache myDnsCache;
+
+// Split an http(s) URL's authority into the host as written (IPv6
+// literals keep their brackets) and the port.
+bool split_url_authority(const std::string &url, std::string &host,
+                         std::string &port) {
+    auto scheme_end = url.find("://");
+    if (scheme_end == std::string::npos) {
+        return false;
+    }
+    auto start = scheme_end + 3;
+    auto end = url.find_first_of("/?#", start);
+    auto authority = url.substr(
+        start, end == std::string::npos ? std::string::npos : end - start);
+    auto at = authority.rfind('@');
+    if (at != std::string::npos) {
+        authority.erase(0, at + 1);
+    }
+    auto colon = authority.rfind(':');
+    if (colon != std::string::npos &&
+        authority.find(']', colon) == std::string::npos) {
+        host = authority.substr(0, colon);
+        port = authority.substr(colon + 1);
+    } else {
+        host = authority;
+        port = url.compare(0, scheme_end, "http") == 0 ? "80" : "443";
+    }
+    return !host.empty();
+}
+
+// The host as getaddrinfo wants it, without an IPv6 literal's brackets.
+std::string bare_host(const std::string &host) {
+    if (host.size() > 1 && host.front() == '[' && host.back() == ']') {
+        return host.substr(1, host.size() - 2);
+    }
+    return host;
+}
+
+bool is_dot(const char *data, size_t len) {
+    return len == 1 && data[0] == '.';
+}
+
+bool is_dot_dot(const char *data, size_t len) {
+    return len == 2 && data[0] == '.' && data[1] == '.';
+}
+
 } // namespace
 
 namespace scitokens {
 
 namespace internal {
 
-SimpleCurlGet::GetStatus SimpleCurlGet::perform_start(const std::string &url) {
-    m_len = 0;
-
+FetchContext::FetchContext() : m_curl_multi(nullptr, &curl_multi_cleanup) {
     m_curl_multi.reset(curl_multi_init());
     if (!m_curl_multi) {
         throw CurlException("Failed to create a new curl async handle.");
     }
+    if (curl_multi_setopt(m_curl_multi.get(), CURLMOPT_SOCKETFUNCTION,
+                          &socket_callback) != CURLM_OK ||
+        curl_multi_setopt(m_curl_multi.get(), CURLMOPT_SOCKETDATA, this) !=
+            CURLM_OK ||
+        curl_multi_setopt(m_curl_multi.get(), CURLMOPT_TIMERFUNCTION,
+                          &timer_callback) != CURLM_OK ||
+        curl_multi_setopt(m_curl_multi.get(), CURLMOPT_TIMERDATA, this) !=
+            CURLM_OK) {
+        throw CurlException("Failed to set curl async callbacks.");
+    }
+}
+
+void FetchContext::add(CURL *easy) {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_results.erase(easy);
+    auto mres = curl_multi_add_handle(m_curl_multi.get(), easy);
+    if (mres) {
+        throw CurlException("Failed to add curl handle to async object");
+    }
+}
+
+void FetchContext::remove(CURL *easy) {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    // A no-op for transfers that already finished.
+    curl_multi_remove_handle(m_curl_multi.get(), easy);
+    m_results.erase(easy);
+}
+
+void FetchContext::drive() {
+    std::unique_lock<std::mutex> lock(m_mutex);
+    // Hosts using the fd_set interface (or none at all) don't tell us which
+    // sockets are ready, so look for ourselves.
+    if (m_ready_sockets.empty() && !m_timer_fired) {
+        poll_sockets(0, lock);
+    }
+    std::vector<std::pair<curl_socket_t, int>> ready;
+    ready.swap(m_ready_sockets);
+    int running;
+    for (const auto &entry : ready) {
+        auto resm = curl_multi_socket_action(m_curl_multi.get(), entry.first,
+                                             entry.second, &running);
+        if (resm) {
+            throw CurlException(curl_multi_strerror(resm));
+        }
+    }
+    if (m_timer_fired ||
+        (m_has_timer &&
+         std::chrono::steady_clock::now() >= m_timer_deadline)) {
+        m_timer_fired = false;
+        m_has_timer = false;
+        auto resm = curl_multi_socket_action(
+            m_curl_multi.get(), CURL_SOCKET_TIMEOUT, 0, &running);
+        if (resm) {
+            throw CurlException(curl_multi_strerror(resm));
+        }
+    }
+
+    CURLMsg *msg;
+    do {
+        int msgq = 0;
+        msg = curl_multi_info_read(m_curl_multi.get(), &msgq);
+        if (msg && (msg->msg == CURLMSG_DONE)) {
+            CURL *easy_handle = msg->easy_handle;
+            m_results[easy_handle] = msg->data.result;
+            curl_multi_remove_handle(m_curl_multi.get(), easy_handle);
+        }
+    } while (msg);
+}
+
+void FetchContext::wait(long timeout_ms) {
+    {
+        std::unique_lock<std::mutex> lock(m_mutex);
+        long timer_ms = get_timer_ms_locked();
+        if (timer_ms >= 0 && timer_ms < timeout_ms) {
+            timeout_ms = timer_ms;
+        }
+        if (m_ready_sockets.empty() && !m_timer_fired) {
+            poll_sockets(timeout_ms, lock);
+        }
+    }
+    drive();
+}
+
+bool FetchContext::get_result(CURL *easy, CURLcode &result) const {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    auto iter = m_results.find(easy);
+    if (iter == m_results.end()) {
+        return false;
+    }
+    result = iter->second;
+    return true;
+}
+
+std::vector<FetchContext::SocketInterest> FetchContext::get_sockets() const {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return m_sockets;
+}
+
+long FetchContext::get_timer_ms() const {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return get_timer_ms_locked();
+}
+
+void FetchContext::socket_ready(curl_socket_t fd, int events) {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_ready_sockets.emplace_back(fd, events);
+}
+
+void FetchContext::timer_fired() {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_timer_fired = true;
+}
+
+long FetchContext::get_timer_ms_locked() const {
+    if (!m_has_timer) {
+        return -1;
+    }
+    auto remaining = std::chrono::duration_cast<std::chrono::milliseconds>(
+                         m_timer_deadline - std::chrono::steady_clock::now())
+                         .count();
+    return remaining > 0 ? remaining : 0;
+}
+
+void FetchContext::poll_sockets(long timeout_ms,
+                                std::unique_lock<std::mutex> &lock) {
+    std::vector<struct pollfd> fds;
+    fds.reserve(m_sockets.size());
+    for (const auto &sock : m_sockets) {
+        struct pollfd pfd;
+        pfd.fd = sock.m_fd;
+        pfd.events = 0;
+        pfd.revents = 0;
+        if (sock.m_events & CURL_POLL_IN) {
+            pfd.events |= POLLIN;
+        }
+        if (sock.m_events & CURL_POLL_OUT) {
+            pfd.events |= POLLOUT;
+        }
+        fds.push_back(pfd);
+    }
+    if (fds.empty() && timeout_ms <= 0) {
+        return;
+    }
+    // Don't hold up the other users of the context while we wait.
+    lock.unlock();
+    int rv = poll(fds.empty() ? nullptr : &fds[0], fds.size(), timeout_ms);
+    lock.lock();
+    if (rv <= 0) {
+        return;
+    }
+    for (const auto &pfd : fds) {
+        int events = 0;
+        if (pfd.revents & (POLLIN | POLLHUP)) {
+            events |= CURL_CSELECT_IN;
+        }
+        if (pfd.revents & POLLOUT) {
+            events |= CURL_CSELECT_OUT;
+        }
+        if (pfd.revents & (POLLERR | POLLNVAL)) {
+            events |= CURL_CSELECT_ERR;
+        }
+        if (events) {
+            m_ready_sockets.emplace_back(pfd.fd, events);
+        }
+    }
+}
+
+int FetchContext::socket_callback(CURL *, curl_socket_t fd, int what,
+                                  void *userp, void *) {
+    auto me = reinterpret_cast<FetchContext *>(userp);
+    auto iter = std::find_if(
+        me->m_sockets.begin(), me->m_sockets.end(),
+        [fd](const SocketInterest &sock) { return sock.m_fd == fd; });
+    if (what == CURL_POLL_REMOVE) {
+        if (iter != me->m_sockets.end()) {
+            me->m_sockets.erase(iter);
+        }
+    } else if (iter != me->m_sockets.end()) {
+        iter->m_events = what;
+    } else {
+        me->m_sockets.push_back(SocketInterest{fd, what});
+    }
+    return 0;
+}
+
+int FetchContext::timer_callback(CURLM *, long timeout_ms, void *userp) {
+    auto me = reinterpret_cast<FetchContext *>(userp);
+    if (timeout_ms < 0) {
+        me->m_has_timer = false;
+    } else {
+        me->m_has_timer = true;
+        me->m_timer_deadline = std::chrono::steady_clock::now() +
+                               std::chrono::milliseconds(timeout_ms);
+    }
+    return 0;
+}
+
+void SimpleCurlGet::set_conditional(const std::string &etag,
+                                    const std::string &last_modified) {
+    m_etag = etag;
+    m_last_modified = last_modified;
+    curl_slist *headers = nullptr;
+    if (!etag.empty()) {
+        headers =
+            curl_slist_append(headers, ("If-None-Match: " + etag).c_str());
+    }
+    if (!last_modified.empty()) {
+        headers = curl_slist_append(
+            headers, ("If-Modified-Since: " + last_modified).c_str());
+    }
+    m_headers.reset(headers);
+}
+
+SimpleCurlGet::GetStatus SimpleCurlGet::perform_start(const std::string &url) {
+    m_len = 0;
+    m_cache_headers = CacheHeaders();
+    m_url = url;
+    m_started = std::chrono::steady_clock::now();
+    m_hedge.reset();
+    m_hedge_started = false;
+
+    if (!m_context) {
+        m_context = std::make_shared<FetchContext>();
+    }
+    if (m_curl) {
+        m_context->remove(m_curl.get());
+    }
     m_curl.reset(curl_easy_init());
     if (!m_curl) {
         throw CurlException("Failed to create a new curl handle.");
@@ -56,12 +488,26 @@ SimpleCurlGet::GetStatus SimpleCurlGet::perform_start(const std::string &url) {
         }
     }
 
-    long timeout = m_timeout > 120 ? 120 : m_timeout;
+    long timeout_ms = 1000L * (m_timeout > 120 ? 120 : m_timeout);
+    long total_timeout_ms =
+        configurer::Configuration::get_fetch_total_timeout();
+    if (total_timeout_ms > 0 && total_timeout_ms < timeout_ms) {
+        timeout_ms = total_timeout_ms;
+    }
 
     CURLcode rv = curl_easy_setopt(m_curl.get(), CURLOPT_URL, url.c_str());
     if (rv != CURLE_OK) {
         throw CurlException("Failed to set CURLOPT_URL.");
     }
+    // Lets curl refuse an oversized response from its Content-Length alone;
+    // write_data enforces the limit on responses without one.
+    if (m_maxbytes > 0) {
+        rv = curl_easy_setopt(m_curl.get(), CURLOPT_MAXFILESIZE,
+                              static_cast<long>(m_maxbytes));
+        if (rv != CURLE_OK) {
+            throw CurlException("Failed to set CURLOPT_MAXFILESIZE.");
+        }
+    }
     rv = curl_easy_setopt(m_curl.get(), CURLOPT_WRITEFUNCTION, &write_data);
     if (rv != CURLE_OK) {
         throw CurlException("Failed to set CURLOPT_WRITEFUNCTION.");
@@ -70,59 +516,109 @@ SimpleCurlGet::GetStatus SimpleCurlGet::perform_start(const std::string &url) {
     if (rv != CURLE_OK) {
         throw CurlException("Failed to set CURLOPT_WRITEDATA.");
     }
-    rv = curl_easy_setopt(m_curl.get(), CURLOPT_TIMEOUT, timeout);
+    rv = curl_easy_setopt(m_curl.get(), CURLOPT_HEADERFUNCTION, &header_data);
     if (rv != CURLE_OK) {
-        throw CurlException("Failed to set CURLOPT_TIMEOUT.");
+        throw CurlException("Failed to set CURLOPT_HEADERFUNCTION.");
     }
-
-    {
-        auto mres = curl_multi_add_handle(m_curl_multi.get(), m_curl.get());
-        if (mres) {
-            throw CurlException("Failed to add curl handle to async object");
+    rv = curl_easy_setopt(m_curl.get(), CURLOPT_HEADERDATA, this);
+    if (rv != CURLE_OK) {
+        throw CurlException("Failed to set CURLOPT_HEADERDATA.");
+    }
+    if (m_headers) {
+        rv = curl_easy_setopt(m_curl.get(), CURLOPT_HTTPHEADER,
+                              m_headers.get());
+        if (rv != CURLE_OK) {
+            throw CurlException("Failed to set CURLOPT_HTTPHEADER.");
+        }
+    }
+    if (myCurlShare.get()) {
+        rv = curl_easy_setopt(m_curl.get(), CURLOPT_SHARE, myCurlShare.get());
+        if (rv != CURLE_OK) {
+            throw CurlException("Failed to set CURLOPT_SHARE.");
+        }
+    }
+    rv = curl_easy_setopt(m_curl.get(), CURLOPT_TIMEOUT_MS, timeout_ms);
+    if (rv != CURLE_OK) {
+        throw CurlException("Failed to set CURLOPT_TIMEOUT_MS.");
+    }
+    long connect_timeout_ms =
+        configurer::Configuration::get_fetch_connect_timeout();
+    if (connect_timeout_ms > 0) {
+        rv = curl_easy_setopt(m_curl.get(), CURLOPT_CONNECTTIMEOUT_MS,
+                              connect_timeout_ms);
+        if (rv != CURLE_OK) {
+            throw CurlException("Failed to set CURLOPT_CONNECTTIMEOUT_MS.");
+        }
+    }
+    rv = curl_easy_setopt(
+        m_curl.get(), CURLOPT_DNS_CACHE_TIMEOUT,
+        static_cast<long>(
+            configurer::Configuration::get_fetch_dns_cache_timeout()));
+    if (rv != CURLE_OK) {
+        throw CurlException("Failed to set CURLOPT_DNS_CACHE_TIMEOUT.");
+    }
+    if (m_is_hedge) {
+        rv = curl_easy_setopt(m_curl.get(), CURLOPT_FRESH_CONNECT, 1L);
+        if (rv != CURLE_OK) {
+            throw CurlException("Failed to set CURLOPT_FRESH_CONNECT.");
+        }
+        if (m_connect_to) {
+            rv = curl_easy_setopt(m_curl.get(), CURLOPT_CONNECT_TO,
+                                  m_connect_to.get());
+            if (rv != CURLE_OK) {
+                throw CurlException("Failed to set CURLOPT_CONNECT_TO.");
+            }
+        }
+    }
+    auto ca_file = configurer::Configuration::get_tls_ca_file();
+    if (!ca_file.empty()) {
+        rv = curl_easy_setopt(m_curl.get(), CURLOPT_CAINFO, ca_file.c_str());
+        if (rv != CURLE_OK) {
+            throw CurlException("Failed to set CURLOPT_CAINFO.");
         }
     }
 
+    // Have the issuer's other addresses ready by the time a hedge starts.
+    std::string host, port;
+    if (!m_is_hedge &&
+        configurer::Configuration::get_fetch_hedge_delay() > 0 &&
+        split_url_authority(url, host, port)) {
+        myDnsCache.lookup(bare_host(host));
+    }
+
+    m_context->add(m_curl.get());
+
     return perform_continue();
 }
 
 SimpleCurlGet::GetStatus SimpleCurlGet::perform_continue() {
-    int still_running;
-    auto resm = curl_multi_perform(m_curl_multi.get(), &still_running);
-    if (!resm && still_running) {
-        resm = curl_multi_timeout(m_curl_multi.get(), &m_timeout_ms);
-        if (resm) {
-            throw CurlException(curl_multi_strerror(resm));
+    m_context->drive();
+    CURLcode res;
+    bool done = m_context->get_result(m_curl.get(), res);
+    if (m_hedge) {
+        CURLcode hedge_res;
+        bool hedge_done =
+            m_context->get_result(m_hedge->m_curl.get(), hedge_res);
+        if (done && res == CURLE_OK) {
+            m_hedge.reset();
+        } else if (hedge_done && hedge_res == CURLE_OK) {
+            adopt_hedge();
+            done = true;
+            res = CURLE_OK;
+        } else if (hedge_done) {
+            m_hedge.reset();
+        } else if (done) {
+            // The first request failed; the hedge may yet succeed.
+            done = false;
         }
-        if (m_timeout_ms < 0) {
-            m_timeout_ms = 100;
-        }
-        FD_ZERO(m_read_fd_set);
-        FD_ZERO(m_write_fd_set);
-        FD_ZERO(m_exc_fd_set);
-        resm = curl_multi_fdset(m_curl_multi.get(), m_read_fd_set,
-                                m_write_fd_set, m_exc_fd_set, &m_max_fd);
-        if (resm) {
-            throw CurlException(curl_multi_strerror(resm));
+    }
+    if (!done) {
+        if (get_hedge_wait_ms() == 0) {
+            start_hedge();
         }
-        if (m_max_fd < 0)
-            m_timeout_ms = 100;
+        update_fd_sets();
         return GetStatus();
     }
-    if (resm) {
-        throw CurlException(curl_multi_strerror(resm));
-    }
-
-    CURLMsg *msg;
-    CURLcode res = static_cast<CURLcode>(-1);
-    do {
-        int msgq = 0;
-        msg = curl_multi_info_read(m_curl_multi.get(), &msgq);
-        if (msg && (msg->msg == CURLMSG_DONE)) {
-            CURL *easy_handle = msg->easy_handle;
-            res = msg->data.result;
-            curl_multi_remove_handle(m_curl_multi.get(), easy_handle);
-        }
-    } while (msg);
     if (res) {
         throw CurlException(curl_easy_strerror(res));
     }
@@ -138,6 +634,108 @@ SimpleCurlGet::GetStatus SimpleCurlGet::perform_continue() {
     return status;
 }
 
+long SimpleCurlGet::get_hedge_wait_ms() const {
+    long delay_ms = configurer::Configuration::get_fetch_hedge_delay();
+    if (m_is_hedge || m_hedge_started || delay_ms <= 0 || !m_curl) {
+        return -1;
+    }
+    auto elapsed_ms = std::chrono::duration_cast<std::chrono::milliseconds>(
+                          std::chrono::steady_clock::now() - m_started)
+                          .count();
+    return elapsed_ms >= delay_ms ? 0 : delay_ms - elapsed_ms;
+}
+
+void SimpleCurlGet::start_hedge() {
+    m_hedge_started = true;
+
+    std::unique_ptr<SimpleCurlGet> hedge(
+        new SimpleCurlGet(m_maxbytes, m_timeout, m_context));
+    hedge->m_is_hedge = true;
+    if (!m_etag.empty() || !m_last_modified.empty()) {
+        hedge->set_conditional(m_etag, m_last_modified);
+    }
+    // Send the hedge to the first address the first request isn't using;
+    // with no other address, a fresh connection still gets around a stalled
+    // one.
+    std::string host, port;
+    if (split_url_authority(m_url, host, port)) {
+        const char *primary_ip = nullptr;
+        if (curl_easy_getinfo(m_curl.get(), CURLINFO_PRIMARY_IP,
+                              &primary_ip) != CURLE_OK ||
+            !primary_ip) {
+            primary_ip = "";
+        }
+        for (const auto &address : myDnsCache.lookup(bare_host(host))) {
+            if (address == primary_ip) {
+                continue;
+            }
+            auto target = address.find(':') == std::string::npos
+                              ? address
+                              : "[" + address + "]";
+            hedge->m_connect_to.reset(curl_slist_append(
+                nullptr,
+                (host + ":" + port + ":" + target + ":" + port).c_str()));
+            break;
+        }
+    }
+    // The hedge is an optimization; if it can't be started, the first
+    // request carries on alone.
+    try {
+        hedge->perform_start(m_url);
+    } catch (const std::exception &) {
+        return;
+    }
+    internal::Stats::add(internal::Stats::get().m_fetch_hedges);
+    m_hedge = std::move(hedge);
+}
+
+void SimpleCurlGet::adopt_hedge() {
+    std::swap(m_curl, m_hedge->m_curl);
+    std::swap(m_data, m_hedge->m_data);
+    std::swap(m_len, m_hedge->m_len);
+    std::swap(m_cache_headers, m_hedge->m_cache_headers);
+    // Takes the first request, now the hedge's, off the context.
+    m_hedge.reset();
+    internal::Stats::add(internal::Stats::get().m_fetch_hedge_wins);
+}
+
+void SimpleCurlGet::update_fd_sets() {
+    m_timeout_ms = m_context->get_timer_ms();
+    if (m_timeout_ms < 0) {
+        m_timeout_ms = 100;
+    }
+    auto hedge_ms = get_hedge_wait_ms();
+    if (hedge_ms >= 0 && hedge_ms < m_timeout_ms) {
+        m_timeout_ms = hedge_ms;
+    }
+    FD_ZERO(&m_read_fd_set);
+    FD_ZERO(&m_write_fd_set);
+    FD_ZERO(&m_exc_fd_set);
+    m_max_fd = -1;
+    bool unrepresentable = false;
+    for (const auto &sock : m_context->get_sockets()) {
+        if (sock.m_fd >= FD_SETSIZE) {
+            unrepresentable = true;
+            continue;
+        }
+        if (sock.m_events & CURL_POLL_IN) {
+            FD_SET(sock.m_fd, &m_read_fd_set);
+        }
+        if (sock.m_events & CURL_POLL_OUT) {
+            FD_SET(sock.m_fd, &m_write_fd_set);
+        }
+        FD_SET(sock.m_fd, &m_exc_fd_set);
+        if (sock.m_fd > m_max_fd) {
+            m_max_fd = sock.m_fd;
+        }
+    }
+    // Without a socket to select() on, fall back to polling as
+    // curl_multi_fdset() suggests.
+    if ((m_max_fd < 0 || unrepresentable) && m_timeout_ms > 100) {
+        m_timeout_ms = 100;
+    }
+}
+
 int SimpleCurlGet::perform(const std::string &url, time_t expiry_time) {
     GetStatus status = perform_start(url);
     while (!status.m_done) {
@@ -151,7 +749,7 @@ int SimpleCurlGet::perform(const std::string &url, time_t expiry_time) {
         timeout.tv_sec = timeout_ms / 1000;
         timeout.tv_usec = (timeout_ms % 1000) * 1000;
         // Return value of select is ignored; curl will take care of it.
-        select(m_max_fd + 1, m_read_fd_set, m_write_fd_set, m_exc_fd_set,
+        select(m_max_fd + 1, &m_read_fd_set, &m_write_fd_set, &m_exc_fd_set,
                &timeout);
         status = perform_continue();
     }
@@ -166,161 +764,1639 @@ void SimpleCurlGet::get_data(char *&buffer, size_t &len) {
 size_t SimpleCurlGet::write_data(void *buffer, size_t size, size_t nmemb,
                                  void *userp) {
     SimpleCurlGet *myself = reinterpret_cast<SimpleCurlGet *>(userp);
-    size_t new_data = size * nmemb;
-    size_t new_length = myself->m_len + new_data;
+    // An exception must not unwind through curl; failing to allocate
+    // aborts the transfer instead.
+    try {
+        size_t new_data = size * nmemb;
+        size_t new_length = myself->m_len + new_data;
+
+        if (myself->m_maxbytes > 0 &&
+            (new_length > static_cast<size_t>(myself->m_maxbytes))) {
+            return 0;
+        }
+        if (myself->m_data.size() < new_length) {
+            myself->m_data.resize(new_length);
+        }
+        memcpy(&(myself->m_data[myself->m_len]), buffer, new_data);
+        myself->m_len = new_length;
+        return new_data;
+    } catch (...) {
+        return 0;
+    }
+}
+
+size_t SimpleCurlGet::header_data(char *buffer, size_t size, size_t nitems,
+                                  void *userp) {
+    SimpleCurlGet *myself = reinterpret_cast<SimpleCurlGet *>(userp);
+    // As in write_data.
+    try {
+        size_t len = size * nitems;
+        std::string line(buffer, len);
+        while (!line.empty() && (line.back() == '\r' || line.back() == '\n')) {
+            line.pop_back();
+        }
 
-    if (myself->m_maxbytes > 0 &&
-        (new_length > static_cast<size_t>(myself->m_maxbytes))) {
+        // A new status line starts a new response (e.g., after a redirect).
+        if (line.compare(0, 5, "HTTP/") == 0) {
+            myself->m_cache_headers = CacheHeaders();
+            return len;
+        }
+        auto colon = line.find(':');
+        if (colon == std::string::npos) {
+            return len;
+        }
+        std::string name;
+        std::transform(line.begin(), line.begin() + colon,
+                       std::back_inserter(name), ::tolower);
+        auto value_start = line.find_first_not_of(" \t", colon + 1);
+        std::string value =
+            value_start == std::string::npos ? "" : line.substr(value_start);
+
+        auto &headers = myself->m_cache_headers;
+        if (name == "cache-control") {
+            std::istringstream directives(value);
+            std::string directive;
+            while (std::getline(directives, directive, ',')) {
+                auto start = directive.find_first_not_of(" \t");
+                if (start == std::string::npos) {
+                    continue;
+                }
+                directive = directive.substr(start);
+                std::transform(directive.begin(), directive.end(),
+                               directive.begin(), ::tolower);
+                if (directive.compare(0, 8, "max-age=") == 0) {
+                    auto digits = directive.substr(8);
+                    if (!digits.empty() && digits.front() == '"') {
+                        digits.erase(0, 1);
+                    }
+                    char *end = nullptr;
+                    auto max_age = strtol(digits.c_str(), &end, 10);
+                    if (end != digits.c_str() && max_age >= 0) {
+                        headers.m_max_age = max_age;
+                    }
+                } else if (directive.compare(0, 8, "no-cache") == 0 ||
+                           directive.compare(0, 8, "no-store") == 0) {
+                    headers.m_max_age = 0;
+                    break;
+                }
+            }
+        } else if (name == "expires") {
+            // Invalid dates (e.g., "0") mean the response is already stale.
+            auto expires = curl_getdate(value.c_str(), nullptr);
+            headers.m_expires = expires < 0 ? 0 : expires;
+        } else if (name == "date") {
+            headers.m_date = curl_getdate(value.c_str(), nullptr);
+        } else if (name == "content-length") {
+            // Size the buffer once rather than growing it chunk by chunk.
+            // The header is the issuer's word, so never reserve more than
+            // max_reserve up front; write_data grows the buffer past it.
+            char *end = nullptr;
+            auto length = strtoull(value.c_str(), &end, 10);
+            if (end != value.c_str() &&
+                (myself->m_maxbytes <= 0 ||
+                 length <= static_cast<unsigned long long>(
+                               myself->m_maxbytes))) {
+                myself->m_data.reserve(static_cast<size_t>(
+                    std::min<unsigned long long>(length, max_reserve)));
+            }
+        } else if (name == "etag") {
+            headers.m_etag = value;
+        } else if (name == "last-modified") {
+            headers.m_last_modified = value;
+        }
+        return len;
+    } catch (...) {
         return 0;
     }
-    if (myself->m_data.size() < new_length) {
-        myself->m_data.resize(new_length);
+}
+
+long SimpleCurlGet::CacheHeaders::lifetime(time_t now) const {
+    if (m_max_age >= 0) {
+        return m_max_age;
+    }
+    if (m_expires >= 0) {
+        // Compare against the server's clock when we can, to be immune to
+        // clock skew.
+        time_t base = m_date >= 0 ? m_date : now;
+        return m_expires > base ? m_expires - base : 0;
     }
-    memcpy(&(myself->m_data[myself->m_len]), buffer, new_data);
-    myself->m_len = new_length;
-    return new_data;
+    return -1;
 }
 
-} // namespace internal
+namespace {
 
-} // namespace scitokens
+template <typename T>
+std::function<void(const std::string &, const std::string &,
+                   std::error_code &)>
+make_verify(T alg) {
+    return [alg](const std::string &data, const std::string &signature,
+                 std::error_code &ec) { alg.verify(data, signature, ec); };
+}
+
+} // namespace
+
+PublicKey::PublicKey(const std::string &algorithm,
+                     const std::string &public_pem)
+    : m_name(algorithm) {
+    if (algorithm == "RS256") {
+        m_verify = make_verify(jwt::algorithm::rs256(public_pem));
+    } else if (algorithm == "ES256") {
+        m_verify = make_verify(jwt::algorithm::es256(public_pem));
+    } else if (algorithm == "ES384") {
+        m_verify = make_verify(jwt::algorithm::es384(public_pem));
+#ifdef SCITOKENS_HAVE_EDDSA
+    } else if (algorithm == "EdDSA") {
+        m_verify = make_verify(jwt::algorithm::ed25519(public_pem));
+#endif
+    } else {
+        throw UnsupportedKeyException("Provided algorithm is not supported.");
+    }
+}
 
 namespace {
 
-void parse_url(const std::string &url, std::string &schema, std::string &netloc,
-               std::string &path) {
-    const std::string prot_end("://");
-    std::string::const_iterator prot_iter =
-        std::search(url.begin(), url.end(), prot_end.begin(), prot_end.end());
-    schema.reserve(distance(url.begin(), prot_iter));
-    std::transform(url.begin(), prot_iter, std::back_inserter(schema),
-                   std::function<int(int)>(tolower));
-    if (prot_iter == url.end()) {
-        throw InvalidIssuerException("Issuer URL missing hostname.");
+// Whether a later ".." in the path removes the component that ends at
+// `iter`, i.e. normalization drops it.
+bool is_cancelled(const char *iter, const char *end) {
+    int depth = 0;
+    while (iter != end) {
+        while (iter != end && *iter == '/') {
+            iter++;
+        }
+        auto next = std::find(iter, end, '/');
+        size_t len = next - iter;
+        if (is_dot_dot(iter, len)) {
+            if (!depth) {
+                return true;
+            }
+            depth--;
+        } else if (len && !is_dot(iter, len)) {
+            depth++;
+        }
+        iter = next;
     }
-    std::advance(prot_iter, prot_end.length());
-    std::string::const_iterator path_iter =
-        std::find(prot_iter, url.end(), '/');
-    netloc.reserve(std::distance(prot_iter, path_iter));
-    std::transform(prot_iter, path_iter, std::back_inserter(netloc),
-                   std::function<int(int)>(tolower));
-    std::string::const_iterator query_iter =
-        std::find(path_iter, url.end(), '?');
+    return false;
+}
+
+} // namespace
+
+ScopeIndex::ScopeIndex(AclsList acls) : m_acls(std::move(acls)) {
+    for (const auto &acl : m_acls) {
+        uint32_t node;
+        if (!find_root(acl.first.data(), acl.first.size(), node)) {
+            node = m_nodes.size();
+            m_nodes.emplace_back();
+            m_roots.emplace_back(acl.first, node);
+        }
+        for (char ch : acl.second) {
+            uint32_t next = node;
+            if (!step(next, ch)) {
+                next = m_nodes.size();
+                m_nodes.emplace_back();
+                m_nodes[node].m_children.emplace_back(ch, next);
+            }
+            node = next;
+        }
+        m_nodes[node].m_terminal = true;
+    }
+}
+
+bool ScopeIndex::find_root(const char *authz, size_t len,
+                           uint32_t &node) const {
+    for (const auto &root : m_roots) {
+        if (root.first.size() == len &&
+            !root.first.compare(0, len, authz, len)) {
+            node = root.second;
+            return true;
+        }
+    }
+    return false;
+}
+
+bool ScopeIndex::step(uint32_t &node, char ch) const {
+    for (const auto &child : m_nodes[node].m_children) {
+        if (child.first == ch) {
+            node = child.second;
+            return true;
+        }
+    }
+    return false;
+}
+
+// Returns false once the walk cannot go on, either because no ACL path
+// continues with `data` or because one ended and `matched` is set.
+bool ScopeIndex::walk(uint32_t &node, const char *data, size_t len,
+                      bool &matched) const {
+    for (size_t idx = 0; idx < len; idx++) {
+        if (!step(node, data[idx])) {
+            return false;
+        }
+        if (m_nodes[node].m_terminal) {
+            matched = true;
+            return false;
+        }
+    }
+    return true;
+}
+
+// Walks the path as normalize_absolute_path would rewrite it, one
+// surviving component at a time, so the request needs no copy.
+bool ScopeIndex::test(const char *authz, size_t authz_len, const char *path,
+                      size_t path_len) const {
+    uint32_t node;
+    if (!find_root(authz, authz_len, node)) {
+        return false;
+    }
+    bool matched = false, has_components = false;
+    const char *iter = path, *end = path + path_len;
+    while (iter != end) {
+        while (iter != end && *iter == '/') {
+            iter++;
+        }
+        auto next = std::find(iter, end, '/');
+        size_t len = next - iter;
+        if (len && !is_dot(iter, len) &&
+            !is_dot_dot(iter, len) && !is_cancelled(next, end)) {
+            has_components = true;
+            if (!walk(node, "/", 1, matched) ||
+                !walk(node, iter, len, matched)) {
+                return matched;
+            }
+        }
+        iter = next;
+    }
+    if (!has_components) {
+        walk(node, "/", 1, matched);
+    }
+    return matched;
+}
+
+size_t cpu_shard(size_t count) {
+#if defined(__linux__)
+    // A vDSO call on most architectures, so no system call.
+    int cpu = sched_getcpu();
+    if (cpu >= 0) {
+        return static_cast<size_t>(cpu) % count;
+    }
+#endif
+    static std::atomic<size_t> next_thread{0};
+    static thread_local size_t thread_shard = next_thread++;
+    return thread_shard % count;
+}
+
+size_t cpu_shard_count() {
+    // Bounded so a huge machine doesn't multiply every per-CPU structure
+    // without end; past this CPUs share shards.
+    static const size_t count =
+        std::max(1u, std::min(256u, std::thread::hardware_concurrency()));
+    return count;
+}
+
+void AclCache::set_capacity(size_t capacity) {
+    size_t shards = capacity / min_shard_capacity;
+    if (shards < 1) {
+        shards = 1;
+    } else if (shards > max_shards) {
+        shards = max_shards;
+    }
+    // Holding every shard keeps inserts and lookups out until the shard
+    // count and the capacities agree again (see lock_shard).
+    std::array<std::unique_lock<std::mutex>, max_shards> locks;
+    for (size_t idx = 0; idx < max_shards; idx++) {
+        locks[idx] = std::unique_lock<std::mutex>(m_shards[idx].m_mutex);
+    }
+    // Entries would be looked for in other shards.
+    bool reshard = shards != m_shard_count;
+    m_shard_count = shards;
+    for (size_t idx = 0; idx < max_shards; idx++) {
+        auto &shard = m_shards[idx];
+        if (reshard) {
+            shard.m_entries.clear();
+            shard.m_index.clear();
+        }
+        // Shards past the count take no entries.
+        shard.m_capacity =
+            idx < shards ? capacity / shards + (idx < capacity % shards) : 0;
+        while (shard.m_entries.size() > shard.m_capacity) {
+            shard.m_index.erase(shard.m_entries.back().m_key);
+            shard.m_entries.pop_back();
+        }
+    }
+    m_capacity = capacity;
+}
+
+AclCache::Shard &AclCache::lock_shard(const Digest &key,
+                                      std::unique_lock<std::mutex> &lock) {
+    // set_capacity changes the shard count only while holding every
+    // shard, so a count that still holds once the shard is locked is the
+    // right one.
+    while (true) {
+        size_t count = m_shard_count.load();
+        auto &shard = m_shards[key[sizeof(size_t)] % count];
+        lock = std::unique_lock<std::mutex>(shard.m_mutex);
+        if (m_shard_count.load() == count) {
+            return shard;
+        }
+        lock.unlock();
+    }
+}
+
+std::shared_ptr<const ScopeIndex>
+AclCache::lookup(const Digest &key,
+                 std::chrono::system_clock::time_point now) {
+    std::unique_lock<std::mutex> lock;
+    auto &shard = lock_shard(key, lock);
+    auto iter = shard.m_index.find(key);
+    if (iter == shard.m_index.end()) {
+        return nullptr;
+    }
+    if (now >= iter->second->m_expires ||
+        RevocationList::get().is_revoked(iter->second->m_jti)) {
+        shard.m_entries.erase(iter->second);
+        shard.m_index.erase(iter);
+        return nullptr;
+    }
+    // Kept: the time may be set later again.
+    if (now < iter->second->m_not_before) {
+        return nullptr;
+    }
+    shard.m_entries.splice(shard.m_entries.begin(), shard.m_entries,
+                           iter->second);
+    return iter->second->m_acls;
+}
+
+void AclCache::insert(const Digest &key,
+                      std::chrono::system_clock::time_point not_before,
+                      std::chrono::system_clock::time_point expires,
+                      const std::string &jti,
+                      std::shared_ptr<const ScopeIndex> acls) {
+    std::unique_lock<std::mutex> lock;
+    auto &shard = lock_shard(key, lock);
+    if (!shard.m_capacity) {
+        return;
+    }
+    auto iter = shard.m_index.find(key);
+    if (iter != shard.m_index.end()) {
+        shard.m_entries.erase(iter->second);
+        shard.m_index.erase(iter);
+    }
+    shard.m_entries.push_front(
+        Entry{key, not_before, expires, jti, std::move(acls)});
+    shard.m_index[key] = shard.m_entries.begin();
+    while (shard.m_entries.size() > shard.m_capacity) {
+        shard.m_index.erase(shard.m_entries.back().m_key);
+        shard.m_entries.pop_back();
+    }
+}
+
+void AclCache::clear() {
+    for (auto &shard : m_shards) {
+        std::lock_guard<std::mutex> guard(shard.m_mutex);
+        shard.m_entries.clear();
+        shard.m_index.clear();
+    }
+}
+
+AclCache::Digest AclCache::digest(const std::string &token) {
+    Digest md;
+    unsigned int md_len = 0;
+    if (!EVP_Digest(token.data(), token.size(), md.data(), &md_len,
+                    EVP_sha256(), nullptr) ||
+        md_len != md.size()) {
+        throw std::runtime_error("Failed to compute token digest");
+    }
+    return md;
+}
+
+void LatencyHistogram::record(std::chrono::steady_clock::duration elapsed) {
+    auto usec =
+        std::chrono::duration_cast<std::chrono::microseconds>(elapsed).count();
+    uint64_t value = usec > 0 ? usec : 0;
+    unsigned bucket = 0;
+    while (bucket < bucket_count - 1 && value > (uint64_t(1) << bucket)) {
+        bucket++;
+    }
+    Stats::add(m_buckets[bucket]);
+    Stats::add(m_count);
+    Stats::add(m_sum_us, value);
+}
+
+void LatencyHistogram::reset() {
+    for (auto &bucket : m_buckets) {
+        bucket.store(0, std::memory_order_relaxed);
+    }
+    m_count.store(0, std::memory_order_relaxed);
+    m_sum_us.store(0, std::memory_order_relaxed);
+}
+
+picojson::value LatencyHistogram::to_json() const {
+    picojson::array buckets;
+    uint64_t cumulative = 0;
+    for (unsigned bucket = 0; bucket < bucket_count; bucket++) {
+        cumulative += m_buckets[bucket].load(std::memory_order_relaxed);
+        picojson::object entry;
+        entry["le"] = picojson::value(
+            bucket == bucket_count - 1
+                ? std::string("+Inf")
+                : std::to_string(uint64_t(1) << bucket));
+        entry["count"] = picojson::value(static_cast<int64_t>(cumulative));
+        buckets.emplace_back(entry);
+    }
+    picojson::object result;
+    result["count"] = picojson::value(
+        static_cast<int64_t>(m_count.load(std::memory_order_relaxed)));
+    result["sum_us"] = picojson::value(
+        static_cast<int64_t>(m_sum_us.load(std::memory_order_relaxed)));
+    result["buckets"] = picojson::value(buckets);
+    return picojson::value(result);
+}
+
+Stats &Stats::get() {
+    static Stats stats;
+    return stats;
+}
+
+void Stats::record_refresh_failure(const std::string &issuer) {
+    add(m_refresh_failures);
+    std::lock_guard<std::mutex> guard(m_failures_mutex);
+    auto iter = m_failures_by_issuer.find(issuer);
+    if (iter != m_failures_by_issuer.end()) {
+        iter->second++;
+    } else if (m_failures_by_issuer.size() < max_failure_issuers) {
+        m_failures_by_issuer[issuer] = 1;
+    } else {
+        m_failures_other++;
+    }
+}
+
+std::string Stats::to_json() const {
+    auto count = [](const std::atomic<uint64_t> &counter) {
+        return picojson::value(
+            static_cast<int64_t>(counter.load(std::memory_order_relaxed)));
+    };
+
+    picojson::object keycache;
+    keycache["lookups"] = count(m_key_lookups);
+    keycache["lookups_fresh"] = count(m_key_lookup_fresh);
+    keycache["lookup_us"] = m_key_lookup_us.to_json();
+    keycache["memory_hits"] = count(m_memory_hits);
+    keycache["sqlite_reads"] = count(m_sqlite_reads);
+    keycache["sqlite_hits"] = count(m_sqlite_hits);
+    keycache["sqlite_read_us"] = m_sqlite_read_us.to_json();
+    keycache["sqlite_writes"] = count(m_sqlite_writes);
+    keycache["sqlite_write_us"] = m_sqlite_write_us.to_json();
+    keycache["sqlite_busy_retries"] = count(m_sqlite_busy_retries);
+    keycache["sqlite_lock_wait_us"] = m_sqlite_lock_wait_us.to_json();
+    keycache["lock_wait_us"] = m_lock_wait_us.to_json();
+    keycache["snapshot_hits"] = count(m_snapshot_hits);
+    keycache["compactions"] = count(m_compactions);
+    keycache["compaction_expired"] = count(m_compaction_expired);
+    keycache["compaction_evicted"] = count(m_compaction_evicted);
+    keycache["memory_evictions"] = count(m_memory_evictions);
+    keycache["memcached_requests"] = count(m_memcached_requests);
+    keycache["memcached_hits"] = count(m_memcached_hits);
+    keycache["memcached_errors"] = count(m_memcached_errors);
+    keycache["memcached_rejected"] = count(m_memcached_rejections);
+
+    picojson::object refresh;
+    refresh["started"] = count(m_refreshes);
+    refresh["succeeded"] = count(m_refresh_successes);
+    refresh["failed"] = count(m_refresh_failures);
+    refresh["not_modified"] = count(m_refresh_not_modified);
+    refresh["duration_us"] = m_refresh_us.to_json();
+    refresh["hedged"] = count(m_fetch_hedges);
+    refresh["hedge_wins"] = count(m_fetch_hedge_wins);
+    picojson::object failures;
+    {
+        std::lock_guard<std::mutex> guard(m_failures_mutex);
+        for (const auto &entry : m_failures_by_issuer) {
+            failures[entry.first] =
+                picojson::value(static_cast<int64_t>(entry.second));
+        }
+        if (m_failures_other) {
+            failures["other"] =
+                picojson::value(static_cast<int64_t>(m_failures_other));
+        }
+    }
+    refresh["failures_by_issuer"] = picojson::value(failures);
+
+    picojson::object verify;
+    verify["count"] = count(m_verifications);
+    verify["failures"] = count(m_verification_failures);
+    verify["rejected_early"] = count(m_early_rejections);
+    verify["revoked"] = count(m_revoked_tokens);
+    verify["signature_us"] = m_verify_us.to_json();
+
+    picojson::object revocation;
+    revocation["reloads"] = count(m_revocation_reloads);
+    revocation["reload_failures"] = count(m_revocation_reload_failures);
+
+    picojson::object enforcer;
+    enforcer["acl_cache_hits"] = count(m_acl_cache_hits);
+    enforcer["acl_cache_misses"] = count(m_acl_cache_misses);
+    enforcer["claim_checks"] = count(m_claim_checks);
+    enforcer["claim_failures"] = count(m_claim_failures);
+    enforcer["claim_check_us"] = m_claim_check_us.to_json();
+    enforcer["capabilities_exported"] = count(m_capability_exports);
+    enforcer["capabilities_imported"] = count(m_capability_imports);
+    enforcer["capabilities_rejected"] = count(m_capability_rejections);
+    enforcer["verified_rechecks"] = count(m_verified_rechecks);
+    enforcer["verified_fallbacks"] = count(m_verified_fallbacks);
+
+    picojson::object result;
+    result["keycache"] = picojson::value(keycache);
+    result["refresh"] = picojson::value(refresh);
+    result["verify"] = picojson::value(verify);
+    result["enforcer"] = picojson::value(enforcer);
+    result["revocation"] = picojson::value(revocation);
+    return picojson::value(result).serialize();
+}
+
+void Stats::reset() {
+    for (auto counter :
+         {&m_key_lookups, &m_key_lookup_fresh, &m_memory_hits, &m_sqlite_reads,
+          &m_sqlite_hits, &m_sqlite_writes, &m_sqlite_busy_retries,
+          &m_snapshot_hits, &m_compactions, &m_compaction_expired,
+          &m_compaction_evicted, &m_memory_evictions,
+          &m_memcached_requests, &m_memcached_hits,
+          &m_memcached_errors, &m_memcached_rejections, &m_refreshes,
+          &m_refresh_successes,
+          &m_refresh_failures, &m_refresh_not_modified, &m_fetch_hedges,
+          &m_fetch_hedge_wins, &m_verifications,
+          &m_verification_failures, &m_early_rejections, &m_revoked_tokens,
+          &m_revocation_reloads, &m_revocation_reload_failures,
+          &m_acl_cache_hits, &m_acl_cache_misses, &m_claim_checks,
+          &m_claim_failures, &m_capability_exports, &m_capability_imports,
+          &m_capability_rejections, &m_verified_rechecks,
+          &m_verified_fallbacks}) {
+        counter->store(0, std::memory_order_relaxed);
+    }
+    for (auto histogram : {&m_key_lookup_us, &m_sqlite_read_us,
+                           &m_sqlite_write_us, &m_sqlite_lock_wait_us,
+                           &m_lock_wait_us, &m_refresh_us, &m_verify_us,
+                           &m_claim_check_us}) {
+        histogram->reset();
+    }
+    std::lock_guard<std::mutex> guard(m_failures_mutex);
+    m_failures_by_issuer.clear();
+    m_failures_other = 0;
+}
+
+std::atomic<bool> TraceSpan::m_enabled{false};
+std::shared_ptr<const TraceSpan::Callback> TraceSpan::m_callback;
+
+void TraceSpan::set_callback(Callback callback) {
+    std::shared_ptr<const Callback> registered;
+    if (callback) {
+        registered = std::make_shared<const Callback>(std::move(callback));
+    }
+    std::atomic_store(&m_callback, registered);
+    m_enabled.store(registered != nullptr, std::memory_order_relaxed);
+}
+
+std::unique_ptr<TraceSpan> TraceSpan::begin() {
+    if (!enabled()) {
+        return nullptr;
+    }
+    std::unique_ptr<TraceSpan> span(new TraceSpan());
+    span->m_span_callback = std::atomic_load(&m_callback);
+    if (!span->m_span_callback) {
+        return nullptr;
+    }
+    return span;
+}
+
+TraceSpan::TraceSpan()
+    : m_last_mark(std::chrono::steady_clock::now()), m_begin(m_last_mark),
+      m_start_us(std::chrono::duration_cast<std::chrono::microseconds>(
+                     std::chrono::system_clock::now().time_since_epoch())
+                     .count()) {
+    for (auto &stage_us : m_stage_us) {
+        stage_us = -1;
+    }
+}
+
+void TraceSpan::mark(Stage stage) {
+    auto now = std::chrono::steady_clock::now();
+    auto elapsed =
+        std::chrono::duration_cast<std::chrono::microseconds>(now - m_last_mark)
+            .count();
+    m_stage_us[stage] = std::max<int64_t>(m_stage_us[stage], 0) + elapsed;
+    m_last_mark = now;
+}
+
+void TraceSpan::carve(Stage part, Stage whole,
+                      std::chrono::steady_clock::duration elapsed) {
+    auto elapsed_us =
+        std::chrono::duration_cast<std::chrono::microseconds>(elapsed).count();
+    if (elapsed_us <= 0 || m_stage_us[whole] < 0) {
+        return;
+    }
+    elapsed_us = std::min(elapsed_us, m_stage_us[whole]);
+    m_stage_us[whole] -= elapsed_us;
+    m_stage_us[part] = std::max<int64_t>(m_stage_us[part], 0) + elapsed_us;
+}
+
+void TraceSpan::finish(const char *error) {
+    if (m_finished) {
+        return;
+    }
+    m_finished = true;
+    m_total_us = std::chrono::duration_cast<std::chrono::microseconds>(
+                     std::chrono::steady_clock::now() - m_begin)
+                     .count();
+    m_failed = error != nullptr;
+    if (error) {
+        m_error = error;
+    }
+    try {
+        (*m_span_callback)(*this);
+    } catch (...) {
+        // A failing callback must not fail the verification it traces.
+    }
+}
+
+VerifierCache &VerifierCache::get() {
+    static VerifierCache cache;
+    return cache;
+}
+
+std::shared_ptr<const PublicKey>
+VerifierCache::lookup(const std::string &issuer, const std::string &kid,
+                      const std::string &fingerprint) {
+    TimedLockGuard guard(m_mutex);
+    auto issuer_iter = m_keys.find(issuer);
+    if (issuer_iter == m_keys.end()) {
+        return nullptr;
+    }
+    auto iter = issuer_iter->second.find(kid);
+    if (iter == issuer_iter->second.end() ||
+        iter->second.m_fingerprint != fingerprint) {
+        return nullptr;
+    }
+    return iter->second.m_key;
+}
+
+void VerifierCache::insert(const std::string &issuer, const std::string &kid,
+                           const std::string &fingerprint,
+                           std::shared_ptr<const PublicKey> key) {
+    TimedLockGuard guard(m_mutex);
+    auto &entry = m_keys[issuer][kid];
+    entry.m_fingerprint = fingerprint;
+    entry.m_key = std::move(key);
+}
+
+void VerifierCache::invalidate(const std::string &issuer) {
+    std::lock_guard<std::mutex> guard(m_mutex);
+    m_keys.erase(issuer);
+}
+
+RefreshState::Outcome
+RefreshState::wait_for(std::chrono::milliseconds timeout,
+                       std::shared_ptr<const picojson::value> &keys,
+                       std::string &error) {
+    std::unique_lock<std::mutex> lock(m_mutex);
+    m_cond.wait_for(lock, timeout,
+                    [this] { return m_outcome != Outcome::PENDING; });
+    if (m_outcome == Outcome::SUCCEEDED) {
+        keys = m_keys;
+    } else if (m_outcome == Outcome::FAILED) {
+        error = m_error;
+    }
+    return m_outcome;
+}
+
+void RefreshState::finish(Outcome outcome,
+                          std::shared_ptr<const picojson::value> keys,
+                          const std::string &error) {
+    {
+        std::lock_guard<std::mutex> guard(m_mutex);
+        m_outcome = outcome;
+        m_keys = std::move(keys);
+        m_error = error;
+    }
+    m_cond.notify_all();
+}
+
+RefreshCoordinator &RefreshCoordinator::get() {
+    static RefreshCoordinator coordinator;
+    return coordinator;
+}
+
+std::shared_ptr<RefreshState>
+RefreshCoordinator::join(const std::string &issuer, bool &leader) {
+    std::lock_guard<std::mutex> guard(m_mutex);
+    auto &state = m_inflight[issuer];
+    leader = !state;
+    if (leader) {
+        state = std::make_shared<RefreshState>();
+    }
+    return state;
+}
+
+void RefreshCoordinator::finish(const std::string &issuer,
+                                const std::shared_ptr<RefreshState> &state,
+                                RefreshState::Outcome outcome,
+                                std::shared_ptr<const picojson::value> keys,
+                                const std::string &error) {
+    if (!state) {
+        return;
+    }
+    {
+        std::lock_guard<std::mutex> guard(m_mutex);
+        auto iter = m_inflight.find(issuer);
+        if (iter != m_inflight.end() && iter->second == state) {
+            m_inflight.erase(iter);
+        }
+    }
+    state->finish(outcome, std::move(keys), error);
+}
+
+NegativeCache &NegativeCache::get() {
+    static NegativeCache cache;
+    return cache;
+}
+
+NegativeCache::IssuerEntry &NegativeCache::entry(const std::string &issuer,
+                                                 time_point now) {
+    auto iter = m_issuers.find(issuer);
+    if (iter != m_issuers.end()) {
+        return iter->second;
+    }
+    if (m_issuers.size() >= max_issuers) {
+        // Drop whatever has lapsed; if nothing has, start over.
+        for (auto it = m_issuers.begin(); it != m_issuers.end();) {
+            bool lapsed = it->second.m_retry_after <= now &&
+                          it->second.m_next_forced_refresh <= now &&
+                          it->second.m_unknown_kids.empty();
+            it = lapsed ? m_issuers.erase(it) : std::next(it);
+        }
+        if (m_issuers.size() >= max_issuers) {
+            m_issuers.clear();
+        }
+    }
+    return m_issuers[issuer];
+}
+
+bool NegativeCache::backing_off(const std::string &issuer, std::string &error,
+                                int64_t &retry_in) {
+    if (configurer::Configuration::get_failure_backoff() <= 0) {
+        return false;
+    }
+    std::lock_guard<std::mutex> guard(m_mutex);
+    auto iter = m_issuers.find(issuer);
+    if (iter == m_issuers.end() || !iter->second.m_failures) {
+        return false;
+    }
+    auto now = std::chrono::steady_clock::now();
+    if (now >= iter->second.m_retry_after) {
+        return false;
+    }
+    error = iter->second.m_error;
+    retry_in = std::chrono::duration_cast<std::chrono::seconds>(
+                   iter->second.m_retry_after - now)
+                   .count() +
+               1;
+    return true;
+}
+
+void NegativeCache::record_failure(const std::string &issuer,
+                                   const std::string &error) {
+    int backoff = configurer::Configuration::get_failure_backoff();
+    if (backoff <= 0) {
+        return;
+    }
+    std::lock_guard<std::mutex> guard(m_mutex);
+    auto now = std::chrono::steady_clock::now();
+    auto &issuer_entry = entry(issuer, now);
+    auto doublings = std::min(issuer_entry.m_failures, max_doublings);
+    issuer_entry.m_failures++;
+    issuer_entry.m_retry_after =
+        now + std::chrono::seconds(static_cast<int64_t>(backoff) << doublings);
+    issuer_entry.m_error = error;
+}
+
+void NegativeCache::record_success(const std::string &issuer) {
+    std::lock_guard<std::mutex> guard(m_mutex);
+    auto iter = m_issuers.find(issuer);
+    if (iter != m_issuers.end()) {
+        iter->second.m_failures = 0;
+        iter->second.m_error.clear();
+    }
+}
+
+bool NegativeCache::kid_unknown(const std::string &issuer,
+                                const std::string &kid) {
+    if (configurer::Configuration::get_unknown_kid_ttl() <= 0) {
+        return false;
+    }
+    std::lock_guard<std::mutex> guard(m_mutex);
+    auto iter = m_issuers.find(issuer);
+    if (iter == m_issuers.end()) {
+        return false;
+    }
+    auto &kids = iter->second.m_unknown_kids;
+    auto kid_iter = kids.find(kid);
+    if (kid_iter == kids.end()) {
+        return false;
+    }
+    if (std::chrono::steady_clock::now() >= kid_iter->second) {
+        kids.erase(kid_iter);
+        return false;
+    }
+    return true;
+}
+
+void NegativeCache::record_unknown_kid(const std::string &issuer,
+                                       const std::string &kid) {
+    int ttl = configurer::Configuration::get_unknown_kid_ttl();
+    if (ttl <= 0) {
+        return;
+    }
+    std::lock_guard<std::mutex> guard(m_mutex);
+    auto now = std::chrono::steady_clock::now();
+    auto &kids = entry(issuer, now).m_unknown_kids;
+    if (kids.size() >= max_kids_per_issuer) {
+        for (auto it = kids.begin(); it != kids.end();) {
+            it = (it->second <= now) ? kids.erase(it) : std::next(it);
+        }
+        if (kids.size() >= max_kids_per_issuer) {
+            kids.clear();
+        }
+    }
+    kids[kid] = now + std::chrono::seconds(ttl);
+}
+
+void NegativeCache::forget_kids(const std::string &issuer) {
+    std::lock_guard<std::mutex> guard(m_mutex);
+    auto iter = m_issuers.find(issuer);
+    if (iter != m_issuers.end()) {
+        iter->second.m_unknown_kids.clear();
+    }
+}
+
+bool NegativeCache::allow_forced_refresh(const std::string &issuer) {
+    std::lock_guard<std::mutex> guard(m_mutex);
+    auto now = std::chrono::steady_clock::now();
+    auto &issuer_entry = entry(issuer, now);
+    if (now < issuer_entry.m_next_forced_refresh) {
+        return false;
+    }
+    issuer_entry.m_next_forced_refresh =
+        now + std::chrono::seconds(
+                  configurer::Configuration::get_min_update_delta());
+    return true;
+}
+
+BackgroundRefresher &BackgroundRefresher::get() {
+    static BackgroundRefresher refresher;
+    return refresher;
+}
+
+BackgroundRefresher::BackgroundRefresher() {
+    // The thread uses these; constructing them first guarantees they are
+    // destroyed after it has been stopped at exit.
+    VerifierCache::get();
+    RefreshCoordinator::get();
+    NegativeCache::get();
+    Stats::get();
+}
+
+BackgroundRefresher::~BackgroundRefresher() {
+    std::lock_guard<std::mutex> control(m_control_mutex);
+    if (m_thread.joinable()) {
+        {
+            std::lock_guard<std::mutex> guard(m_mutex);
+            m_shutdown = true;
+        }
+        m_cond.notify_all();
+        m_thread.join();
+    }
+}
+
+void BackgroundRefresher::reconfigure() {
+    std::lock_guard<std::mutex> control(m_control_mutex);
+    bool enabled = configurer::Configuration::get_refresh_interval() > 0;
+    {
+        std::lock_guard<std::mutex> guard(m_mutex);
+        m_shutdown = !enabled;
+        m_generation++;
+    }
+    m_cond.notify_all();
+    if (!enabled && m_thread.joinable()) {
+        m_thread.join();
+    } else if (enabled && !m_thread.joinable()) {
+        m_thread = std::thread(&BackgroundRefresher::run, this);
+    }
+}
+
+void BackgroundRefresher::track(const std::string &issuer) {
+    std::lock_guard<std::mutex> guard(m_mutex);
+    m_issuers.insert(issuer);
+}
+
+void parallel_for(size_t count, unsigned threads,
+                  const std::function<void(size_t)> &job) {
+    std::atomic<size_t> next(0);
+    std::mutex error_mutex;
+    std::exception_ptr error;
+    auto run = [&]() {
+        for (size_t idx = next++; idx < count; idx = next++) {
+            try {
+                job(idx);
+            } catch (...) {
+                std::lock_guard<std::mutex> lock(error_mutex);
+                if (!error) {
+                    error = std::current_exception();
+                }
+            }
+        }
+    };
+    std::vector<std::thread> workers;
+    for (unsigned worker = 1; worker < threads && worker < count; worker++) {
+        workers.emplace_back(run);
+    }
+    run();
+    for (auto &worker : workers) {
+        worker.join();
+    }
+    if (error) {
+        std::rethrow_exception(error);
+    }
+}
+
+VerifyPool &VerifyPool::get() {
+    static VerifyPool pool;
+    return pool;
+}
+
+VerifyPool::VerifyPool() {
+    // Jobs use it; constructing it first guarantees it is destroyed after
+    // the workers have been stopped at exit.
+    BackgroundRefresher::get();
+}
+
+VerifyPool::~VerifyPool() {
+    std::lock_guard<std::mutex> control(m_control_mutex);
+    stop_threads();
+}
+
+void VerifyPool::stop_threads() {
+    {
+        std::lock_guard<std::mutex> guard(m_mutex);
+        m_shutdown = true;
+    }
+    m_cond.notify_all();
+    // Workers finish the queued jobs before exiting; requests wait on them.
+    for (auto &thread : m_threads) {
+        thread.join();
+    }
+    m_threads.clear();
+}
+
+void VerifyPool::reconfigure() {
+    std::lock_guard<std::mutex> control(m_control_mutex);
+    size_t threads =
+        std::max(0, configurer::Configuration::get_verify_threads());
+    if (threads == m_threads.size()) {
+        return;
+    }
+    stop_threads();
+    {
+        std::lock_guard<std::mutex> guard(m_mutex);
+        m_shutdown = false;
+    }
+    for (size_t idx = 0; idx < threads; idx++) {
+        m_threads.emplace_back(&VerifyPool::run, this);
+    }
+}
+
+bool VerifyPool::submit(std::function<void()> job) {
+    std::lock_guard<std::mutex> guard(m_mutex);
+    if (m_shutdown || m_threads.empty()) {
+        return false;
+    }
+    m_jobs.push_back(std::move(job));
+    m_cond.notify_one();
+    return true;
+}
+
+void VerifyPool::run() {
+    std::unique_lock<std::mutex> lock(m_mutex);
+    while (true) {
+        m_cond.wait(lock, [&] { return m_shutdown || !m_jobs.empty(); });
+        if (m_jobs.empty()) {
+            return;
+        }
+        auto job = std::move(m_jobs.front());
+        m_jobs.pop_front();
+        lock.unlock();
+        job();
+        lock.lock();
+    }
+}
+
+CompletionEngine &CompletionEngine::get() {
+    static CompletionEngine engine;
+    return engine;
+}
+
+CompletionEngine::CompletionEngine()
+    : m_context(std::make_shared<FetchContext>()) {
+    // Requests use these; constructing them first guarantees they are
+    // destroyed after the thread has been stopped at exit.
+    VerifyPool::get();
+}
+
+CompletionEngine::~CompletionEngine() {
+    {
+        std::lock_guard<std::mutex> guard(m_mutex);
+        m_shutdown = true;
+    }
+    m_cond.notify_all();
+    if (m_thread.joinable()) {
+        m_thread.join();
+    }
+}
+
+void CompletionEngine::submit(Step step) {
+    std::lock_guard<std::mutex> guard(m_mutex);
+    m_submitted.push_back(std::move(step));
+    if (!m_thread.joinable()) {
+        m_thread = std::thread(&CompletionEngine::run, this);
+    }
+    m_cond.notify_one();
+}
+
+void CompletionEngine::run() {
+    std::vector<Step> active;
+    while (true) {
+        {
+            std::unique_lock<std::mutex> lock(m_mutex);
+            // With requests in flight, check back at least every poll
+            // interval: a request waiting on the VerifyPool has no socket
+            // the fetch context could report on.
+            if (active.empty()) {
+                m_cond.wait(lock, [&] {
+                    return m_shutdown || !m_submitted.empty();
+                });
+            }
+            if (m_shutdown) {
+                // Requests still in flight are dropped unanswered.
+                return;
+            }
+            std::move(m_submitted.begin(), m_submitted.end(),
+                      std::back_inserter(active));
+            m_submitted.clear();
+        }
+        try {
+            m_context->wait(RefreshState::poll_interval_ms);
+        } catch (std::exception &) {
+            // The transfers' own results report any failure to them.
+        }
+        active.erase(std::remove_if(active.begin(), active.end(),
+                                    [](Step &step) { return step(); }),
+                     active.end());
+    }
+}
+
+VerifyJob::VerifyJob() {
+    if (pipe(m_pipe) == -1) {
+        throw std::runtime_error("Failed to create a pipe for verification");
+    }
+    for (auto fd : m_pipe) {
+        fcntl(fd, F_SETFD, FD_CLOEXEC);
+        fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+    }
+}
+
+VerifyJob::~VerifyJob() {
+    close(m_pipe[0]);
+    close(m_pipe[1]);
+}
+
+void VerifyJob::finish(TokenProfile profile, std::exception_ptr error) {
+    {
+        std::lock_guard<std::mutex> guard(m_mutex);
+        m_done = true;
+        m_profile = profile;
+        m_error = error;
+    }
+    m_cond.notify_all();
+    char byte = 0;
+    // The pipe starts empty and is written once, so this cannot block.
+    if (write(m_pipe[1], &byte, 1) != 1) {
+        // Pollers still see the job done on their next continue call.
+    }
+}
+
+bool VerifyJob::is_done() const {
+    std::lock_guard<std::mutex> guard(m_mutex);
+    return m_done;
+}
+
+void VerifyJob::wait() const {
+    std::unique_lock<std::mutex> lock(m_mutex);
+    m_cond.wait(lock, [&] { return m_done; });
+}
+
+TokenProfile VerifyJob::get_profile() const {
+    std::lock_guard<std::mutex> guard(m_mutex);
+    if (m_error) {
+        std::rethrow_exception(m_error);
+    }
+    return m_profile;
+}
+
+fd_set *VerifyJob::get_read_fd_set() {
+    // Rebuilt on every call, as select() overwrites it.
+    FD_ZERO(&m_read_fd_set);
+    if (m_pipe[0] < FD_SETSIZE) {
+        FD_SET(m_pipe[0], &m_read_fd_set);
+    }
+    return &m_read_fd_set;
+}
+
+fd_set *VerifyJob::get_empty_fd_set() {
+    FD_ZERO(&m_empty_fd_set);
+    return &m_empty_fd_set;
+}
+
+void BackgroundRefresher::run() {
+    std::unique_lock<std::mutex> lock(m_mutex);
+    while (!m_shutdown) {
+        int interval = configurer::Configuration::get_refresh_interval();
+        auto generation = m_generation;
+        if (m_cond.wait_for(lock, std::chrono::seconds(interval), [&] {
+                return m_shutdown || m_generation != generation;
+            })) {
+            // Shut down or rescheduled.
+            continue;
+        }
+
+        std::vector<std::string> issuers(m_issuers.begin(), m_issuers.end());
+        lock.unlock();
+        // Renew anything that would come due before the next pass.
+        int64_t horizon = std::time(NULL) + interval;
+        for (const auto &issuer : issuers) {
+            try {
+                Validator::refresh_if_due(issuer, horizon);
+            } catch (std::exception &) {
+                // Try again on the next pass; the foreground path will also
+                // retry once the keys are due.
+            }
+        }
+        lock.lock();
+    }
+}
+
+namespace {
+
+// Filter bits set per ID, and bits of filter per ID; about a 0.1% false
+// positive rate.
+const unsigned revocation_filter_probes = 6;
+const size_t revocation_filter_bits_per_id = 16;
+
+// A revocation list larger than this is a mistake.
+const int revocation_max_bytes = 64 * 1024 * 1024;
+
+uint64_t mix(uint64_t value) {
+    value ^= value >> 33;
+    value *= 0xff51afd7ed558ccdULL;
+    value ^= value >> 33;
+    value *= 0xc4ceb9fe1a85ec53ULL;
+    value ^= value >> 33;
+    return value;
+}
+
+} // namespace
+
+RevocationFilter::RevocationFilter(std::vector<std::string> ids)
+    : m_ids(std::move(ids)) {
+    std::sort(m_ids.begin(), m_ids.end());
+    m_ids.erase(std::unique(m_ids.begin(), m_ids.end()), m_ids.end());
+    size_t bits = std::max<size_t>(
+        m_ids.size() * revocation_filter_bits_per_id, 1);
+    m_blocks.resize((bits + 511) / 512, Block());
+    for (const auto &id : m_ids) {
+        auto value = hash(id);
+        auto &block = m_blocks[(value >> 32) % m_blocks.size()];
+        auto probes = mix(value);
+        for (unsigned idx = 0; idx < revocation_filter_probes; idx++) {
+            unsigned bit = probes & 511;
+            probes >>= 9;
+            block.m_words[bit / 64] |= uint64_t(1) << (bit % 64);
+        }
+    }
+}
+
+uint64_t RevocationFilter::hash(const std::string &id) {
+    // FNV-1a, mixed so both halves are usable on their own.
+    uint64_t value = 0xcbf29ce484222325ULL;
+    for (unsigned char byte : id) {
+        value = (value ^ byte) * 0x100000001b3ULL;
+    }
+    return mix(value);
+}
+
+bool RevocationFilter::contains(const std::string &id) const {
+    auto value = hash(id);
+    const auto &block = m_blocks[(value >> 32) % m_blocks.size()];
+    auto probes = mix(value);
+    for (unsigned idx = 0; idx < revocation_filter_probes; idx++) {
+        unsigned bit = probes & 511;
+        probes >>= 9;
+        if (!(block.m_words[bit / 64] & (uint64_t(1) << (bit % 64)))) {
+            return false;
+        }
+    }
+    return std::binary_search(m_ids.begin(), m_ids.end(), id);
+}
+
+RevocationList &RevocationList::get() {
+    static RevocationList revocations;
+    return revocations;
+}
+
+RevocationList::RevocationList() {
+    // The thread uses it; constructing it first guarantees it is destroyed
+    // after the thread has been stopped at exit.
+    Stats::get();
+}
+
+RevocationList::~RevocationList() {
+    std::lock_guard<std::mutex> control(m_control_mutex);
+    if (m_thread.joinable()) {
+        {
+            std::lock_guard<std::mutex> guard(m_mutex);
+            m_shutdown = true;
+        }
+        m_cond.notify_all();
+        m_thread.join();
+    }
+}
+
+std::shared_ptr<const RevocationFilter>
+RevocationList::load(const std::string &source) {
+    std::string contents;
+    if (source.compare(0, 8, "https://") == 0 ||
+        source.compare(0, 7, "http://") == 0) {
+        SimpleCurlGet cget(revocation_max_bytes,
+                           SimpleCurlGet::extended_timeout);
+        auto status_code = cget.perform(
+            source, std::time(NULL) + SimpleCurlGet::extended_timeout);
+        if (status_code != 200) {
+            throw CurlException("Failed to retrieve the revocation list " +
+                                source + " (status code " +
+                                std::to_string(status_code) + ")");
+        }
+        char *buffer;
+        size_t len;
+        cget.get_data(buffer, len);
+        contents.assign(buffer, len);
+    } else {
+        std::ifstream file(source);
+        std::stringstream buffer;
+        if (!(file && buffer << file.rdbuf())) {
+            throw std::runtime_error("Failed to read the revocation list " +
+                                     source);
+        }
+        contents = buffer.str();
+    }
+
+    std::vector<std::string> ids;
+    std::istringstream lines(contents);
+    std::string line;
+    while (std::getline(lines, line)) {
+        auto begin = line.find_first_not_of(" \t\r");
+        if (begin == std::string::npos || line[begin] == '#') {
+            continue;
+        }
+        auto end = line.find_last_not_of(" \t\r");
+        ids.emplace_back(line, begin, end - begin + 1);
+    }
+    return std::make_shared<const RevocationFilter>(std::move(ids));
+}
+
+void RevocationList::set_source(const std::string &source) {
+    std::shared_ptr<const RevocationFilter> filter;
+    if (!source.empty()) {
+        filter = load(source);
+    }
+
+    std::lock_guard<std::mutex> control(m_control_mutex);
+    {
+        std::lock_guard<std::mutex> guard(m_mutex);
+        m_source = source;
+        std::atomic_store(&m_filter, filter);
+        m_active = static_cast<bool>(filter);
+        m_shutdown = !filter;
+        m_generation++;
+    }
+    m_cond.notify_all();
+    if (!filter && m_thread.joinable()) {
+        m_thread.join();
+    } else if (filter && !m_thread.joinable()) {
+        m_thread = std::thread(&RevocationList::run, this);
+    }
+}
+
+std::string RevocationList::get_source() {
+    std::lock_guard<std::mutex> guard(m_mutex);
+    return m_source;
+}
+
+void RevocationList::reconfigure() {
+    {
+        std::lock_guard<std::mutex> guard(m_mutex);
+        m_generation++;
+    }
+    m_cond.notify_all();
+}
+
+void RevocationList::run() {
+    std::unique_lock<std::mutex> lock(m_mutex);
+    while (!m_shutdown) {
+        int interval =
+            configurer::Configuration::get_revocation_refresh_interval();
+        auto generation = m_generation;
+        auto rescheduled = [&] {
+            return m_shutdown || m_generation != generation;
+        };
+        // A non-positive interval loads the list only when it is set.
+        if (interval <= 0) {
+            m_cond.wait(lock, rescheduled);
+            continue;
+        }
+        if (m_cond.wait_for(lock, std::chrono::seconds(interval),
+                            rescheduled)) {
+            continue;
+        }
+
+        auto source = m_source;
+        lock.unlock();
+        auto &stats = Stats::get();
+        std::shared_ptr<const RevocationFilter> filter;
+        try {
+            filter = load(source);
+            Stats::add(stats.m_revocation_reloads);
+        } catch (std::exception &) {
+            // Keep the list we have; a revoked token must not become valid
+            // because the source is briefly unreachable.
+            Stats::add(stats.m_revocation_reload_failures);
+        }
+        lock.lock();
+        // Unless the source was changed while loading.
+        if (filter && m_generation == generation) {
+            std::atomic_store(&m_filter, filter);
+        }
+    }
+}
+
+} // namespace internal
+
+} // namespace scitokens
+
+namespace {
+
+void parse_url(const std::string &url, std::string &schema, std::string &netloc,
+               std::string &path) {
+    const std::string prot_end("://");
+    std::string::const_iterator prot_iter =
+        std::search(url.begin(), url.end(), prot_end.begin(), prot_end.end());
+    schema.reserve(distance(url.begin(), prot_iter));
+    std::transform(url.begin(), prot_iter, std::back_inserter(schema),
+                   std::function<int(int)>(tolower));
+    if (prot_iter == url.end()) {
+        throw InvalidIssuerException("Issuer URL missing hostname.");
+    }
+    std::advance(prot_iter, prot_end.length());
+    std::string::const_iterator path_iter =
+        std::find(prot_iter, url.end(), '/');
+    netloc.reserve(std::distance(prot_iter, path_iter));
+    std::transform(prot_iter, path_iter, std::back_inserter(netloc),
+                   std::function<int(int)>(tolower));
+    std::string::const_iterator query_iter =
+        std::find(path_iter, url.end(), '?');
     path.assign(path_iter, query_iter);
 }
 
-void get_metadata_endpoint(const std::string &issuer,
-                           std::string &openid_metadata,
-                           std::string &oauth_metadata) {
-    std::string schema, netloc, path;
-    parse_url(issuer, schema, netloc, path);
-    if (schema != "https") {
-        throw InvalidIssuerException("Issuer URL must be HTTPS");
+void get_metadata_endpoint(const std::string &issuer,
+                           std::string &openid_metadata,
+                           std::string &oauth_metadata) {
+    std::string schema, netloc, path;
+    parse_url(issuer, schema, netloc, path);
+    if (schema != "https") {
+        throw InvalidIssuerException("Issuer URL must be HTTPS");
+    }
+    if (path == "/") {
+        path = "";
+    }
+    std::string new_path = "/.well-known/oauth-authorization-server" + path;
+    oauth_metadata = "https://" + netloc + new_path;
+
+    openid_metadata = issuer + "/.well-known/openid-configuration";
+}
+
+/*
+  "keys": [
+    {
+      "alg": "RS256",
+      "e": "AQAB",
+      "kid": "key-rs256",
+      "kty": "RSA",
+      "n":
+"uGDGTLXnqh3mfopjys6sFUBvFl3F4Qt6NEYphq_u_aBhtN1X9NEyb78uB_I1KjciJNGLIQU0ECsJiFx6qV1hR9xE1dPyrS3bU92AVtnBrvzUtTU-aUZAmZQiuAC_rC0-z_TOQr6qJkkUgZtxR9n9op55ZBpRfZD5dzhkW4Dm146vfTKt0D4cIMoMNJS5xQx9nibeB4E8hryZDW_fPeD0XZDcpByNyP0jFDYkxdUtQFvyRpz4WMZ4ejUfvW3gf4LRAfGZJtMnsZ7ZW4RfoQbhiXKMfWeBEjQDiXh0r-KuZLykxhYJtpf7fTnPna753IzMgRMmW3F69iQn2LQN3LoSMw==",
+      "use": "sig"
+    },
+    {
+      "alg": "ES256",
+      "kid": "key-es356",
+      "kty": "EC",
+      "use": "sig",
+      "x": "ncSCrGTBTXXOhNiAOTwNdPjwRz1hVY4saDNiHQK9Bh4=",
+      "y": "sCsFXvx7FAAklwq3CzRCBcghqZOFPB2dKUayS6LY_Lo="
+    }
+  ]
+}
+*/
+// Resolve the algorithm and parameters of a JWK; throws if it is unusable.
+void resolve_key(const picojson::object &key_obj,
+                 internal::KeyIndex::Key &key) {
+    auto iter = key_obj.find("alg");
+    std::string alg;
+    if (iter == key_obj.end() || (!iter->second.is<std::string>())) {
+        auto iter2 = key_obj.find("kty");
+        if (iter2 == key_obj.end() || !iter2->second.is<std::string>()) {
+            throw JsonException("Key is missing key type");
+        } else {
+            auto kty = iter2->second.get<std::string>();
+            if (kty == "RSA") {
+                alg = "RS256";
+            } else if (kty == "EC") {
+                auto iter3 = key_obj.find("crv");
+                if (iter3 == key_obj.end() ||
+                    !iter3->second.is<std::string>()) {
+                    throw JsonException("EC key is missing curve name");
+                }
+                auto crv = iter3->second.get<std::string>();
+                if (crv == "P-256") {
+                    alg = "ES256";
+                } else if (crv == "P-384") {
+                    alg = "ES384";
+                } else {
+                    throw JsonException("Unsupported EC curve in public key");
+                }
+            } else if (kty == "OKP") {
+                // The curve is checked below.
+                alg = "EdDSA";
+            } else {
+                throw JsonException("Unknown public key type");
+            }
+        }
+    } else {
+        alg = iter->second.get<std::string>();
+    }
+    if (!SciTokenKey::is_supported_algorithm(alg)) {
+        throw UnsupportedKeyException(
+            "Issuer is using an unsupported algorithm");
+    }
+    std::string first, second;
+    if (alg == "EdDSA") {
+        iter = key_obj.find("crv");
+        if (iter == key_obj.end() || (!iter->second.is<std::string>()) ||
+            iter->second.get<std::string>() != "Ed25519") {
+            throw UnsupportedKeyException(
+                "Unsupported EdDSA curve in public key");
+        }
+        second = iter->second.get<std::string>();
+        iter = key_obj.find("x");
+        if (iter == key_obj.end() || (!iter->second.is<std::string>())) {
+            throw JsonException("EdDSA key is missing its public key");
+        }
+        first = iter->second.get<std::string>();
+    } else if (alg == "ES256" || alg == "ES384") {
+        iter = key_obj.find("x");
+        if (iter == key_obj.end() || (!iter->second.is<std::string>())) {
+            throw JsonException("Elliptic curve is missing x-coordinate");
+        }
+        first = iter->second.get<std::string>();
+        iter = key_obj.find("y");
+        if (iter == key_obj.end() || (!iter->second.is<std::string>())) {
+            throw JsonException("Elliptic curve is missing y-coordinate");
+        }
+        second = iter->second.get<std::string>();
+    } else {
+        iter = key_obj.find("e");
+        if (iter == key_obj.end() || (!iter->second.is<std::string>())) {
+            throw JsonException("Public key is missing exponent");
+        }
+        first = iter->second.get<std::string>();
+        iter = key_obj.find("n");
+        if (iter == key_obj.end() || (!iter->second.is<std::string>())) {
+            throw JsonException("Public key is missing n-value");
+        }
+        second = iter->second.get<std::string>();
+    }
+    key.m_fingerprint = alg + ":" + first + ":" + second;
+    key.m_alg = std::move(alg);
+    key.m_first = std::move(first);
+    key.m_second = std::move(second);
+}
+
+internal::KeyIndex::Key index_key(const picojson::value &value) {
+    internal::KeyIndex::Key key;
+    if (!value.is<picojson::object>()) {
+        key.m_error = "Key is not a JSON object";
+        return key;
     }
-    if (path == "/") {
-        path = "";
+    try {
+        resolve_key(value.get<picojson::object>(), key);
+    } catch (UnsupportedKeyException &exc) {
+        key.m_error = exc.what();
+        key.m_unsupported = true;
+    } catch (std::exception &exc) {
+        key.m_error = exc.what();
     }
-    std::string new_path = "/.well-known/oauth-authorization-server" + path;
-    oauth_metadata = "https://" + netloc + new_path;
-
-    openid_metadata = issuer + "/.well-known/openid-configuration";
+    return key;
 }
 
-/*
-  "keys": [
-    {
-      "alg": "RS256",
-      "e": "AQAB",
-      "kid": "key-rs256",
-      "kty": "RSA",
-      "n":
-"uGDGTLXnqh3mfopjys6sFUBvFl3F4Qt6NEYphq_u_aBhtN1X9NEyb78uB_I1KjciJNGLIQU0ECsJiFx6qV1hR9xE1dPyrS3bU92AVtnBrvzUtTU-aUZAmZQiuAC_rC0-z_TOQr6qJkkUgZtxR9n9op55ZBpRfZD5dzhkW4Dm146vfTKt0D4cIMoMNJS5xQx9nibeB4E8hryZDW_fPeD0XZDcpByNyP0jFDYkxdUtQFvyRpz4WMZ4ejUfvW3gf4LRAfGZJtMnsZ7ZW4RfoQbhiXKMfWeBEjQDiXh0r-KuZLykxhYJtpf7fTnPna753IzMgRMmW3F69iQn2LQN3LoSMw==",
-      "use": "sig"
-    },
-    {
-      "alg": "ES256",
-      "kid": "key-es356",
-      "kty": "EC",
-      "use": "sig",
-      "x": "ncSCrGTBTXXOhNiAOTwNdPjwRz1hVY4saDNiHQK9Bh4=",
-      "y": "sCsFXvx7FAAklwq3CzRCBcghqZOFPB2dKUayS6LY_Lo="
-    }
-  ]
-}
-*/
-picojson::value::object find_key_id(const picojson::value json,
-                                    const std::string &kid) {
-    if (!json.is<picojson::object>()) {
-        throw JsonException("Top-level JSON is not an object.");
+} // namespace
+
+internal::KeyIndex::KeyIndex(std::shared_ptr<const picojson::value> keys)
+    : m_keys(std::move(keys)) {
+    if (!m_keys || !m_keys->is<picojson::object>()) {
+        m_error = "Top-level JSON is not an object.";
+        return;
     }
-    auto top_obj = json.get<picojson::object>();
+    const auto &top_obj = m_keys->get<picojson::object>();
     auto iter = top_obj.find("keys");
     if (iter == top_obj.end() || (!iter->second.is<picojson::array>())) {
-        throw JsonException("Metadata resource is missing 'keys' array value");
+        m_error = "Metadata resource is missing 'keys' array value";
+        return;
+    }
+    const auto &keys_array = iter->second.get<picojson::array>();
+    m_key_count = keys_array.size();
+    if (m_key_count == 1) {
+        m_sole_key.reset(new Key(index_key(keys_array[0])));
+    }
+    for (const auto &value : keys_array) {
+        if (!value.is<picojson::object>()) {
+            continue;
+        }
+        const auto &key_obj = value.get<picojson::object>();
+        auto kid_iter = key_obj.find("kid");
+        if (kid_iter == key_obj.end() ||
+            !kid_iter->second.is<std::string>()) {
+            continue;
+        }
+        // As before the index, the first key with the ID wins.
+        const auto &kid = kid_iter->second.get<std::string>();
+        if (!m_by_kid.count(kid)) {
+            m_by_kid.emplace(kid, index_key(value));
+        }
+    }
+}
+
+bool internal::KeyIndex::contains(const std::string &kid) const {
+    return m_by_kid.count(kid) != 0;
+}
+
+const internal::KeyIndex::Key &
+internal::KeyIndex::find(const std::string &kid) const {
+    if (!m_error.empty()) {
+        throw JsonException(m_error);
     }
-    auto keys_array = iter->second.get<picojson::array>();
+    const Key *key = nullptr;
     if (kid.empty()) {
-        if (keys_array.size() != 1) {
+        if (m_key_count != 1) {
             throw JsonException("Key ID empty but multiple keys published.");
         }
-        auto &key = keys_array.at(0);
-        return key.get<picojson::object>();
+        key = m_sole_key.get();
     } else {
-        for (auto &key : keys_array) {
-            if (!key.is<picojson::object>()) {
-                continue;
-            }
-
-            auto key_obj = key.get<picojson::object>();
-            iter = key_obj.find("kid");
-            if (iter == key_obj.end() || (!iter->second.is<std::string>())) {
-                continue;
-            }
-
-            std::string cur_kid = iter->second.get<std::string>();
-
-            if (cur_kid == kid) {
-                return key_obj;
-            }
+        auto iter = m_by_kid.find(kid);
+        if (iter == m_by_kid.end()) {
+            throw JsonException("Key ID is not published by the issuer.");
+        }
+        key = &iter->second;
+    }
+    if (!key->m_error.empty()) {
+        if (key->m_unsupported) {
+            throw UnsupportedKeyException(key->m_error);
         }
-        throw JsonException("Key ID is not published by the issuer.");
+        throw JsonException(key->m_error);
     }
+    return *key;
 }
 
-struct local_base64url : public jwt::alphabet::base64url {
-    static const std::string &fill() {
-        static std::string fill = "=";
-        return fill;
-    }
-};
+namespace {
 
-// Assuming a padding, decode
-std::string b64url_decode_nopadding(const std::string &input) {
-    std::string result = input;
-    switch (result.size() % 4) {
-    case 1:
-        result += "="; // fallthrough
-    case 2:
-        result += "="; // fallthrough
-    case 3:
-        result += "="; // fallthrough
-    default:
-        break;
-    }
-    return jwt::base::decode<local_base64url>(result);
-}
-
-// Base64-encode without padding.
-std::string b64url_encode_nopadding(const std::string &input) {
-    std::string result = jwt::base::encode<local_base64url>(input);
-    auto pos = result.find("=");
-    return result.substr(0, pos);
-}
-
-std::string es256_from_coords(const std::string &x_str,
-                              const std::string &y_str) {
-    auto x_decode = b64url_decode_nopadding(x_str);
-    auto y_decode = b64url_decode_nopadding(y_str);
+// The PEM of the EC public key at (x, y) on the curve OpenSSL knows as
+// `nid` (or by `group_name`, from OpenSSL 3).
+std::string ec_from_coords(const std::string &x_str, const std::string &y_str,
+                           int nid, const char *group_name) {
+    auto x_decode = internal::b64url_decode(x_str);
+    auto y_decode = internal::b64url_decode(y_str);
     std::unique_ptr<BIO, decltype(&BIO_free_all)> pubkey_bio(
         BIO_new(BIO_s_mem()), BIO_free_all);
     std::unique_ptr<BIGNUM, decltype(&BN_free)> x_bignum(
@@ -336,7 +2412,7 @@ std::string es256_from_coords(const std::string &x_str,
     unsigned char *buf;
     OSSL_PARAM *params;
     std::unique_ptr<EC_GROUP, decltype(&EC_GROUP_free)> ec_group(
-        EC_GROUP_new_by_curve_name(EC_NAME), EC_GROUP_free);
+        EC_GROUP_new_by_curve_name(nid), EC_GROUP_free);
     if (!ec_group.get()) {
         throw UnsupportedKeyException("Unable to get OpenSSL EC group");
     }
@@ -365,7 +2441,7 @@ std::string es256_from_coords(const std::string &x_str,
         OSSL_PARAM_BLD_new(), OSSL_PARAM_BLD_free);
     if (!param_build.get() ||
         !OSSL_PARAM_BLD_push_utf8_string(param_build.get(), "group",
-                                         "prime256v1", 0) ||
+                                         group_name, 0) ||
         !OSSL_PARAM_BLD_push_octet_string(param_build.get(), "pub", buf,
                                           out_len) ||
         (params = OSSL_PARAM_BLD_to_param(param_build.get())) == NULL) {
@@ -394,11 +2470,12 @@ std::string es256_from_coords(const std::string &x_str,
     OSSL_PARAM_free(params);
     OPENSSL_free(buf);
 #else
+    (void)group_name;
     std::unique_ptr<EC_KEY, decltype(&EC_KEY_free)> ec(
-        EC_KEY_new_by_curve_name(EC_NAME), EC_KEY_free);
+        EC_KEY_new_by_curve_name(nid), EC_KEY_free);
     if (!ec.get()) {
         throw UnsupportedKeyException(
-            "OpenSSL does not support the P-256 curve");
+            "OpenSSL does not support the key's curve");
     }
 
     EC_GROUP *params = (EC_GROUP *)EC_KEY_get0_group(ec.get());
@@ -434,8 +2511,8 @@ std::string es256_from_coords(const std::string &x_str,
 
 std::string rs256_from_coords(const std::string &e_str,
                               const std::string &n_str) {
-    auto e_decode = b64url_decode_nopadding(e_str);
-    auto n_decode = b64url_decode_nopadding(n_str);
+    auto e_decode = internal::b64url_decode(e_str);
+    auto n_decode = internal::b64url_decode(n_str);
     std::unique_ptr<BIO, decltype(&BIO_free_all)> pubkey_bio(
         BIO_new(BIO_s_mem()), BIO_free_all);
     std::unique_ptr<BIGNUM, decltype(&BN_free)> e_bignum(
@@ -508,68 +2585,243 @@ std::string rs256_from_coords(const std::string &e_str,
     return result;
 }
 
+#ifdef SCITOKENS_HAVE_EDDSA
+std::string ed25519_from_x(const std::string &x_str) {
+    auto x_decode = internal::b64url_decode(x_str);
+    std::unique_ptr<EVP_PKEY, decltype(&EVP_PKEY_free)> pkey(
+        EVP_PKEY_new_raw_public_key(
+            EVP_PKEY_ED25519, nullptr,
+            reinterpret_cast<const unsigned char *>(x_decode.data()),
+            x_decode.size()),
+        EVP_PKEY_free);
+    if (!pkey.get()) {
+        throw UnsupportedKeyException("Invalid Ed25519 public key");
+    }
+    std::unique_ptr<BIO, decltype(&BIO_free_all)> pubkey_bio(
+        BIO_new(BIO_s_mem()), BIO_free_all);
+    if (PEM_write_bio_PUBKEY(pubkey_bio.get(), pkey.get()) == 0) {
+        throw UnsupportedKeyException("Failed to serialize Ed25519 public key");
+    }
+
+    char *mem_data;
+    size_t mem_len = BIO_get_mem_data(pubkey_bio.get(), &mem_data);
+    return std::string(mem_data, mem_len);
+}
+#endif
+
+// The PEM of a key resolved from a JWK.
+std::string pem_from_key(const internal::KeyIndex::Key &key) {
+    if (key.m_alg == "ES256") {
+        return ec_from_coords(key.m_first, key.m_second, EC_NAME,
+                              "prime256v1");
+    } else if (key.m_alg == "ES384") {
+        return ec_from_coords(key.m_first, key.m_second, NID_secp384r1,
+                              "secp384r1");
+#ifdef SCITOKENS_HAVE_EDDSA
+    } else if (key.m_alg == "EdDSA") {
+        return ed25519_from_x(key.m_first);
+#endif
+    }
+    return rs256_from_coords(key.m_first, key.m_second);
+}
+
 /**
  * Normalize path: collapse etc.
  * >>> normalize_path('/a/b///c')
  * '/a/b/c'
+ *
+ * Writes into `result`, so a caller reusing it normalizes in one pass
+ * without allocating.
  */
-std::string normalize_absolute_path(const std::string &path) {
-    if ((path == "//") || (path == "/") || (path == "")) {
-        return "/";
+void normalize_absolute_path(const char *data, size_t len,
+                             std::string &result) {
+    result.clear();
+    const char *iter = data, *end = data + len;
+    while (iter != end) {
+        while (iter != end && *iter == '/') {
+            iter++;
+        }
+        auto next = std::find(iter, end, '/');
+        size_t component_len = next - iter;
+        if (is_dot_dot(iter, component_len)) {
+            // Above the root, ".." stays at the root.
+            auto slash = result.rfind('/');
+            result.resize(slash == std::string::npos ? 0 : slash);
+        } else if (component_len && !is_dot(iter, component_len)) {
+            result += '/';
+            result.append(iter, component_len);
+        }
+        iter = next;
     }
-    std::vector<std::string> path_components;
-    auto path_iter = path.begin();
-    while (path_iter != path.end()) {
-        while (*path_iter == '/') {
-            path_iter++;
-        }
-        auto next_path_iter = std::find(path_iter, path.end(), '/');
-        std::string component;
-        component.reserve(std::distance(path_iter, next_path_iter));
-        component.assign(path_iter, next_path_iter);
-        path_components.push_back(component);
-        path_iter = next_path_iter;
-    }
-    std::vector<std::string> path_components_filtered;
-    path_components_filtered.reserve(path_components.size());
-    for (const auto &component : path_components) {
-        if (component == "..") {
-            path_components_filtered.pop_back();
-        } else if (!component.empty() && component != ".") {
-            path_components_filtered.push_back(component);
+    if (result.empty()) {
+        result = "/";
+    }
+}
+
+bool equals(const char *data, size_t len, const char *literal) {
+    return !strncmp(data, literal, len) && literal[len] == '\0';
+}
+
+// Whether the token's payload may name one of the issuers, judged from the
+// base64url-decoded text alone.  Escapes could hide an issuer that is
+// there, so a payload with any passes, as does one that does not decode.
+bool may_name_issuer(const std::string &data,
+                     const std::vector<std::string> &allowed_issuers) {
+    auto start = data.find('.');
+    auto end = data.find('.', start + 1);
+    if (start == std::string::npos || end == std::string::npos) {
+        return true;
+    }
+    std::string payload;
+    try {
+        payload = internal::b64url_decode(data.data() + start + 1,
+                                          end - start - 1);
+    } catch (std::exception &) {
+        return true;
+    }
+    if (payload.find('\\') != std::string::npos) {
+        return true;
+    }
+    std::string quoted;
+    for (const auto &issuer : allowed_issuers) {
+        quoted.assign(1, '"').append(issuer).append(1, '"');
+        if (payload.find(quoted) != std::string::npos) {
+            return true;
         }
     }
-    std::stringstream ss;
-    for (const auto &component : path_components_filtered) {
-        ss << "/" << component;
+    return false;
+}
+
+// Decode a serialized token's parts with the library's base64url codec.
+std::shared_ptr<const jwt::decoded_jwt<jwt::traits::kazuho_picojson>>
+decode_token(const std::string &data) {
+    return std::make_shared<
+        const jwt::decoded_jwt<jwt::traits::kazuho_picojson>>(
+        data, [](const std::string &part) {
+            return internal::b64url_decode(part);
+        });
+}
+
+// Decode a serialized token, closing the trace span (if any) when the
+// token is malformed or, with the issuer prefilter on, plainly not from
+// one of `allowed_issuers`.  Given `why`, the prefilter's rejection is
+// recorded there, and null returned, instead of thrown.
+std::shared_ptr<const jwt::decoded_jwt<jwt::traits::kazuho_picojson>>
+decode_traced(const std::string &data, internal::TraceSpan *span,
+              const std::vector<std::string> &allowed_issuers,
+              internal::Rejection *why = nullptr) {
+    try {
+        if (!allowed_issuers.empty() &&
+            configurer::Configuration::get_issuer_prefilter() &&
+            !may_name_issuer(data, allowed_issuers)) {
+            auto &stats = internal::Stats::get();
+            internal::Stats::add(stats.m_early_rejections);
+            const char *reason =
+                "Token issuer is not in list of allowed issuers.";
+            if (!why) {
+                throw JWTVerificationException(reason);
+            }
+            why->set(reason);
+            if (span) {
+                span->finish(why->message().c_str());
+            }
+            return nullptr;
+        }
+        auto decoded = decode_token(data);
+        if (span) {
+            span->mark(internal::TraceSpan::DECODE);
+        }
+        return decoded;
+    } catch (std::exception &exc) {
+        if (span) {
+            span->finish(exc.what());
+        }
+        throw;
     }
-    std::string result = ss.str();
-    return result.empty() ? "/" : result;
 }
 
 } // namespace
 
+
 void SciToken::deserialize(const std::string &data,
                            const std::vector<std::string> allowed_issuers) {
-    m_decoded.reset(new jwt::decoded_jwt<jwt::traits::kazuho_picojson>(data));
+    internal::Rejection why;
+    if (!try_deserialize(data, allowed_issuers, why)) {
+        why.raise();
+    }
+}
+
+void SciToken::deserialize(const std::string &data, const Validator &validator,
+                           const std::vector<std::string> &allowed_issuers) {
+    internal::Rejection why;
+    if (!try_deserialize(data, validator, allowed_issuers, why)) {
+        why.raise();
+    }
+}
 
+bool SciToken::try_deserialize(const std::string &data,
+                               const std::vector<std::string> &allowed_issuers,
+                               internal::Rejection &why) {
     scitokens::Validator val;
     val.add_allowed_issuers(allowed_issuers);
     val.set_validate_all_claims_scitokens_1(false);
     val.set_validate_profile(m_deserialize_profile);
-    val.verify(*m_decoded);
+    return try_deserialize(data, val, allowed_issuers, why);
+}
+
+bool SciToken::try_deserialize(const std::string &data,
+                               const Validator &validator,
+                               const std::vector<std::string> &allowed_issuers,
+                               internal::Rejection &why) {
+    auto span = internal::TraceSpan::begin();
+    m_decoded = decode_traced(data, span.get(), allowed_issuers, &why);
+    m_claims.clear();
+    if (!m_decoded) {
+        return false;
+    }
 
-    // Set all the claims
-    m_claims = m_decoded->get_payload_claims();
+    // The Validator may be shared, so the profile is taken from here rather
+    // than from Validator::get_profile.
+    Profile profile;
+    if (!validator.try_verify(m_decoded, std::move(span), profile, why)) {
+        return false;
+    }
 
     // Copy over the profile
-    m_profile = val.get_profile();
+    m_profile = profile;
+    return true;
+}
+
+void SciToken::peek(const std::string &data) {
+    m_decoded = decode_token(data);
+    m_claims.clear();
+    m_profile = Profile::COMPAT;
+}
+
+std::string SciToken::peek_header(const std::string &data) {
+    auto end = data.find('.');
+    if (end == std::string::npos) {
+        throw std::invalid_argument("invalid token supplied");
+    }
+    auto header = internal::b64url_decode(data.substr(0, end));
+    picojson::value json;
+    auto err = picojson::parse(json, header);
+    if (!err.empty()) {
+        throw JsonException(err);
+    }
+    if (!json.is<picojson::object>()) {
+        throw JsonException("Token header is not a JSON object");
+    }
+    return header;
 }
 
 std::unique_ptr<SciTokenAsyncStatus>
 SciToken::deserialize_start(const std::string &data,
-                            const std::vector<std::string> allowed_issuers) {
-    m_decoded.reset(new jwt::decoded_jwt<jwt::traits::kazuho_picojson>(data));
+                            const std::vector<std::string> allowed_issuers,
+                            std::shared_ptr<internal::FetchContext> context) {
+    auto span = internal::TraceSpan::begin();
+    m_decoded = decode_traced(data, span.get(), allowed_issuers);
+    m_claims.clear();
 
     std::unique_ptr<SciTokenAsyncStatus> status(new SciTokenAsyncStatus());
     status->m_validator.reset(new scitokens::Validator());
@@ -577,7 +2829,8 @@ SciToken::deserialize_start(const std::string &data,
     status->m_validator->set_validate_all_claims_scitokens_1(false);
     status->m_validator->set_validate_profile(m_deserialize_profile);
 
-    status->m_status = status->m_validator->verify_async(*m_decoded);
+    status->m_status = status->m_validator->verify_async(
+        m_decoded, std::move(context), true, std::move(span));
 
     return deserialize_continue(std::move(status));
 }
@@ -585,69 +2838,574 @@ SciToken::deserialize_start(const std::string &data,
 std::unique_ptr<SciTokenAsyncStatus>
 SciToken::deserialize_continue(std::unique_ptr<SciTokenAsyncStatus> status) {
 
-    // Check if the status is completed (verification is complete)
-    if (status->m_status) {
-        // Set all the claims
-        m_claims = m_decoded->get_payload_claims();
-
-        // Copy over the profile
-        m_profile = status->m_validator->get_profile();
-    } else {
+    if (!status->m_status->m_done) {
         status->m_status = status->m_validator->verify_async_continue(
             std::move(status->m_status));
     }
 
+    // Check if the status is completed (verification is complete)
+    if (status->m_status->m_done) {
+        // Copy over the profile
+        m_profile = status->m_status->m_profile;
+    }
+
     return std::move(status);
 }
 
-std::unique_ptr<AsyncStatus>
-Validator::get_public_keys_from_web(const std::string &issuer,
-                                    unsigned timeout) {
+void SciToken::deserialize_with_callback(
+    const std::string &data, std::vector<std::string> allowed_issuers,
+    std::function<void(std::exception_ptr)> done) {
+    auto validator = std::make_shared<Validator>();
+    try {
+        m_decoded = decode_traced(data, nullptr, allowed_issuers);
+        m_claims.clear();
+        validator->add_allowed_issuers(allowed_issuers);
+        validator->set_validate_all_claims_scitokens_1(false);
+        validator->set_validate_profile(m_deserialize_profile);
+    } catch (...) {
+        done(std::current_exception());
+        return;
+    }
+    // The callback keeps the Validator alive until it is called.
+    validator->verify_with_callback(
+        m_decoded, [this, validator, done](Profile profile,
+                                           std::exception_ptr error) {
+            if (!error) {
+                m_profile = profile;
+            }
+            done(error);
+        });
+}
+
+std::vector<std::string>
+SciToken::deserialize_many(const std::vector<std::string> &data,
+                           const std::vector<SciToken *> &tokens,
+                           const std::vector<std::string> &allowed_issuers,
+                           unsigned threads) {
+    std::vector<std::string> errors(data.size());
+    // Tokens may ask for different profiles; verify each profile's batch
+    // with its own validator.
+    std::map<Profile, std::vector<size_t>> batches;
+    for (size_t idx = 0; idx < data.size(); idx++) {
+        auto &token = *tokens[idx];
+        try {
+            token.m_decoded =
+                decode_traced(data[idx], nullptr, allowed_issuers);
+            token.m_claims.clear();
+            batches[token.m_deserialize_profile].push_back(idx);
+        } catch (std::exception &exc) {
+            errors[idx] = exc.what();
+        }
+    }
+
+    for (const auto &batch : batches) {
+        scitokens::Validator val;
+        val.add_allowed_issuers(allowed_issuers);
+        val.set_validate_all_claims_scitokens_1(false);
+        val.set_validate_profile(batch.first);
+
+        std::vector<std::shared_ptr<
+            const jwt::decoded_jwt<jwt::traits::kazuho_picojson>>>
+            decoded;
+        decoded.reserve(batch.second.size());
+        for (auto idx : batch.second) {
+            decoded.push_back(tokens[idx]->m_decoded);
+        }
+        std::vector<Profile> profiles;
+        auto batch_errors = val.verify_many(decoded, profiles, threads);
+        for (size_t pos = 0; pos < batch.second.size(); pos++) {
+            auto idx = batch.second[pos];
+            if (batch_errors[pos].empty()) {
+                tokens[idx]->m_profile = profiles[pos];
+            } else {
+                errors[idx] = std::move(batch_errors[pos]);
+            }
+        }
+    }
+    return errors;
+}
+
+namespace {
+
+// Pad a serialized JSON object missing its closing brace with spaces, which
+// JSON ignores, to a multiple of 3 bytes: its base64url encoding then has
+// no padding and the rest of the object can be encoded separately.
+void pad_to_base64_block(std::string &json) {
+    while (json.size() % 3) {
+        json += ' ';
+    }
+}
+
+} // namespace
+
+TokenTemplate::TokenTemplate(const SciToken &token)
+    : m_key(token.m_key), m_lifetime(token.m_lifetime) {
+    if (!token.m_issuer_set) {
+        throw MissingIssuerException();
+    }
+    auto claims = token.m_claims;
+    if (token.m_decoded) {
+        for (const auto &entry : token.m_decoded->get_payload_claims()) {
+            claims.insert(entry);
+        }
+    }
+    token.add_profile_claims(claims);
+    for (const auto &name : {"jti", "iat", "nbf", "exp"}) {
+        claims.erase(name);
+    }
+    auto sub = claims.find("sub");
+    if (sub != claims.end()) {
+        m_sub = sub->second.as_string();
+        claims.erase(sub);
+    }
+
+    picojson::object header;
+    header["alg"] = picojson::value(m_key.name());
+    header["kid"] = picojson::value(m_key.kid());
+    if (token.m_serialize_profile == SciToken::Profile::AT_JWT) {
+        header["typ"] = picojson::value("at+jwt");
+    }
+    picojson::object payload;
+    for (const auto &entry : claims) {
+        payload[entry.first] = entry.second.to_json();
+    }
+    m_has_fixed_claims = !payload.empty();
+    auto payload_json = picojson::value(payload).serialize();
+    payload_json.pop_back();
+    pad_to_base64_block(payload_json);
+
+    m_prefix = internal::b64url_encode(picojson::value(header).serialize()) +
+               "." + internal::b64url_encode(payload_json);
+}
+
+std::string TokenTemplate::serialize(const std::string &sub) const {
+    auto now = std::chrono::duration_cast<std::chrono::seconds>(
+                   std::chrono::system_clock::now().time_since_epoch())
+                   .count();
+    picojson::object claims;
+    claims["exp"] = picojson::value(static_cast<int64_t>(now + m_lifetime));
+    claims["iat"] = picojson::value(static_cast<int64_t>(now));
+    claims["jti"] = picojson::value(SciToken::generate_jti());
+    claims["nbf"] = picojson::value(static_cast<int64_t>(now));
+    const auto &token_sub = sub.empty() ? m_sub : sub;
+    if (!token_sub.empty()) {
+        claims["sub"] = picojson::value(token_sub);
+    }
+    // Serialize as an object, then drop its opening brace.
+    auto suffix = picojson::value(claims).serialize();
+    suffix[0] = m_has_fixed_claims ? ',' : ' ';
+
+    auto token = m_prefix + internal::b64url_encode(suffix);
+    std::error_code ec;
+    auto signature = m_key.sign(token, ec);
+    jwt::error::throw_if_error(ec);
+    return token + "." + internal::b64url_encode(signature);
+}
+
+std::vector<std::string>
+TokenTemplate::serialize_many(const std::vector<std::string> &subs,
+                              unsigned threads) const {
+    std::vector<std::string> tokens(subs.size());
+    internal::parallel_for(subs.size(), threads, [&](size_t idx) {
+        tokens[idx] = serialize(subs[idx]);
+    });
+    return tokens;
+}
+
+std::shared_ptr<const Validator::ClaimPlan>
+Validator::base_claim_plan(bool issuer_checked) {
+    static const auto make = [](bool issuer_checked) {
+        ClaimPlan plan;
+        for (const char *name : {"exp", "iat", "iss", "nbf", "ver"}) {
+            if (issuer_checked || strcmp(name, "iss")) {
+                plan.emplace_back();
+                plan.back().m_name = name;
+                plan.back().m_skip = true;
+            }
+        }
+        return std::make_shared<const ClaimPlan>(std::move(plan));
+    };
+    static const std::shared_ptr<const ClaimPlan> plain = make(false);
+    static const std::shared_ptr<const ClaimPlan> checked = make(true);
+    return issuer_checked ? checked : plain;
+}
+
+void Validator::rebuild_claim_plan() {
+    bool issuer_checked = !m_allowed_issuers.empty();
+    if (m_validators.empty() && m_claim_validators.empty() &&
+        m_string_claims.empty() && m_accepted_claims.empty()) {
+        m_claim_plan = base_claim_plan(issuer_checked);
+        return;
+    }
+
+    std::map<std::string, ClaimRule> rules;
+    for (const auto &entry : m_validators) {
+        auto &funcs = rules[entry.first].m_string_validators;
+        funcs.insert(funcs.end(), entry.second.begin(), entry.second.end());
+    }
+    for (const auto &entry : m_claim_validators) {
+        auto &funcs = rules[entry.first].m_claim_validators;
+        funcs.insert(funcs.end(), entry.second.begin(), entry.second.end());
+    }
+    for (const auto &name : m_string_claims) {
+        rules[name].m_require_string = true;
+    }
+    for (const auto &name : m_accepted_claims) {
+        rules[name];
+    }
+
+    for (const auto &rule : *base_claim_plan(issuer_checked)) {
+        // The issuer's own validators still run; a validator registered
+        // for the other skipped claims never has.
+        if (rule.m_name != "iss") {
+            rules.erase(rule.m_name);
+        }
+        rules.emplace(rule.m_name, rule);
+    }
+
+    ClaimPlan plan;
+    plan.reserve(rules.size());
+    for (auto &entry : rules) {
+        ClaimRule &rule = entry.second;
+        rule.m_name = entry.first;
+        if (!rule.m_skip) {
+            rule.m_not_string_error =
+                "'" + rule.m_name + "' claim value must be a string to verify.";
+            rule.m_failed_error =
+                "'" + rule.m_name + "' claim verification failed.";
+        }
+        plan.push_back(std::move(rule));
+    }
+    m_claim_plan = std::make_shared<const ClaimPlan>(std::move(plan));
+}
+
+void Validator::verify_with_callback(
+    std::shared_ptr<const jwt::decoded_jwt<jwt::traits::kazuho_picojson>>
+        jwt_decoded,
+    VerifyCallback done) const {
+    auto &engine = internal::CompletionEngine::get();
+    // Held by the engine's step; std::function can't hold the status.
+    struct Request {
+        std::unique_ptr<AsyncStatus> m_status;
+        VerifyCallback m_done;
+    };
+    auto request = std::make_shared<Request>();
+    try {
+        request->m_status = verify_async(std::move(jwt_decoded),
+                                         engine.get_context(), true);
+    } catch (...) {
+        done(SciToken::Profile::COMPAT, std::current_exception());
+        return;
+    }
+    if (request->m_status->m_done) {
+        done(request->m_status->m_profile, nullptr);
+        return;
+    }
+    request->m_done = std::move(done);
+    engine.submit([this, request]() {
+        try {
+            request->m_status =
+                verify_async_continue(std::move(request->m_status));
+        } catch (...) {
+            request->m_done(SciToken::Profile::COMPAT,
+                            std::current_exception());
+            return true;
+        }
+        if (!request->m_status->m_done) {
+            return false;
+        }
+        request->m_done(request->m_status->m_profile, nullptr);
+        return true;
+    });
+}
+
+std::future<SciToken::Profile> Validator::verify_future(
+    std::shared_ptr<const jwt::decoded_jwt<jwt::traits::kazuho_picojson>>
+        jwt_decoded) const {
+    auto promise = std::make_shared<std::promise<SciToken::Profile>>();
+    auto future = promise->get_future();
+    verify_with_callback(
+        std::move(jwt_decoded),
+        [promise](SciToken::Profile profile, std::exception_ptr error) {
+            if (error) {
+                promise->set_exception(error);
+            } else {
+                promise->set_value(profile);
+            }
+        });
+    return future;
+}
+
+bool Validator::try_verify(
+    std::shared_ptr<const jwt::decoded_jwt<jwt::traits::kazuho_picojson>>
+        jwt_decoded,
+    std::unique_ptr<internal::TraceSpan> span, SciToken::Profile &profile,
+    internal::Rejection &why) const {
+    if (!span) {
+        span = internal::TraceSpan::begin();
+    }
+    const auto &jwt = *jwt_decoded;
+    try {
+        if (span && jwt.has_issuer()) {
+            span->m_issuer = jwt.get_issuer();
+            span->m_kid = get_key_id(jwt);
+        }
+        if (check_preconditions(jwt, profile, why)) {
+            auto status =
+                get_public_key_pem(jwt.get_issuer(), get_key_id(jwt), nullptr);
+            while (!status->m_done) {
+                status = get_public_key_pem_continue(std::move(status));
+            }
+            if (span) {
+                span->mark(internal::TraceSpan::KEY_LOOKUP);
+                span->carve(internal::TraceSpan::KEY_CONSTRUCT,
+                            internal::TraceSpan::KEY_LOOKUP,
+                            status->m_key_construct_time);
+                span->m_key_source = status->m_key_source;
+            }
+            check_token(jwt, *status->m_public_key, status->m_issuer, profile,
+                        span.get(), why);
+        }
+    } catch (std::exception &exc) {
+        if (span) {
+            span->finish(exc.what());
+        }
+        throw;
+    }
+    if (why) {
+        if (span) {
+            span->finish(why.message().c_str());
+        }
+        return false;
+    }
+    if (span) {
+        span->finish(nullptr);
+    }
+    m_profile = profile;
+    return true;
+}
+
+std::vector<std::string> Validator::verify_many(
+    const std::vector<
+        std::shared_ptr<const jwt::decoded_jwt<jwt::traits::kazuho_picojson>>>
+        &tokens,
+    std::vector<SciToken::Profile> &profiles, unsigned threads) const {
+    std::vector<std::string> errors(tokens.size());
+    profiles.assign(tokens.size(), SciToken::Profile::COMPAT);
+
+    // Group the tokens by the key that signed them, checking on the way
+    // whatever can be checked without it.
+    struct KeyRequest {
+        std::vector<size_t> m_tokens;
+        std::unique_ptr<AsyncStatus> m_status;
+    };
+    std::map<std::pair<std::string, std::string>, KeyRequest> requests;
+    for (size_t idx = 0; idx < tokens.size(); idx++) {
+        try {
+            const auto &jwt = *tokens[idx];
+            internal::Rejection why;
+            if (!check_preconditions(jwt, profiles[idx], why)) {
+                errors[idx] = why.message();
+                continue;
+            }
+            requests[{jwt.get_issuer(), get_key_id(jwt)}].m_tokens.push_back(
+                idx);
+        } catch (std::exception &exc) {
+            errors[idx] = exc.what();
+        }
+    }
+    auto fail = [&](KeyRequest &request, const std::string &error) {
+        for (auto idx : request.m_tokens) {
+            errors[idx] = error;
+        }
+        request.m_status.reset();
+    };
+    auto pending = [](const KeyRequest &request) {
+        return request.m_status && !request.m_status->m_done;
+    };
+
+    // Look up each key once; any downloads run side by side on one multi
+    // handle, and the refresh coordinator folds those for the same issuer.
+    auto context = std::make_shared<internal::FetchContext>();
+    for (auto &entry : requests) {
+        try {
+            entry.second.m_status = get_public_key_pem(
+                entry.first.first, entry.first.second, context);
+        } catch (std::exception &exc) {
+            fail(entry.second, exc.what());
+        }
+    }
+    auto expiry_time = time(NULL) + 20;
+    while (std::any_of(requests.begin(), requests.end(),
+                       [&](const decltype(requests)::value_type &entry) {
+                           return pending(entry.second);
+                       })) {
+        if (time(NULL) >= expiry_time) {
+            for (auto &entry : requests) {
+                if (pending(entry.second)) {
+                    fail(entry.second,
+                         "Timeout when loading the OIDC metadata.");
+                }
+            }
+            break;
+        }
+        context->wait(internal::RefreshState::poll_interval_ms);
+        for (auto &entry : requests) {
+            if (!pending(entry.second)) {
+                continue;
+            }
+            try {
+                entry.second.m_status = get_public_key_pem_continue(
+                    std::move(entry.second.m_status));
+            } catch (std::exception &exc) {
+                fail(entry.second, exc.what());
+            }
+        }
+    }
+
+    // Check the signatures and claims, with each token starting from the
+    // state its key lookup ended in.
+    std::vector<std::pair<size_t, std::unique_ptr<AsyncStatus>>> jobs;
+    for (const auto &entry : requests) {
+        const auto &key_status = entry.second.m_status;
+        if (!key_status) {
+            continue;
+        }
+        for (auto idx : entry.second.m_tokens) {
+            std::unique_ptr<AsyncStatus> status(new AsyncStatus());
+            status->m_done = true;
+            status->m_issuer = key_status->m_issuer;
+            status->m_kid = key_status->m_kid;
+            status->m_public_key = key_status->m_public_key;
+            status->m_jwt = tokens[idx];
+            status->m_profile = profiles[idx];
+            jobs.emplace_back(idx, std::move(status));
+        }
+    }
+    internal::parallel_for(jobs.size(), threads, [&](size_t job) {
+        auto idx = jobs[job].first;
+        try {
+            auto result = verify_async_continue(std::move(jobs[job].second));
+            profiles[idx] = result->m_profile;
+        } catch (std::exception &exc) {
+            errors[idx] = exc.what();
+        }
+    });
+    return errors;
+}
+
+bool Validator::start_verify_job(AsyncStatus &status,
+                                 internal::TraceSpan *span) const {
+    // Checked without the pool's lock first, so the common case of no
+    // worker threads doesn't pay for a pipe.
+    if (configurer::Configuration::get_verify_threads() <= 0) {
+        return false;
+    }
+    auto job = std::make_shared<internal::VerifyJob>();
+    auto jwt = status.m_jwt;
+    auto key = status.m_public_key;
+    auto issuer = status.m_issuer;
+    auto profile = status.m_profile;
+    bool submitted =
+        internal::VerifyPool::get().submit([this, job, jwt, key, issuer,
+                                            profile, span]() mutable {
+            try {
+                check_token(*jwt, *key, issuer, profile, span);
+                job->finish(profile, nullptr);
+            } catch (...) {
+                job->finish(profile, std::current_exception());
+            }
+        });
+    if (!submitted) {
+        return false;
+    }
+    status.m_verify_job = std::move(job);
+    status.m_done = false;
+    return true;
+}
+
+void Validator::get_public_keys_from_web(AsyncStatus &status,
+                                         const std::string &issuer,
+                                         unsigned timeout) {
     std::string openid_metadata, oauth_metadata;
     get_metadata_endpoint(issuer, openid_metadata, oauth_metadata);
 
-    std::unique_ptr<AsyncStatus> status(new AsyncStatus());
-    status->m_oauth_metadata_url = oauth_metadata;
-    status->m_cget.reset(new internal::SimpleCurlGet(1024 * 1024, timeout));
-    auto cget_status = status->m_cget->perform_start(openid_metadata);
-    status->m_continue_fetch = true;
+    status.m_timeout = timeout;
+    status.m_continue_fetch = true;
+    if (status.m_refresh_start == std::chrono::steady_clock::time_point()) {
+        // Not when rediscovering keys that moved, mid-refresh.
+        status.m_refresh_start = std::chrono::steady_clock::now();
+        internal::Stats::add(internal::Stats::get().m_refreshes);
+    }
+    const auto &metadata = status.m_metadata;
+    if (!metadata.m_jwks_uri.empty() &&
+        std::time(NULL) <= metadata.m_jwks_uri_expires) {
+        // We already know where the keys are; skip the discovery.
+        status.m_state = AsyncStatus::DOWNLOAD_PUBLIC_KEY;
+        status.m_jwks_uri_cached = true;
+        status.m_cget.reset(new internal::SimpleCurlGet(
+            configurer::Configuration::get_max_jwks_bytes(), timeout,
+            status.m_fetch_context));
+        if (status.m_keys) {
+            status.m_cget->set_conditional(metadata.m_etag,
+                                           metadata.m_last_modified);
+        }
+        status.m_cget->perform_start(metadata.m_jwks_uri);
+        return;
+    }
+
+    // Try whichever metadata endpoint worked last time first.
+    bool oauth_first = metadata.m_metadata_url == oauth_metadata;
+    status.m_state = AsyncStatus::DOWNLOAD_METADATA;
+    status.m_jwks_uri_cached = false;
+    status.m_metadata_fallback = false;
+    status.m_metadata_url = oauth_first ? oauth_metadata : openid_metadata;
+    status.m_fallback_metadata_url =
+        oauth_first ? openid_metadata : oauth_metadata;
+    status.m_cget.reset(new internal::SimpleCurlGet(
+        configurer::Configuration::get_max_metadata_bytes(), timeout,
+        status.m_fetch_context));
+    auto cget_status = status.m_cget->perform_start(status.m_metadata_url);
     if (!cget_status.m_done) {
-        return std::move(status);
+        return;
     }
-    return get_public_keys_from_web_continue(std::move(status));
+    get_public_keys_from_web_continue(status);
 }
 
-std::unique_ptr<AsyncStatus> Validator::get_public_keys_from_web_continue(
-    std::unique_ptr<AsyncStatus> status) {
+void Validator::get_public_keys_from_web_continue(AsyncStatus &status) {
     char *buffer;
     size_t len;
 
-    switch (status->m_state) {
+    switch (status.m_state) {
 
     case AsyncStatus::DOWNLOAD_METADATA: {
-        auto cget_status = status->m_cget->perform_continue();
+        auto cget_status = status.m_cget->perform_continue();
         if (!cget_status.m_done) {
-            return std::move(status);
+            return;
         }
         if (cget_status.m_status_code != 200) {
-            if (status->m_oauth_fallback) {
+            if (status.m_metadata_fallback) {
                 throw CurlException("Failed to retrieve metadata provider "
                                     "information for issuer.");
             } else {
-                status->m_oauth_fallback = true;
-                status->m_cget.reset(new internal::SimpleCurlGet());
-                cget_status =
-                    status->m_cget->perform_start(status->m_oauth_metadata_url);
+                status.m_metadata_fallback = true;
+                status.m_cget.reset(new internal::SimpleCurlGet(
+                    configurer::Configuration::get_max_metadata_bytes(),
+                    internal::SimpleCurlGet::extended_timeout,
+                    status.m_fetch_context));
+                cget_status = status.m_cget->perform_start(
+                    status.m_fallback_metadata_url);
                 if (!cget_status.m_done) {
-                    return std::move(status);
+                    return;
                 }
-                return get_public_keys_from_web_continue(std::move(status));
+                return get_public_keys_from_web_continue(status);
             }
         }
-        status->m_cget->get_data(buffer, len);
-        std::string metadata(buffer, len);
+        // Parsed straight from the download buffer.
+        status.m_cget->get_data(buffer, len);
         picojson::value json_obj;
-        auto err = picojson::parse(json_obj, metadata);
+        std::string err;
+        picojson::parse(json_obj, buffer, buffer + len, &err);
         if (!err.empty()) {
             throw JsonException(err);
         }
@@ -655,79 +3413,289 @@ std::unique_ptr<AsyncStatus> Validator::get_public_keys_from_web_continue(
             throw JsonException(
                 "Metadata resource contains improperly-formatted JSON.");
         }
-        auto top_obj = json_obj.get<picojson::object>();
+        const auto &top_obj = json_obj.get<picojson::object>();
         auto iter = top_obj.find("jwks_uri");
         if (iter == top_obj.end() || (!iter->second.is<std::string>())) {
             throw JsonException(
                 "Metadata resource is missing 'jwks_uri' string value");
         }
-        auto jwks_uri = iter->second.get<std::string>();
-        status->m_has_metadata = true;
-        status->m_state = AsyncStatus::DOWNLOAD_PUBLIC_KEY;
-        status->m_cget.reset(new internal::SimpleCurlGet());
-        status->m_cget->perform_start(jwks_uri);
+        auto jwks_uri = iter->second.get<std::string>();
+        status.m_has_metadata = true;
+
+        // Remember where the keys are (and how we found out) for next time.
+        auto &cached = status.m_metadata;
+        if (jwks_uri != cached.m_jwks_uri) {
+            // Validators from another URL don't apply.
+            cached.m_etag.clear();
+            cached.m_last_modified.clear();
+        }
+        cached.m_jwks_uri = jwks_uri;
+        cached.m_jwks_uri_expires =
+            std::time(NULL) + configurer::Configuration::get_metadata_delta();
+        cached.m_metadata_url = status.m_metadata_fallback
+                                    ? status.m_fallback_metadata_url
+                                    : status.m_metadata_url;
+
+        status.m_state = AsyncStatus::DOWNLOAD_PUBLIC_KEY;
+        status.m_cget.reset(new internal::SimpleCurlGet(
+            configurer::Configuration::get_max_jwks_bytes(),
+            internal::SimpleCurlGet::extended_timeout,
+            status.m_fetch_context));
+        if (status.m_keys) {
+            // Only ask for the key set if it changed from what we have.
+            status.m_cget->set_conditional(status.m_metadata.m_etag,
+                                           status.m_metadata.m_last_modified);
+        }
+        status.m_cget->perform_start(jwks_uri);
         // This should also fall through the next state
     }
 
     case AsyncStatus::DOWNLOAD_PUBLIC_KEY: {
-        auto cget_status = status->m_cget->perform_continue();
+        auto cget_status = status.m_cget->perform_continue();
         if (!cget_status.m_done) {
-            return std::move(status);
+            return;
         }
-        if (cget_status.m_status_code != 200) {
+        // A 304 is only possible for a conditional request, so we have the
+        // current keys already.
+        bool not_modified = cget_status.m_status_code == 304 && status.m_keys;
+        if (cget_status.m_status_code != 200 && !not_modified) {
+            if (status.m_jwks_uri_cached) {
+                // The keys may have moved; rediscover them.
+                status.m_metadata.m_jwks_uri.clear();
+                return get_public_keys_from_web(status, status.m_issuer,
+                                                status.m_timeout);
+            }
             throw CurlException("Failed to retrieve the issuer's key set");
         }
 
-        status->m_cget->get_data(buffer, len);
-        auto metadata = std::string(buffer, len);
-        picojson::value json_obj;
-        auto err = picojson::parse(json_obj, metadata);
-        status->m_cget.reset();
-        if (!err.empty()) {
-            throw JsonException(err);
+        const auto &headers = status.m_cget->get_cache_headers();
+        if (!not_modified) {
+            status.m_cget->get_data(buffer, len);
+            picojson::value json_obj;
+            std::string err;
+            picojson::parse(json_obj, buffer, buffer + len, &err);
+            if (!err.empty()) {
+                throw JsonException(err);
+            }
+            status.m_keys =
+                std::make_shared<const picojson::value>(std::move(json_obj));
+            status.m_metadata.m_etag = headers.m_etag;
+            status.m_metadata.m_last_modified = headers.m_last_modified;
+        } else {
+            auto &stats = internal::Stats::get();
+            internal::Stats::add(stats.m_refresh_not_modified);
+            // A 304 may carry updated validators.
+            if (!headers.m_etag.empty()) {
+                status.m_metadata.m_etag = headers.m_etag;
+            }
+            if (!headers.m_last_modified.empty()) {
+                status.m_metadata.m_last_modified = headers.m_last_modified;
+            }
         }
 
         auto now = std::time(NULL);
-        // TODO: take expiration time from the cache-control header in the
-        // response.
-
-        int next_update_delta =
+        long next_update_delta =
             configurer::Configuration::get_next_update_delta();
+        // Prefer the lifetime advertised by the server, within bounds.
+        auto lifetime = headers.lifetime(now);
+        if (lifetime >= 0) {
+            next_update_delta = std::min<long>(
+                std::max<long>(
+                    lifetime, configurer::Configuration::get_min_update_delta()),
+                configurer::Configuration::get_max_update_delta());
+        }
+        status.m_cget.reset();
         int expiry_delta = configurer::Configuration::get_expiry_delta();
-        status->m_next_update = now + next_update_delta;
-        status->m_expires = now + expiry_delta;
-        status->m_keys = json_obj;
-        status->m_continue_fetch = false;
-        status->m_done = true;
-        status->m_state = AsyncStatus::DONE;
+        status.m_next_update = now + next_update_delta;
+        status.m_expires = now + expiry_delta;
+        status.m_continue_fetch = false;
+        status.m_done = true;
+        status.m_state = AsyncStatus::DONE;
     }
     case AsyncStatus::DONE:
-        status->m_done = true;
+        status.m_done = true;
 
     } // Switch
-    return std::move(status);
 }
 
 std::string Validator::get_jwks(const std::string &issuer) {
     auto now = std::time(NULL);
-    picojson::value jwks;
+    std::shared_ptr<const picojson::value> jwks;
     int64_t next_update;
     if (get_public_keys_from_db(issuer, now, jwks, next_update)) {
-        return jwks.serialize();
+        return jwks->serialize();
     }
     return std::string("{\"keys\": []}");
 }
 
 bool Validator::refresh_jwks(const std::string &issuer) {
-    int64_t next_update, expires;
-    picojson::value keys;
-    std::unique_ptr<scitokens::AsyncStatus> status = get_public_keys_from_web(
-        issuer, internal::SimpleCurlGet::extended_timeout);
-    while (!status->m_done) {
-        status = get_public_keys_from_web_continue(std::move(status));
+    return refresh_keys(issuer, internal::SimpleCurlGet::extended_timeout);
+}
+
+bool Validator::refresh_keys(const std::string &issuer, unsigned timeout) {
+    using Outcome = internal::RefreshState::Outcome;
+    std::unique_ptr<AsyncStatus> status(new AsyncStatus());
+    status->m_issuer = issuer;
+    auto expiry_time = time(NULL) + timeout;
+
+    bool leader = false;
+    status->m_refresh =
+        internal::RefreshCoordinator::get().join(issuer, leader);
+    if (!leader) {
+        // Someone else is already fetching these keys; share their result.
+        std::string error;
+        auto outcome = Outcome::PENDING;
+        while (outcome == Outcome::PENDING && time(NULL) < expiry_time) {
+            outcome = status->m_refresh->wait_for(
+                std::chrono::seconds(1), status->m_keys, error);
+        }
+        if (outcome == Outcome::FAILED) {
+            throw CurlException(error);
+        }
+        return outcome == Outcome::SUCCEEDED;
+    }
+    status->m_refresh_leader = true;
+
+    // With the current keys and their validators, the refresh can be a
+    // conditional request.
+    int64_t next_update;
+    if (!get_public_keys_from_db(issuer, time(NULL), status->m_keys,
+                                 next_update, &status->m_metadata)) {
+        status->m_keys.reset();
+    }
+
+    try {
+        get_public_keys_from_web(*status, issuer, timeout);
+        while (!status->m_done) {
+            auto timeout_val = status->get_timeout_val(expiry_time);
+            select(status->get_max_fd() + 1, status->get_read_fd_set(),
+                   status->get_write_fd_set(), status->get_exc_fd_set(),
+                   &timeout_val);
+            get_public_keys_from_web_continue(*status);
+        }
+    } catch (std::runtime_error &exc) {
+        finish_refresh(*status, exc.what());
+        throw;
+    }
+    auto result =
+        store_public_keys(issuer, status->m_keys, status->m_next_update,
+                          status->m_expires, status->m_metadata);
+    finish_refresh(*status, nullptr);
+    return result;
+}
+
+std::vector<std::string>
+Validator::prefetch_keys(const std::vector<std::string> &issuers,
+                         unsigned timeout) {
+    using Outcome = internal::RefreshState::Outcome;
+    auto deadline =
+        std::chrono::steady_clock::now() + std::chrono::seconds(timeout);
+    auto context = std::make_shared<internal::FetchContext>();
+    std::vector<std::string> errors(issuers.size());
+    std::vector<std::unique_ptr<AsyncStatus>> statuses(issuers.size());
+
+    for (size_t idx = 0; idx < issuers.size(); idx++) {
+        std::unique_ptr<AsyncStatus> status(new AsyncStatus());
+        status->m_issuer = issuers[idx];
+        status->m_fetch_context = context;
+        bool leader = false;
+        status->m_refresh =
+            internal::RefreshCoordinator::get().join(issuers[idx], leader);
+        status->m_refresh_leader = leader;
+        if (leader) {
+            int64_t next_update;
+            if (!get_public_keys_from_db(issuers[idx], time(NULL),
+                                         status->m_keys, next_update,
+                                         &status->m_metadata)) {
+                status->m_keys.reset();
+            }
+            try {
+                get_public_keys_from_web(*status, issuers[idx], timeout);
+            } catch (std::runtime_error &exc) {
+                errors[idx] = exc.what();
+                finish_refresh(*status, exc.what());
+            }
+        }
+        statuses[idx] = std::move(status);
+    }
+
+    // Drive every transfer we lead until all are done or time runs out.
+    while (true) {
+        bool active = false;
+        for (size_t idx = 0; idx < statuses.size(); idx++) {
+            auto &status = *statuses[idx];
+            if (!status.m_refresh_leader) {
+                continue;
+            }
+            try {
+                if (!status.m_done) {
+                    get_public_keys_from_web_continue(status);
+                }
+                if (!status.m_done) {
+                    active = true;
+                    continue;
+                }
+                if (!store_public_keys(status.m_issuer, status.m_keys,
+                                       status.m_next_update, status.m_expires,
+                                       status.m_metadata)) {
+                    errors[idx] = "Failed to refresh JWKS cache for issuer.";
+                }
+                finish_refresh(status, nullptr);
+            } catch (std::runtime_error &exc) {
+                errors[idx] = exc.what();
+                finish_refresh(status, exc.what());
+            }
+        }
+        auto remaining = std::chrono::duration_cast<std::chrono::milliseconds>(
+            deadline - std::chrono::steady_clock::now());
+        if (!active || remaining.count() <= 0) {
+            break;
+        }
+        context->wait(remaining.count());
+    }
+
+    for (size_t idx = 0; idx < statuses.size(); idx++) {
+        auto &status = *statuses[idx];
+        if (status.m_refresh_leader) {
+            errors[idx] = "Timed out refreshing the JWKS for issuer.";
+            finish_refresh(status, errors[idx].c_str());
+            continue;
+        }
+        if (!status.m_refresh) {
+            continue;
+        }
+        // Another caller (or an earlier entry in the list) is fetching these
+        // keys; share their result.
+        std::string error;
+        auto outcome = Outcome::PENDING;
+        while (outcome == Outcome::PENDING) {
+            auto remaining =
+                std::chrono::duration_cast<std::chrono::milliseconds>(
+                    deadline - std::chrono::steady_clock::now());
+            if (remaining.count() <= 0) {
+                break;
+            }
+            outcome =
+                status.m_refresh->wait_for(remaining, status.m_keys, error);
+        }
+        if (outcome == Outcome::FAILED) {
+            errors[idx] = error;
+        } else if (outcome != Outcome::SUCCEEDED) {
+            errors[idx] = "Timed out refreshing the JWKS for issuer.";
+        }
+        status.m_refresh.reset();
+    }
+    return errors;
+}
+
+bool Validator::refresh_if_due(const std::string &issuer, int64_t horizon) {
+    std::shared_ptr<const picojson::value> keys;
+    int64_t next_update;
+    if (get_public_keys_from_db(issuer, std::time(NULL), keys, next_update) &&
+        next_update > horizon) {
+        return false;
     }
-    return store_public_keys(issuer, status->m_keys, status->m_next_update,
-                             status->m_expires);
+    return refresh_keys(issuer, internal::SimpleCurlGet::default_timeout);
 }
 
 bool Validator::store_jwks(const std::string &issuer,
@@ -741,128 +3709,226 @@ bool Validator::store_jwks(const std::string &issuer,
     if (!err.empty()) {
         throw JsonException(err);
     }
-    return store_public_keys(issuer, jwks, next_update, expires);
+    return store_public_keys(
+        issuer, std::make_shared<const picojson::value>(std::move(jwks)),
+        next_update, expires);
 }
 
 std::unique_ptr<AsyncStatus>
-Validator::get_public_key_pem(const std::string &issuer, const std::string &kid,
-                              std::string &public_pem, std::string &algorithm) {
+Validator::get_public_key_pem(const std::string &issuer,
+                              const std::string &kid,
+                              std::shared_ptr<internal::FetchContext> context) {
+
+    auto &stats = internal::Stats::get();
+    internal::Stats::add(stats.m_key_lookups);
+    internal::ScopedLatency timer(stats.m_key_lookup_us);
 
     auto now = std::time(NULL);
     std::unique_ptr<AsyncStatus> result(new AsyncStatus());
+    result->m_issuer = issuer;
+    result->m_kid = kid;
+    result->m_fetch_context = std::move(context);
+
+    bool from_memory = false;
+    bool have_keys = get_public_keys_from_db(
+        issuer, now, result->m_keys, result->m_next_update,
+        &result->m_metadata, &from_memory, &result->m_key_index);
+    if (have_keys) {
+        result->m_key_source = from_memory
+                                   ? internal::TraceSpan::KeySource::MEMORY
+                                   : internal::TraceSpan::KeySource::SQLITE;
+    }
+    std::string error;
+    int64_t retry_in;
+    if (have_keys && now <= result->m_next_update) {
+        internal::Stats::add(stats.m_key_lookup_fresh);
+        // Got the keys from the DB, and they are still valid.
+        result->m_do_store = false;
+        result->m_done = true;
+    } else if (internal::NegativeCache::get().backing_off(issuer, error,
+                                                           retry_in)) {
+        // The last attempts to refresh failed; the cached keys, if any,
+        // will have to do until the next.
+        if (!have_keys) {
+            throw CurlException("Unable to get the issuer's keys "
+                                "(retrying in " +
+                                std::to_string(retry_in) + "s): " + error);
+        }
+        result->m_do_store = false;
+        result->m_done = true;
+    } else {
+        // No keys in the DB, or they are due for an update.  If the keys
+        // are expired too, we must wait for the refresh; otherwise the
+        // fetch errors are ignored as we have a valid set of keys already.
+        result->m_ignore_error = have_keys;
+        join_refresh(*result);
+        if (have_keys && !result->m_refresh_leader) {
+            // Someone else is refreshing; keep using the cached keys.
+            result->m_refresh.reset();
+            result->m_done = true;
+        }
+    }
 
-    if (get_public_keys_from_db(issuer, now, result->m_keys,
-                                result->m_next_update)) {
-        if (now > result->m_next_update) {
-            try {
-                result->m_ignore_error = true;
-                result = get_public_keys_from_web(
-                    issuer, internal::SimpleCurlGet::default_timeout);
-            } catch (std::runtime_error &) {
-                result->m_do_store = false;
-                // ignore the exception: we have a valid set of keys already
-            }
+    // Always call the continue because it sets up the public key
+    return get_public_key_pem_continue(std::move(result));
+}
+
+void Validator::join_refresh(AsyncStatus &status) {
+    bool leader = false;
+    status.m_refresh =
+        internal::RefreshCoordinator::get().join(status.m_issuer, leader);
+    status.m_refresh_leader = leader;
+    status.m_do_store = leader;
+    if (leader) {
+        advance_refresh(status, true);
+    }
+}
+
+void Validator::advance_refresh(AsyncStatus &status, bool start) {
+    try {
+        if (start) {
+            get_public_keys_from_web(status, status.m_issuer,
+                                     internal::SimpleCurlGet::default_timeout);
         } else {
-            // Got the keys from the DB, and they are still valid.
-            result->m_continue_fetch = false;
-            result->m_do_store = false;
-            result->m_done = true;
+            get_public_keys_from_web_continue(status);
+        }
+    } catch (std::runtime_error &exc) {
+        finish_refresh(status, exc.what());
+        if (!status.m_ignore_error) {
+            throw;
         }
+        // ignore the exception: we have a valid set of keys already
+        status.m_cget.reset();
+        status.m_continue_fetch = false;
+        status.m_do_store = false;
+    }
+}
+
+void Validator::finish_refresh(AsyncStatus &status, const char *error) {
+    using Outcome = internal::RefreshState::Outcome;
+    auto &stats = internal::Stats::get();
+    if (status.m_refresh_start != std::chrono::steady_clock::time_point()) {
+        stats.m_refresh_us.record(std::chrono::steady_clock::now() -
+                                  status.m_refresh_start);
+        status.m_refresh_start = std::chrono::steady_clock::time_point();
+    }
+    if (error) {
+        stats.record_refresh_failure(status.m_issuer);
+        internal::NegativeCache::get().record_failure(status.m_issuer, error);
     } else {
-        // No keys in the DB, or they are expired, so get them from the web.
-        result = get_public_keys_from_web(
-            issuer, internal::SimpleCurlGet::default_timeout);
+        internal::Stats::add(stats.m_refresh_successes);
+        internal::NegativeCache::get().record_success(status.m_issuer);
     }
-    result->m_issuer = issuer;
-    result->m_kid = kid;
+    internal::RefreshCoordinator::get().finish(
+        status.m_issuer, status.m_refresh,
+        error ? Outcome::FAILED : Outcome::SUCCEEDED,
+        error ? nullptr : status.m_keys, error ? error : "");
+    status.m_refresh.reset();
+    status.m_refresh_leader = false;
+}
 
-    // Always call the continue because it formats the public_pem and algorithm
-    return get_public_key_pem_continue(std::move(result), public_pem,
-                                       algorithm);
+bool Validator::wait_for_refresh(AsyncStatus &status) {
+    using Outcome = internal::RefreshState::Outcome;
+    std::string error;
+    auto outcome = status.m_refresh->wait_for(
+        std::chrono::milliseconds(internal::RefreshState::poll_interval_ms),
+        status.m_keys, error);
+    switch (outcome) {
+    case Outcome::PENDING:
+        return false;
+    case Outcome::SUCCEEDED:
+        status.m_refresh.reset();
+        status.m_key_source = internal::TraceSpan::KeySource::WEB;
+        return true;
+    case Outcome::FAILED:
+        status.m_refresh.reset();
+        throw CurlException(error);
+    case Outcome::ABANDONED:
+        // The leader went away before finishing; take over (or follow
+        // whoever else did).
+        join_refresh(status);
+        return status.m_refresh_leader;
+    }
+    return false;
 }
 
 std::unique_ptr<AsyncStatus>
-Validator::get_public_key_pem_continue(std::unique_ptr<AsyncStatus> status,
-                                       std::string &public_pem,
-                                       std::string &algorithm) {
+Validator::get_public_key_pem_continue(std::unique_ptr<AsyncStatus> status) {
 
+    if (status->m_refresh && !status->m_refresh_leader) {
+        if (!wait_for_refresh(*status)) {
+            return std::move(status);
+        }
+    }
     if (status->m_continue_fetch) {
-        status = get_public_keys_from_web_continue(std::move(status));
+        advance_refresh(*status, false);
         if (status->m_continue_fetch) {
             return std::move(status);
         }
     }
     if (status->m_do_store) {
         store_public_keys(status->m_issuer, status->m_keys,
-                          status->m_next_update, status->m_expires);
+                          status->m_next_update, status->m_expires,
+                          status->m_metadata);
+        status->m_key_source = internal::TraceSpan::KeySource::WEB;
+    }
+    if (status->m_refresh_leader) {
+        // Publish only after storing, so a caller arriving next sees the
+        // new keys in the cache rather than starting another refresh.
+        finish_refresh(*status, nullptr);
     }
     status->m_done = true;
 
-    auto key_obj = find_key_id(status->m_keys, status->m_kid);
-
-    auto iter = key_obj.find("alg");
-    std::string alg;
-    if (iter == key_obj.end() || (!iter->second.is<std::string>())) {
-        auto iter2 = key_obj.find("kty");
-        if (iter2 == key_obj.end() || !iter2->second.is<std::string>()) {
-            throw JsonException("Key is missing key type");
-        } else {
-            auto kty = iter2->second.get<std::string>();
-            if (kty == "RSA") {
-                alg = "RS256";
-            } else if (kty == "EC") {
-                auto iter3 = key_obj.find("crv");
-                if (iter3 == key_obj.end() ||
-                    !iter3->second.is<std::string>()) {
-                    throw JsonException("EC key is missing curve name");
-                }
-                auto crv = iter3->second.get<std::string>();
-                if (crv == "P-256") {
-                    alg = "ES256";
-                } else {
-                    throw JsonException("Unsupported EC curve in public key");
-                }
-            } else {
-                throw JsonException("Unknown public key type");
-            }
-        }
-    } else {
-        alg = iter->second.get<std::string>();
+    if (!status->m_keys) {
+        throw JsonException("Top-level JSON is not an object.");
     }
-    if (alg != "RS256" and alg != "ES256") {
-        throw UnsupportedKeyException(
-            "Issuer is using an unsupported algorithm");
+    // Keys just downloaded, rather than loaded from the cache, have no
+    // index yet.
+    if (!status->m_key_index ||
+        status->m_key_index->get_keys() != status->m_keys) {
+        status->m_key_index =
+            std::make_shared<const internal::KeyIndex>(status->m_keys);
     }
-    std::string pem;
-
-    if (alg == "ES256") {
-        iter = key_obj.find("x");
-        if (iter == key_obj.end() || (!iter->second.is<std::string>())) {
-            throw JsonException("Elliptic curve is missing x-coordinate");
-        }
-        auto x = iter->second.get<std::string>();
-        iter = key_obj.find("y");
-        if (iter == key_obj.end() || (!iter->second.is<std::string>())) {
-            throw JsonException("Elliptic curve is missing y-coordinate");
-        }
-        auto y = iter->second.get<std::string>();
-        pem = es256_from_coords(x, y);
-    } else {
-        iter = key_obj.find("e");
-        if (iter == key_obj.end() || (!iter->second.is<std::string>())) {
-            throw JsonException("Public key is missing exponent");
+    if (!status->m_kid.empty() &&
+        !status->m_key_index->contains(status->m_kid)) {
+        auto &negative = internal::NegativeCache::get();
+        if (negative.kid_unknown(status->m_issuer, status->m_kid)) {
+            throw JsonException("Key ID is not published by the issuer.");
         }
-        auto e = iter->second.get<std::string>();
-        iter = key_obj.find("n");
-        if (iter == key_obj.end() || (!iter->second.is<std::string>())) {
-            throw JsonException("Public key is missing n-value");
+        if (!status->m_kid_refreshed &&
+            status->m_key_source != internal::TraceSpan::KeySource::WEB &&
+            negative.allow_forced_refresh(status->m_issuer)) {
+            // Perhaps the issuer rotated its keys; look once more, keeping
+            // the cached keys if that fails.
+            status->m_kid_refreshed = true;
+            status->m_done = false;
+            status->m_ignore_error = true;
+            join_refresh(*status);
+            return get_public_key_pem_continue(std::move(status));
         }
-        auto n = iter->second.get<std::string>();
-        pem = rs256_from_coords(e, n);
+        negative.record_unknown_kid(status->m_issuer, status->m_kid);
+    }
+    const auto &key = status->m_key_index->find(status->m_kid);
+    status->m_public_key = std::atomic_load(&key.m_public_key);
+    if (status->m_public_key) {
+        return std::move(status);
     }
 
-    public_pem = pem;
-    algorithm = alg;
+    // Only rebuild the key from its coordinates if this exact JWK hasn't
+    // been seen before, e.g. in the key set this one replaced.
+    auto &cache = internal::VerifierCache::get();
+    status->m_public_key =
+        cache.lookup(status->m_issuer, status->m_kid, key.m_fingerprint);
+    if (!status->m_public_key) {
+        auto start = std::chrono::steady_clock::now();
+        std::string pem = pem_from_key(key);
+        status->m_public_key =
+            std::make_shared<internal::PublicKey>(key.m_alg, pem);
+        cache.insert(status->m_issuer, status->m_kid, key.m_fingerprint,
+                     status->m_public_key);
+        status->m_key_construct_time = std::chrono::steady_clock::now() - start;
+    }
+    std::atomic_store(&key.m_public_key, status->m_public_key);
 
     return std::move(status);
 }
@@ -966,113 +4032,585 @@ bool scitokens::Validator::store_public_ec_key(const std::string &issuer,
     key_obj["kid"] = picojson::value(keyid);
     key_obj["use"] = picojson::value("sig");
     key_obj["kty"] = picojson::value("EC");
-    key_obj["x"] = picojson::value(b64url_encode_nopadding(x_str));
-    key_obj["y"] = picojson::value(b64url_encode_nopadding(y_str));
+    key_obj["x"] = picojson::value(internal::b64url_encode(x_str));
+    key_obj["y"] = picojson::value(internal::b64url_encode(y_str));
     std::vector<picojson::value> key_list;
     key_list.emplace_back(key_obj);
 
     picojson::object top_obj;
     top_obj["keys"] = picojson::value(key_list);
 
-    picojson::value top_value(top_obj);
+    auto top_value = std::make_shared<const picojson::value>(top_obj);
 
     auto now = std::time(NULL);
     int next_update_delta = configurer::Configuration::get_next_update_delta();
     int expiry_delta = configurer::Configuration::get_expiry_delta();
-    return store_public_keys(issuer, top_value, now + next_update_delta,
-                             now + expiry_delta);
+    return store_public_keys(issuer, std::move(top_value),
+                             now + next_update_delta, now + expiry_delta);
+}
+
+std::shared_ptr<const internal::ScopeIndex>
+scitokens::Enforcer::lookup_acls(const SciToken &scitoken) const {
+    auto &stats = internal::Stats::get();
+    const auto &verified = scitoken.m_verified;
+    if (verified && verified->m_enforcer == m_id &&
+        verified->m_decoded == scitoken.m_decoded) {
+        auto now = std::chrono::system_clock::to_time_t(m_validator.get_now());
+        // Otherwise the token is verified in full, so that it fails with
+        // the same error as one never marked.
+        if (now >= verified->m_not_before && now <= verified->m_expires &&
+            !internal::RevocationList::get().is_revoked(verified->m_jti)) {
+            internal::Stats::add(stats.m_verified_rechecks);
+            return verified->m_acls;
+        }
+        internal::Stats::add(stats.m_verified_fallbacks);
+    }
+    if (!m_acl_cache.get_capacity() || !scitoken.m_decoded) {
+        return nullptr;
+    }
+    auto acls = m_acl_cache.lookup(
+        internal::AclCache::digest(scitoken.m_decoded->get_token()),
+        m_validator.get_now());
+    internal::Stats::add(acls ? stats.m_acl_cache_hits
+                              : stats.m_acl_cache_misses);
+    return acls;
+}
+
+std::shared_ptr<const internal::ScopeIndex>
+scitokens::Enforcer::store_acls(const AsyncStatus &status,
+                                const AclsList &acls) const {
+    auto index = std::make_shared<const internal::ScopeIndex>(acls);
+    const auto &jwt = status.m_jwt;
+    if (m_acl_cache.get_capacity() && jwt && jwt->has_expires_at()) {
+        // The Validator accepted the token at get_now(), so it may not be
+        // used before its "nbf" or "iat", whichever is later.
+        std::chrono::system_clock::time_point not_before;
+        const auto &claims = internal::PayloadAccess::get(*jwt);
+        for (const char *name : {"nbf", "iat"}) {
+            auto claim = internal::find_claim(claims, name);
+            if (claim && claim->is<int64_t>()) {
+                not_before = std::max(not_before,
+                                      std::chrono::system_clock::from_time_t(
+                                          claim->get<int64_t>()));
+            }
+        }
+        // Checked against the revocation list on every hit.
+        auto jti = internal::find_claim(claims, "jti");
+        m_acl_cache.insert(internal::AclCache::digest(jwt->get_token()),
+                           not_before, jwt->get_expires_at(),
+                           jti && jti->is<std::string>()
+                               ? jti->get<std::string>()
+                               : std::string(),
+                           index);
+    }
+    return index;
+}
+
+void scitokens::Enforcer::mark_verified(SciToken &scitoken) const {
+    auto status = verify(scitoken);
+    AclsList acls;
+    check_claims(*status, "", "", acls);
+    auto verified = std::make_shared<internal::VerifiedToken>();
+    verified->m_enforcer = m_id;
+    verified->m_decoded = scitoken.m_decoded;
+    verified->m_acls = store_acls(*status, acls);
+    const auto &claims = internal::PayloadAccess::get(*status->m_jwt);
+    // The Validator checked these claims' types along with their values.
+    for (const char *name : {"nbf", "iat"}) {
+        auto claim = internal::find_claim(claims, name);
+        if (claim && claim->is<int64_t>()) {
+            verified->m_not_before =
+                std::max(verified->m_not_before, claim->get<int64_t>());
+        }
+    }
+    auto exp = internal::find_claim(claims, "exp");
+    if (exp && exp->is<int64_t>()) {
+        verified->m_expires = exp->get<int64_t>();
+    }
+    auto jti = internal::find_claim(claims, "jti");
+    if (jti && jti->is<std::string>()) {
+        verified->m_jti = jti->get<std::string>();
+    }
+    scitoken.m_verified = std::move(verified);
+}
+
+void scitokens::Enforcer::generate_acls_with_callback(
+    const SciToken &scitoken, AclsCallback done) const {
+    auto &engine = internal::CompletionEngine::get();
+    // Held by the engine's step; std::function can't hold the status.
+    struct Request {
+        std::unique_ptr<AsyncStatus> m_status;
+        AclsList m_acls;
+        AclsCallback m_done;
+    };
+    auto request = std::make_shared<Request>();
+    try {
+        request->m_status = generate_acls_start(scitoken, request->m_acls,
+                                                engine.get_context());
+    } catch (...) {
+        done(AclsList(), std::current_exception());
+        return;
+    }
+    if (request->m_status->m_done) {
+        done(std::move(request->m_acls), nullptr);
+        return;
+    }
+    request->m_done = std::move(done);
+    engine.submit([this, request]() {
+        try {
+            request->m_status = generate_acls_continue(
+                std::move(request->m_status), request->m_acls);
+        } catch (...) {
+            request->m_done(AclsList(), std::current_exception());
+            return true;
+        }
+        if (!request->m_status->m_done) {
+            return false;
+        }
+        request->m_done(std::move(request->m_acls), nullptr);
+        return true;
+    });
+}
+
+std::future<scitokens::Enforcer::AclsList>
+scitokens::Enforcer::generate_acls_future(const SciToken &scitoken) const {
+    auto promise = std::make_shared<std::promise<AclsList>>();
+    auto future = promise->get_future();
+    generate_acls_with_callback(
+        scitoken, [promise](AclsList acls, std::exception_ptr error) {
+            if (error) {
+                promise->set_exception(error);
+            } else {
+                promise->set_value(std::move(acls));
+            }
+        });
+    return future;
+}
+
+namespace {
+
+/**
+ * A capability is, with integers little-endian and each string preceded
+ * by its 16-bit length:
+ *
+ *   version (1 byte), profile (1 byte), expiry (8 bytes), jti, subject,
+ *   ACL count (2 bytes), then each ACL's authz and resource,
+ *
+ * followed by the HMAC-SHA256 of the Enforcer's capability context and
+ * all of the above.
+ */
+const unsigned char capability_version = 1;
+const size_t capability_mac_size = 32;
+
+void put_uint(std::string &out, uint64_t value, unsigned bytes) {
+    for (unsigned idx = 0; idx < bytes; idx++) {
+        out += static_cast<char>(value >> (8 * idx));
+    }
+}
+
+void put_string(std::string &out, const std::string &value) {
+    if (value.size() > 0xffff) {
+        throw std::invalid_argument("Token is too large for a capability.");
+    }
+    put_uint(out, value.size(), 2);
+    out += value;
+}
+
+// Reads a capability's fields, throwing std::out_of_range if it runs out.
+class CapabilityReader {
+  public:
+    CapabilityReader(const char *data, size_t size)
+        : m_data(data), m_size(size) {}
+
+    uint64_t get_uint(unsigned bytes) {
+        need(bytes);
+        uint64_t value = 0;
+        for (unsigned idx = 0; idx < bytes; idx++) {
+            value |= uint64_t(static_cast<unsigned char>(m_data[m_pos++]))
+                     << (8 * idx);
+        }
+        return value;
+    }
+
+    std::string get_string() {
+        size_t size = get_uint(2);
+        need(size);
+        std::string value(m_data + m_pos, size);
+        m_pos += size;
+        return value;
+    }
+
+    bool at_end() const { return m_pos == m_size; }
+
+  private:
+    void need(size_t bytes) const {
+        if (m_size - m_pos < bytes) {
+            throw std::out_of_range("Malformed capability.");
+        }
+    }
+
+    const char *m_data;
+    size_t m_size;
+    size_t m_pos{0};
+};
+
+std::string capability_mac(const std::string &secret,
+                           const std::string &context, const char *body,
+                           size_t body_size) {
+    std::string data = context;
+    data.append(body, body_size);
+    unsigned char mac[EVP_MAX_MD_SIZE];
+    unsigned mac_size = 0;
+    if (!HMAC(EVP_sha256(), secret.data(), secret.size(),
+              reinterpret_cast<const unsigned char *>(data.data()),
+              data.size(), mac, &mac_size) ||
+        mac_size != capability_mac_size) {
+        throw std::runtime_error("Failed to compute the capability MAC.");
+    }
+    return std::string(reinterpret_cast<char *>(mac), mac_size);
 }
 
-bool scitokens::Enforcer::scope_validator(const jwt::claim &claim,
-                                          void *myself) {
-    auto me = reinterpret_cast<scitokens::Enforcer *>(myself);
-    if (claim.get_type() != jwt::json::type::string) {
+std::shared_ptr<const std::string> capability_secret() {
+    auto secret = configurer::Configuration::get_capability_secret();
+    if (!secret || secret->empty()) {
+        throw std::runtime_error("No capability secret is configured.");
+    }
+    return secret;
+}
+
+} // namespace
+
+std::string scitokens::Enforcer::capability_context() const {
+    // Sorted, as the set's order differs between processes.
+    std::vector<std::string> audiences(m_audiences.begin(), m_audiences.end());
+    std::sort(audiences.begin(), audiences.end());
+    std::string context = "scitokens-capability";
+    context += '\0';
+    context += m_issuer;
+    context += '\0';
+    for (const auto &audience : audiences) {
+        context += audience;
+        context += '\0';
+    }
+    context += static_cast<char>(m_validate_profile);
+    return context;
+}
+
+std::string
+scitokens::Enforcer::export_capability(const SciToken &scitoken) const {
+    auto secret = capability_secret();
+    auto status = verify(scitoken);
+    AclsList acls;
+    check_claims(*status, "", "", acls);
+    const auto &jwt = *status->m_jwt;
+    const auto &claims = internal::PayloadAccess::get(jwt);
+    // The Validator only checks that these are strings when present; a
+    // missing claim is exported as an empty string.
+    auto optional_claim = [&](const char *name) {
+        const picojson::value *claim = internal::find_claim(claims, name);
+        return claim ? claim->get<std::string>() : std::string();
+    };
+    if (acls.size() > 0xffff) {
+        throw std::invalid_argument("Token is too large for a capability.");
+    }
+
+    std::string capability;
+    capability += static_cast<char>(capability_version);
+    capability += static_cast<char>(status->m_profile);
+    put_uint(capability,
+             std::chrono::system_clock::to_time_t(jwt.get_expires_at()), 8);
+    put_string(capability, optional_claim("jti"));
+    put_string(capability, optional_claim("sub"));
+    put_uint(capability, acls.size(), 2);
+    for (const auto &acl : acls) {
+        put_string(capability, acl.first);
+        put_string(capability, acl.second);
+    }
+    capability += capability_mac(*secret, capability_context(),
+                                 capability.data(), capability.size());
+    internal::Stats::add(internal::Stats::get().m_capability_exports);
+    return capability;
+}
+
+scitokens::Enforcer::Capability
+scitokens::Enforcer::import_capability(const std::string &capability) const {
+    auto &stats = internal::Stats::get();
+    auto reject = [&](const char *reason) {
+        internal::Stats::add(stats.m_capability_rejections);
+        throw JWTVerificationException(reason);
+    };
+    auto secret = capability_secret();
+    if (capability.size() < capability_mac_size + 1) {
+        reject("Malformed capability.");
+    }
+    size_t body_size = capability.size() - capability_mac_size;
+    auto mac = capability_mac(*secret, capability_context(),
+                              capability.data(), body_size);
+    if (CRYPTO_memcmp(mac.data(), capability.data() + body_size,
+                      capability_mac_size) != 0) {
+        reject("Capability is not valid for this enforcer.");
+    }
+
+    Capability result;
+    try {
+        CapabilityReader reader(capability.data(), body_size);
+        if (reader.get_uint(1) != capability_version) {
+            reject("Unsupported capability version.");
+        }
+        result.m_profile = static_cast<SciToken::Profile>(reader.get_uint(1));
+        result.m_expiry = static_cast<int64_t>(reader.get_uint(8));
+        result.m_jti = reader.get_string();
+        result.m_subject = reader.get_string();
+        size_t count = reader.get_uint(2);
+        result.m_acls.reserve(count);
+        for (size_t idx = 0; idx < count; idx++) {
+            auto authz = reader.get_string();
+            result.m_acls.emplace_back(std::move(authz), reader.get_string());
+        }
+        if (!reader.at_end()) {
+            reject("Malformed capability.");
+        }
+    } catch (std::out_of_range &) {
+        reject("Malformed capability.");
+    }
+    if (std::chrono::system_clock::to_time_t(m_validator.get_now()) >=
+        result.m_expiry) {
+        reject("Capability has expired.");
+    }
+    if (internal::RevocationList::get().is_revoked(result.m_jti)) {
+        reject("Token has been revoked.");
+    }
+    internal::Stats::add(stats.m_capability_imports);
+    return result;
+}
+
+void scitokens::Enforcer::check_claims(const AsyncStatus &status,
+                                       const std::string &authz,
+                                       const std::string &path,
+                                       AclsList &acls) const {
+    auto &stats = internal::Stats::get();
+    internal::Stats::add(stats.m_claim_checks);
+    internal::ScopedLatency timer(stats.m_claim_check_us);
+    const auto &jwt = *status.m_jwt;
+    const picojson::value *aud =
+        internal::find_claim(internal::PayloadAccess::get(jwt), "aud");
+    if (aud && !check_audience(*aud, status.m_profile)) {
+        internal::Stats::add(stats.m_claim_failures);
+        throw JWTVerificationException("'aud' claim verification failed.");
+    }
+    const picojson::value *scope =
+        internal::find_claim(internal::PayloadAccess::get(jwt), "scope");
+    if (!scope || !check_scope(*scope, status.m_profile, authz, path, acls)) {
+        internal::Stats::add(stats.m_claim_failures);
+        throw JWTVerificationException("'scope' claim verification failed.");
+    }
+}
+
+bool scitokens::Enforcer::check_audience(const picojson::value &claim,
+                                         SciToken::Profile profile) const {
+    auto matches = [&](const std::string &aud_value) {
+        return ((profile == SciToken::Profile::SCITOKENS_2_0) &&
+                (aud_value == "ANY")) ||
+               ((profile == SciToken::Profile::WLCG_1_0) &&
+                (aud_value == "https://wlcg.cern.ch/jwt/v1/any")) ||
+               m_audiences.count(aud_value);
+    };
+    if (claim.is<std::string>()) {
+        return matches(claim.get<std::string>());
+    } else if (claim.is<picojson::array>()) {
+        for (const auto &aud_value : claim.get<picojson::array>()) {
+            if (matches(aud_value.get<std::string>())) {
+                return true;
+            }
+        }
+    }
+    return false;
+}
+
+bool scitokens::Enforcer::check_scope(const picojson::value &claim,
+                                      SciToken::Profile profile,
+                                      const std::string &test_authz,
+                                      const std::string &test_path,
+                                      AclsList &acls) const {
+    if (!claim.is<std::string>()) {
         return false;
     }
-    std::string scope = claim.as_string();
-    std::string requested_path = normalize_absolute_path(me->m_test_path);
-    auto scope_iter = scope.begin();
-    // std::cout << "Comparing scope " << scope << " against test accesses " <<
-    // me->m_test_authz << ":" << requested_path << std::endl;
+    const std::string &scope = claim.get<std::string>();
+    // The scopes are parsed in place; only the normalized paths need
+    // scratch space, reused from one scope to the next.
+    std::string requested_path, path;
+    normalize_absolute_path(test_path.data(), test_path.size(),
+                            requested_path);
     bool compat_modify = false, compat_create = false, compat_cancel = false;
-    while (scope_iter != scope.end()) {
-        while (*scope_iter == ' ') {
+    const char *scope_iter = scope.data(),
+               *scope_end = scope.data() + scope.size();
+    while (scope_iter != scope_end) {
+        while (scope_iter != scope_end && *scope_iter == ' ') {
             scope_iter++;
         }
-        auto next_scope_iter = std::find(scope_iter, scope.end(), ' ');
-        std::string full_authz;
-        full_authz.reserve(std::distance(scope_iter, next_scope_iter));
-        full_authz.assign(scope_iter, next_scope_iter);
-        auto sep_iter = full_authz.find(':');
-        std::string authz = full_authz.substr(0, sep_iter);
-        std::string path;
-        if (sep_iter == std::string::npos) {
+        auto next_scope_iter = std::find(scope_iter, scope_end, ' ');
+        if (scope_iter == next_scope_iter) {
+            continue;
+        }
+        auto sep_iter = std::find(scope_iter, next_scope_iter, ':');
+        const char *authz = scope_iter;
+        size_t authz_len = sep_iter - scope_iter;
+        if (sep_iter == next_scope_iter) {
             path = "/";
         } else {
-            path = full_authz.substr((++sep_iter));
+            normalize_absolute_path(sep_iter + 1,
+                                    next_scope_iter - sep_iter - 1, path);
         }
-        path = normalize_absolute_path(path);
+        scope_iter = next_scope_iter;
 
         // If we are in compatibility mode and this is a WLCG token, then
         // translate the authorization names to utilize the SciToken-style
         // names.
-        std::string alt_authz;
-        if (me->m_validate_profile == SciToken::Profile::COMPAT &&
-            me->m_validator.get_profile() == SciToken::Profile::WLCG_1_0) {
-            if (authz == "storage.read") {
-                authz = "read";
-            } else if (authz == "storage.create") {
-                authz = "write";
+        const char *alt_authz = nullptr;
+        auto rename = [&](const char *name) {
+            authz = name;
+            authz_len = strlen(name);
+        };
+        if (m_validate_profile == SciToken::Profile::COMPAT &&
+            profile == SciToken::Profile::WLCG_1_0) {
+            if (equals(authz, authz_len, "storage.read")) {
+                rename("read");
+            } else if (equals(authz, authz_len, "storage.create")) {
+                rename("write");
                 alt_authz = "create";
-            } else if (authz == "storage.modify") {
-                authz = "write";
+            } else if (equals(authz, authz_len, "storage.modify")) {
+                rename("write");
                 alt_authz = "modify";
-            } else if (authz == "compute.read") {
-                authz = "condor";
+            } else if (equals(authz, authz_len, "compute.read")) {
+                rename("condor");
                 path = "/READ";
-            } else if (authz == "compute.modify") {
+            } else if (equals(authz, authz_len, "compute.modify")) {
                 compat_modify = true;
-            } else if (authz == "compute.create") {
+            } else if (equals(authz, authz_len, "compute.create")) {
                 compat_create = true;
-            } else if (authz == "compute.cancel") {
+            } else if (equals(authz, authz_len, "compute.cancel")) {
                 compat_cancel = true;
             }
         }
 
-        if (me->m_test_authz.empty()) {
-            me->m_gen_acls.emplace_back(authz, path);
-            if (!alt_authz.empty())
-                me->m_gen_acls.emplace_back(alt_authz, path);
-        } else if (((me->m_test_authz == authz) ||
-                    (!alt_authz.empty() && (me->m_test_authz == alt_authz))) &&
-                   (requested_path.substr(0, path.size()) == path)) {
+        if (test_authz.empty()) {
+            acls.emplace_back(std::string(authz, authz_len), path);
+            if (alt_authz)
+                acls.emplace_back(alt_authz, path);
+        } else if (((test_authz.size() == authz_len &&
+                     !test_authz.compare(0, authz_len, authz, authz_len)) ||
+                    (alt_authz && (test_authz == alt_authz))) &&
+                   !requested_path.compare(0, path.size(), path)) {
             return true;
         }
-
-        scope_iter = next_scope_iter;
     }
 
     // Compatibility mode: the combination on compute modify, create, and cancel
     // mode are equivalent to the condor:/WRITE authorization.
     if (compat_modify && compat_create && compat_cancel) {
-        if (me->m_test_authz.empty()) {
-            me->m_gen_acls.emplace_back("condor", "/WRITE");
-        } else if ((me->m_test_authz == "condor") &&
-                   (requested_path.substr(0, 6) == "/WRITE")) {
+        if (test_authz.empty()) {
+            acls.emplace_back("condor", "/WRITE");
+        } else if ((test_authz == "condor") &&
+                   !requested_path.compare(0, 6, "/WRITE")) {
             return true;
         }
     }
 
-    return me->m_test_authz.empty();
+    return test_authz.empty();
 }
 
 // Configuration class functions
+namespace {
+
+// Read a secret of at least 32 bytes from `path` into `secret`, refusing
+// files other users could read or change; `what` names the secret in
+// errors.  An empty path is an empty secret.
+std::pair<bool, std::string> read_secret_file(const std::string &path,
+                                              const std::string &what,
+                                              std::string &secret) {
+    secret.clear();
+    if (path.empty()) {
+        return std::make_pair(true, "");
+    }
+    int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return std::make_pair(false, "Failed to open " + path);
+    }
+    struct stat info;
+    bool shared = fstat(fd, &info) != 0 ||
+                  (info.st_mode & (S_IRWXO | S_IWGRP)) != 0;
+    char buf[4096];
+    ssize_t len = 0;
+    while (!shared && (len = read(fd, buf, sizeof(buf))) > 0) {
+        secret.append(buf, len);
+    }
+    close(fd);
+    // Anyone who can read the secret can forge what it protects.
+    if (shared) {
+        return std::make_pair(false,
+                              path + " must not be accessible to other users.");
+    }
+    if (len < 0) {
+        return std::make_pair(false, "Failed to read " + path);
+    }
+    if (secret.size() < 32) {
+        return std::make_pair(false,
+                              "The " + what + " must be at least 32 bytes.");
+    }
+    return std::make_pair(true, "");
+}
+
+} // namespace
+
+std::pair<bool, std::string>
+configurer::Configuration::set_capability_secret_file(const std::string &path) {
+    std::string secret;
+    auto rp = read_secret_file(path, "capability secret", secret);
+    if (!rp.first) {
+        return rp;
+    }
+    std::atomic_store(&m_capability_secret,
+                      std::make_shared<const std::string>(std::move(secret)));
+    std::atomic_store(&m_capability_secret_file,
+                      std::make_shared<const std::string>(path));
+    return rp;
+}
+
+std::pair<bool, std::string>
+configurer::Configuration::set_memcached_secret_file(const std::string &path) {
+    std::string secret;
+    auto rp = read_secret_file(path, "memcached secret", secret);
+    if (!rp.first) {
+        return rp;
+    }
+    std::atomic_store(&m_memcached_secret,
+                      std::make_shared<const std::string>(std::move(secret)));
+    std::atomic_store(&m_memcached_secret_file,
+                      std::make_shared<const std::string>(path));
+    return rp;
+}
+
+std::pair<bool, std::string>
+configurer::Configuration::set_bundle_secret_file(const std::string &path) {
+    std::string secret;
+    auto rp = read_secret_file(path, "bundle secret", secret);
+    if (!rp.first) {
+        return rp;
+    }
+    std::atomic_store(&m_bundle_secret,
+                      std::make_shared<const std::string>(std::move(secret)));
+    std::atomic_store(&m_bundle_secret_file,
+                      std::make_shared<const std::string>(path));
+    return rp;
+}
+
 std::pair<bool, std::string>
 configurer::Configuration::set_cache_home(const std::string dir_path) {
     // If setting to "", then we should treat as though it is unsetting the
     // config
     if (dir_path.length() == 0) { // User is configuring to empty string
         m_cache_home = std::make_shared<std::string>(dir_path);
+        m_cache_home_generation++;
         return std::make_pair(true, "");
     }
 
@@ -1096,6 +4634,7 @@ configurer::Configuration::set_cache_home(const std::string dir_path) {
     // Now it exists and we can write to it, set the value and let
     // scitokens_cache handle the rest
     m_cache_home = std::make_shared<std::string>(cleaned_dir_path);
+    m_cache_home_generation++;
     return std::make_pair(true, "");
 }
 
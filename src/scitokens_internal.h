@@ -1,13 +1,32 @@
 
+#include <array>
+#include <chrono>
+#include <condition_variable>
+#include <cstring>
+#include <deque>
+#include <functional>
+#include <future>
+#include <limits>
+#include <list>
 #include <memory>
+#include <mutex>
+#include <set>
 #include <sstream>
+#include <thread>
+#include <type_traits>
 #include <unordered_map>
+#include <unordered_set>
 
 #include <atomic>
 #include <curl/curl.h>
 #include <jwt-cpp/jwt.h>
 #include <uuid/uuid.h>
 
+// jwt-cpp offers Ed25519 only with OpenSSL 1.1.1 or later.
+#if !defined(JWT_OPENSSL_1_0_0) && !defined(JWT_OPENSSL_1_1_0)
+#define SCITOKENS_HAVE_EDDSA
+#endif
+
 #if defined(__GNUC__)
 #define WARN_UNUSED_RESULT __attribute__((warn_unused_result))
 #else
@@ -42,13 +61,217 @@ class Configuration {
         m_expiry_delta = _expiry_delta;
     }
     static int get_expiry_delta() { return m_expiry_delta; }
+    // Bounds applied to key set lifetimes taken from HTTP caching headers.
+    static void set_min_update_delta(int _min_update_delta) {
+        m_min_update_delta = _min_update_delta;
+    }
+    static int get_min_update_delta() { return m_min_update_delta; }
+    static void set_max_update_delta(int _max_update_delta) {
+        m_max_update_delta = _max_update_delta;
+    }
+    static int get_max_update_delta() { return m_max_update_delta; }
+    // How long a discovered jwks_uri is used before the issuer's metadata
+    // is fetched again.
+    static void set_metadata_delta(int _metadata_delta) {
+        m_metadata_delta = _metadata_delta;
+    }
+    static int get_metadata_delta() { return m_metadata_delta; }
+    // How often the background refresher runs; 0 disables it.
+    static void set_refresh_interval(int _refresh_interval) {
+        m_refresh_interval = _refresh_interval;
+    }
+    static int get_refresh_interval() { return m_refresh_interval; }
+    // Threads the asynchronous API hands signature checks to; 0 checks
+    // them on the caller's thread.
+    static void set_verify_threads(int _verify_threads) {
+        m_verify_threads = _verify_threads;
+    }
+    static int get_verify_threads() { return m_verify_threads; }
+
+    static void set_sqlite_busy_timeout(int _busy_timeout_ms) {
+        m_sqlite_busy_timeout = _busy_timeout_ms;
+    }
+    static int get_sqlite_busy_timeout() { return m_sqlite_busy_timeout; }
+
+    static void set_keycache_snapshot(bool _snapshot) {
+        m_keycache_snapshot = _snapshot;
+    }
+    static bool get_keycache_snapshot() { return m_keycache_snapshot; }
+
+    static void set_failure_backoff(int _failure_backoff) {
+        m_failure_backoff = _failure_backoff;
+    }
+    static int get_failure_backoff() { return m_failure_backoff; }
+
+    static void set_unknown_kid_ttl(int _unknown_kid_ttl) {
+        m_unknown_kid_ttl = _unknown_kid_ttl;
+    }
+    static int get_unknown_kid_ttl() { return m_unknown_kid_ttl; }
+    // Freed objects of each pooled type a thread keeps for reuse; 0 turns
+    // pooling off.
+    static void set_pool_objects(int _pool_objects) {
+        m_pool_objects = _pool_objects;
+    }
+    static int get_pool_objects() { return m_pool_objects; }
+    // Whether tokens are screened for an allowed issuer before their JSON
+    // is parsed.
+    static void set_issuer_prefilter(bool _issuer_prefilter) {
+        m_issuer_prefilter = _issuer_prefilter;
+    }
+    static bool get_issuer_prefilter() { return m_issuer_prefilter; }
+    // Largest metadata and key set responses accepted; 0 for no limit.
+    static void set_max_metadata_bytes(int _max_metadata_bytes) {
+        m_max_metadata_bytes = _max_metadata_bytes;
+    }
+    static int get_max_metadata_bytes() { return m_max_metadata_bytes; }
+    static void set_max_jwks_bytes(int _max_jwks_bytes) {
+        m_max_jwks_bytes = _max_jwks_bytes;
+    }
+    static int get_max_jwks_bytes() { return m_max_jwks_bytes; }
+    static void set_revocation_refresh_interval(int _interval) {
+        m_revocation_refresh_interval = _interval;
+    }
+    static int get_revocation_refresh_interval() {
+        return m_revocation_refresh_interval;
+    }
+    // Key cache bounds; 0 for no limit, or for no periodic compaction.
+    static void set_keycache_max_entries(int _max_entries) {
+        m_keycache_max_entries = _max_entries;
+    }
+    static int get_keycache_max_entries() { return m_keycache_max_entries; }
+    static void set_keycache_max_bytes(int _max_bytes) {
+        m_keycache_max_bytes = _max_bytes;
+    }
+    static int get_keycache_max_bytes() { return m_keycache_max_bytes; }
+    static void set_keycache_compact_interval(int _interval) {
+        m_keycache_compact_interval = _interval;
+    }
+    static int get_keycache_compact_interval() {
+        return m_keycache_compact_interval;
+    }
+    // Issuer fetch limits; 0 for curl's connect timeout, or for the limit
+    // each fetch is started with.
+    static void set_fetch_connect_timeout(int _timeout_ms) {
+        m_fetch_connect_timeout = _timeout_ms;
+    }
+    static int get_fetch_connect_timeout() { return m_fetch_connect_timeout; }
+    static void set_fetch_total_timeout(int _timeout_ms) {
+        m_fetch_total_timeout = _timeout_ms;
+    }
+    static int get_fetch_total_timeout() { return m_fetch_total_timeout; }
+    static void set_fetch_dns_cache_timeout(int _timeout) {
+        m_fetch_dns_cache_timeout = _timeout;
+    }
+    static int get_fetch_dns_cache_timeout() {
+        return m_fetch_dns_cache_timeout;
+    }
+    // How long a fetch runs before a second request races it; 0 for never.
+    static void set_fetch_hedge_delay(int _delay_ms) {
+        m_fetch_hedge_delay = _delay_ms;
+    }
+    static int get_fetch_hedge_delay() { return m_fetch_hedge_delay; }
+    // An empty file means curl's default CA bundle.
+    static void set_tls_ca_file(const std::string &ca_file) {
+        std::atomic_store(&m_tls_ca_file,
+                          std::make_shared<const std::string>(ca_file));
+    }
+    static std::string get_tls_ca_file() {
+        return *std::atomic_load(&m_tls_ca_file);
+    }
     static std::pair<bool, std::string> set_cache_home(const std::string cache_home);
     static std::string get_cache_home();
+    // Where the key cache keeps key sets: "sqlite", "memcached" or
+    // "memory".
+    static void set_keycache_backend(const std::string &backend) {
+        std::atomic_store(&m_keycache_backend,
+                          std::make_shared<const std::string>(backend));
+        m_cache_home_generation++;
+    }
+    static std::string get_keycache_backend() {
+        return *std::atomic_load(&m_keycache_backend);
+    }
+    // The "host:port" of the memcached backend's server.
+    static void set_memcached_server(const std::string &server) {
+        std::atomic_store(&m_memcached_server,
+                          std::make_shared<const std::string>(server));
+        m_cache_home_generation++;
+    }
+    static std::string get_memcached_server() {
+        return *std::atomic_load(&m_memcached_server);
+    }
+    // The secret the memcached backend's rows are MAC'd with, read from the
+    // file; an empty path forgets it, leaving the backend unused.
+    static std::pair<bool, std::string>
+    set_memcached_secret_file(const std::string &path);
+    static std::string get_memcached_secret_file() {
+        return *std::atomic_load(&m_memcached_secret_file);
+    }
+    // Empty when no secret is configured.
+    static std::shared_ptr<const std::string> get_memcached_secret() {
+        return std::atomic_load(&m_memcached_secret);
+    }
+    // The secret key cache bundles are MAC'd with, read from the file; an
+    // empty path forgets it, leaving bundles unusable.
+    static std::pair<bool, std::string>
+    set_bundle_secret_file(const std::string &path);
+    static std::string get_bundle_secret_file() {
+        return *std::atomic_load(&m_bundle_secret_file);
+    }
+    // Empty when no secret is configured.
+    static std::shared_ptr<const std::string> get_bundle_secret() {
+        return std::atomic_load(&m_bundle_secret);
+    }
+    // The node-local secret capabilities are MAC'd with, read from the
+    // file; an empty path forgets it.
+    static std::pair<bool, std::string>
+    set_capability_secret_file(const std::string &path);
+    static std::string get_capability_secret_file() {
+        return *std::atomic_load(&m_capability_secret_file);
+    }
+    // Empty when no secret is configured.
+    static std::shared_ptr<const std::string> get_capability_secret() {
+        return std::atomic_load(&m_capability_secret);
+    }
+    // Bumped every time the cache home or backend is changed; lets the key
+    // cache know when its resolved path, open database handles and memory
+    // tier are out of date.
+    static int get_cache_home_generation() { return m_cache_home_generation; }
 
   private:
     static std::atomic_int m_next_update_delta;
     static std::atomic_int m_expiry_delta;
+    static std::atomic_int m_min_update_delta;
+    static std::atomic_int m_max_update_delta;
+    static std::atomic_int m_metadata_delta;
+    static std::atomic_int m_refresh_interval;
+    static std::atomic_int m_verify_threads;
+    static std::atomic_int m_sqlite_busy_timeout;
+    static std::atomic_bool m_keycache_snapshot;
+    static std::atomic_int m_failure_backoff;
+    static std::atomic_int m_unknown_kid_ttl;
+    static std::atomic_int m_pool_objects;
+    static std::atomic_bool m_issuer_prefilter;
+    static std::atomic_int m_max_metadata_bytes;
+    static std::atomic_int m_max_jwks_bytes;
+    static std::atomic_int m_revocation_refresh_interval;
+    static std::atomic_int m_keycache_max_entries;
+    static std::atomic_int m_keycache_max_bytes;
+    static std::atomic_int m_keycache_compact_interval;
+    static std::atomic_int m_fetch_connect_timeout;
+    static std::atomic_int m_fetch_total_timeout;
+    static std::atomic_int m_fetch_dns_cache_timeout;
+    static std::atomic_int m_fetch_hedge_delay;
     static std::shared_ptr<std::string> m_cache_home;
+    static std::shared_ptr<const std::string> m_tls_ca_file;
+    static std::shared_ptr<const std::string> m_keycache_backend;
+    static std::shared_ptr<const std::string> m_memcached_server;
+    static std::shared_ptr<const std::string> m_memcached_secret_file;
+    static std::shared_ptr<const std::string> m_memcached_secret;
+    static std::shared_ptr<const std::string> m_bundle_secret_file;
+    static std::shared_ptr<const std::string> m_bundle_secret;
+    static std::shared_ptr<const std::string> m_capability_secret_file;
+    static std::shared_ptr<const std::string> m_capability_secret;
+    static std::atomic_int m_cache_home_generation;
     // static bool check_dir(const std::string dir_path);
     static std::pair<bool, std::string>
     mkdir_and_parents_if_needed(const std::string dir_path);
@@ -60,17 +283,182 @@ namespace scitokens {
 
 namespace internal {
 
-class SimpleCurlGet {
+/**
+ * base64url without padding, as token parts and JWK members are encoded;
+ * defined in scitokens_base64.cpp.  Bulk input goes through SSSE3 or AVX2
+ * where the CPU has them.  Decoding also accepts padded input and throws
+ * std::runtime_error on any other character outside the alphabet, or if the
+ * last character has bits set past the end of the data.
+ */
+std::string b64url_decode(const char *data, size_t len);
+inline std::string b64url_decode(const std::string &data) {
+    return b64url_decode(data.data(), data.size());
+}
+std::string b64url_encode(const char *data, size_t len);
+inline std::string b64url_encode(const std::string &data) {
+    return b64url_encode(data.data(), data.size());
+}
+// Turn the SIMD paths off (or back on, where the CPU has them) so tests can
+// exercise the scalar one; not safe while other threads are coding.
+void b64url_set_simd(bool enabled);
+
+/**
+ * Base for the objects every verification allocates and frees (AsyncStatus,
+ * SimpleCurlGet and the like): their memory is recycled through a free list
+ * per thread and type, so under multithreaded load they do not go through
+ * malloc.  An object may be freed on another thread than the one that
+ * allocated it; the block then joins that thread's list.  Derived classes
+ * of a different size fall through to the global allocator.
+ */
+template <typename T> class Pooled {
+  public:
+    static void *operator new(size_t size) {
+        auto &list = get_list();
+        if (size == sizeof(T) && list.m_head) {
+            auto block = list.m_head;
+            list.m_head = block->m_next;
+            list.m_count--;
+            return block;
+        }
+        return ::operator new(size);
+    }
+
+    static void operator delete(void *ptr, size_t size) {
+        auto &list = get_list();
+        if (size == sizeof(T) && !list.m_closed &&
+            list.m_count <
+                static_cast<size_t>(
+                    configurer::Configuration::get_pool_objects())) {
+            static thread_local Reaper reaper;
+            (void)reaper;
+            auto block = static_cast<Block *>(ptr);
+            block->m_next = list.m_head;
+            list.m_head = block;
+            list.m_count++;
+            return;
+        }
+        ::operator delete(ptr);
+    }
+
+  private:
+    struct Block {
+        Block *m_next;
+    };
+
+    // Trivial, so it stays usable while the thread's other objects are
+    // being destroyed.
+    struct FreeList {
+        Block *m_head;
+        size_t m_count;
+        bool m_closed;
+    };
+
+    // Returns the thread's blocks to the global allocator when it exits.
+    struct Reaper {
+        ~Reaper() {
+            auto &list = get_list();
+            list.m_closed = true;
+            while (list.m_head) {
+                auto block = list.m_head;
+                list.m_head = block->m_next;
+                ::operator delete(block);
+            }
+            list.m_count = 0;
+        }
+    };
+
+    static FreeList &get_list() {
+        static thread_local FreeList list{nullptr, 0, false};
+        return list;
+    }
+};
+
+/**
+ * A curl multi handle shared by any number of SimpleCurlGet transfers, so a
+ * single wait (or continue call) advances all of them.  Transfers that are
+ * not given a context get a private one.  Sockets and the timer are tracked
+ * through the socket and timer callbacks, for hosts with their own event
+ * loop.
+ */
+class FetchContext {
+  public:
+    // A socket libcurl wants watched; m_events is a mask of CURL_POLL_IN
+    // and CURL_POLL_OUT.
+    struct SocketInterest {
+        curl_socket_t m_fd;
+        int m_events;
+    };
+
+    FetchContext();
+    FetchContext(const FetchContext &) = delete;
+    FetchContext &operator=(const FetchContext &) = delete;
+
+    void add(CURL *easy);
+    void remove(CURL *easy);
+
+    // Let libcurl act on whatever is ready, checking the sockets ourselves
+    // if the host hasn't reported on them.
+    void drive();
+    // Wait up to timeout_ms for socket activity or the timer, then drive().
+    void wait(long timeout_ms);
+    // Returns true, with the transfer's result, once `easy` has finished.
+    // The result is kept until `easy` is removed or added again.
+    bool get_result(CURL *easy, CURLcode &result) const;
+
+    std::vector<SocketInterest> get_sockets() const;
+    // Milliseconds until the timer expires, or -1 if there is none.
+    long get_timer_ms() const;
+    // `events` is a mask of CURL_CSELECT_IN, CURL_CSELECT_OUT and
+    // CURL_CSELECT_ERR.
+    void socket_ready(curl_socket_t fd, int events);
+    void timer_fired();
+
+  private:
+    long get_timer_ms_locked() const;
+    void poll_sockets(long timeout_ms, std::unique_lock<std::mutex> &lock);
+
+    static int socket_callback(CURL *easy, curl_socket_t fd, int what,
+                               void *userp, void *socketp);
+    static int timer_callback(CURLM *multi, long timeout_ms, void *userp);
+
+    mutable std::mutex m_mutex;
+    std::vector<SocketInterest> m_sockets;
+    std::vector<std::pair<curl_socket_t, int>> m_ready_sockets;
+    std::unordered_map<CURL *, CURLcode> m_results;
+    bool m_has_timer{false};
+    bool m_timer_fired{false};
+    std::chrono::steady_clock::time_point m_timer_deadline;
+    // Last so the callbacks it makes while being cleaned up still find the
+    // members above.
+    std::unique_ptr<CURLM, decltype(&curl_multi_cleanup)> m_curl_multi;
+};
+
+class SimpleCurlGet : public Pooled<SimpleCurlGet> {
+
+    // The most header_data reserves for a response's Content-Length.
+    static constexpr size_t max_reserve = 1024 * 1024;
 
     int m_maxbytes{1048576};
     unsigned m_timeout;
     std::vector<char> m_data;
     size_t m_len{0};
+    std::shared_ptr<FetchContext> m_context;
     std::unique_ptr<CURL, decltype(&curl_easy_cleanup)> m_curl;
-    std::unique_ptr<CURLM, decltype(&curl_multi_cleanup)> m_curl_multi;
-    fd_set m_read_fd_set[FD_SETSIZE];
-    fd_set m_write_fd_set[FD_SETSIZE];
-    fd_set m_exc_fd_set[FD_SETSIZE];
+    std::unique_ptr<curl_slist, decltype(&curl_slist_free_all)> m_headers;
+    std::string m_url;
+    std::string m_etag;
+    std::string m_last_modified;
+    std::chrono::steady_clock::time_point m_started;
+    // A second request for m_url, on a fresh connection and preferably to
+    // another of the host's addresses, raced against the first once it has
+    // run for the hedge delay.  Whichever succeeds first is kept.
+    std::unique_ptr<SimpleCurlGet> m_hedge;
+    bool m_hedge_started{false};
+    bool m_is_hedge{false};
+    std::unique_ptr<curl_slist, decltype(&curl_slist_free_all)> m_connect_to;
+    fd_set m_read_fd_set;
+    fd_set m_write_fd_set;
+    fd_set m_exc_fd_set;
     int m_max_fd{-1};
     long m_timeout_ms{0};
 
@@ -78,16 +466,50 @@ class SimpleCurlGet {
     static const unsigned default_timeout = 4;
     static const unsigned extended_timeout = 30;
 
-    SimpleCurlGet(int maxbytes = 1024 * 1024, unsigned timeout = 30)
+    // The caching-related headers of the last response.
+    struct CacheHeaders {
+        long m_max_age{-1}; // Cache-Control max-age; 0 for no-cache/no-store.
+        time_t m_expires{-1};
+        time_t m_date{-1};
+        std::string m_etag;
+        std::string m_last_modified;
+
+        // Seconds the response may be cached for, or -1 if the server
+        // didn't say.  max-age takes precedence over Expires.
+        long lifetime(time_t now) const;
+    };
+
+    SimpleCurlGet(int maxbytes = 1024 * 1024, unsigned timeout = 30,
+                  std::shared_ptr<FetchContext> context = nullptr)
         : m_maxbytes(maxbytes), m_timeout(timeout),
-          m_curl(nullptr, &curl_easy_cleanup),
-          m_curl_multi(nullptr, &curl_multi_cleanup) {}
+          m_context(std::move(context)), m_curl(nullptr, &curl_easy_cleanup),
+          m_headers(nullptr, &curl_slist_free_all),
+          m_connect_to(nullptr, &curl_slist_free_all) {
+        FD_ZERO(&m_read_fd_set);
+        FD_ZERO(&m_write_fd_set);
+        FD_ZERO(&m_exc_fd_set);
+    }
+    SimpleCurlGet(const SimpleCurlGet &) = delete;
+    SimpleCurlGet &operator=(const SimpleCurlGet &) = delete;
+
+    // A transfer abandoned midway must not be left on a shared context.
+    ~SimpleCurlGet() {
+        m_hedge.reset();
+        if (m_context && m_curl) {
+            m_context->remove(m_curl.get());
+        }
+    }
 
     struct GetStatus {
         bool m_done{false};
         int m_status_code{-1};
     };
 
+    // Make the next request conditional on the resource having changed since
+    // it was served with the given validators (either may be empty).
+    void set_conditional(const std::string &etag,
+                         const std::string &last_modified);
+
     GetStatus perform_start(const std::string &url);
     GetStatus perform_continue();
     int perform(const std::string &url, time_t expiry_time);
@@ -95,13 +517,46 @@ class SimpleCurlGet {
 
     long get_timeout_ms() const { return m_timeout_ms; }
     int get_max_fd() const { return m_max_fd; }
-    fd_set *get_read_fd_set() { return m_read_fd_set; }
-    fd_set *get_write_fd_set() { return m_write_fd_set; }
-    fd_set *get_exc_fd_set() { return m_exc_fd_set; }
+    fd_set *get_read_fd_set() { return &m_read_fd_set; }
+    fd_set *get_write_fd_set() { return &m_write_fd_set; }
+    fd_set *get_exc_fd_set() { return &m_exc_fd_set; }
+    const CacheHeaders &get_cache_headers() const { return m_cache_headers; }
+
+    // Event-loop interface, see FetchContext.  After reporting readiness or
+    // a timer expiry, call perform_continue().
+    std::vector<FetchContext::SocketInterest> get_sockets() const {
+        return m_context ? m_context->get_sockets()
+                         : std::vector<FetchContext::SocketInterest>();
+    }
+    long get_timer_ms() const {
+        long timer_ms = m_context ? m_context->get_timer_ms() : -1;
+        long hedge_ms = get_hedge_wait_ms();
+        return hedge_ms >= 0 && (timer_ms < 0 || hedge_ms < timer_ms)
+                   ? hedge_ms
+                   : timer_ms;
+    }
+    void socket_ready(curl_socket_t fd, int events) {
+        if (m_context)
+            m_context->socket_ready(fd, events);
+    }
+    void timer_fired() {
+        if (m_context)
+            m_context->timer_fired();
+    }
 
   private:
+    void update_fd_sets();
+    // Milliseconds until the hedge is due, or -1 if none is to be started.
+    long get_hedge_wait_ms() const;
+    void start_hedge();
+    // Take over the hedge's finished transfer and its response.
+    void adopt_hedge();
     static size_t write_data(void *buffer, size_t size, size_t nmemb,
                              void *userp);
+    static size_t header_data(char *buffer, size_t size, size_t nitems,
+                              void *userp);
+
+    CacheHeaders m_cache_headers;
 };
 
 } // namespace internal
@@ -153,236 +608,1482 @@ class SciTokenKey {
     std::string serialize(jwt::builder<jwt::traits::kazuho_picojson> &builder) {
         std::error_code ec;
         builder.set_key_id(m_kid);
-        return builder.sign(*this);
+        return builder.sign(*this, [](const std::string &data) {
+            return internal::b64url_encode(data);
+        });
+    }
+
+    // The JWS algorithms keys may use for signing and verifying.
+    static bool is_supported_algorithm(const std::string &name) {
+        return name == "RS256" || name == "ES256" || name == "ES384"
+#ifdef SCITOKENS_HAVE_EDDSA
+               || name == "EdDSA"
+#endif
+            ;
     }
 
     std::string sign(const std::string &data, std::error_code &ec) const {
-        if (m_name == "RS256") {
-            return jwt::algorithm::rs256(m_public, m_private).sign(data, ec);
-        } else if (m_name == "ES256") {
-            return jwt::algorithm::es256(m_public, m_private).sign(data, ec);
+        if (!is_supported_algorithm(m_name)) {
+            throw UnsupportedKeyException(
+                "Provided algorithm name is not supported");
         }
-        throw UnsupportedKeyException(
-            "Provided algorithm name is not supported");
+        return get_algorithm().m_sign(data, ec);
     }
 
     std::string name() const { return m_name; }
 
+    const std::string &kid() const { return m_kid; }
+
     void verify(const std::string &data, const std::string &signature,
                 std::error_code &ec) const {
-        if (m_name == "RS256") {
-            jwt::algorithm::rs256(m_public, m_private)
-                .verify(data, signature, ec);
-        } else if (m_name == "ES256") {
-            jwt::algorithm::es256(m_public, m_private)
-                .verify(data, signature, ec);
-        } else {
+        if (!is_supported_algorithm(m_name)) {
             throw UnsupportedKeyException(
                 "Provided algorithm is not supported.");
         }
+        get_algorithm().m_verify(data, signature, ec);
     }
 
   private:
+    struct Algorithm {
+        std::function<std::string(const std::string &, std::error_code &)>
+            m_sign;
+        std::function<void(const std::string &, const std::string &,
+                           std::error_code &)>
+            m_verify;
+    };
+
+    // The key is parsed by OpenSSL on first use and reused afterwards, as
+    // parsing costs far more than signing.  If parsing throws, the next
+    // use tries again.  (Not std::call_once: a throwing callable deadlocks
+    // it on some standard libraries and under ThreadSanitizer.)
+    const Algorithm &get_algorithm() const {
+        auto algorithm = std::atomic_load(&m_algorithm);
+        if (!algorithm) {
+            std::lock_guard<std::mutex> lock(m_algorithm_mutex);
+            algorithm = std::atomic_load(&m_algorithm);
+            if (!algorithm) {
+                if (m_name == "RS256") {
+                    algorithm = make_algorithm(
+                        jwt::algorithm::rs256(m_public, m_private));
+                } else if (m_name == "ES384") {
+                    algorithm = make_algorithm(
+                        jwt::algorithm::es384(m_public, m_private));
+#ifdef SCITOKENS_HAVE_EDDSA
+                } else if (m_name == "EdDSA") {
+                    // EdDSA keys are Ed25519 ones; Ed448 is not supported.
+                    algorithm = make_algorithm(
+                        jwt::algorithm::ed25519(m_public, m_private));
+#endif
+                } else {
+                    algorithm = make_algorithm(
+                        jwt::algorithm::es256(m_public, m_private));
+                }
+                std::atomic_store(&m_algorithm, algorithm);
+            }
+        }
+        // Once set, m_algorithm is never replaced.
+        return *algorithm;
+    }
+
+    template <typename T>
+    static std::shared_ptr<const Algorithm> make_algorithm(T alg) {
+        std::shared_ptr<Algorithm> algorithm(new Algorithm());
+        algorithm->m_sign = [alg](const std::string &data,
+                                  std::error_code &ec) {
+            return alg.sign(data, ec);
+        };
+        algorithm->m_verify = [alg](const std::string &data,
+                                    const std::string &signature,
+                                    std::error_code &ec) {
+            alg.verify(data, signature, ec);
+        };
+        return algorithm;
+    }
+
     std::string m_kid;
     std::string m_name;
     std::string m_public;
     std::string m_private;
+    mutable std::mutex m_algorithm_mutex;
+    mutable std::shared_ptr<const Algorithm> m_algorithm;
 };
 
-class Validator;
+namespace internal {
 
-class AsyncStatus {
+/**
+ * A histogram of latencies, in microseconds, with power-of-two buckets.
+ * Recording is lock-free.
+ */
+class LatencyHistogram {
   public:
-    AsyncStatus() = default;
-    AsyncStatus(const AsyncStatus &) = delete;
-    AsyncStatus &operator=(const AsyncStatus &) = delete;
+    // Bucket i counts latencies of at most 2^i us; the last one is +Inf.
+    static constexpr unsigned bucket_count = 26;
 
-    enum AsyncState { DOWNLOAD_METADATA, DOWNLOAD_PUBLIC_KEY, DONE };
+    LatencyHistogram() { reset(); }
 
-    bool m_done{false};
-    bool m_continue_fetch{false};
-    bool m_ignore_error{false};
-    bool m_do_store{true};
-    bool m_has_metadata{false};
-    bool m_oauth_fallback{false};
-    AsyncState m_state{DOWNLOAD_METADATA};
+    void record(std::chrono::steady_clock::duration elapsed);
+    void reset();
+    // {"count": N, "sum_us": N, "buckets": [{"le": "1", "count": N}, ...]},
+    // with cumulative bucket counts as Prometheus expects.
+    picojson::value to_json() const;
 
-    int64_t m_next_update{-1};
-    int64_t m_expires{-1};
-    picojson::value m_keys;
-    std::string m_issuer;
-    std::string m_kid;
-    std::string m_oauth_metadata_url;
-    std::unique_ptr<internal::SimpleCurlGet> m_cget;
-    std::string m_jwt_string;
-    std::string m_public_pem;
-    std::string m_algorithm;
+  private:
+    std::atomic<uint64_t> m_buckets[bucket_count];
+    std::atomic<uint64_t> m_count;
+    std::atomic<uint64_t> m_sum_us;
+};
 
-    struct timeval get_timeout_val(time_t expiry_time) const {
-        auto now = time(NULL);
-        long timeout_ms = 100 * (expiry_time - now);
-        if (m_cget && (m_cget->get_timeout_ms() < timeout_ms))
-            timeout_ms = m_cget->get_timeout_ms();
-        struct timeval timeout;
-        timeout.tv_sec = timeout_ms / 1000;
-        timeout.tv_usec = (timeout_ms % 1000) * 1000;
-        return timeout;
+// Records the time from construction to destruction into a histogram.
+class ScopedLatency {
+  public:
+    explicit ScopedLatency(LatencyHistogram &histogram)
+        : m_histogram(histogram), m_start(std::chrono::steady_clock::now()) {}
+    ~ScopedLatency() {
+        m_histogram.record(std::chrono::steady_clock::now() - m_start);
     }
 
-    int get_max_fd() const { return m_cget ? m_cget->get_max_fd() : -1; }
-    fd_set *get_read_fd_set() {
-        return m_cget ? m_cget->get_read_fd_set() : nullptr;
-    }
-    fd_set *get_write_fd_set() {
-        return m_cget ? m_cget->get_write_fd_set() : nullptr;
-    }
-    fd_set *get_exc_fd_set() {
-        return m_cget ? m_cget->get_exc_fd_set() : nullptr;
-    }
+  private:
+    LatencyHistogram &m_histogram;
+    std::chrono::steady_clock::time_point m_start;
 };
 
-class SciTokenAsyncStatus {
+/**
+ * Process-wide counters for the key cache, key refreshes, signature checks
+ * and the enforcers, exported as JSON by scitoken_get_stats.
+ *
+ * The counters are relaxed atomics, cheap enough to leave always on; only
+ * the per-issuer failure counts take a lock.
+ */
+class Stats {
   public:
-    SciTokenAsyncStatus() = default;
-    SciTokenAsyncStatus(const SciTokenAsyncStatus &) = delete;
-    SciTokenAsyncStatus &operator=(const SciTokenAsyncStatus &) = delete;
+    static Stats &get();
 
-    std::unique_ptr<Validator> m_validator;
-    std::unique_ptr<AsyncStatus> m_status;
+    // Bump a counter; the count is a statistic, so no ordering is needed.
+    static void add(std::atomic<uint64_t> &counter, uint64_t value = 1) {
+        counter.fetch_add(value, std::memory_order_relaxed);
+    }
+
+    void record_refresh_failure(const std::string &issuer);
+    std::string to_json() const;
+    void reset();
+
+    // Validator::get_public_key_pem.
+    std::atomic<uint64_t> m_key_lookups{0};
+    std::atomic<uint64_t> m_key_lookup_fresh{0};
+    LatencyHistogram m_key_lookup_us;
+    // Validator::get_public_keys_from_db and store_public_keys.
+    std::atomic<uint64_t> m_memory_hits{0};
+    std::atomic<uint64_t> m_sqlite_reads{0};
+    std::atomic<uint64_t> m_sqlite_hits{0};
+    LatencyHistogram m_sqlite_read_us;
+    std::atomic<uint64_t> m_sqlite_writes{0};
+    LatencyHistogram m_sqlite_write_us;
+    // Statements retried after the busy timeout ran out.
+    std::atomic<uint64_t> m_sqlite_busy_retries{0};
+    // Taking the database's write lock, including waiting out other
+    // connections' writes.
+    LatencyHistogram m_sqlite_lock_wait_us;
+    // Waits for the in-process key caches' locks while another thread held
+    // them; uncontended locking is not recorded.
+    LatencyHistogram m_lock_wait_us;
+    std::atomic<uint64_t> m_snapshot_hits{0};
+    // Key cache compactions, the expired rows they dropped and the rows
+    // evicted (from the database or the in-memory tier) to stay in bounds.
+    std::atomic<uint64_t> m_compactions{0};
+    std::atomic<uint64_t> m_compaction_expired{0};
+    std::atomic<uint64_t> m_compaction_evicted{0};
+    std::atomic<uint64_t> m_memory_evictions{0};
+    // Requests to the memcached backend, and those that failed outright.
+    std::atomic<uint64_t> m_memcached_requests{0};
+    std::atomic<uint64_t> m_memcached_hits{0};
+    std::atomic<uint64_t> m_memcached_errors{0};
+    // Rows from the memcached backend whose MAC did not match.
+    std::atomic<uint64_t> m_memcached_rejections{0};
+    // Downloads of issuer keys, from the first request to the result.
+    std::atomic<uint64_t> m_refreshes{0};
+    std::atomic<uint64_t> m_refresh_successes{0};
+    std::atomic<uint64_t> m_refresh_failures{0};
+    std::atomic<uint64_t> m_refresh_not_modified{0};
+    LatencyHistogram m_refresh_us;
+    // Hedged requests started, and those that answered first.
+    std::atomic<uint64_t> m_fetch_hedges{0};
+    std::atomic<uint64_t> m_fetch_hedge_wins{0};
+    // Signature (and time claim) checks.
+    std::atomic<uint64_t> m_verifications{0};
+    std::atomic<uint64_t> m_verification_failures{0};
+    // Tokens turned away by the checks made before any key lookup.
+    std::atomic<uint64_t> m_early_rejections{0};
+    // Tokens whose ID is on the revocation list, and list reloads.
+    std::atomic<uint64_t> m_revoked_tokens{0};
+    std::atomic<uint64_t> m_revocation_reloads{0};
+    std::atomic<uint64_t> m_revocation_reload_failures{0};
+    LatencyHistogram m_verify_us;
+    // Enforcer ACL cache and claim checks.
+    std::atomic<uint64_t> m_acl_cache_hits{0};
+    std::atomic<uint64_t> m_acl_cache_misses{0};
+    std::atomic<uint64_t> m_claim_checks{0};
+    std::atomic<uint64_t> m_claim_failures{0};
+    LatencyHistogram m_claim_check_us;
+    // Enforcer::export_capability and import_capability.
+    std::atomic<uint64_t> m_capability_exports{0};
+    std::atomic<uint64_t> m_capability_imports{0};
+    std::atomic<uint64_t> m_capability_rejections{0};
+    // Tests of tokens marked verified that only re-checked their times,
+    // and those that had to be verified in full after all.
+    std::atomic<uint64_t> m_verified_rechecks{0};
+    std::atomic<uint64_t> m_verified_fallbacks{0};
+
+  private:
+    // Past this many issuers, failures are counted under "other" so hostile
+    // tokens naming random issuers can't grow the map without bound.
+    static constexpr size_t max_failure_issuers = 1024;
+
+    mutable std::mutex m_failures_mutex;
+    std::unordered_map<std::string, uint64_t> m_failures_by_issuer;
+    uint64_t m_failures_other{0};
 };
 
-class SciToken {
+/**
+ * Like std::lock_guard, but records the wait in Stats::m_lock_wait_us if
+ * the mutex is contended.  Locking an uncontended mutex costs one try_lock.
+ */
+class TimedLockGuard {
+  public:
+    explicit TimedLockGuard(std::mutex &mutex) : m_mutex(mutex) {
+        if (!m_mutex.try_lock()) {
+            ScopedLatency timer(Stats::get().m_lock_wait_us);
+            m_mutex.lock();
+        }
+    }
+    ~TimedLockGuard() { m_mutex.unlock(); }
 
-    friend class scitokens::Validator;
+    TimedLockGuard(const TimedLockGuard &) = delete;
+    TimedLockGuard &operator=(const TimedLockGuard &) = delete;
+
+  private:
+    std::mutex &m_mutex;
+};
 
+/**
+ * Which of `count` per-CPU shards the calling thread should use: that of
+ * the CPU it is running on, where finding it is cheap, else one fixed for
+ * the thread.  Threads on different CPUs thus rarely share a shard's lock
+ * or cache lines.
+ */
+size_t cpu_shard(size_t count);
+
+// The number of shards for per-CPU structures.
+size_t cpu_shard_count();
+
+/**
+ * The stage timings of one token verification, reported to the callback
+ * registered with scitoken_config_set_trace_callback when it succeeds or
+ * fails.
+ *
+ * Spans exist only while a callback is registered: begin() returns null
+ * otherwise, and the verification path then skips all of the timing.
+ */
+class TraceSpan {
   public:
-    enum class Profile {
-        COMPAT = 0,
-        SCITOKENS_1_0,
-        SCITOKENS_2_0,
-        WLCG_1_0,
-        AT_JWT
+    enum Stage {
+        DECODE,
+        KEY_LOOKUP,
+        KEY_CONSTRUCT,
+        SIGNATURE,
+        CLAIMS,
+        STAGE_COUNT
     };
+    enum class KeySource { NONE, MEMORY, SQLITE, WEB };
+    typedef std::function<void(const TraceSpan &)> Callback;
+
+    static bool enabled() { return m_enabled.load(std::memory_order_relaxed); }
+    // Pass an empty callback to stop tracing.
+    static void set_callback(Callback callback);
+    static std::unique_ptr<TraceSpan> begin();
+
+    // `stage` ran from the previous mark (or the start of the span) to now.
+    void mark(Stage stage);
+    // Move `elapsed` of the time marked for `whole` to its part `part`.
+    void carve(Stage part, Stage whole,
+               std::chrono::steady_clock::duration elapsed);
+    // Report the span; `error` is null if the verification succeeded.
+    void finish(const char *error);
+
+    // Microseconds spent in the stage, or -1 if it wasn't reached.
+    int64_t get_stage_us(Stage stage) const { return m_stage_us[stage]; }
+    int64_t get_total_us() const { return m_total_us; }
+    // Unix time of the start of the span, in microseconds.
+    int64_t get_start_us() const { return m_start_us; }
 
-    SciToken(SciTokenKey &signing_algorithm) : m_key(signing_algorithm) {}
+    std::string m_issuer;
+    std::string m_kid;
+    KeySource m_key_source{KeySource::NONE};
+    std::string m_error;
+    bool m_failed{false};
 
-    void set_claim(const std::string &key, const jwt::claim &value) {
-        m_claims[key] = value;
-        if (key == "iss") {
-            m_issuer_set = true;
-        }
-    }
+  private:
+    TraceSpan();
+
+    static std::atomic<bool> m_enabled;
+    static std::shared_ptr<const Callback> m_callback;
+
+    std::shared_ptr<const Callback> m_span_callback;
+    std::chrono::steady_clock::time_point m_last_mark;
+    std::chrono::steady_clock::time_point m_begin;
+    int64_t m_start_us;
+    int64_t m_stage_us[STAGE_COUNT];
+    int64_t m_total_us{-1};
+    bool m_finished{false};
+};
 
-    void set_serialize_mode(Profile profile) { m_serialize_profile = profile; }
+/**
+ * A public key whose PEM has already been parsed by OpenSSL.
+ *
+ * Instances are immutable and shared between all verifications that use the
+ * same (issuer, kid); the expensive JWK -> PEM -> EVP_PKEY conversion happens
+ * once, in the constructor.
+ */
+class PublicKey {
+  public:
+    PublicKey(const std::string &algorithm, const std::string &public_pem);
 
-    void set_deserialize_mode(Profile profile) {
-        m_deserialize_profile = profile;
+    std::string name() const { return m_name; }
+
+    void verify(const std::string &data, const std::string &signature,
+                std::error_code &ec) const {
+        m_verify(data, signature, ec);
     }
 
-    const jwt::claim get_claim(const std::string &key) { return m_claims[key]; }
+  private:
+    std::string m_name;
+    std::function<void(const std::string &, const std::string &,
+                       std::error_code &)>
+        m_verify;
+};
 
-    bool has_claim(const std::string &key) const {
-        return m_claims.find(key) != m_claims.end();
-    }
+/**
+ * Process-wide cache of parsed public keys, keyed by issuer and key ID.
+ *
+ * Each entry remembers the JWK parameters it was built from (the
+ * "fingerprint"); a lookup only hits if the caller's JWK still matches, so
+ * keys rotated by another process sharing the on-disk cache are never
+ * served stale.
+ */
+class VerifierCache {
+  public:
+    static VerifierCache &get();
 
-    void set_claim_list(const std::string &claim,
-                        std::vector<std::string> &claim_list) {
-        picojson::array array;
-        array.reserve(claim_list.size());
-        for (const auto &entry : claim_list) {
-            array.emplace_back(entry);
-        }
-        m_claims[claim] = jwt::claim(picojson::value(array));
-    }
+    std::shared_ptr<const PublicKey> lookup(const std::string &issuer,
+                                            const std::string &kid,
+                                            const std::string &fingerprint);
+    void insert(const std::string &issuer, const std::string &kid,
+                const std::string &fingerprint,
+                std::shared_ptr<const PublicKey> key);
 
-    // Return a claim as a string
-    // If the claim is not a string, it can throw
-    // a std::bad_cast() exception.
-    const std::string get_claim_string(const std::string &key) {
-        return m_claims[key].as_string();
-    }
+    // Drop all keys for the issuer; called when its key set is replaced.
+    void invalidate(const std::string &issuer);
 
-    const std::vector<std::string> get_claim_list(const std::string &key) {
-        picojson::array array;
-        try {
-            array = m_claims[key].as_array();
-        } catch (std::bad_cast &) {
-            throw JsonException("Claim's value is not a JSON list");
-        }
-        std::vector<std::string> result;
-        for (const auto &value : array) {
-            result.emplace_back(value.get<std::string>());
-        }
-        return result;
-    }
+  private:
+    struct Entry {
+        std::string m_fingerprint;
+        std::shared_ptr<const PublicKey> m_key;
+    };
 
-    void set_lifetime(int lifetime) { m_lifetime = lifetime; }
+    std::mutex m_mutex;
+    std::unordered_map<std::string, std::unordered_map<std::string, Entry>>
+        m_keys;
+};
 
-    std::string serialize() {
-        jwt::builder<jwt::traits::kazuho_picojson> builder(jwt::create());
+/**
+ * An issuer's key set indexed by key ID, with each key's algorithm resolved
+ * and parameters checked once, when the key set is loaded, so selecting the
+ * key for a token is a hash lookup.
+ */
+class KeyIndex {
+  public:
+    struct Key {
+        std::string m_alg;
+        // The EC point's x and y, the RSA exponent and modulus, or the
+        // Ed25519 public key and its curve name.
+        std::string m_first;
+        std::string m_second;
+        std::string m_fingerprint;
+        // Why the key cannot be used, if it cannot; reported only when a
+        // token asks for it.
+        std::string m_error;
+        bool m_unsupported{false};
+        // Built on first use.  Access with std::atomic_load/atomic_store.
+        mutable std::shared_ptr<const PublicKey> m_public_key;
+    };
 
-        if (!m_issuer_set) {
-            throw MissingIssuerException();
-        }
-        auto time = std::chrono::system_clock::now();
-        builder.set_issued_at(time);
-        builder.set_not_before(time);
-        builder.set_expires_at(time + std::chrono::seconds(m_lifetime));
-        if (m_serialize_profile == Profile::AT_JWT) {
-            builder.set_type("at+jwt");
-        }
+    explicit KeyIndex(std::shared_ptr<const picojson::value> keys);
 
-        uuid_t uuid;
-        uuid_generate(uuid);
-        char uuid_str[37];
-        uuid_unparse_lower(uuid, uuid_str);
-        m_claims["jti"] = jwt::claim(std::string(uuid_str));
+    const std::shared_ptr<const picojson::value> &get_keys() const {
+        return m_keys;
+    }
 
-        if (m_serialize_profile == Profile::SCITOKENS_2_0) {
-            m_claims["ver"] = jwt::claim(std::string("scitoken:2.0"));
-            auto iter = m_claims.find("aud");
-            if (iter == m_claims.end()) {
-                m_claims["aud"] = jwt::claim(std::string("ANY"));
-            }
-        } else if (m_serialize_profile == Profile::WLCG_1_0) {
-            m_claims["wlcg.ver"] = jwt::claim(std::string("1.0"));
-            auto iter = m_claims.find("aud");
-            if (iter == m_claims.end()) {
-                m_claims["aud"] =
-                    jwt::claim(std::string("https://wlcg.cern.ch/jwt/v1/any"));
-            }
-        }
+    // The key for a token with this key ID (empty if the token has none);
+    // throws as Validator does for missing and unusable keys.
+    const Key &find(const std::string &kid) const;
+    bool contains(const std::string &kid) const;
 
-        // Set all the payload claims
-        for (auto it : m_claims) {
-            builder.set_payload_claim(it.first, it.second);
-        }
+  private:
+    std::shared_ptr<const picojson::value> m_keys;
+    // Set if the key set itself is malformed.
+    std::string m_error;
+    std::unordered_map<std::string, Key> m_by_kid;
+    // The key used by tokens without a key ID, if exactly one is published.
+    std::unique_ptr<Key> m_sole_key;
+    size_t m_key_count{0};
+};
 
-        return m_key.serialize(builder);
-    }
+/**
+ * The ACLs granted by a token's scopes, compiled into one prefix trie of
+ * normalized paths per authorization so that testing a request neither
+ * re-parses the scopes nor allocates.
+ */
+class ScopeIndex {
+  public:
+    typedef std::vector<std::pair<std::string, std::string>> AclsList;
 
-    void deserialize(const std::string &data,
-                     std::vector<std::string> allowed_issuers = {});
+    // The ACL paths must already be normalized.
+    explicit ScopeIndex(AclsList acls);
 
-    std::unique_ptr<SciTokenAsyncStatus>
-    deserialize_start(const std::string &data,
-                      std::vector<std::string> allowed_issuers = {});
+    const AclsList &get_acls() const { return m_acls; }
 
-    std::unique_ptr<SciTokenAsyncStatus>
-    deserialize_continue(std::unique_ptr<SciTokenAsyncStatus> status);
+    // Whether some ACL grants `authz` on a prefix of the normalized `path`.
+    bool test(const std::string &authz, const std::string &path) const {
+        return test(authz.data(), authz.size(), path.data(), path.size());
+    }
+    bool test(const char *authz, size_t authz_len, const char *path,
+              size_t path_len) const;
 
   private:
+    struct Node {
+        std::vector<std::pair<char, uint32_t>> m_children;
+        // An ACL path ends here.
+        bool m_terminal{false};
+    };
+
+    bool find_root(const char *authz, size_t len, uint32_t &node) const;
+    // Follow the edge for `ch` from `node`; false if there is none.
+    bool step(uint32_t &node, char ch) const;
+    bool walk(uint32_t &node, const char *data, size_t len,
+              bool &matched) const;
+
+    AclsList m_acls;
+    std::vector<Node> m_nodes;
+    // A token grants only a handful of authorizations, so a linear scan
+    // beats hashing and looks up a bare `char *` without a copy.
+    std::vector<std::pair<std::string, uint32_t>> m_roots;
+};
+
+/**
+ * LRU cache of the ACLs an Enforcer generated for the tokens it verified,
+ * keyed by a digest of the serialized token.  Entries are only returned
+ * while the token is valid at the lookup's time and its ID is not on the
+ * revocation list, and dropped once it expires or is revoked.  Thread-safe,
+ * as the Enforcer that owns it may be shared; large caches are split by
+ * digest into shards with their own lock and LRU order, so threads testing
+ * different tokens rarely contend.
+ */
+class AclCache {
+  public:
+    // A capacity of 0 disables the cache.  Changing the number of shards
+    // the capacity calls for empties the cache.  Safe to call while other
+    // threads look tokens up or insert them.
+    void set_capacity(size_t capacity);
+    size_t get_capacity() const { return m_capacity; }
+
+    // A SHA-256 digest, held inline so that a lookup does not allocate.
+    typedef std::array<unsigned char, 32> Digest;
+
+    std::shared_ptr<const ScopeIndex>
+    lookup(const Digest &key, std::chrono::system_clock::time_point now);
+    void insert(const Digest &key,
+                std::chrono::system_clock::time_point not_before,
+                std::chrono::system_clock::time_point expires,
+                const std::string &jti,
+                std::shared_ptr<const ScopeIndex> acls);
+    void clear();
+
+    // The cache key for a serialized token.
+    static Digest digest(const std::string &token);
+
+  private:
+    // Each shard holds at least min_shard_capacity entries, so a small
+    // cache is one exact LRU.
+    static constexpr size_t max_shards = 16;
+    static constexpr size_t min_shard_capacity = 64;
+
+    struct DigestHash {
+        size_t operator()(const Digest &key) const {
+            size_t hash;
+            memcpy(&hash, key.data(), sizeof(hash));
+            return hash;
+        }
+    };
+
+    struct Entry {
+        Digest m_key;
+        std::chrono::system_clock::time_point m_not_before;
+        std::chrono::system_clock::time_point m_expires;
+        std::string m_jti;
+        std::shared_ptr<const ScopeIndex> m_acls;
+    };
+
+    struct Shard {
+        std::mutex m_mutex;
+        size_t m_capacity{0};
+        // Most recently used first.
+        std::list<Entry> m_entries;
+        std::unordered_map<Digest, std::list<Entry>::iterator, DigestHash>
+            m_index;
+    };
+
+    // Lock and return the shard `key` belongs to.  DigestHash uses the
+    // first bytes; shards are picked by another.
+    Shard &lock_shard(const Digest &key, std::unique_lock<std::mutex> &lock);
+
+    std::atomic<size_t> m_capacity{0};
+    std::atomic<size_t> m_shard_count{1};
+    std::array<Shard, max_shards> m_shards;
+};
+
+/**
+ * What an Enforcer established when it verified a token, kept by the token
+ * (see Enforcer::mark_verified) so that the same Enforcer can test it again
+ * checking only what changes with time.
+ */
+struct VerifiedToken {
+    // Enforcer::m_id when the token was verified.
+    uint64_t m_enforcer{0};
+    // The decoded token that was verified; a token deserialized again no
+    // longer matches.  Held so that its address is not reused.
+    std::shared_ptr<const jwt::decoded_jwt<jwt::traits::kazuho_picojson>>
+        m_decoded;
+    // The token is valid from m_not_before ("nbf" or "iat", whichever is
+    // later) to m_expires, inclusive.
+    int64_t m_not_before{std::numeric_limits<int64_t>::min()};
+    int64_t m_expires{std::numeric_limits<int64_t>::max()};
+    std::string m_jti;
+    std::shared_ptr<const ScopeIndex> m_acls;
+};
+
+/**
+ * What the key cache remembers about an issuer besides its keys, to make
+ * refreshes cheaper.
+ */
+struct KeyCacheMetadata {
+    // Validators of the last key set response, for conditional requests.
+    std::string m_etag;
+    std::string m_last_modified;
+    // Where the key set was found, the metadata endpoint that said so, and
+    // until when we may skip asking again.
+    std::string m_jwks_uri;
+    std::string m_metadata_url;
+    int64_t m_jwks_uri_expires{-1};
+};
+
+/**
+ * Where the key cache keeps issuers' key sets beyond each process's memory
+ * tier, as selected by "keycache.backend": the SQLite database in the cache
+ * home (the default), a memcached server that many hosts share (so an
+ * issuer's keys are downloaded once per refresh for all of them), or the
+ * process's memory alone.
+ *
+ * Rows are the JSON documents Validator::store_public_keys builds; a backend
+ * only has to keep each until its expiry.  Backends are used by many
+ * threads at once.
+ */
+class KeyCacheBackend {
+  public:
+    enum class Lookup { FOUND, MISSING, UNAVAILABLE };
+
+    virtual ~KeyCacheBackend() {}
+
+    // The backend the configuration currently selects.
+    static std::shared_ptr<KeyCacheBackend> get();
+
+    // Fetch the issuer's row.  UNAVAILABLE means the backend could not be
+    // asked, so callers may make do with what they already have.  `now`
+    // lets a backend skip rows it knows are due for an update.
+    virtual Lookup lookup(const std::string &issuer, int64_t now,
+                          std::string &row) = 0;
+
+    // Returns false if the row could not be stored.
+    virtual bool store(const std::string &issuer, const std::string &row,
+                       int64_t expires) = 0;
+
+    virtual void invalidate(const std::string &issuer) = 0;
+
+    // Drop expired rows and evict past the configured bounds; returns the
+    // number of rows removed.  Backends that expire rows themselves (e.g.,
+    // memcached) have nothing to do.
+    virtual size_t compact(int64_t /*now*/) { return 0; }
+};
+
+// The backend keeping rows on the memcached server at `server`
+// ("host:port"), defined in scitokens_memcached.cpp.
+std::shared_ptr<KeyCacheBackend>
+make_memcached_backend(const std::string &server);
+
+/**
+ * The outcome of one in-flight key set refresh, shared by the caller
+ * performing it (the "leader") and everyone waiting on it.
+ */
+class RefreshState {
+  public:
+    enum class Outcome { PENDING, SUCCEEDED, FAILED, ABANDONED };
+
+    // How long a waiting caller blocks per poll.
+    static const int poll_interval_ms = 10;
+
+    // Wait up to `timeout` for the refresh to finish.  On success the
+    // refreshed keys are copied to `keys`; on failure `error` is set.
+    Outcome wait_for(std::chrono::milliseconds timeout,
+                     std::shared_ptr<const picojson::value> &keys,
+                     std::string &error);
+
+    void finish(Outcome outcome, std::shared_ptr<const picojson::value> keys,
+                const std::string &error);
+
+  private:
+    std::mutex m_mutex;
+    std::condition_variable m_cond;
+    Outcome m_outcome{Outcome::PENDING};
+    std::shared_ptr<const picojson::value> m_keys;
+    std::string m_error;
+};
+
+/**
+ * Coalesces key set refreshes so there is at most one in flight per issuer.
+ */
+class RefreshCoordinator {
+  public:
+    static RefreshCoordinator &get();
+
+    // Returns the issuer's in-flight refresh; if there was none, a new one
+    // is created and `leader` is set to indicate the caller must perform it.
+    std::shared_ptr<RefreshState> join(const std::string &issuer,
+                                       bool &leader);
+
+    // Called by the leader to retire the refresh and wake any waiters.
+    void finish(const std::string &issuer,
+                const std::shared_ptr<RefreshState> &state,
+                RefreshState::Outcome outcome,
+                std::shared_ptr<const picojson::value> keys,
+                const std::string &error);
+
+  private:
+    std::mutex m_mutex;
+    std::unordered_map<std::string, std::shared_ptr<RefreshState>> m_inflight;
+};
+
+/**
+ * Remembers what recently failed, so it is not retried on every
+ * verification: issuers whose key set could not be downloaded, which are
+ * backed off exponentially ("keycache.failure_backoff_s" doubling per
+ * consecutive failure), and key IDs an issuer does not publish
+ * ("keycache.unknown_kid_ttl_s").  A key ID missing from the cached keys may
+ * be a rotation, so it may force a refresh, but at most one per issuer per
+ * "keycache.min_update_interval_s".
+ */
+class NegativeCache {
+  public:
+    static NegativeCache &get();
+
+    // True if the issuer is backing off; `error` is set to its last failure
+    // and `retry_in` to the seconds left.
+    bool backing_off(const std::string &issuer, std::string &error,
+                     int64_t &retry_in);
+    void record_failure(const std::string &issuer, const std::string &error);
+    void record_success(const std::string &issuer);
+
+    bool kid_unknown(const std::string &issuer, const std::string &kid);
+    void record_unknown_kid(const std::string &issuer, const std::string &kid);
+    // The issuer's keys changed, so any key ID may now be published.
+    void forget_kids(const std::string &issuer);
+    // Whether to refresh the issuer's keys to look for a missing key ID;
+    // if so, no other refresh is allowed until the interval passes.
+    bool allow_forced_refresh(const std::string &issuer);
+
+  private:
+    typedef std::chrono::steady_clock::time_point time_point;
+
+    // Backoff doubles up to this many times.
+    static const unsigned max_doublings = 5;
+    // Bounds on the state kept, as either may be attacker-controlled.
+    static const size_t max_issuers = 1024;
+    static const size_t max_kids_per_issuer = 256;
+
+    struct IssuerEntry {
+        unsigned m_failures{0};
+        time_point m_retry_after;
+        std::string m_error;
+        time_point m_next_forced_refresh;
+        std::unordered_map<std::string, time_point> m_unknown_kids;
+    };
+
+    // Must be called with m_mutex held.
+    IssuerEntry &entry(const std::string &issuer, time_point now);
+
+    std::mutex m_mutex;
+    std::unordered_map<std::string, IssuerEntry> m_issuers;
+};
+
+/**
+ * Background thread renewing the key sets of issuers seen by Validator
+ * before they are due for an update, so foreground verifications do not
+ * wait on the network.  It runs every "keycache.refresh_interval_s"
+ * seconds and is off unless that is set.
+ */
+class BackgroundRefresher {
+  public:
+    static BackgroundRefresher &get();
+
+    ~BackgroundRefresher();
+
+    // Start, stop or reschedule the thread to match the configuration.
+    void reconfigure();
+
+    // Keep this issuer's keys fresh from now on.
+    void track(const std::string &issuer);
+
+  private:
+    BackgroundRefresher();
+
+    void run();
+
+    std::mutex m_control_mutex; // Serializes starting and stopping.
+    std::thread m_thread;
+
+    std::mutex m_mutex;
+    std::condition_variable m_cond;
+    bool m_shutdown{false};
+    unsigned m_generation{0};
+    std::unordered_set<std::string> m_issuers;
+};
+
+/**
+ * An immutable set of revoked token IDs.  A blocked Bloom filter answers
+ * almost every lookup of an ID that is not in the set from a single cache
+ * line; the few IDs it lets through are confirmed against the sorted list
+ * of IDs.
+ */
+class RevocationFilter {
+  public:
+    explicit RevocationFilter(std::vector<std::string> ids);
+
+    bool contains(const std::string &id) const;
+    size_t size() const { return m_ids.size(); }
+
+  private:
+    // 512 bits, one cache line, holding all of an ID's filter bits.
+    struct Block {
+        uint64_t m_words[8];
+    };
+
+    static uint64_t hash(const std::string &id);
+
+    std::vector<Block> m_blocks;
+    std::vector<std::string> m_ids; // Sorted.
+};
+
+/**
+ * The token IDs ("jti") revoked before their expiry, loaded from the file
+ * or https URL set as "revocation.source" and reloaded on a thread of its
+ * own every "revocation.refresh_interval_s" seconds.  A reload that fails
+ * keeps the list already loaded.
+ *
+ * The source lists one ID per line; blank lines and lines starting with
+ * '#' are skipped.  Lookups take no locks, and cost a single relaxed load
+ * while no source is set.
+ */
+class RevocationList {
+  public:
+    static RevocationList &get();
+
+    ~RevocationList();
+
+    bool is_revoked(const std::string &jti) const {
+        if (!m_active.load(std::memory_order_relaxed)) {
+            return false;
+        }
+        auto filter = std::atomic_load(&m_filter);
+        return filter && filter->contains(jti);
+    }
+
+    // Load the list from `source` and keep it fresh from now on; an empty
+    // source drops the list.  Throws, changing nothing, if it can't be
+    // loaded.
+    void set_source(const std::string &source);
+    std::string get_source();
+
+    // Wake the reload thread to pick up a new interval.
+    void reconfigure();
+
+  private:
+    RevocationList();
+
+    static std::shared_ptr<const RevocationFilter>
+    load(const std::string &source);
+    void run();
+
+    std::atomic<bool> m_active{false};
+    // Access with std::atomic_load/atomic_store.
+    std::shared_ptr<const RevocationFilter> m_filter;
+
+    std::mutex m_control_mutex; // Serializes starting and stopping.
+    std::thread m_thread;
+
+    std::mutex m_mutex;
+    std::condition_variable m_cond;
+    bool m_shutdown{false};
+    unsigned m_generation{0};
+    std::string m_source;
+};
+
+/**
+ * Run job(0) ... job(count - 1) on the calling thread and up to
+ * `threads - 1` more.  Each of the jobs runs exactly once; the first
+ * exception one throws is rethrown once all threads are done.
+ */
+void parallel_for(size_t count, unsigned threads,
+                  const std::function<void(size_t)> &job);
+
+/**
+ * Worker threads for the signature and claim checks of asynchronous
+ * verifications, so callers' event loops stay responsive while the work
+ * spreads across cores.  Sized by "verify.worker_threads"; with no threads,
+ * checks run on the caller's thread.
+ */
+class VerifyPool {
+  public:
+    static VerifyPool &get();
+
+    ~VerifyPool();
+
+    // Start or stop threads to match the configuration.
+    void reconfigure();
+
+    // Queue `job`; returns false, without running it, if there are no
+    // worker threads.
+    bool submit(std::function<void()> job);
+
+  private:
+    VerifyPool();
+
+    void run();
+    void stop_threads();
+
+    std::mutex m_control_mutex; // Serializes starting and stopping.
+    std::vector<std::thread> m_threads;
+
+    std::mutex m_mutex;
+    std::condition_variable m_cond;
+    bool m_shutdown{false};
+    std::deque<std::function<void()>> m_jobs;
+};
+
+/**
+ * Drives asynchronous requests to completion on a thread of its own, so
+ * callers are called back when a request is over instead of polling it.
+ * Requests' downloads go on the engine's fetch context.  The thread is
+ * started on first use.
+ */
+class CompletionEngine {
+  public:
+    // Advances a request; returns true once it is over (having reported
+    // its outcome).  Must not throw.
+    typedef std::function<bool()> Step;
+
+    static CompletionEngine &get();
+
+    ~CompletionEngine();
+
+    const std::shared_ptr<FetchContext> &get_context() const {
+        return m_context;
+    }
+
+    // Take over a request that is waiting on a download or the VerifyPool.
+    void submit(Step step);
+
+  private:
+    CompletionEngine();
+
+    void run();
+
+    std::shared_ptr<FetchContext> m_context;
+
+    std::mutex m_mutex;
+    std::condition_variable m_cond;
+    bool m_shutdown{false};
+    std::vector<Step> m_submitted;
+    std::thread m_thread;
+};
+
+} // namespace internal
+
+class Validator;
+class Enforcer;
+class MultiEnforcer;
+
+// The token profiles; declared here so AsyncStatus can record one, and
+// known to everyone else as SciToken::Profile.
+enum class TokenProfile {
+    COMPAT = 0,
+    SCITOKENS_1_0,
+    SCITOKENS_2_0,
+    WLCG_1_0,
+    AT_JWT
+};
+
+namespace internal {
+
+/**
+ * A signature check handed to the VerifyPool.  Its file descriptor becomes
+ * readable once the check is over, so the request's caller can wait for
+ * it in select() or its event loop like for a download.
+ */
+class VerifyJob {
+  public:
+    VerifyJob();
+    ~VerifyJob();
+    VerifyJob(const VerifyJob &) = delete;
+    VerifyJob &operator=(const VerifyJob &) = delete;
+
+    // Called by the worker with the token's profile or the failure.
+    void finish(TokenProfile profile, std::exception_ptr error);
+
+    bool is_done() const;
+    // Block until the worker is done with the job.
+    void wait() const;
+    // The profile the check found; rethrows its failure.
+    TokenProfile get_profile() const;
+
+    int get_fd() const { return m_pipe[0]; }
+    fd_set *get_read_fd_set();
+    fd_set *get_empty_fd_set();
+
+  private:
+    mutable std::mutex m_mutex;
+    mutable std::condition_variable m_cond;
+    bool m_done{false};
+    TokenProfile m_profile{TokenProfile::COMPAT};
+    std::exception_ptr m_error;
+    int m_pipe[2]{-1, -1};
+    fd_set m_read_fd_set;
+    fd_set m_empty_fd_set;
+};
+
+typedef jwt::details::map_of_claims<jwt::traits::kazuho_picojson>
+    PayloadClaims;
+
+// Reaches a token's claims in place; get_payload_claims copies them.
+struct PayloadAccess : jwt::decoded_jwt<jwt::traits::kazuho_picojson> {
+    static const PayloadClaims &
+    get(const jwt::decoded_jwt<jwt::traits::kazuho_picojson> &jwt) {
+        return jwt.*(&PayloadAccess::payload_claims);
+    }
+};
+
+inline const picojson::value *find_claim(const PayloadClaims &claims,
+                                         const char *name) {
+    for (const auto &claim : claims) {
+        if (claim.first == name) {
+            return &claim.second;
+        }
+    }
+    return nullptr;
+}
+
+// The value a claim wraps, in place; to_json copies it.  A jwt::claim holds
+// nothing but its value, so the two share an address.
+inline const picojson::value &claim_value(const jwt::claim &claim) {
+    static_assert(std::is_standard_layout<jwt::claim>::value &&
+                      sizeof(jwt::claim) == sizeof(picojson::value),
+                  "jwt::claim must hold only its JSON value");
+    return *reinterpret_cast<const picojson::value *>(&claim);
+}
+
+/**
+ * Why a token was turned away, recorded without throwing or formatting a
+ * message, so that rejecting a token costs about as much as accepting one.
+ * The message, identical to what the exception would have said, is only
+ * built when asked for.  Reasons and names are borrowed: they must outlive
+ * the Rejection (string literals, or the Validator's claim plan).
+ */
+class Rejection {
+  public:
+    Rejection() = default;
+    Rejection(const Rejection &) = delete;
+    Rejection &operator=(const Rejection &) = delete;
+
+    explicit operator bool() const { return m_reason || m_code; }
+
+    void set(const char *reason) { m_reason = reason; }
+    // A message formatted elsewhere (e.g., by a claim validator).
+    void take(std::string reason) {
+        m_owned = std::move(reason);
+        m_reason = m_owned.c_str();
+    }
+    // The message is `reason` followed by `detail`.
+    void set(const char *reason, const std::string &detail) {
+        m_reason = reason;
+        m_detail = &detail;
+    }
+    // The message is `name`, quoted, followed by `reason`.
+    void set_quoted(const std::string &name, const char *reason) {
+        m_reason = reason;
+        m_detail = &name;
+        m_quoted = true;
+    }
+    // A failure jwt-cpp reported.
+    void set(std::error_code code) { m_code = code; }
+
+    std::string message() const {
+        if (m_code) {
+            return std::system_error(m_code).what();
+        }
+        return JWTVerificationException(describe()).what();
+    }
+
+    // Throw the exception the throwing interfaces report this with.
+    [[noreturn]] void raise() const {
+        if (m_code) {
+            jwt::error::throw_if_error(m_code);
+        }
+        throw JWTVerificationException(describe());
+    }
+
+  private:
+    std::string describe() const {
+        if (!m_detail) {
+            return m_reason;
+        }
+        if (m_quoted) {
+            return "'" + *m_detail + "' " + m_reason;
+        }
+        return m_reason + *m_detail;
+    }
+
+    const char *m_reason{nullptr};
+    const std::string *m_detail{nullptr};
+    bool m_quoted{false};
+    std::string m_owned;
+    std::error_code m_code;
+};
+
+} // namespace internal
+
+class AsyncStatus : public internal::Pooled<AsyncStatus> {
+  public:
+    AsyncStatus() = default;
+    AsyncStatus(const AsyncStatus &) = delete;
+    AsyncStatus &operator=(const AsyncStatus &) = delete;
+
+    ~AsyncStatus() {
+        // The worker is still using the Validator and the token.
+        if (m_verify_job) {
+            m_verify_job->wait();
+        }
+        // A leader dropped mid-refresh must not strand its waiters.
+        if (m_refresh_leader) {
+            internal::RefreshCoordinator::get().finish(
+                m_issuer, m_refresh, internal::RefreshState::Outcome::ABANDONED,
+                nullptr, "");
+        }
+    }
+
+    enum AsyncState { DOWNLOAD_METADATA, DOWNLOAD_PUBLIC_KEY, DONE };
+
+    bool m_done{false};
+    bool m_continue_fetch{false};
+    bool m_ignore_error{false};
+    bool m_do_store{true};
+    bool m_has_metadata{false};
+    bool m_metadata_fallback{false};
+    bool m_jwks_uri_cached{false};
+    bool m_refresh_leader{false};
+    // Set once the keys were refreshed to look for a missing key ID.
+    bool m_kid_refreshed{false};
+    // When this status started downloading keys, for the refresh stats.
+    std::chrono::steady_clock::time_point m_refresh_start;
+    // Where the key came from, and how long it took to parse, for tracing.
+    internal::TraceSpan::KeySource m_key_source{
+        internal::TraceSpan::KeySource::NONE};
+    std::chrono::steady_clock::duration m_key_construct_time{};
+    std::unique_ptr<internal::TraceSpan> m_trace;
+    // Hand the signature check to the VerifyPool, if it has threads.
+    bool m_use_worker_pool{false};
+    AsyncState m_state{DOWNLOAD_METADATA};
+
+    int64_t m_next_update{-1};
+    int64_t m_expires{-1};
+    std::shared_ptr<const picojson::value> m_keys;
+    internal::KeyCacheMetadata m_metadata;
+    std::string m_issuer;
+    std::string m_kid;
+    std::string m_metadata_url;
+    std::string m_fallback_metadata_url;
+    unsigned m_timeout{internal::SimpleCurlGet::default_timeout};
+    // Shared multi handle for the downloads, if the caller provided one.
+    std::shared_ptr<internal::FetchContext> m_fetch_context;
+    std::unique_ptr<internal::SimpleCurlGet> m_cget;
+    // The token being verified, decoded once by the caller.
+    std::shared_ptr<const jwt::decoded_jwt<jwt::traits::kazuho_picojson>> m_jwt;
+    // The profile the token was found to follow.  Kept here rather than on
+    // the Validator so that one Validator can verify several tokens at once.
+    TokenProfile m_profile{TokenProfile::COMPAT};
+    std::shared_ptr<const internal::PublicKey> m_public_key;
+    // The index of m_keys, if it was loaded with one.
+    std::shared_ptr<const internal::KeyIndex> m_key_index;
+    // Set while this request performs or waits on a key set refresh.
+    std::shared_ptr<internal::RefreshState> m_refresh;
+    // Set while the signature check runs on the VerifyPool.
+    std::shared_ptr<internal::VerifyJob> m_verify_job;
+
+    struct timeval get_timeout_val(time_t expiry_time) const {
+        auto now = time(NULL);
+        long timeout_ms = 100 * (expiry_time - now);
+        if (m_cget && (m_cget->get_timeout_ms() < timeout_ms))
+            timeout_ms = m_cget->get_timeout_ms();
+        if (m_refresh && !m_refresh_leader &&
+            (internal::RefreshState::poll_interval_ms < timeout_ms))
+            timeout_ms = internal::RefreshState::poll_interval_ms;
+        struct timeval timeout;
+        timeout.tv_sec = timeout_ms / 1000;
+        timeout.tv_usec = (timeout_ms % 1000) * 1000;
+        return timeout;
+    }
+
+    int get_max_fd() const {
+        if (m_verify_job) {
+            return m_verify_job->get_fd();
+        }
+        return m_cget ? m_cget->get_max_fd() : -1;
+    }
+    fd_set *get_read_fd_set() {
+        if (m_verify_job) {
+            return m_verify_job->get_read_fd_set();
+        }
+        return m_cget ? m_cget->get_read_fd_set() : nullptr;
+    }
+    fd_set *get_write_fd_set() {
+        if (m_verify_job) {
+            return m_verify_job->get_empty_fd_set();
+        }
+        return m_cget ? m_cget->get_write_fd_set() : nullptr;
+    }
+    fd_set *get_exc_fd_set() {
+        if (m_verify_job) {
+            return m_verify_job->get_empty_fd_set();
+        }
+        return m_cget ? m_cget->get_exc_fd_set() : nullptr;
+    }
+
+    std::vector<internal::FetchContext::SocketInterest> get_sockets() const {
+        if (m_verify_job) {
+            return {{m_verify_job->get_fd(), CURL_POLL_IN}};
+        }
+        return m_cget ? m_cget->get_sockets()
+                      : std::vector<internal::FetchContext::SocketInterest>();
+    }
+    // A request waiting on another's refresh has no socket of its own and
+    // instead needs to be woken up to check on it.
+    long get_timer_ms() const {
+        if (m_verify_job) {
+            return -1;
+        }
+        long timer_ms = m_cget ? m_cget->get_timer_ms() : -1;
+        if (m_refresh && !m_refresh_leader &&
+            (timer_ms < 0 ||
+             internal::RefreshState::poll_interval_ms < timer_ms))
+            timer_ms = internal::RefreshState::poll_interval_ms;
+        return timer_ms;
+    }
+    void socket_ready(curl_socket_t fd, int events) {
+        if (m_cget && !m_verify_job)
+            m_cget->socket_ready(fd, events);
+    }
+    void timer_fired() {
+        if (m_cget && !m_verify_job)
+            m_cget->timer_fired();
+    }
+};
+
+class SciTokenAsyncStatus : public internal::Pooled<SciTokenAsyncStatus> {
+  public:
+    SciTokenAsyncStatus() = default;
+    SciTokenAsyncStatus(const SciTokenAsyncStatus &) = delete;
+    SciTokenAsyncStatus &operator=(const SciTokenAsyncStatus &) = delete;
+
+    std::unique_ptr<Validator> m_validator;
+    std::unique_ptr<AsyncStatus> m_status;
+};
+
+class SciToken {
+
+    friend class scitokens::Validator;
+    friend class scitokens::Enforcer;
+    friend class scitokens::MultiEnforcer;
+
+  public:
+    typedef TokenProfile Profile;
+
+    SciToken(SciTokenKey &signing_algorithm) : m_key(signing_algorithm) {}
+
+    void set_claim(const std::string &key, const jwt::claim &value) {
+        m_claims[key] = value;
+        if (key == "iss") {
+            m_issuer_set = true;
+        }
+    }
+
+    void set_serialize_mode(Profile profile) { m_serialize_profile = profile; }
+
+    void set_deserialize_mode(Profile profile) {
+        m_deserialize_profile = profile;
+    }
+
+    const jwt::claim get_claim(const std::string &key) {
+        jwt::claim claim;
+        if (lookup_claim(key, claim)) {
+            return claim;
+        }
+        return m_claims[key];
+    }
+
+    bool has_claim(const std::string &key) const {
+        return m_claims.find(key) != m_claims.end() ||
+               (m_decoded && m_decoded->has_payload_claim(key));
+    }
+
+    void set_claim_list(const std::string &claim,
+                        std::vector<std::string> &claim_list) {
+        picojson::array array;
+        array.reserve(claim_list.size());
+        for (const auto &entry : claim_list) {
+            array.emplace_back(entry);
+        }
+        m_claims[claim] = jwt::claim(picojson::value(array));
+    }
+
+    // Return a claim as a string
+    // If the claim is not a string, it can throw
+    // a std::bad_cast() exception.
+    const std::string get_claim_string(const std::string &key) {
+        return get_claim(key).as_string();
+    }
+
+    // The claim's value in place, or null if it is not set.  Valid until
+    // the token is changed, serialized, deserialized again or destroyed.
+    const picojson::value *find_claim(const std::string &key) const {
+        auto iter = m_claims.find(key);
+        if (iter != m_claims.end()) {
+            return &internal::claim_value(iter->second);
+        }
+        if (m_decoded) {
+            return internal::find_claim(
+                internal::PayloadAccess::get(*m_decoded), key.c_str());
+        }
+        return nullptr;
+    }
+
+    const std::vector<std::string> get_claim_list(const std::string &key) {
+        picojson::array array;
+        try {
+            array = get_claim(key).as_array();
+        } catch (std::bad_cast &) {
+            throw JsonException("Claim's value is not a JSON list");
+        }
+        std::vector<std::string> result;
+        for (const auto &value : array) {
+            result.emplace_back(value.get<std::string>());
+        }
+        return result;
+    }
+
+    void set_lifetime(int lifetime) { m_lifetime = lifetime; }
+
+    std::string serialize() {
+        jwt::builder<jwt::traits::kazuho_picojson> builder(jwt::create());
+
+        if (!m_issuer_set) {
+            throw MissingIssuerException();
+        }
+        if (m_decoded) {
+            // Re-serializing a deserialized token; carry over the claims
+            // that weren't overridden.
+            for (const auto &entry : m_decoded->get_payload_claims()) {
+                m_claims.insert(entry);
+            }
+        }
+        auto time = std::chrono::system_clock::now();
+        builder.set_issued_at(time);
+        builder.set_not_before(time);
+        builder.set_expires_at(time + std::chrono::seconds(m_lifetime));
+        if (m_serialize_profile == Profile::AT_JWT) {
+            builder.set_type("at+jwt");
+        }
+
+        m_claims["jti"] = jwt::claim(generate_jti());
+        add_profile_claims(m_claims);
+
+        // Set all the payload claims
+        for (const auto &it : m_claims) {
+            builder.set_payload_claim(it.first, it.second);
+        }
+
+        return m_key.serialize(builder);
+    }
+
+    void deserialize(const std::string &data,
+                     std::vector<std::string> allowed_issuers = {});
+
+    // As above, verifying with an already configured Validator (which
+    // should accept only `allowed_issuers`); the token's own deserialize
+    // profile is not consulted.
+    void deserialize(const std::string &data, const Validator &validator,
+                     const std::vector<std::string> &allowed_issuers);
+
+    // As the two above, but a rejected token is reported by returning false
+    // with the reason in `why` instead of by throwing; malformed tokens and
+    // failures to get the issuer's keys still throw.
+    bool try_deserialize(const std::string &data,
+                         const std::vector<std::string> &allowed_issuers,
+                         internal::Rejection &why);
+    bool try_deserialize(const std::string &data, const Validator &validator,
+                         const std::vector<std::string> &allowed_issuers,
+                         internal::Rejection &why);
+
+    // Decode a token's claims WITHOUT verifying it: no signature check, key
+    // lookup or claim validation.  For routing only; anything granting
+    // access must verify the token (Enforcer does so itself).
+    void peek(const std::string &data);
+
+    // The decoded JSON header of a serialized token, which is checked to
+    // be a JSON object but otherwise NOT verified; the payload is not
+    // decoded at all.
+    static std::string peek_header(const std::string &data);
+
+    std::unique_ptr<SciTokenAsyncStatus>
+    deserialize_start(const std::string &data,
+                      std::vector<std::string> allowed_issuers = {},
+                      std::shared_ptr<internal::FetchContext> context = nullptr);
+
+    std::unique_ptr<SciTokenAsyncStatus>
+    deserialize_continue(std::unique_ptr<SciTokenAsyncStatus> status);
+
+    // Deserialize and verify, calling `done` with the failure, if any,
+    // once it is over; see Validator::verify_with_callback for where
+    // `done` runs.  The token must outlive the call.
+    void deserialize_with_callback(
+        const std::string &data, std::vector<std::string> allowed_issuers,
+        std::function<void(std::exception_ptr)> done);
+
+    // Deserialize data[i] into *tokens[i] for every i, verifying them as a
+    // batch with Validator::verify_many.  Returns one entry per token: empty
+    // on success, the error otherwise.
+    static std::vector<std::string>
+    deserialize_many(const std::vector<std::string> &data,
+                     const std::vector<SciToken *> &tokens,
+                     const std::vector<std::string> &allowed_issuers = {},
+                     unsigned threads = 1);
+
+  private:
+    friend class TokenTemplate;
+
+    static std::string generate_jti() {
+        uuid_t uuid;
+        uuid_generate(uuid);
+        char uuid_str[37];
+        uuid_unparse_lower(uuid, uuid_str);
+        return uuid_str;
+    }
+
+    // Add the claims the serialize profile calls for.
+    void add_profile_claims(
+        std::unordered_map<std::string, jwt::claim> &claims) const {
+        if (m_serialize_profile == Profile::SCITOKENS_2_0) {
+            claims["ver"] = jwt::claim(std::string("scitoken:2.0"));
+            auto iter = claims.find("aud");
+            if (iter == claims.end()) {
+                claims["aud"] = jwt::claim(std::string("ANY"));
+            }
+        } else if (m_serialize_profile == Profile::WLCG_1_0) {
+            claims["wlcg.ver"] = jwt::claim(std::string("1.0"));
+            auto iter = claims.find("aud");
+            if (iter == claims.end()) {
+                claims["aud"] =
+                    jwt::claim(std::string("https://wlcg.cern.ch/jwt/v1/any"));
+            }
+        }
+    }
+
+    // Claims set on a deserialized token override those it was decoded with,
+    // which are read from m_decoded rather than copied.
+    bool lookup_claim(const std::string &key, jwt::claim &claim) const {
+        auto iter = m_claims.find(key);
+        if (iter != m_claims.end()) {
+            claim = iter->second;
+            return true;
+        }
+        if (m_decoded && m_decoded->has_payload_claim(key)) {
+            claim = m_decoded->get_payload_claim(key);
+            return true;
+        }
+        return false;
+    }
+
     bool m_issuer_set{false};
     int m_lifetime{600};
     Profile m_profile{Profile::SCITOKENS_1_0};
     Profile m_serialize_profile{Profile::COMPAT};
     Profile m_deserialize_profile{Profile::COMPAT};
     std::unordered_map<std::string, jwt::claim> m_claims;
-    std::unique_ptr<jwt::decoded_jwt<jwt::traits::kazuho_picojson>> m_decoded;
+    std::shared_ptr<const jwt::decoded_jwt<jwt::traits::kazuho_picojson>>
+        m_decoded;
+    // Set by Enforcer::mark_verified.
+    std::shared_ptr<const internal::VerifiedToken> m_verified;
     SciTokenKey &m_key;
 };
 
-class Validator {
+/**
+ * A token's header and fixed claims, encoded once, for minting many tokens
+ * that differ only in their jti, iat, nbf, exp and sub claims.
+ */
+class TokenTemplate {
+  public:
+    // Captures the token's claims, lifetime and serialize profile, which may
+    // be changed afterwards; the token's key must outlive the template.
+    explicit TokenTemplate(const SciToken &token);
+
+    // Mint a token; an empty `sub` keeps the template's, if any.
+    std::string serialize(const std::string &sub = "") const;
+
+    // Mint one token per entry of `subs`, signing on up to `threads`
+    // threads.
+    std::vector<std::string>
+    serialize_many(const std::vector<std::string> &subs,
+                   unsigned threads = 1) const;
+
+  private:
+    const SciTokenKey &m_key;
+    int m_lifetime;
+    // "<encoded header>.<encoded fixed claims>"; the fixed claims are padded
+    // to a multiple of 3 bytes, so the per-token claims can be encoded on
+    // their own and appended.
+    std::string m_prefix;
+    // Whether the per-token claims follow other claims.
+    bool m_has_fixed_claims{false};
+    std::string m_sub;
+};
+
+class Validator : public internal::Pooled<Validator> {
+
+    friend class internal::BackgroundRefresher;
 
     typedef int (*StringValidatorFunction)(const char *value, char **err_msg);
     typedef bool (*ClaimValidatorFunction)(const jwt::claim &claim_value,
@@ -393,381 +2094,711 @@ class Validator {
                      std::vector<std::pair<ClaimValidatorFunction, void *>>>
         ClaimValidatorMap;
 
-  public:
-    Validator() : m_now(std::chrono::system_clock::now()) {}
+    // A claim's handlers, frozen by rebuild_claim_plan whenever the
+    // Validator is configured.  A ClaimPlan is sorted by name, as are a
+    // token's claims, so check_token matches the two in one merge pass.
+    struct ClaimRule {
+        std::string m_name;
+        // Checked elsewhere (the timestamps, profile version and, when
+        // there are allowed issuers, the issuer).
+        bool m_skip{false};
+        // The handlers, in the order check_token runs them.
+        bool m_require_string{false};
+        std::vector<StringValidatorFunction> m_string_validators;
+        std::vector<std::pair<ClaimValidatorFunction, void *>>
+            m_claim_validators;
+        // Error messages, formatted up front.
+        std::string m_not_string_error;
+        std::string m_failed_error;
+    };
+    typedef std::vector<ClaimRule> ClaimPlan;
+
+  public:
+    Validator()
+        : m_now(std::chrono::system_clock::now()),
+          m_claim_plan(base_claim_plan(false)) {}
+
+    void set_now(std::chrono::system_clock::time_point now) { m_now = now; }
+    // Check each token against the time it is verified at rather than the
+    // time the Validator was made, for Validators reused over a long time.
+    void use_current_time() { m_now = std::chrono::system_clock::time_point(); }
+    std::chrono::system_clock::time_point get_now() const {
+        if (m_now == std::chrono::system_clock::time_point()) {
+            return std::chrono::system_clock::now();
+        }
+        return m_now;
+    }
+
+    std::unique_ptr<AsyncStatus>
+    verify_async(const SciToken &scitoken,
+                 std::shared_ptr<internal::FetchContext> context =
+                     nullptr) const {
+        if (!scitoken.m_decoded) {
+            throw JWTVerificationException(
+                "Token is not deserialized from string.");
+        }
+        return verify_async(scitoken.m_decoded, std::move(context));
+    }
+
+    void verify(const SciToken &scitoken, time_t expiry_time) const {
+        auto result = verify_async(scitoken);
+        while (!result->m_done) {
+            auto timeout_val = result->get_timeout_val(expiry_time);
+            select(result->get_max_fd() + 1, result->get_read_fd_set(),
+                   result->get_write_fd_set(), result->get_exc_fd_set(),
+                   &timeout_val);
+            if (time(NULL) >= expiry_time) {
+                throw CurlException("Timeout when loading the OIDC metadata.");
+            }
+
+            result = verify_async_continue(std::move(result));
+        }
+    }
+
+    void
+    verify(std::shared_ptr<const jwt::decoded_jwt<jwt::traits::kazuho_picojson>>
+               jwt,
+           std::unique_ptr<internal::TraceSpan> span = nullptr) const {
+        auto result =
+            verify_async(std::move(jwt), nullptr, false, std::move(span));
+        while (!result->m_done) {
+            result = verify_async_continue(std::move(result));
+        }
+    }
+
+    // Verify a decoded token, returning false with the reason in `why`,
+    // rather than throwing, if the token is rejected; failing to get the
+    // issuer's keys still throws.  On success the token's profile is stored
+    // in `profile`.
+    bool try_verify(
+        std::shared_ptr<const jwt::decoded_jwt<jwt::traits::kazuho_picojson>>
+            jwt_decoded,
+        std::unique_ptr<internal::TraceSpan> span, SciToken::Profile &profile,
+        internal::Rejection &why) const;
+
+    // Called once a verification is over with the token's profile, or with
+    // the failure (and an unspecified profile).  Must not throw.
+    typedef std::function<void(SciToken::Profile, std::exception_ptr)>
+        VerifyCallback;
+
+    // Verify the token and call `done` with the outcome, instead of having
+    // the caller poll.  The first step runs on the calling thread; if that
+    // settles it (as when the keys are cached), `done` is called before
+    // this returns, otherwise on the CompletionEngine's thread.  The
+    // Validator must outlive the call.
+    void verify_with_callback(
+        std::shared_ptr<const jwt::decoded_jwt<jwt::traits::kazuho_picojson>>
+            jwt_decoded,
+        VerifyCallback done) const;
+
+    // As verify_with_callback, with the outcome delivered by a future.
+    std::future<SciToken::Profile> verify_future(
+        std::shared_ptr<const jwt::decoded_jwt<jwt::traits::kazuho_picojson>>
+            jwt_decoded) const;
+
+    // Downloads go on `context`'s multi handle if one is given.  With
+    // `use_worker_pool`, the signature check may be handed to the
+    // VerifyPool; the Validator must then outlive the returned status.
+    // A `span` already timing the decode is carried on; otherwise one is
+    // begun here if tracing is on.
+    std::unique_ptr<AsyncStatus> verify_async(
+        std::shared_ptr<const jwt::decoded_jwt<jwt::traits::kazuho_picojson>>
+            jwt_decoded,
+        std::shared_ptr<internal::FetchContext> context = nullptr,
+        bool use_worker_pool = false,
+        std::unique_ptr<internal::TraceSpan> span = nullptr) const {
+        if (!span) {
+            span = internal::TraceSpan::begin();
+        }
+        const auto &jwt = *jwt_decoded;
+        std::unique_ptr<AsyncStatus> status;
+        try {
+            if (span && jwt.has_issuer()) {
+                span->m_issuer = jwt.get_issuer();
+                span->m_kid = get_key_id(jwt);
+            }
+            auto profile = check_preconditions(jwt);
+            status = get_public_key_pem(jwt.get_issuer(), get_key_id(jwt),
+                                        std::move(context));
+            status->m_profile = profile;
+        } catch (std::exception &exc) {
+            if (span) {
+                span->finish(exc.what());
+            }
+            throw;
+        }
+        status->m_jwt = std::move(jwt_decoded);
+        status->m_use_worker_pool = use_worker_pool;
+        status->m_trace = std::move(span);
+
+        return verify_async_continue(std::move(status));
+    }
+
+    std::unique_ptr<AsyncStatus>
+    verify_async_continue(std::unique_ptr<AsyncStatus> status) const {
+        // Held here so the span is reported even if a stage throws.
+        auto span = std::move(status->m_trace);
+        try {
+            status = verify_step(std::move(status), span.get());
+        } catch (std::exception &exc) {
+            if (span) {
+                span->finish(exc.what());
+            }
+            throw;
+        }
+        if (!status->m_done) {
+            status->m_trace = std::move(span);
+        } else if (span) {
+            span->finish(nullptr);
+        }
+        return status;
+    }
+
+    void add_critical_claims(const std::vector<std::string> &claims) {
+        std::copy(claims.begin(), claims.end(),
+                  std::back_inserter(m_critical_claims));
+    }
+
+    void add_allowed_issuers(const std::vector<std::string> &allowed_issuers) {
+        m_allowed_issuers.insert(allowed_issuers.begin(),
+                                 allowed_issuers.end());
+        rebuild_claim_plan();
+    }
+
+    void add_string_validator(const std::string &claim,
+                              StringValidatorFunction func) {
+        auto result = m_validators.insert(
+            {claim, std::vector<StringValidatorFunction>()});
+        result.first->second.push_back(func);
+        rebuild_claim_plan();
+    }
+
+    void add_claim_validator(const std::string &claim,
+                             ClaimValidatorFunction func, void *data) {
+        auto result = m_claim_validators.insert(
+            {claim, std::vector<std::pair<ClaimValidatorFunction, void *>>()});
+        result.first->second.push_back({func, data});
+        rebuild_claim_plan();
+    }
+
+    // Accept the claim if its value is a string; unlike a claim validator,
+    // this is checked without building a jwt::claim.
+    void require_string_claim(const std::string &claim) {
+        m_string_claims.insert(claim);
+        rebuild_claim_plan();
+    }
+
+    // Accept the claim whatever its value, leaving it to the caller (e.g.,
+    // the Enforcer's audience and scope checks).
+    void accept_claim(const std::string &claim) {
+        m_accepted_claims.insert(claim);
+        rebuild_claim_plan();
+    }
+
+    void set_validate_all_claims_scitokens_1(bool new_val) {
+        m_validate_all_claims = new_val;
+    }
+
+    /**
+     * Verify a batch of decoded tokens.  The tokens are grouped by issuer
+     * and key id so that each key is looked up once, downloads for all of
+     * them share one fetch context, and the signature and claim checks are
+     * spread over up to `threads` threads.
+     *
+     * Returns one entry per token: empty if it verified, the error otherwise.
+     * The profile of each verified token is stored in `profiles`.
+     */
+    std::vector<std::string> verify_many(
+        const std::vector<std::shared_ptr<
+            const jwt::decoded_jwt<jwt::traits::kazuho_picojson>>> &tokens,
+        std::vector<SciToken::Profile> &profiles, unsigned threads = 1) const;
+
+    /**
+     * Get the profile of the last validated token.
+     *
+     * If there has been no validation - or the validation failed,
+     * then the return value is unspecified.  When verifying concurrently,
+     * use the profile in each request's AsyncStatus instead.
+     *
+     * Will not return Profile::COMPAT.
+     */
+    SciToken::Profile get_profile() const {
+        if (m_profile == SciToken::Profile::COMPAT) {
+            throw JWTVerificationException("Token profile has not been set.");
+        }
+        return m_profile;
+    }
+
+    /**
+     * Set the profile that will be used for validation; COMPAT indicates any
+     * supported profile is allowable.
+     */
+    void set_validate_profile(SciToken::Profile profile) {
+        m_validate_profile = profile;
+    }
+
+    /**
+     * Store the contents of a public EC key for a given issuer.
+     */
+    static bool store_public_ec_key(const std::string &issuer,
+                                    const std::string &kid,
+                                    const std::string &key);
+
+    /**
+     * Store the contents of a JWKS for a given issuer.
+     */
+    static bool store_jwks(const std::string &issuer, const std::string &jwks);
+
+    /**
+     * Write every unexpired entry of the key cache, with its lifetimes, to
+     * a bundle at `file`; returns the number of issuers written.
+     */
+    static size_t export_keycache_bundle(const std::string &file);
 
-    void set_now(std::chrono::system_clock::time_point now) { m_now = now; }
+    /**
+     * Store every unexpired entry of the bundle at `file` in the key cache,
+     * replacing existing entries, in a single transaction; returns the
+     * number of issuers stored.
+     */
+    static size_t import_keycache_bundle(const std::string &file);
 
-    std::unique_ptr<AsyncStatus> verify_async(const SciToken &scitoken) {
-        const jwt::decoded_jwt<jwt::traits::kazuho_picojson> *jwt_decoded =
-            scitoken.m_decoded.get();
-        if (!jwt_decoded) {
-            throw JWTVerificationException(
-                "Token is not deserialized from string.");
-        }
-        return verify_async(*jwt_decoded);
-    }
+    /**
+     * Drop expired entries from the key cache database, then evict the least
+     * recently used ones past "keycache.max_entries" or "keycache.max_bytes";
+     * returns the number of issuers removed.  Also done every
+     * "keycache.compact_interval_s" by the process storing keys.
+     */
+    static size_t compact_keycache();
 
-    void verify(const SciToken &scitoken, time_t expiry_time) {
-        auto result = verify_async(scitoken);
-        while (!result->m_done) {
-            auto timeout_val = result->get_timeout_val(expiry_time);
-            select(result->get_max_fd() + 1, result->get_read_fd_set(),
-                   result->get_write_fd_set(), result->get_exc_fd_set(),
-                   &timeout_val);
-            if (time(NULL) >= expiry_time) {
-                throw CurlException("Timeout when loading the OIDC metadata.");
-            }
+    /**
+     * Trigger a refresh of the JWKS or a given issuer.
+     */
+    static bool refresh_jwks(const std::string &issuer);
 
-            result = verify_async_continue(std::move(result));
-        }
-    }
+    /**
+     * Refresh the JWKS of several issuers at once, sharing one connection
+     * pool, and give up on any still outstanding after `timeout` seconds.
+     * Returns one entry per issuer: empty on success, else the error.
+     */
+    static std::vector<std::string>
+    prefetch_keys(const std::vector<std::string> &issuers, unsigned timeout);
 
-    void verify(const jwt::decoded_jwt<jwt::traits::kazuho_picojson> &jwt) {
-        auto result = verify_async(jwt);
-        while (!result->m_done) {
-            result = verify_async_continue(std::move(result));
+    /**
+     * Fetch the contents of fa JWKS for a given issuer (do not trigger a
+     * refresh). Will return an empty JWKS if no valid JWKS is available.
+     */
+    static std::string get_jwks(const std::string &issuer);
+
+  private:
+    // The checks that need neither the issuer's keys nor the signature;
+    // returns the profile the token's header implies, if any.
+    SciToken::Profile check_preconditions(
+        const jwt::decoded_jwt<jwt::traits::kazuho_picojson> &jwt) const {
+        auto profile = SciToken::Profile::COMPAT;
+        internal::Rejection why;
+        if (!check_preconditions(jwt, profile, why)) {
+            why.raise();
         }
+        return profile;
     }
 
-    std::unique_ptr<AsyncStatus>
-    verify_async(const jwt::decoded_jwt<jwt::traits::kazuho_picojson> &jwt) {
+    // As above, recording why in `why` (and returning false) rather than
+    // throwing when the token is turned away.
+    bool check_preconditions(
+        const jwt::decoded_jwt<jwt::traits::kazuho_picojson> &jwt,
+        SciToken::Profile &profile, internal::Rejection &why) const {
+        profile = SciToken::Profile::COMPAT;
         // If token has a typ header claim (RFC8725 Section 3.11), trust that in
         // COMPAT mode.
         if (jwt.has_type()) {
             std::string t_type = jwt.get_type();
             if (m_validate_profile == SciToken::Profile::COMPAT) {
                 if (t_type == "at+jwt" || t_type == "application/at+jwt") {
-                    m_profile = SciToken::Profile::AT_JWT;
+                    profile = SciToken::Profile::AT_JWT;
                 }
             } else if (m_validate_profile == SciToken::Profile::AT_JWT) {
                 if (t_type != "at+jwt" && t_type != "application/at+jwt") {
-                    throw JWTVerificationException(
-                        "'typ' header claim must be at+jwt");
+                    why.set("'typ' header claim must be at+jwt");
+                    return false;
                 }
-                m_profile = SciToken::Profile::AT_JWT;
+                profile = SciToken::Profile::AT_JWT;
             }
         } else {
             if (m_validate_profile == SciToken::Profile::AT_JWT) {
-                throw JWTVerificationException(
-                    "'typ' header claim must be set for at+jwt tokens");
+                why.set("'typ' header claim must be set for at+jwt tokens");
+                return false;
             }
         }
         if (!jwt.has_payload_claim("iat")) {
-            throw JWTVerificationException("'iat' claim is mandatory");
+            why.set("'iat' claim is mandatory");
+            return false;
         }
-        if (m_profile == SciToken::Profile::SCITOKENS_1_0 ||
-            m_profile == SciToken::Profile::SCITOKENS_2_0) {
+        if (profile == SciToken::Profile::SCITOKENS_1_0 ||
+            profile == SciToken::Profile::SCITOKENS_2_0) {
             if (!jwt.has_payload_claim("nbf")) {
-                throw JWTVerificationException("'nbf' claim is mandatory");
+                why.set("'nbf' claim is mandatory");
+                return false;
             }
         }
         if (!jwt.has_payload_claim("exp")) {
-            throw JWTVerificationException("'exp' claim is mandatory");
+            why.set("'exp' claim is mandatory");
+            return false;
         }
         if (!jwt.has_payload_claim("iss")) {
-            throw JWTVerificationException("'iss' claim is mandatory");
+            why.set("'iss' claim is mandatory");
+            return false;
         }
+        auto &stats = internal::Stats::get();
         if (!m_allowed_issuers.empty()) {
-            std::string issuer = jwt.get_issuer();
-            bool permitted = false;
-            for (const auto &allowed_issuer : m_allowed_issuers) {
-                if (issuer == allowed_issuer) {
-                    permitted = true;
-                    break;
-                }
-            }
-            if (!permitted) {
-                throw JWTVerificationException(
-                    "Token issuer is not in list of allowed issuers.");
+            const picojson::value *issuer =
+                internal::find_claim(internal::PayloadAccess::get(jwt), "iss");
+            if (!issuer->is<std::string>() ||
+                !m_allowed_issuers.count(issuer->get<std::string>())) {
+                internal::Stats::add(stats.m_early_rejections);
+                why.set("Token issuer is not in list of allowed issuers.");
+                return false;
             }
         }
+        // Turn away what the signature check would reject anyway, before
+        // the key lookup can touch the cache or the network.
+        auto ec = check_algorithm_and_times(jwt);
+        if (ec) {
+            internal::Stats::add(stats.m_early_rejections);
+            why.set(ec);
+            return false;
+        }
+
+        auto &revocations = internal::RevocationList::get();
+        const picojson::value *jti =
+            internal::find_claim(internal::PayloadAccess::get(jwt), "jti");
+        if (jti && jti->is<std::string>() &&
+            revocations.is_revoked(jti->get<std::string>())) {
+            internal::Stats::add(stats.m_revoked_tokens);
+            why.set("Token has been revoked.");
+            return false;
+        }
 
         for (const auto &claim : m_critical_claims) {
             if (!jwt.has_payload_claim(claim)) {
-                std::stringstream ss;
-                ss << "'" << claim << "' claim is mandatory";
-                throw JWTVerificationException(ss.str());
+                why.set_quoted(claim, "claim is mandatory");
+                return false;
             }
         }
 
-        std::string public_pem;
-        std::string algorithm;
-        // Key id is optional in the RFC, set to blank if it doesn't exist
-        std::string key_id;
-        try {
-            key_id = jwt.get_key_id();
-        } catch (const std::runtime_error &) {
-            // Don't do anything, key_id is empty, as it should be.
-        }
-        auto status =
-            get_public_key_pem(jwt.get_issuer(), key_id, public_pem, algorithm);
-        status->m_jwt_string = jwt.get_token();
-        status->m_public_pem = public_pem;
-        status->m_algorithm = algorithm;
+        return true;
+    }
 
-        return verify_async_continue(std::move(status));
+    static bool is_supported_algorithm(const std::string &alg) {
+        return SciTokenKey::is_supported_algorithm(alg);
+    }
+
+    // The header algorithm must be one a key can have, and the time claims
+    // must hold at get_now(), as jwt::verify checks them (with no leeway); the
+    // error is the one it would report.
+    std::error_code check_algorithm_and_times(
+        const jwt::decoded_jwt<jwt::traits::kazuho_picojson> &jwt) const {
+        if (!jwt.has_algorithm() ||
+            !is_supported_algorithm(jwt.get_algorithm())) {
+            return jwt::error::token_verification_error::wrong_algorithm;
+        }
+        auto now = std::chrono::system_clock::to_time_t(get_now());
+        const internal::PayloadClaims &claims =
+            internal::PayloadAccess::get(jwt);
+        // A claim of the wrong type is left for jwt::verify to report.
+        auto time_claim = [&](const char *name, int64_t &value) {
+            auto claim = internal::find_claim(claims, name);
+            if (!claim || !claim->is<int64_t>()) {
+                return false;
+            }
+            value = claim->get<int64_t>();
+            return true;
+        };
+        int64_t value;
+        if ((time_claim("exp", value) && now > value) ||
+            (time_claim("iat", value) && now < value) ||
+            (time_claim("nbf", value) && now < value)) {
+            return jwt::error::token_verification_error::token_expired;
+        }
+        return {};
     }
 
+    // Advance a verification by one step; returns a new, done, status when
+    // it has finished.
     std::unique_ptr<AsyncStatus>
-    verify_async_continue(std::unique_ptr<AsyncStatus> status) {
-        if (!status->m_done) {
-            std::string public_pem, algorithm;
-            status = get_public_key_pem_continue(std::move(status), public_pem,
-                                                 algorithm);
-            status->m_public_pem = public_pem;
-            status->m_algorithm = algorithm;
+    verify_step(std::unique_ptr<AsyncStatus> status,
+                internal::TraceSpan *span) const {
+        auto profile = status->m_profile;
+        if (status->m_verify_job) {
+            if (!status->m_verify_job->is_done()) {
+                return std::move(status);
+            }
+            profile = status->m_verify_job->get_profile();
+        } else {
             if (!status->m_done) {
+                status = get_public_key_pem_continue(std::move(status));
+                if (!status->m_done) {
+                    return std::move(status);
+                }
+            }
+            if (span) {
+                span->mark(internal::TraceSpan::KEY_LOOKUP);
+                span->carve(internal::TraceSpan::KEY_CONSTRUCT,
+                            internal::TraceSpan::KEY_LOOKUP,
+                            status->m_key_construct_time);
+                span->m_key_source = status->m_key_source;
+            }
+            if (status->m_use_worker_pool && start_verify_job(*status, span)) {
                 return std::move(status);
             }
+            check_token(*status->m_jwt, *status->m_public_key,
+                        status->m_issuer, profile, span);
         }
+        m_profile = profile;
+        std::unique_ptr<AsyncStatus> result(new AsyncStatus());
+        result->m_done = true;
+        result->m_jwt = std::move(status->m_jwt);
+        result->m_profile = profile;
+        return result;
+    }
 
-        // std::cout << "Public PEM: " << public_pem << std::endl << "Algorithm:
-        // " << algorithm << std::endl;
-        SciTokenKey key(status->m_kid, status->m_algorithm,
-                        status->m_public_pem, "");
+    // Check the signature and the claims of a token, given its issuer's
+    // key; `profile` starts as the one check_preconditions found and is
+    // updated to the token's.
+    void check_token(const jwt::decoded_jwt<jwt::traits::kazuho_picojson> &jwt,
+                     const internal::PublicKey &key, const std::string &issuer,
+                     SciToken::Profile &profile,
+                     internal::TraceSpan *span = nullptr) const {
+        internal::Rejection why;
+        if (!check_token(jwt, key, issuer, profile, span, why)) {
+            why.raise();
+        }
+    }
 
+    // As above, recording why in `why` (and returning false) rather than
+    // throwing when the token is turned away.
+    bool check_token(const jwt::decoded_jwt<jwt::traits::kazuho_picojson> &jwt,
+                     const internal::PublicKey &key, const std::string &issuer,
+                     SciToken::Profile &profile, internal::TraceSpan *span,
+                     internal::Rejection &why) const {
         auto verifier =
-            jwt::verify<FixedClock, jwt::traits::kazuho_picojson>({m_now})
+            jwt::verify<FixedClock, jwt::traits::kazuho_picojson>({get_now()})
                 .allow_algorithm(key);
 
-        const jwt::decoded_jwt<jwt::traits::kazuho_picojson> jwt(
-            status->m_jwt_string);
-        verifier.verify(jwt);
+        auto &stats = internal::Stats::get();
+        internal::Stats::add(stats.m_verifications);
+        std::error_code ec;
+        try {
+            internal::ScopedLatency timer(stats.m_verify_us);
+            verifier.verify(jwt, ec);
+        } catch (...) {
+            internal::Stats::add(stats.m_verification_failures);
+            throw;
+        }
+        if (ec) {
+            internal::Stats::add(stats.m_verification_failures);
+            why.set(ec);
+            return false;
+        }
+        if (span) {
+            span->mark(internal::TraceSpan::SIGNATURE);
+        }
+
+        if (configurer::Configuration::get_refresh_interval() > 0) {
+            internal::BackgroundRefresher::get().track(issuer);
+        }
 
+        const internal::PayloadClaims &claims =
+            internal::PayloadAccess::get(jwt);
         bool must_verify_everything = true;
-        if (jwt.has_payload_claim("ver")) {
-            const jwt::claim &claim = jwt.get_payload_claim("ver");
-            if (claim.get_type() != jwt::json::type::string) {
-                throw JWTVerificationException(
-                    "'ver' claim value must be a string (if present)");
+        const picojson::value *ver = internal::find_claim(claims, "ver");
+        const picojson::value *wlcg_ver =
+            ver ? nullptr : internal::find_claim(claims, "wlcg.ver");
+        if (ver) {
+            if (!ver->is<std::string>()) {
+                why.set("'ver' claim value must be a string (if present)");
+                return false;
             }
-            std::string ver_string = claim.as_string();
+            const std::string &ver_string = ver->get<std::string>();
             if ((ver_string == "scitokens:2.0") ||
                 (ver_string == "scitoken:2.0")) {
                 must_verify_everything = false;
                 if ((m_validate_profile != SciToken::Profile::COMPAT) &&
                     (m_validate_profile != SciToken::Profile::SCITOKENS_2_0)) {
-                    throw JWTVerificationException(
+                    why.set(
                         "Invalidate token type; not expecting a SciToken 2.0.");
+                    return false;
                 }
-                m_profile = SciToken::Profile::SCITOKENS_2_0;
-                if (!jwt.has_payload_claim("aud")) {
-                    throw JWTVerificationException(
-                        "'aud' claim required for SciTokens 2.0 profile");
+                profile = SciToken::Profile::SCITOKENS_2_0;
+                if (!internal::find_claim(claims, "aud")) {
+                    why.set("'aud' claim required for SciTokens 2.0 profile");
+                    return false;
                 }
             } else if (ver_string == "scitokens:1.0") {
                 must_verify_everything = m_validate_all_claims;
                 if ((m_validate_profile != SciToken::Profile::COMPAT) &&
                     (m_validate_profile != SciToken::Profile::SCITOKENS_1_0)) {
-                    throw JWTVerificationException(
+                    why.set(
                         "Invalidate token type; not expecting a SciToken 1.0.");
+                    return false;
                 }
-                m_profile = SciToken::Profile::SCITOKENS_1_0;
+                profile = SciToken::Profile::SCITOKENS_1_0;
             } else {
-                std::stringstream ss;
-                ss << "Unknown profile version in token: " << ver_string;
-                throw JWTVerificationException(ss.str());
+                why.set("Unknown profile version in token: ", ver_string);
+                return false;
             }
             // Handle WLCG common JWT profile.
-        } else if (jwt.has_payload_claim("wlcg.ver")) {
+        } else if (wlcg_ver) {
             if ((m_validate_profile != SciToken::Profile::COMPAT) &&
                 (m_validate_profile != SciToken::Profile::WLCG_1_0)) {
-                throw JWTVerificationException(
-                    "Invalidate token type; not expecting a WLCG 1.0.");
+                why.set("Invalidate token type; not expecting a WLCG 1.0.");
+                return false;
             }
 
-            m_profile = SciToken::Profile::WLCG_1_0;
+            profile = SciToken::Profile::WLCG_1_0;
             must_verify_everything = false;
-            const jwt::claim &claim = jwt.get_payload_claim("wlcg.ver");
-            if (claim.get_type() != jwt::json::type::string) {
-                throw JWTVerificationException(
-                    "'ver' claim value must be a string (if present)");
+            if (!wlcg_ver->is<std::string>()) {
+                why.set("'ver' claim value must be a string (if present)");
+                return false;
             }
-            std::string ver_string = claim.as_string();
+            const std::string &ver_string = wlcg_ver->get<std::string>();
             if (ver_string != "1.0") {
-                std::stringstream ss;
-                ss << "Unknown WLCG profile version in token: " << ver_string;
-                throw JWTVerificationException(ss.str());
+                why.set("Unknown WLCG profile version in token: ", ver_string);
+                return false;
             }
-            if (!jwt.has_payload_claim("aud")) {
-                throw JWTVerificationException(
+            if (!internal::find_claim(claims, "aud")) {
+                why.set(
                     "Malformed token: 'aud' claim required for WLCG profile");
+                return false;
             }
-        } else if (m_profile == SciToken::Profile::AT_JWT) {
+        } else if (profile == SciToken::Profile::AT_JWT) {
             // detected early above from typ header claim.
             must_verify_everything = false;
         } else {
             if ((m_validate_profile != SciToken::Profile::COMPAT) &&
                 (m_validate_profile != SciToken::Profile::SCITOKENS_1_0)) {
-                throw JWTVerificationException(
-                    "Invalidate token type; not expecting a SciToken 1.0.");
+                why.set("Invalidate token type; not expecting a SciToken 1.0.");
+                return false;
             }
 
-            m_profile = SciToken::Profile::SCITOKENS_1_0;
+            profile = SciToken::Profile::SCITOKENS_1_0;
             must_verify_everything = m_validate_all_claims;
         }
 
-        auto claims = jwt.get_payload_claims();
+        // Both the plan and the claims are sorted by name; walk them
+        // together.  Only a claim without a rule has no handlers.
+        const ClaimPlan &plan = *m_claim_plan;
+        auto rule = plan.begin();
         for (const auto &claim_pair : claims) {
-            if (claim_pair.first == "iat" || claim_pair.first == "nbf" ||
-                claim_pair.first == "exp" || claim_pair.first == "ver") {
-                continue;
+            while (rule != plan.end() && rule->m_name < claim_pair.first) {
+                ++rule;
             }
-            auto iter = m_validators.find(claim_pair.first);
-            auto iter_claim = m_claim_validators.find(claim_pair.first);
-            if ((iter == m_validators.end() || iter->second.empty()) &&
-                (iter_claim == m_claim_validators.end() ||
-                 iter_claim->second.empty())) {
-                bool is_issuer = claim_pair.first == "iss";
-                if (is_issuer && !m_allowed_issuers.empty()) {
-                    // skip; we verified it above
-                } else if (must_verify_everything) {
-                    std::stringstream ss;
-                    ss << "'" << claim_pair.first
-                       << "' claim verification is mandatory";
-                    // std::cout << ss.str() << std::endl;
-                    throw JWTVerificationException(ss.str());
+            if (rule == plan.end() || rule->m_name != claim_pair.first) {
+                if (must_verify_everything) {
+                    why.set_quoted(claim_pair.first,
+                                   "claim verification is mandatory");
+                    return false;
                 }
+                continue;
             }
-            // std::cout << "Running claim " << claim_pair.first << " through
-            // validation." << std::endl;
-            if (iter != m_validators.end())
-                for (const auto &verification_func : iter->second) {
-                    const jwt::claim &claim =
-                        jwt.get_payload_claim(claim_pair.first);
-                    if (claim.get_type() != jwt::json::type::string) {
-                        std::stringstream ss;
-                        ss << "'" << claim_pair.first
-                           << "' claim value must be a string to verify.";
-                        throw JWTVerificationException(ss.str());
-                    }
-                    std::string value = claim.as_string();
-                    char *err_msg = nullptr;
-                    if (verification_func(value.c_str(), &err_msg)) {
-                        if (err_msg) {
-                            throw JWTVerificationException(err_msg);
-                        } else {
-                            std::stringstream ss;
-                            ss << "'" << claim_pair.first
-                               << "' claim verification failed.";
-                            throw JWTVerificationException(ss.str());
-                        }
+            if (rule->m_skip) {
+                continue;
+            }
+            const picojson::value &value = claim_pair.second;
+            if ((rule->m_require_string ||
+                 !rule->m_string_validators.empty()) &&
+                !value.is<std::string>()) {
+                why.set(rule->m_require_string
+                            ? rule->m_failed_error.c_str()
+                            : rule->m_not_string_error.c_str());
+                return false;
+            }
+            for (const auto &verification_func : rule->m_string_validators) {
+                char *err_msg = nullptr;
+                if (verification_func(value.get<std::string>().c_str(),
+                                      &err_msg)) {
+                    if (err_msg) {
+                        why.take(err_msg);
+                    } else {
+                        why.set(rule->m_failed_error.c_str());
                     }
+                    return false;
                 }
-            if (iter_claim != m_claim_validators.end())
-                for (const auto &verification_pair : iter_claim->second) {
-                    const jwt::claim &claim =
-                        jwt.get_payload_claim(claim_pair.first);
+            }
+            if (!rule->m_claim_validators.empty()) {
+                const jwt::claim claim(value);
+                for (const auto &verification_pair :
+                     rule->m_claim_validators) {
                     if (verification_pair.first(
                             claim, verification_pair.second) == false) {
-                        std::stringstream ss;
-                        ss << "'" << claim_pair.first
-                           << "' claim verification failed.";
-                        throw JWTVerificationException(ss.str());
+                        why.set(rule->m_failed_error.c_str());
+                        return false;
                     }
                 }
+            }
         }
-        std::unique_ptr<AsyncStatus> result(new AsyncStatus());
-        result->m_done = true;
-        return std::move(result);
-    }
-
-    void add_critical_claims(const std::vector<std::string> &claims) {
-        std::copy(claims.begin(), claims.end(),
-                  std::back_inserter(m_critical_claims));
-    }
-
-    void add_allowed_issuers(const std::vector<std::string> &allowed_issuers) {
-        std::copy(allowed_issuers.begin(), allowed_issuers.end(),
-                  std::back_inserter(m_allowed_issuers));
-    }
-
-    void add_string_validator(const std::string &claim,
-                              StringValidatorFunction func) {
-        auto result = m_validators.insert(
-            {claim, std::vector<StringValidatorFunction>()});
-        result.first->second.push_back(func);
-    }
-
-    void add_claim_validator(const std::string &claim,
-                             ClaimValidatorFunction func, void *data) {
-        auto result = m_claim_validators.insert(
-            {claim, std::vector<std::pair<ClaimValidatorFunction, void *>>()});
-        result.first->second.push_back({func, data});
+        if (span) {
+            span->mark(internal::TraceSpan::CLAIMS);
+        }
+        return true;
     }
 
-    void set_validate_all_claims_scitokens_1(bool new_val) {
-        m_validate_all_claims = new_val;
-    }
+    // Hand the status's check_token call to the VerifyPool; returns false
+    // if the pool has no threads.  The job marks `span`, which must outlive
+    // it, as check_token does.
+    bool start_verify_job(AsyncStatus &status,
+                          internal::TraceSpan *span) const;
 
-    /**
-     * Get the profile of the last validated token.
-     *
-     * If there has been no validation - or the validation failed,
-     * then the return value is unspecified.
-     *
-     * Will not return Profile::COMPAT.
-     */
-    SciToken::Profile get_profile() const {
-        if (m_profile == SciToken::Profile::COMPAT) {
-            throw JWTVerificationException("Token profile has not been set.");
+    static std::string
+    get_key_id(const jwt::decoded_jwt<jwt::traits::kazuho_picojson> &jwt) {
+        // Key id is optional in the RFC, set to blank if it doesn't exist
+        std::string key_id;
+        try {
+            key_id = jwt.get_key_id();
+        } catch (const std::runtime_error &) {
+            // Don't do anything, key_id is empty, as it should be.
         }
-        return m_profile;
-    }
-
-    /**
-     * Set the profile that will be used for validation; COMPAT indicates any
-     * supported profile is allowable.
-     */
-    void set_validate_profile(SciToken::Profile profile) {
-        m_validate_profile = profile;
+        return key_id;
     }
 
-    /**
-     * Store the contents of a public EC key for a given issuer.
-     */
-    static bool store_public_ec_key(const std::string &issuer,
-                                    const std::string &kid,
-                                    const std::string &key);
-
-    /**
-     * Store the contents of a JWKS for a given issuer.
-     */
-    static bool store_jwks(const std::string &issuer, const std::string &jwks);
-
-    /**
-     * Trigger a refresh of the JWKS or a given issuer.
-     */
-    static bool refresh_jwks(const std::string &issuer);
-
-    /**
-     * Fetch the contents of fa JWKS for a given issuer (do not trigger a
-     * refresh). Will return an empty JWKS if no valid JWKS is available.
-     */
-    static std::string get_jwks(const std::string &issuer);
-
-  private:
     static std::unique_ptr<AsyncStatus>
     get_public_key_pem(const std::string &issuer, const std::string &kid,
-                       std::string &public_pem, std::string &algorithm);
-    static std::unique_ptr<AsyncStatus>
-    get_public_key_pem_continue(std::unique_ptr<AsyncStatus> status,
-                                std::string &public_pem,
-                                std::string &algorithm);
-    static std::unique_ptr<AsyncStatus>
-    get_public_keys_from_web(const std::string &issuer, unsigned timeout);
+                       std::shared_ptr<internal::FetchContext> context);
     static std::unique_ptr<AsyncStatus>
-    get_public_keys_from_web_continue(std::unique_ptr<AsyncStatus> status);
-    static bool get_public_keys_from_db(const std::string issuer, int64_t now,
-                                        picojson::value &keys,
-                                        int64_t &next_update);
-    static bool store_public_keys(const std::string &issuer,
-                                  const picojson::value &keys,
-                                  int64_t next_update, int64_t expires);
+    get_public_key_pem_continue(std::unique_ptr<AsyncStatus> status);
+    static void get_public_keys_from_web(AsyncStatus &status,
+                                         const std::string &issuer,
+                                         unsigned timeout);
+    static void get_public_keys_from_web_continue(AsyncStatus &status);
+    // Join (or lead) the refresh of the status's issuer.
+    static void join_refresh(AsyncStatus &status);
+    // Drive the leader's fetch; errors are published to any waiters.
+    static void advance_refresh(AsyncStatus &status, bool start);
+    static void finish_refresh(AsyncStatus &status, const char *error);
+    // Returns true once a waiter has keys or has taken over the refresh.
+    static bool wait_for_refresh(AsyncStatus &status);
+    // Synchronously fetch and store the issuer's keys, or wait for the
+    // refresh already in flight.
+    static bool refresh_keys(const std::string &issuer, unsigned timeout);
+    // Refresh the issuer's keys if they are due for an update by `horizon`.
+    static bool refresh_if_due(const std::string &issuer, int64_t horizon);
+    // `from_memory` is set to whether the keys were served from the
+    // in-memory tier rather than read from SQLite.
+    static bool
+    get_public_keys_from_db(const std::string issuer, int64_t now,
+                            std::shared_ptr<const picojson::value> &keys,
+                            int64_t &next_update,
+                            internal::KeyCacheMetadata *metadata = nullptr,
+                            bool *from_memory = nullptr,
+                            std::shared_ptr<const internal::KeyIndex> *index =
+                                nullptr);
+    static bool store_public_keys(
+        const std::string &issuer, std::shared_ptr<const picojson::value> keys,
+        int64_t next_update, int64_t expires,
+        const internal::KeyCacheMetadata &metadata = {});
 
     bool m_validate_all_claims{true};
-    SciToken::Profile m_profile{SciToken::Profile::COMPAT};
+    mutable std::atomic<SciToken::Profile> m_profile{
+        SciToken::Profile::COMPAT};
     SciToken::Profile m_validate_profile{SciToken::Profile::COMPAT};
     ClaimStringValidatorMap m_validators;
     ClaimValidatorMap m_claim_validators;
@@ -775,7 +2806,49 @@ class Validator {
     std::chrono::system_clock::time_point m_now;
 
     std::vector<std::string> m_critical_claims;
+    std::unordered_set<std::string> m_allowed_issuers;
+    std::set<std::string> m_string_claims;
+    std::set<std::string> m_accepted_claims;
+
+    // Validators sharing a configuration (e.g., the default one)
+    // share the plan.
+    std::shared_ptr<const ClaimPlan> m_claim_plan;
+    void rebuild_claim_plan();
+    static std::shared_ptr<const ClaimPlan>
+    base_claim_plan(bool issuer_checked);
+};
+
+/**
+ * The settings for deserializing tokens - the allowed issuers and the
+ * profile - configured once and reused for any number of tokens, instead of
+ * configuring a new Validator for each as SciToken::deserialize does.  Keys
+ * come from the process-wide key cache.  May be used by several threads at
+ * once.
+ */
+class Deserializer {
+  public:
+    Deserializer(std::vector<std::string> allowed_issuers,
+                 SciToken::Profile profile)
+        : m_allowed_issuers(std::move(allowed_issuers)) {
+        m_validator.add_allowed_issuers(m_allowed_issuers);
+        m_validator.set_validate_all_claims_scitokens_1(false);
+        m_validator.set_validate_profile(profile);
+        m_validator.use_current_time();
+    }
+
+    void deserialize(const std::string &data, SciToken &token) const {
+        token.deserialize(data, m_validator, m_allowed_issuers);
+    }
+
+    bool try_deserialize(const std::string &data, SciToken &token,
+                         internal::Rejection &why) const {
+        return token.try_deserialize(data, m_validator, m_allowed_issuers,
+                                     why);
+    }
+
+  private:
     std::vector<std::string> m_allowed_issuers;
+    Validator m_validator;
 };
 
 class Enforcer {
@@ -783,18 +2856,21 @@ class Enforcer {
   public:
     typedef std::vector<std::pair<std::string, std::string>> AclsList;
 
+    // Once configured, an Enforcer may be shared by any number of threads:
+    // the state of each request lives on the caller's stack or in its
+    // AsyncStatus.  The setters below must not race with requests.
     Enforcer(std::string issuer, std::vector<std::string> audience_list)
-        : m_issuer(issuer), m_audiences(audience_list) {
+        : m_issuer(issuer),
+          m_audiences(audience_list.begin(), audience_list.end()) {
         m_validator.add_allowed_issuers({m_issuer});
-        m_validator.add_claim_validator("jti", &Enforcer::str_validator,
-                                        nullptr);
-        m_validator.add_claim_validator("sub", &Enforcer::str_validator,
-                                        nullptr);
-        m_validator.add_claim_validator("opt", &Enforcer::all_validator,
-                                        nullptr);
-        m_validator.add_claim_validator("aud", &Enforcer::aud_validator, this);
-        m_validator.add_claim_validator("scope", &Enforcer::scope_validator,
-                                        this);
+        m_validator.require_string_claim("jti");
+        m_validator.require_string_claim("sub");
+        m_validator.accept_claim("opt");
+        // The audience and scope depend on the request and the token's
+        // profile, so they are checked by check_claims once the Validator
+        // has accepted the token.
+        m_validator.accept_claim("aud");
+        m_validator.accept_claim("scope");
         std::vector<std::string> critical_claims = {"scope"};
 
         // If any audiences are in the given to us, then force the validator to
@@ -805,109 +2881,289 @@ class Enforcer {
         m_validator.add_critical_claims(critical_claims);
     }
 
+    // Cached results are checked against the time on every hit, so they
+    // survive changing it.
     void set_now(std::chrono::system_clock::time_point now) {
         m_validator.set_now(now);
     }
 
+    // Tokens marked verified under the old profile are verified again.
     void set_validate_profile(SciToken::Profile profile) {
         m_validate_profile = profile;
+        m_validator.set_validate_profile(profile);
+        m_acl_cache.clear();
+        m_id = next_id();
     }
 
+    // Remember the ACLs of up to `entries` verified tokens, so presenting
+    // one again skips verification; 0 (the default) disables this.
+    void set_cache_size(size_t entries) { m_acl_cache.set_capacity(entries); }
+
     bool test(const SciToken &scitoken, const std::string &authz,
-              const std::string &path) {
-        reset_state();
-        m_test_path = path;
-        m_test_authz = authz;
-        try {
-            m_validator.verify(scitoken, time(NULL) + 20);
+              const std::string &path) const {
+        if (m_acl_cache.get_capacity() || scitoken.m_verified) {
+            if (!compile_acls(scitoken)->test(authz, path)) {
+                throw JWTVerificationException(
+                    "'scope' claim verification failed.");
+            }
             return true;
-        } catch (std::runtime_error &) {
-            throw;
         }
+        AclsList acls;
+        check_claims(*verify(scitoken), authz, path, acls);
+        return true;
+    }
+
+    // As above, but with the ACL cache enabled a token already verified
+    // is tested without allocating; `authz` and `path` need not be
+    // NUL-terminated.
+    bool test(const SciToken &scitoken, const char *authz, size_t authz_len,
+              const char *path, size_t path_len) const {
+        if (m_acl_cache.get_capacity() || scitoken.m_verified) {
+            if (!compile_acls(scitoken)->test(authz, authz_len, path,
+                                              path_len)) {
+                throw JWTVerificationException(
+                    "'scope' claim verification failed.");
+            }
+            return true;
+        }
+        return test(scitoken, std::string(authz, authz_len),
+                    std::string(path, path_len));
+    }
+
+    // Verify the token once and test each (authz, path) request against
+    // its scopes.  Throws if the token fails verification.
+    std::vector<bool> test_many(const SciToken &scitoken,
+                                const AclsList &requests) const {
+        auto index = compile_acls(scitoken);
+        std::vector<bool> results;
+        results.reserve(requests.size());
+        for (const auto &request : requests) {
+            results.push_back(index->test(request.first, request.second));
+        }
+        return results;
     }
 
-    AclsList generate_acls(const SciToken &scitoken) {
-        reset_state();
-        m_validator.verify(scitoken, time(NULL) + 20);
-        return m_gen_acls;
+    // As generate_acls, but shares the compiled ACLs (with the cache, when
+    // it is enabled) rather than copying them out.
+    std::shared_ptr<const internal::ScopeIndex>
+    generate_acl_index(const SciToken &scitoken) const {
+        return compile_acls(scitoken);
+    }
+
+    // Called once generate_acls_with_callback is over with the ACLs, or
+    // with the failure.  Must not throw.
+    typedef std::function<void(AclsList, std::exception_ptr)> AclsCallback;
+
+    // As generate_acls, calling `done` with the outcome rather than having
+    // the caller poll; see Validator::verify_with_callback for where `done`
+    // runs.  The Enforcer must outlive the call.
+    void generate_acls_with_callback(const SciToken &scitoken,
+                                     AclsCallback done) const;
+
+    // As generate_acls_with_callback, with the outcome delivered by a
+    // future.
+    std::future<AclsList> generate_acls_future(const SciToken &scitoken) const;
+
+    AclsList generate_acls(const SciToken &scitoken) const {
+        auto index = lookup_acls(scitoken);
+        if (index) {
+            return index->get_acls();
+        }
+        auto status = verify(scitoken);
+        AclsList acls;
+        check_claims(*status, "", "", acls);
+        store_acls(*status, acls);
+        return acls;
     }
 
-    std::unique_ptr<AsyncStatus> generate_acls_start(const SciToken &scitoken,
-                                                     AclsList &acls) {
-        reset_state();
-        auto status = m_validator.verify_async(scitoken);
+    std::unique_ptr<AsyncStatus> generate_acls_start(
+        const SciToken &scitoken, AclsList &acls,
+        std::shared_ptr<internal::FetchContext> context = nullptr) const {
+        auto index = lookup_acls(scitoken);
+        if (index) {
+            acls = index->get_acls();
+            std::unique_ptr<AsyncStatus> status(new AsyncStatus());
+            status->m_done = true;
+            return status;
+        }
+        if (!scitoken.m_decoded) {
+            throw JWTVerificationException(
+                "Token is not deserialized from string.");
+        }
+        auto status = m_validator.verify_async(scitoken.m_decoded,
+                                               std::move(context), true);
         if (status->m_done) {
-            acls = m_gen_acls;
+            finish_acls(*status, acls);
         }
         return status;
     }
 
     std::unique_ptr<AsyncStatus>
     generate_acls_continue(std::unique_ptr<AsyncStatus> status,
-                           AclsList &acls) {
+                           AclsList &acls) const {
         auto result = m_validator.verify_async_continue(std::move(status));
         if (result->m_done) {
-            acls = m_gen_acls;
+            finish_acls(*result, acls);
         }
         return result;
     }
 
+    // Verify the token and record on it what this Enforcer established, so
+    // that later tests and ACL generation by this Enforcer only check the
+    // token's times against get_now() and the revocation list, using the
+    // ACLs compiled here.  Throws if the token fails verification.  The
+    // token must not be in use by other threads meanwhile.
+    void mark_verified(SciToken &scitoken) const;
+
+    // What a verified token grants, as carried by a capability.
+    struct Capability {
+        AclsList m_acls;
+        std::string m_subject;
+        std::string m_jti;
+        int64_t m_expiry{0};
+        SciToken::Profile m_profile{SciToken::Profile::COMPAT};
+    };
+
+    // Verify the token and export what it grants as a compact binary
+    // capability, MAC'd with the node's secret ("capability.secret_file"),
+    // which import_capability accepts in another process without verifying
+    // the token again.
+    std::string export_capability(const SciToken &scitoken) const;
+
+    // Check a capability's MAC, expiry and ID against the revocation list,
+    // throwing if any fails.  Only capabilities exported by an Enforcer with
+    // the same issuer, audiences and validate profile are accepted.
+    Capability import_capability(const std::string &capability) const;
+
   private:
-    static bool all_validator(const jwt::claim &, void *) { return true; }
-
-    static bool str_validator(const jwt::claim &claim, void *) {
-        return claim.get_type() == jwt::json::type::string;
-    }
-
-    static bool scope_validator(const jwt::claim &claim, void *myself);
-
-    static bool aud_validator(const jwt::claim &claim, void *myself) {
-        auto me = reinterpret_cast<scitokens::Enforcer *>(myself);
-        std::vector<std::string> jwt_audiences;
-        if (claim.get_type() == jwt::json::type::string) {
-            const std::string &audience = claim.as_string();
-            jwt_audiences.push_back(audience);
-        } else if (claim.get_type() == jwt::json::type::array) {
-            const picojson::array &audiences = claim.as_array();
-            for (const auto &aud_value : audiences) {
-                const std::string &audience = aud_value.get<std::string>();
-                jwt_audiences.push_back(audience);
-            }
-        }
-        for (const auto &aud_value : jwt_audiences) {
-            if (((me->m_validator.get_profile() ==
-                  SciToken::Profile::SCITOKENS_2_0) &&
-                 (aud_value == "ANY")) ||
-                ((me->m_validator.get_profile() ==
-                  SciToken::Profile::WLCG_1_0) &&
-                 (aud_value == "https://wlcg.cern.ch/jwt/v1/any"))) {
-                return true;
-            }
-            for (const auto &aud : me->m_audiences) {
-                if (aud == aud_value) {
-                    return true;
-                }
+    // Verify the token with the shared Validator; the returned status
+    // holds the decoded token and its profile.
+    std::unique_ptr<AsyncStatus> verify(const SciToken &scitoken) const {
+        if (!scitoken.m_decoded) {
+            throw JWTVerificationException(
+                "Token is not deserialized from string.");
+        }
+        auto expiry_time = time(NULL) + 20;
+        auto result = m_validator.verify_async(scitoken.m_decoded);
+        while (!result->m_done) {
+            auto timeout_val = result->get_timeout_val(expiry_time);
+            select(result->get_max_fd() + 1, result->get_read_fd_set(),
+                   result->get_write_fd_set(), result->get_exc_fd_set(),
+                   &timeout_val);
+            if (time(NULL) >= expiry_time) {
+                throw CurlException("Timeout when loading the OIDC metadata.");
             }
+            result = m_validator.verify_async_continue(std::move(result));
         }
-        return false;
+        return result;
+    }
+
+    // Check the audience and scope of a token the Validator accepted.  With
+    // an empty `authz`, the scopes are translated into `acls`; otherwise
+    // this fails unless they grant `authz` on `path`.
+    void check_claims(const AsyncStatus &status, const std::string &authz,
+                      const std::string &path, AclsList &acls) const;
+
+    bool check_audience(const picojson::value &claim,
+                        SciToken::Profile profile) const;
+
+    bool check_scope(const picojson::value &claim, SciToken::Profile profile,
+                     const std::string &authz, const std::string &path,
+                     AclsList &acls) const;
+
+    void finish_acls(const AsyncStatus &status, AclsList &acls) const {
+        AclsList generated;
+        check_claims(status, "", "", generated);
+        store_acls(status, generated);
+        acls = std::move(generated);
     }
 
-    void reset_state() {
-        m_test_path = "";
-        m_test_authz = "";
-        m_gen_acls.clear();
-        m_validator.set_validate_profile(m_validate_profile);
+    // The bytes MAC'd along with a capability, binding it to this
+    // Enforcer's configuration.
+    std::string capability_context() const;
+
+    // The compiled ACLs of a token marked verified by this Enforcer if
+    // they may be used at get_now(), else (from the cache, if enabled) of
+    // a token verified before, else null.
+    std::shared_ptr<const internal::ScopeIndex>
+    lookup_acls(const SciToken &scitoken) const;
+    // Called after a successful verification in "generate" mode; compiles
+    // the generated ACLs and caches them if the cache is enabled.
+    std::shared_ptr<const internal::ScopeIndex>
+    store_acls(const AsyncStatus &status, const AclsList &acls) const;
+    // The compiled ACLs of a verified token, from the cache if possible.
+    std::shared_ptr<const internal::ScopeIndex>
+    compile_acls(const SciToken &scitoken) const {
+        auto index = lookup_acls(scitoken);
+        if (index) {
+            return index;
+        }
+        auto status = verify(scitoken);
+        AclsList acls;
+        check_claims(*status, "", "", acls);
+        return store_acls(*status, acls);
     }
 
-    SciToken::Profile m_validate_profile{SciToken::Profile::COMPAT};
+    // Identifies the Enforcer, as configured, to the tokens it marks
+    // verified; unique for the life of the process.
+    static uint64_t next_id() {
+        static std::atomic<uint64_t> last{0};
+        return ++last;
+    }
 
-    std::string m_test_path;
-    std::string m_test_authz;
-    AclsList m_gen_acls;
+    SciToken::Profile m_validate_profile{SciToken::Profile::COMPAT};
+    uint64_t m_id{next_id()};
 
     std::string m_issuer;
-    std::vector<std::string> m_audiences;
+    std::unordered_set<std::string> m_audiences;
     scitokens::Validator m_validator;
+    // Shared by all requests; locks internally.
+    mutable internal::AclCache m_acl_cache;
+};
+
+/**
+ * A set of Enforcers, one per trusted issuer, each with its own audiences,
+ * profile and ACL cache.  A token is routed to its issuer's Enforcer by
+ * one hash lookup of its "iss" claim, so it is verified once instead of
+ * by each Enforcer in turn; the key cache is shared by all of them.
+ *
+ * As with an Enforcer, issuers must not be added while requests run.
+ */
+class MultiEnforcer {
+  public:
+    // The issuer's Enforcer, created with `audience_list` if needed.
+    Enforcer &add_issuer(const std::string &issuer,
+                         const std::vector<std::string> &audience_list) {
+        auto &enforcer = m_enforcers[issuer];
+        if (!enforcer) {
+            enforcer.reset(new Enforcer(issuer, audience_list));
+        }
+        return *enforcer;
+    }
+
+    // The Enforcer for the token's issuer.
+    Enforcer &route(const SciToken &scitoken) const {
+        if (!scitoken.m_decoded) {
+            throw JWTVerificationException(
+                "Token is not deserialized from string.");
+        }
+        const picojson::value *issuer = internal::find_claim(
+            internal::PayloadAccess::get(*scitoken.m_decoded), "iss");
+        if (!issuer) {
+            throw JWTVerificationException("'iss' claim is mandatory");
+        }
+        auto iter = issuer->is<std::string>()
+                        ? m_enforcers.find(issuer->get<std::string>())
+                        : m_enforcers.end();
+        if (iter == m_enforcers.end()) {
+            throw JWTVerificationException(
+                "Token issuer is not in list of allowed issuers.");
+        }
+        return *iter->second;
+    }
+
+  private:
+    std::unordered_map<std::string, std::unique_ptr<Enforcer>> m_enforcers;
 };
 
 } // namespace scitokens
@@ -0,0 +1,379 @@
+
+#include <atomic>
+#include <ctime>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+#include <openssl/crypto.h>
+#include <openssl/evp.h>
+#include <openssl/hmac.h>
+
+#include "scitokens_internal.h"
+
+namespace {
+
+// How long the server may take over one request before it is treated as
+// unavailable.
+const int io_timeout_ms = 1000;
+
+// After the server fails, it is left alone this long so every lookup does
+// not wait out the timeout again.
+const int retry_after_s = 5;
+
+// Idle connections kept for reuse.
+const size_t max_idle_connections = 8;
+
+/**
+ * A connection to the server speaking the memcached text protocol, which
+ * is strictly one response per request.
+ */
+class Connection {
+  public:
+    Connection() = default;
+    Connection(const Connection &) = delete;
+    Connection &operator=(const Connection &) = delete;
+
+    ~Connection() {
+        if (m_fd >= 0) {
+            close(m_fd);
+        }
+    }
+
+    bool connect(const std::string &server) {
+        std::string host = server, port = "11211";
+        auto colon = server.rfind(':');
+        if (colon != std::string::npos &&
+            server.find(']', colon) == std::string::npos) {
+            host = server.substr(0, colon);
+            port = server.substr(colon + 1);
+        }
+        if (host.size() > 1 && host.front() == '[' && host.back() == ']') {
+            host = host.substr(1, host.size() - 2);
+        }
+
+        struct addrinfo hints = {};
+        hints.ai_family = AF_UNSPEC;
+        hints.ai_socktype = SOCK_STREAM;
+        struct addrinfo *addrs = nullptr;
+        if (getaddrinfo(host.c_str(), port.c_str(), &hints, &addrs) != 0) {
+            return false;
+        }
+        struct timeval timeout;
+        timeout.tv_sec = io_timeout_ms / 1000;
+        timeout.tv_usec = (io_timeout_ms % 1000) * 1000;
+        for (auto addr = addrs; addr; addr = addr->ai_next) {
+            int fd = socket(addr->ai_family, addr->ai_socktype | SOCK_CLOEXEC,
+                            addr->ai_protocol);
+            if (fd < 0) {
+                continue;
+            }
+            // On Linux the send timeout bounds connect() too.
+            setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+            setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+            int one = 1;
+            setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+            if (::connect(fd, addr->ai_addr, addr->ai_addrlen) == 0) {
+                m_fd = fd;
+                break;
+            }
+            close(fd);
+        }
+        freeaddrinfo(addrs);
+        return m_fd >= 0;
+    }
+
+    bool send(const std::string &data) {
+        size_t sent = 0;
+        while (sent < data.size()) {
+            auto rc = ::send(m_fd, data.data() + sent, data.size() - sent,
+                             MSG_NOSIGNAL);
+            if (rc <= 0) {
+                return false;
+            }
+            sent += rc;
+        }
+        return true;
+    }
+
+    // Read one line of the response, without its CRLF.
+    bool read_line(std::string &line) {
+        size_t end;
+        while ((end = m_buffer.find("\r\n")) == std::string::npos) {
+            if (!fill()) {
+                return false;
+            }
+        }
+        line = m_buffer.substr(0, end);
+        m_buffer.erase(0, end + 2);
+        return true;
+    }
+
+    // Read a data block of `size` bytes and the CRLF ending it.
+    bool read_data(size_t size, std::string &data) {
+        while (m_buffer.size() < size + 2) {
+            if (!fill()) {
+                return false;
+            }
+        }
+        if (m_buffer.compare(size, 2, "\r\n") != 0) {
+            return false;
+        }
+        data = m_buffer.substr(0, size);
+        m_buffer.erase(0, size + 2);
+        return true;
+    }
+
+  private:
+    bool fill() {
+        char buf[4096];
+        auto rc = recv(m_fd, buf, sizeof(buf), 0);
+        if (rc <= 0) {
+            return false;
+        }
+        m_buffer.append(buf, rc);
+        return true;
+    }
+
+    int m_fd{-1};
+    // Received but not yet consumed.
+    std::string m_buffer;
+};
+
+// Rows are stored behind an HMAC-SHA256 of the issuer and the row.
+const size_t row_mac_size = 32;
+
+/**
+ * Anything that can write to the server could otherwise plant a key set for
+ * any issuer, so every row is MAC'd with the secret from
+ * "keycache.memcached_secret_file", which all hosts sharing the server
+ * hold.  Without a secret the backend is not used at all.
+ */
+class MemcachedBackend : public scitokens::internal::KeyCacheBackend {
+  public:
+    explicit MemcachedBackend(const std::string &server) : m_server(server) {}
+
+    Lookup lookup(const std::string &issuer, int64_t /*now*/,
+                  std::string &row) override {
+        auto secret = get_secret();
+        if (!secret) {
+            return Lookup::UNAVAILABLE;
+        }
+        bool found = false;
+        std::string value;
+        bool ok = transact([&](Connection &conn) {
+            std::string line;
+            found = false;
+            if (!conn.send("get " + key(issuer) + "\r\n") ||
+                !conn.read_line(line)) {
+                return false;
+            }
+            if (line == "END") {
+                return true;
+            }
+            // VALUE <key> <flags> <bytes>
+            std::istringstream fields(line);
+            std::string word, name;
+            unsigned flags;
+            size_t size;
+            if (!(fields >> word >> name >> flags >> size) ||
+                word != "VALUE" || !conn.read_data(size, value) ||
+                !conn.read_line(line) || line != "END") {
+                return false;
+            }
+            found = true;
+            return true;
+        });
+        if (!ok) {
+            return Lookup::UNAVAILABLE;
+        }
+        if (!found) {
+            return Lookup::MISSING;
+        }
+        auto &stats = scitokens::internal::Stats::get();
+        // A row that fails the check is treated as missing, so the keys
+        // are downloaded and the row replaced.
+        if (value.size() < row_mac_size ||
+            CRYPTO_memcmp(value.data(),
+                          mac(*secret, issuer, value.data() + row_mac_size,
+                              value.size() - row_mac_size)
+                              .data(),
+                          row_mac_size) != 0) {
+            scitokens::internal::Stats::add(stats.m_memcached_rejections);
+            return Lookup::MISSING;
+        }
+        row = value.substr(row_mac_size);
+        scitokens::internal::Stats::add(stats.m_memcached_hits);
+        return Lookup::FOUND;
+    }
+
+    bool store(const std::string &issuer, const std::string &row,
+               int64_t expires) override {
+        auto secret = get_secret();
+        if (!secret) {
+            return false;
+        }
+        auto value = mac(*secret, issuer, row.data(), row.size()) + row;
+        // memcached takes expiry times past 30 days as absolute Unix times,
+        // which any current time is.
+        auto request = "set " + key(issuer) + " 0 " + std::to_string(expires) +
+                       " " + std::to_string(value.size()) + "\r\n" + value +
+                       "\r\n";
+        std::string line;
+        if (!transact([&](Connection &conn) {
+                return conn.send(request) && conn.read_line(line);
+            })) {
+            return false;
+        }
+        // Typically SERVER_ERROR for a key set larger than the server's
+        // item size limit.
+        if (line != "STORED") {
+            scitokens::internal::Stats::add(
+                scitokens::internal::Stats::get().m_memcached_errors);
+            return false;
+        }
+        return true;
+    }
+
+    void invalidate(const std::string &issuer) override {
+        if (!get_secret()) {
+            return;
+        }
+        transact([&](Connection &conn) {
+            std::string line;
+            return conn.send("delete " + key(issuer) + "\r\n") &&
+                   conn.read_line(line);
+        });
+    }
+
+  private:
+    // Issuers may be longer than memcached's 250 byte keys, or contain
+    // characters keys may not, so keys are their digests.
+    static std::string key(const std::string &issuer) {
+        static const char hex[] = "0123456789abcdef";
+        auto digest = scitokens::internal::AclCache::digest(issuer);
+        std::string result = "scitokens-cpp:";
+        for (auto byte : digest) {
+            result += hex[byte >> 4];
+            result += hex[byte & 0xf];
+        }
+        return result;
+    }
+
+    // Null unless a secret is configured.
+    static std::shared_ptr<const std::string> get_secret() {
+        auto secret = configurer::Configuration::get_memcached_secret();
+        return secret && !secret->empty() ? secret : nullptr;
+    }
+
+    // The MAC binds the row to its issuer, so one issuer's keys can't be
+    // replayed as another's.
+    static std::string mac(const std::string &secret,
+                           const std::string &issuer, const char *row,
+                           size_t row_size) {
+        std::string data = "scitokens-keycache";
+        data += '\0';
+        data += issuer;
+        data += '\0';
+        data.append(row, row_size);
+        unsigned char result[EVP_MAX_MD_SIZE];
+        unsigned result_size = 0;
+        if (!HMAC(EVP_sha256(), secret.data(), secret.size(),
+                  reinterpret_cast<const unsigned char *>(data.data()),
+                  data.size(), result, &result_size) ||
+            result_size != row_mac_size) {
+            throw std::runtime_error("Failed to compute the key cache MAC.");
+        }
+        return std::string(reinterpret_cast<char *>(result), result_size);
+    }
+
+    // Run one request and read its response with `exchange`, which returns
+    // false if the connection failed.  An idle connection may have died
+    // since its last use (e.g., the server restarted), so that failure is
+    // retried once on a new connection before the server is considered
+    // down.  Returns false if the request failed.
+    bool transact(const std::function<bool(Connection &)> &exchange) {
+        scitokens::internal::Stats::add(
+            scitokens::internal::Stats::get().m_memcached_requests);
+        std::unique_ptr<Connection> conn;
+        {
+            std::lock_guard<std::mutex> guard(m_mutex);
+            if (!m_idle.empty()) {
+                conn = std::move(m_idle.back());
+                m_idle.pop_back();
+            }
+        }
+        if (conn) {
+            if (exchange(*conn)) {
+                release(std::move(conn));
+                return true;
+            }
+            // The other idle connections likely died with this one.
+            std::lock_guard<std::mutex> guard(m_mutex);
+            m_idle.clear();
+        }
+        conn = connect();
+        if (!conn) {
+            return false;
+        }
+        if (!exchange(*conn)) {
+            fail();
+            return false;
+        }
+        release(std::move(conn));
+        return true;
+    }
+
+    // A new connection; null while the server is considered down.
+    std::unique_ptr<Connection> connect() {
+        if (std::time(NULL) < m_retry_after) {
+            return nullptr;
+        }
+        std::unique_ptr<Connection> conn(new Connection());
+        if (!conn->connect(m_server)) {
+            fail();
+            return nullptr;
+        }
+        return conn;
+    }
+
+    // Return a connection whose request completed.
+    void release(std::unique_ptr<Connection> conn) {
+        std::lock_guard<std::mutex> guard(m_mutex);
+        if (m_idle.size() < max_idle_connections) {
+            m_idle.push_back(std::move(conn));
+        }
+    }
+
+    // A new connection has failed (and is dropped by the caller); so may
+    // the idle ones have.
+    void fail() {
+        scitokens::internal::Stats::add(
+            scitokens::internal::Stats::get().m_memcached_errors);
+        m_retry_after = std::time(NULL) + retry_after_s;
+        std::lock_guard<std::mutex> guard(m_mutex);
+        m_idle.clear();
+    }
+
+    const std::string m_server;
+    std::atomic<int64_t> m_retry_after{0};
+    std::mutex m_mutex;
+    std::vector<std::unique_ptr<Connection>> m_idle;
+};
+
+} // namespace
+
+std::shared_ptr<scitokens::internal::KeyCacheBackend>
+scitokens::internal::make_memcached_backend(const std::string &server) {
+    return std::make_shared<MemcachedBackend>(server);
+}
@@ -1,15 +1,26 @@
 
 #include "scitokens.h"
 
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
 #include <fstream>
 #include <getopt.h>
 #include <iostream>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
 
 namespace {
 
 const char usage[] =
     "\n"
     "Syntax: %s [--cred cred_file] TOKEN\n"
+    "        %s [--cred cred_file] --batch FILE [--threads N] [--repeat N] "
+    "[--async]\n"
     "\n"
     " Options\n"
     "    -h | --help                  Display usage\n"
@@ -18,18 +29,46 @@ const char usage[] =
     "    -K | --keyid          <kid>  Name of the token key.\n"
     "    -p | --profile    <profile>  Profile to enforce (wlcg, scitokens1, "
     "scitokens2, atjwt).\n"
+    "    -b | --batch         <file>  Verify the tokens in the file, one per "
+    "line\n"
+    "                                 (- for stdin), and report throughput,\n"
+    "                                 latency percentiles and failures.\n"
+    "    -t | --threads          <N>  Threads verifying the batch (default "
+    "1); with\n"
+    "                                 --async, requests in flight.\n"
+    "    -n | --repeat           <N>  Passes over the batch (default 1).\n"
+    "    -a | --async                 Verify through the callback API, "
+    "driven by\n"
+    "                                 the library's thread.\n"
     "\n";
 
-const struct option long_options[] = {{"help", no_argument, NULL, 'h'},
-                                      {"cred", required_argument, NULL, 'c'},
-                                      {"issuer", required_argument, NULL, 'i'},
-                                      {"keyid", required_argument, NULL, 'K'},
-                                      {"profile", required_argument, NULL, 'p'},
-                                      {0, 0, 0, 0}};
+const struct option long_options[] = {
+    {"help", no_argument, NULL, 'h'},
+    {"cred", required_argument, NULL, 'c'},
+    {"issuer", required_argument, NULL, 'i'},
+    {"keyid", required_argument, NULL, 'K'},
+    {"profile", required_argument, NULL, 'p'},
+    {"batch", required_argument, NULL, 'b'},
+    {"threads", required_argument, NULL, 't'},
+    {"repeat", required_argument, NULL, 'n'},
+    {"async", no_argument, NULL, 'a'},
+    {0, 0, 0, 0}};
 
-const char short_options[] = "hc:i:K:p:";
+const char short_options[] = "hc:i:K:p:b:t:n:a";
 
-std::string g_cred, g_issuer, g_keyid, g_profile;
+std::string g_cred, g_issuer, g_keyid, g_profile, g_batch;
+int g_threads = 1, g_repeat = 1;
+bool g_async = false;
+
+int positive_argument(const char *argv0, const char *name, const char *arg) {
+    char *end;
+    long value = strtol(arg, &end, 10);
+    if (*arg == '\0' || *end != '\0' || value <= 0 || value > 1000000) {
+        fprintf(stderr, "%s: invalid %s -- %s\n", argv0, name, arg);
+        exit(1);
+    }
+    return value;
+}
 
 int init_arguments(int argc, char *const argv[]) {
     int arg;
@@ -37,7 +76,7 @@ int init_arguments(int argc, char *const argv[]) {
                               nullptr)) != -1) {
         switch (arg) {
         case 'h':
-            printf(usage, argv[0]);
+            printf(usage, argv[0], argv[0]);
             exit(0);
             break;
         case 'c':
@@ -52,22 +91,36 @@ int init_arguments(int argc, char *const argv[]) {
         case 'p':
             g_profile = optarg;
             break;
+        case 'b':
+            g_batch = optarg;
+            break;
+        case 't':
+            g_threads = positive_argument(argv[0], "thread count", optarg);
+            break;
+        case 'n':
+            g_repeat = positive_argument(argv[0], "repeat count", optarg);
+            break;
+        case 'a':
+            g_async = true;
+            break;
         default:
-            fprintf(stderr, usage, argv[0]);
+            fprintf(stderr, usage, argv[0], argv[0]);
             exit(1);
             break;
         }
     }
 
-    if (optind < argc - 1) {
+    // A batch takes the place of the token.
+    int tokens = g_batch.empty() ? 1 : 0;
+    if (optind < argc - tokens) {
         fprintf(stderr, "%s: invalid option -- %s\n", argv[0], argv[optind]);
-        fprintf(stderr, usage, argv[0]);
+        fprintf(stderr, usage, argv[0], argv[0]);
         exit(1);
     }
 
-    if (optind == argc) {
+    if (optind == argc - tokens + 1) {
         fprintf(stderr, "%s: Must provide a token as a requirement\n", argv[0]);
-        fprintf(stderr, usage, argv[0]);
+        fprintf(stderr, usage, argv[0], argv[0]);
         exit(1);
     }
 
@@ -77,13 +130,192 @@ int init_arguments(int argc, char *const argv[]) {
                 "%s: If --cred, --keyid, or --issuer are set, then all must be "
                 "set.\n",
                 argv[0]);
-        fprintf(stderr, usage, argv[0]);
+        fprintf(stderr, usage, argv[0], argv[0]);
         exit(1);
     }
 
     return 0;
 }
 
+/**
+ * The outcomes of a batch: each verification's latency and, for those
+ * that failed, how many failed with each error.
+ */
+class BatchResults {
+  public:
+    void record(double latency_us, const char *err_msg) {
+        std::lock_guard<std::mutex> guard(m_mutex);
+        m_latencies.push_back(latency_us);
+        if (err_msg) {
+            m_failures[err_msg]++;
+        }
+    }
+
+    // Print the report; returns the number of failures.
+    size_t report(std::chrono::duration<double> elapsed) {
+        std::lock_guard<std::mutex> guard(m_mutex);
+        size_t failed = 0;
+        for (const auto &entry : m_failures) {
+            failed += entry.second;
+        }
+        auto &all = m_latencies;
+        printf("Verified %zu tokens (%zu failed) in %.3f s with %d %s\n",
+               all.size(), failed, elapsed.count(), g_threads,
+               g_async ? "requests in flight" : "threads");
+        if (all.empty()) {
+            return failed;
+        }
+        std::sort(all.begin(), all.end());
+        auto percentile = [&](double pct) {
+            return all[std::min(all.size() - 1,
+                                static_cast<size_t>(pct * all.size()))];
+        };
+        printf("Throughput: %.1f tokens/s\n", all.size() / elapsed.count());
+        printf("Latency (us): p50 %.1f  p90 %.1f  p99 %.1f  p99.9 %.1f  "
+               "max %.1f\n",
+               percentile(0.5), percentile(0.9), percentile(0.99),
+               percentile(0.999), all.back());
+        if (failed) {
+            std::vector<std::pair<size_t, std::string>> failures;
+            for (const auto &entry : m_failures) {
+                failures.emplace_back(entry.second, entry.first);
+            }
+            std::sort(failures.rbegin(), failures.rend());
+            printf("Failures:\n");
+            for (const auto &entry : failures) {
+                printf("%10zu  %s\n", entry.first, entry.second.c_str());
+            }
+        }
+        return failed;
+    }
+
+  private:
+    std::mutex m_mutex;
+    std::vector<double> m_latencies;
+    std::map<std::string, size_t> m_failures;
+};
+
+// Verify each token on the calling thread, taking the next one from
+// `next`.
+void verify_sync(const std::vector<std::string> &tokens,
+                 std::atomic<size_t> &next, BatchResults &results) {
+    size_t count = tokens.size() * g_repeat;
+    for (size_t idx = next++; idx < count; idx = next++) {
+        const auto &token = tokens[idx % tokens.size()];
+        auto start = std::chrono::steady_clock::now();
+        SciToken scitoken = nullptr;
+        char *err_msg = nullptr;
+        scitoken_deserialize(token.c_str(), &scitoken, nullptr, &err_msg);
+        std::chrono::duration<double, std::micro> latency =
+            std::chrono::steady_clock::now() - start;
+        results.record(latency.count(), err_msg);
+        free(err_msg);
+        scitoken_destroy(scitoken);
+    }
+}
+
+/**
+ * Verification requests submitted through the callback API, at most
+ * g_threads of them at once.
+ */
+class AsyncBatch {
+  public:
+    explicit AsyncBatch(BatchResults &results) : m_results(results) {}
+
+    void run(const std::vector<std::string> &tokens) {
+        size_t count = tokens.size() * g_repeat;
+        for (size_t idx = 0; idx < count; idx++) {
+            {
+                std::unique_lock<std::mutex> lock(m_mutex);
+                m_cond.wait(lock, [&] { return m_in_flight < g_threads; });
+                m_in_flight++;
+            }
+            auto request = new Request{this, std::chrono::steady_clock::now()};
+            char *err_msg = nullptr;
+            if (scitoken_deserialize_with_callback(
+                    tokens[idx % tokens.size()].c_str(), nullptr, done,
+                    request, &err_msg)) {
+                // Never started, so the callback won't be called.
+                done(request, nullptr, err_msg);
+            }
+        }
+        std::unique_lock<std::mutex> lock(m_mutex);
+        m_cond.wait(lock, [&] { return m_in_flight == 0; });
+    }
+
+  private:
+    struct Request {
+        AsyncBatch *m_batch;
+        std::chrono::steady_clock::time_point m_start;
+    };
+
+    static void done(void *data, SciToken token, char *err_msg) {
+        std::unique_ptr<Request> request(static_cast<Request *>(data));
+        std::chrono::duration<double, std::micro> latency =
+            std::chrono::steady_clock::now() - request->m_start;
+        auto &batch = *request->m_batch;
+        batch.m_results.record(latency.count(), err_msg);
+        free(err_msg);
+        scitoken_destroy(token);
+        {
+            std::lock_guard<std::mutex> guard(batch.m_mutex);
+            batch.m_in_flight--;
+        }
+        batch.m_cond.notify_all();
+    }
+
+    BatchResults &m_results;
+    std::mutex m_mutex;
+    std::condition_variable m_cond;
+    int m_in_flight{0};
+};
+
+int verify_batch(const char *argv0) {
+    std::ifstream file;
+    if (g_batch != "-") {
+        file.open(g_batch);
+        if (!file) {
+            fprintf(stderr, "%s: Failed to open %s\n", argv0, g_batch.c_str());
+            return 1;
+        }
+    }
+    std::istream &input = g_batch == "-" ? std::cin : file;
+    std::vector<std::string> tokens;
+    std::string line;
+    while (std::getline(input, line)) {
+        auto begin = line.find_first_not_of(" \t\r");
+        if (begin == std::string::npos) {
+            continue;
+        }
+        auto end = line.find_last_not_of(" \t\r");
+        tokens.emplace_back(line, begin, end - begin + 1);
+    }
+    if (tokens.empty()) {
+        fprintf(stderr, "%s: No tokens in %s\n", argv0, g_batch.c_str());
+        return 1;
+    }
+
+    BatchResults results;
+    auto start = std::chrono::steady_clock::now();
+    if (g_async) {
+        AsyncBatch(results).run(tokens);
+    } else {
+        std::atomic<size_t> next(0);
+        std::vector<std::thread> workers;
+        for (int thread = 1; thread < g_threads; thread++) {
+            workers.emplace_back(verify_sync, std::cref(tokens),
+                                 std::ref(next), std::ref(results));
+        }
+        verify_sync(tokens, next, results);
+        for (auto &worker : workers) {
+            worker.join();
+        }
+    }
+    std::chrono::duration<double> elapsed =
+        std::chrono::steady_clock::now() - start;
+    return results.report(elapsed) ? 1 : 0;
+}
+
 } // namespace
 
 int main(int argc, char *const *argv) {
@@ -91,15 +323,13 @@ int main(int argc, char *const *argv) {
         fprintf(stderr,
                 "%s: Insufficient arguments; must at least provide a token.\n",
                 argv[0]);
-        fprintf(stderr, usage, argv[0]);
+        fprintf(stderr, usage, argv[0], argv[0]);
         return 1;
     }
     if (init_arguments(argc, argv)) {
         return 1;
     }
 
-    std::string token(argv[argc - 1]);
-
     if (!g_issuer.empty()) {
         char *err_msg;
 
@@ -117,6 +347,11 @@ int main(int argc, char *const *argv) {
         }
     }
 
+    if (!g_batch.empty()) {
+        return verify_batch(argv[0]);
+    }
+
+    std::string token(argv[argc - 1]);
     SciToken scitoken;
     char *err_msg = nullptr;
     if (scitoken_deserialize(token.c_str(), &scitoken, nullptr, &err_msg)) {